@@ -0,0 +1,10 @@
+AC_DEFUN([DOVECOT_COMPRESS_THREADS], [
+  if test "$have_zlib" = "yes"; then
+    AC_CHECK_HEADER(pthread.h, [
+      AC_CHECK_LIB(pthread, pthread_create, [
+        AC_DEFINE(HAVE_COMPRESS_THREADS,, [Define if compression can use threads])
+        COMPRESS_LIBS="$COMPRESS_LIBS -lpthread"
+      ])
+    ])
+  fi
+])
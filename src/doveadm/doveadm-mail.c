@@ -151,6 +151,7 @@ cmd_purge_run(struct doveadm_mail_cmd_context *ctx, struct mail_user *user)
 			continue;
 
 		storage = mail_namespace_get_default_storage(ns);
+		mail_storage_set_purge_throttle(storage, TRUE);
 		if (mail_storage_purge(storage) < 0) {
 			i_error("Purging namespace '%s' failed: %s", ns->prefix,
 				mail_storage_get_last_internal_error(storage, NULL));
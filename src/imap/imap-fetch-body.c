@@ -87,16 +87,36 @@ static string_t *get_prefix(struct imap_fetch_state *state,
 	return str;
 }
 
+static void fetch_stream_input_ready(struct imap_fetch_context *ctx)
+{
+	io_remove(&ctx->state.cur_input_io);
+	/* continue sending via the client's output handler */
+	o_stream_set_flush_pending(ctx->client->output, TRUE);
+}
+
 static int fetch_stream_continue(struct imap_fetch_context *ctx)
 {
 	struct imap_fetch_state *state = &ctx->state;
 	const char *disconnect_reason;
 	uoff_t orig_input_offset = state->cur_input->v_offset;
+	bool async_input = state->cur_input->async_input &&
+		state->cur_input->blocking;
 	enum ostream_send_istream_result res;
 
+	/* Mail streams are blocking, but they may be waiting for async reads
+	   internally (e.g. attachments in an async mail_attachment_fs).
+	   Let them return to the ioloop instead. Do this only while sending,
+	   since the same underlying streams may be used by others that
+	   expect them to be blocking. Other streams are left alone, so their
+	   fds' O_NONBLOCK flags don't keep getting changed. */
+	io_remove(&state->cur_input_io);
+	if (async_input)
+		i_stream_set_blocking(state->cur_input, FALSE);
 	o_stream_set_max_buffer_size(ctx->client->output, 0);
 	res = o_stream_send_istream(ctx->client->output, state->cur_input);
 	o_stream_set_max_buffer_size(ctx->client->output, (size_t)-1);
+	if (async_input)
+		i_stream_set_blocking(state->cur_input, TRUE);
 
 	if (ctx->state.cur_stats_sizep != NULL) {
 		*ctx->state.cur_stats_sizep +=
@@ -119,7 +139,13 @@ static int fetch_stream_continue(struct imap_fetch_context *ctx)
 		}
 		return 1;
 	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT:
-		i_unreached();
+		/* The mail is read from a non-blocking stream (e.g. an async
+		   fs backend). Don't block the ioloop waiting for it - other
+		   clients and commands can be handled meanwhile. */
+		state->cur_input_io = io_add_istream(state->cur_input,
+						     fetch_stream_input_ready,
+						     ctx);
+		return 0;
 	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT:
 		return 0;
 	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT:
@@ -516,6 +516,7 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 
 		state->cont_handler = NULL;
                 state->cur_handler++;
+		io_remove(&state->cur_input_io);
 		if (state->cur_input != NULL)
 			i_stream_unref(&state->cur_input);
 	}
@@ -581,6 +582,7 @@ static int imap_fetch_more_int(struct imap_fetch_context *ctx, bool cancel)
 			}
 
 			state->cont_handler = NULL;
+			io_remove(&state->cur_input_io);
 			if (state->cur_input != NULL)
 				i_stream_unref(&state->cur_input);
 		}
@@ -666,6 +668,7 @@ int imap_fetch_end(struct imap_fetch_context *ctx)
 
 	str_free(&state->cur_str);
 
+	io_remove(&state->cur_input_io);
 	i_stream_unref(&state->cur_input);
 
 	if (state->search_ctx != NULL) {
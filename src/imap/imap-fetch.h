@@ -58,6 +58,8 @@ struct imap_fetch_state {
 	string_t *cur_str;
 	size_t cur_str_prefix_size;
 	struct istream *cur_input;
+	/* Waiting for more data to be readable from cur_input */
+	struct io *cur_input_io;
 	bool skip_cr;
 	int (*cont_handler)(struct imap_fetch_context *ctx);
 	uint64_t *cur_stats_sizep;
@@ -101,6 +101,24 @@ msgset_is_valid(ARRAY_TYPE(seq_range) *seqset, uint32_t messages_count)
 	return TRUE;
 }
 
+static int
+imap_search_parse_seqset(struct client_command_context *cmd, const char *set,
+			 struct mail_search_arg *arg, pool_t pool)
+{
+	const ARRAY_TYPE(seq_range) *seqset;
+
+	/* simple command lines have the set already parsed by imap-parser */
+	seqset = cmd->parser == NULL ? NULL :
+		imap_parser_get_seqset(cmd->parser, set);
+	if (seqset != NULL) {
+		p_array_init(&arg->value.seqset, pool, array_count(seqset));
+		array_append_array(&arg->value.seqset, seqset);
+		return 0;
+	}
+	p_array_init(&arg->value.seqset, pool, 16);
+	return imap_seq_set_parse(set, &arg->value.seqset);
+}
+
 static int imap_search_get_msgset_arg(struct client_command_context *cmd,
 				      const char *messageset,
 				      struct mail_search_args **args_r,
@@ -111,8 +129,8 @@ static int imap_search_get_msgset_arg(struct client_command_context *cmd,
 	args = mail_search_build_init();
 	args->args = p_new(args->pool, struct mail_search_arg, 1);
 	args->args->type = SEARCH_SEQSET;
-	p_array_init(&args->args->value.seqset, args->pool, 16);
-	if (imap_seq_set_parse(messageset, &args->args->value.seqset) < 0 ||
+	if (imap_search_parse_seqset(cmd, messageset, args->args,
+				     args->pool) < 0 ||
 	    !msgset_is_valid(&args->args->value.seqset,
 			     cmd->client->messages_count)) {
 		*error_r = "Invalid messageset";
@@ -124,7 +142,8 @@ static int imap_search_get_msgset_arg(struct client_command_context *cmd,
 }
 
 static int
-imap_search_get_uidset_arg(const char *uidset, struct mail_search_args **args_r,
+imap_search_get_uidset_arg(struct client_command_context *cmd,
+			   const char *uidset, struct mail_search_args **args_r,
 			   const char **error_r)
 {
 	struct mail_search_args *args;
@@ -132,8 +151,8 @@ imap_search_get_uidset_arg(const char *uidset, struct mail_search_args **args_r,
 	args = mail_search_build_init();
 	args->args = p_new(args->pool, struct mail_search_arg, 1);
 	args->args->type = SEARCH_UIDSET;
-	p_array_init(&args->args->value.seqset, args->pool, 16);
-	if (imap_seq_set_parse(uidset, &args->args->value.seqset) < 0) {
+	if (imap_search_parse_seqset(cmd, uidset, args->args,
+				     args->pool) < 0) {
 		*error_r = "Invalid uidset";
 		mail_search_args_unref(&args);
 		return -1;
@@ -200,7 +219,7 @@ int imap_search_get_anyset(struct client_command_context *cmd,
 		ret = imap_search_get_msgset_arg(cmd, set, search_args_r,
 						 &client_error);
 	} else {
-		ret = imap_search_get_uidset_arg(set, search_args_r,
+		ret = imap_search_get_uidset_arg(cmd, set, search_args_r,
 						 &client_error);
 	}
 	if (ret < 0) {
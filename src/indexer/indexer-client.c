@@ -61,6 +61,7 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 			     const char *const *args, const char **error_r)
 {
 	struct indexer_client_request *ctx = NULL;
+	enum indexer_request_priority priority;
 	const char *session_id = NULL;
 	unsigned int tag, max_recent_msgs;
 
@@ -89,7 +90,17 @@ indexer_client_request_queue(struct indexer_client *client, bool append,
 		indexer_client_ref(client);
 	}
 
-	indexer_queue_append(client->queue, append, args[1], args[2],
+	/* PREPEND is used when a client is waiting for the indexing to
+	   finish. APPENDs with a session ID come from the mail processes'
+	   fts_autoindex, the rest are bulk requests from doveadm. */
+	if (!append)
+		priority = INDEXER_REQUEST_PRIORITY_INTERACTIVE;
+	else if (session_id != NULL)
+		priority = INDEXER_REQUEST_PRIORITY_NEW_MAIL;
+	else
+		priority = INDEXER_REQUEST_PRIORITY_BULK;
+
+	indexer_queue_append(client->queue, append, priority, args[1], args[2],
 			     session_id, max_recent_msgs, ctx);
 	o_stream_nsend_str(client->output, t_strdup_printf("%u\tOK\n", tag));
 	return 0;
@@ -6,13 +6,79 @@
 #include "hash.h"
 #include "indexer-queue.h"
 
+/* Relative share of the dequeued requests for each priority class */
+#define INDEXER_QUEUE_WEIGHT_BULK 1
+#define INDEXER_QUEUE_WEIGHT_NEW_MAIL 4
+#define INDEXER_QUEUE_WEIGHT_INTERACTIVE 16
+#define INDEXER_QUEUE_STRIDE 0x10000
+/* Don't dequeue more requests for a user while this many of its requests
+   are being worked on. This keeps the rest of the user's requests in the
+   queue where they can still be reprioritized. */
+#define INDEXER_QUEUE_USER_MAX_WORKING 1
+
+struct indexer_queue_user_class {
+	struct indexer_queue_user_class *prev, *next;
+	struct indexer_queue_user *user;
+
+	struct indexer_request *head, *tail;
+	/* linked to the class's list of users that can be dequeued */
+	bool linked:1;
+};
+
+struct indexer_queue_user {
+	char *username;
+	/* number of requests queued in any of the classes */
+	unsigned int queued_count;
+	/* number of requests being worked on */
+	unsigned int working_count;
+
+	struct indexer_queue_user_class classes[INDEXER_REQUEST_PRIORITY_COUNT];
+};
+
+struct indexer_queue_class {
+	const char *name;
+	unsigned int weight;
+	/* stride scheduling: the class with the lowest pass is dequeued
+	   next, after which its pass is increased by stride/weight. */
+	uint64_t pass;
+
+	/* users with dequeueable requests in round-robin order */
+	struct indexer_queue_user_class *head, *tail;
+};
+
 struct indexer_queue {
 	indexer_status_callback_t *callback;
 	void (*listen_callback)(struct indexer_queue *);
 
 	/* username+mailbox -> indexer_request */
 	HASH_TABLE(struct indexer_request *, struct indexer_request *) requests;
-	struct indexer_request *head, *tail;
+	/* username -> indexer_queue_user */
+	HASH_TABLE(char *, struct indexer_queue_user *) users;
+	unsigned int queued_count;
+
+	struct indexer_queue_class classes[INDEXER_REQUEST_PRIORITY_COUNT];
+	/* pass of the most recently dequeued class */
+	uint64_t pass;
+};
+
+static struct event_category event_category_indexer = {
+	.name = "indexer",
+};
+
+static const struct indexer_queue_class
+indexer_queue_classes_default[INDEXER_REQUEST_PRIORITY_COUNT] = {
+	[INDEXER_REQUEST_PRIORITY_BULK] = {
+		.name = "bulk",
+		.weight = INDEXER_QUEUE_WEIGHT_BULK,
+	},
+	[INDEXER_REQUEST_PRIORITY_NEW_MAIL] = {
+		.name = "new-mail",
+		.weight = INDEXER_QUEUE_WEIGHT_NEW_MAIL,
+	},
+	[INDEXER_REQUEST_PRIORITY_INTERACTIVE] = {
+		.name = "interactive",
+		.weight = INDEXER_QUEUE_WEIGHT_INTERACTIVE,
+	},
 };
 
 static unsigned int
@@ -32,11 +98,15 @@ struct indexer_queue *
 indexer_queue_init(indexer_status_callback_t *callback)
 {
 	struct indexer_queue *queue;
-	
+	unsigned int i;
+
 	queue = i_new(struct indexer_queue, 1);
 	queue->callback = callback;
 	hash_table_create(&queue->requests, default_pool, 0,
 			  indexer_request_hash, indexer_request_cmp);
+	hash_table_create(&queue->users, default_pool, 0, str_hash, strcmp);
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+		queue->classes[i] = indexer_queue_classes_default[i];
 	return queue;
 }
 
@@ -47,8 +117,10 @@ void indexer_queue_deinit(struct indexer_queue **_queue)
 	*_queue = NULL;
 
 	i_assert(indexer_queue_is_empty(queue));
+	i_assert(hash_table_count(queue->users) == 0);
 
 	hash_table_destroy(&queue->requests);
+	hash_table_destroy(&queue->users);
 	i_free(queue);
 }
 
@@ -69,6 +141,139 @@ indexer_queue_lookup(struct indexer_queue *queue,
 	return hash_table_lookup(queue->requests, &lookup_request);
 }
 
+static struct indexer_queue_user *
+indexer_queue_user_get(struct indexer_queue *queue, const char *username)
+{
+	struct indexer_queue_user *user;
+	unsigned int i;
+
+	user = hash_table_lookup(queue->users, username);
+	if (user == NULL) {
+		user = i_new(struct indexer_queue_user, 1);
+		user->username = i_strdup(username);
+		for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+			user->classes[i].user = user;
+		hash_table_insert(queue->users, user->username, user);
+	}
+	return user;
+}
+
+static void
+indexer_queue_user_free_if_unused(struct indexer_queue *queue,
+				   struct indexer_queue_user *user)
+{
+	if (user->queued_count > 0 || user->working_count > 0)
+		return;
+
+	hash_table_remove(queue->users, user->username);
+	i_free(user->username);
+	i_free(user);
+}
+
+static void
+indexer_queue_user_class_link(struct indexer_queue *queue,
+			      enum indexer_request_priority priority,
+			      struct indexer_queue_user_class *user_class)
+{
+	struct indexer_queue_class *class = &queue->classes[priority];
+
+	if (user_class->linked || user_class->head == NULL ||
+	    user_class->user->working_count >= INDEXER_QUEUE_USER_MAX_WORKING)
+		return;
+
+	if (class->head == NULL) {
+		/* the class was idle - don't let it use up the turns it
+		   missed while it was empty */
+		class->pass = I_MAX(class->pass, queue->pass);
+	}
+	DLLIST2_APPEND(&class->head, &class->tail, user_class);
+	user_class->linked = TRUE;
+}
+
+static void
+indexer_queue_user_class_unlink(struct indexer_queue *queue,
+				enum indexer_request_priority priority,
+				struct indexer_queue_user_class *user_class)
+{
+	struct indexer_queue_class *class = &queue->classes[priority];
+
+	if (!user_class->linked)
+		return;
+	DLLIST2_REMOVE(&class->head, &class->tail, user_class);
+	user_class->linked = FALSE;
+}
+
+static void
+indexer_queue_user_link_all(struct indexer_queue *queue,
+			    struct indexer_queue_user *user)
+{
+	unsigned int i;
+
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+		indexer_queue_user_class_link(queue, i, &user->classes[i]);
+}
+
+static void
+indexer_queue_user_unlink_all(struct indexer_queue *queue,
+			      struct indexer_queue_user *user)
+{
+	unsigned int i;
+
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+		indexer_queue_user_class_unlink(queue, i, &user->classes[i]);
+}
+
+static void
+indexer_queue_add_request(struct indexer_queue *queue,
+			  struct indexer_request *request, bool append)
+{
+	struct indexer_queue_user_class *user_class;
+
+	i_assert(request->user == NULL);
+
+	request->user = indexer_queue_user_get(queue, request->username);
+	user_class = &request->user->classes[request->priority];
+	if (append)
+		DLLIST2_APPEND(&user_class->head, &user_class->tail, request);
+	else
+		DLLIST2_PREPEND(&user_class->head, &user_class->tail, request);
+	request->user->queued_count++;
+	queue->queued_count++;
+	indexer_queue_user_class_link(queue, request->priority, user_class);
+
+	if (request->event == NULL) {
+		request->event = event_create(NULL);
+		event_add_category(request->event, &event_category_indexer);
+		event_add_str(request->event, "user", request->username);
+		event_add_str(request->event, "mailbox", request->mailbox);
+	}
+	event_add_str(request->event, "priority",
+		      queue->classes[request->priority].name);
+}
+
+static void
+indexer_queue_remove_request(struct indexer_queue *queue,
+			     struct indexer_request *request)
+{
+	struct indexer_queue_user *user = request->user;
+	struct indexer_queue_user_class *user_class;
+
+	i_assert(user != NULL);
+
+	user_class = &user->classes[request->priority];
+	DLLIST2_REMOVE(&user_class->head, &user_class->tail, request);
+	if (user_class->head == NULL) {
+		indexer_queue_user_class_unlink(queue, request->priority,
+						user_class);
+	}
+	i_assert(user->queued_count > 0);
+	user->queued_count--;
+	i_assert(queue->queued_count > 0);
+	queue->queued_count--;
+	request->user = NULL;
+	indexer_queue_user_free_if_unused(queue, user);
+}
+
 static void request_add_context(struct indexer_request *request, void *context)
 {
 	if (context == NULL)
@@ -81,12 +286,15 @@ static void request_add_context(struct indexer_request *request, void *context)
 
 static struct indexer_request *
 indexer_queue_append_request(struct indexer_queue *queue, bool append,
+			     enum indexer_request_priority priority,
 			     const char *username, const char *mailbox,
 			     const char *session_id,
 			     unsigned int max_recent_msgs, void *context)
 {
 	struct indexer_request *request;
 
+	i_assert(priority < INDEXER_REQUEST_PRIORITY_COUNT);
+
 	request = indexer_queue_lookup(queue, username, mailbox);
 	if (request == NULL) {
 		request = i_new(struct indexer_request, 1);
@@ -94,6 +302,7 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 		request->mailbox = i_strdup(mailbox);
 		request->session_id = i_strdup(session_id);
 		request->max_recent_msgs = max_recent_msgs;
+		request->priority = priority;
 		request_add_context(request, context);
 		hash_table_insert(queue->requests, request, request);
 	} else {
@@ -102,24 +311,28 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 		request_add_context(request, context);
 		if (request->working) {
 			/* we're already indexing this mailbox. */
+			if (!request->reindex_head && !request->reindex_tail)
+				request->reindex_priority = priority;
+			else if (request->reindex_priority < priority)
+				request->reindex_priority = priority;
 			if (append)
 				request->reindex_tail = TRUE;
 			else
 				request->reindex_head = TRUE;
 			return request;
 		}
-		if (append) {
+		if (priority < request->priority ||
+		    (priority == request->priority && append)) {
 			/* keep the request in its old position */
 			return request;
 		}
-		/* move request to beginning of the queue */
-		DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+		/* move the request to the new priority class, or to the
+		   beginning of the user's queue */
+		indexer_queue_remove_request(queue, request);
+		request->priority = priority;
 	}
 
-	if (append)
-		DLLIST2_APPEND(&queue->head, &queue->tail, request);
-	else
-		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	indexer_queue_add_request(queue, request, append);
 	return request;
 }
 
@@ -131,15 +344,16 @@ static void indexer_queue_append_finish(struct indexer_queue *queue)
 }
 
 void indexer_queue_append(struct indexer_queue *queue, bool append,
+			  enum indexer_request_priority priority,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
 			  void *context)
 {
 	struct indexer_request *request;
 
-	request = indexer_queue_append_request(queue, append, username, mailbox,
-					       session_id, max_recent_msgs,
-					       context);
+	request = indexer_queue_append_request(queue, append, priority,
+					       username, mailbox, session_id,
+					       max_recent_msgs, context);
 	request->index = TRUE;
 	indexer_queue_append_finish(queue);
 }
@@ -150,24 +364,63 @@ void indexer_queue_append_optimize(struct indexer_queue *queue,
 {
 	struct indexer_request *request;
 
-	request = indexer_queue_append_request(queue, TRUE, username, mailbox,
-					       NULL, 0, context);
+	request = indexer_queue_append_request(queue, TRUE,
+					       INDEXER_REQUEST_PRIORITY_BULK,
+					       username, mailbox, NULL, 0,
+					       context);
 	request->optimize = TRUE;
 	indexer_queue_append_finish(queue);
 }
 
+static struct indexer_queue_class *
+indexer_queue_next_class(struct indexer_queue *queue)
+{
+	struct indexer_queue_class *class, *next_class = NULL;
+	unsigned int i;
+
+	/* on ties prefer the higher priority */
+	for (i = INDEXER_REQUEST_PRIORITY_COUNT; i > 0; i--) {
+		class = &queue->classes[i-1];
+		if (class->head != NULL &&
+		    (next_class == NULL || class->pass < next_class->pass))
+			next_class = class;
+	}
+	return next_class;
+}
+
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
 {
-	return queue->head;
+	struct indexer_queue_class *class;
+
+	class = indexer_queue_next_class(queue);
+	return class == NULL ? NULL : class->head->head;
 }
 
 void indexer_queue_request_remove(struct indexer_queue *queue)
 {
-	struct indexer_request *request = queue->head;
+	struct indexer_queue_class *class;
+	struct indexer_queue_user_class *user_class;
+	struct indexer_request *request;
 
-	i_assert(request != NULL);
+	class = indexer_queue_next_class(queue);
+	i_assert(class != NULL);
+	user_class = class->head;
+	request = user_class->head;
+
+	queue->pass = class->pass;
+	class->pass += INDEXER_QUEUE_STRIDE / class->weight;
+
+	if (request->next != NULL) {
+		/* give the next user a turn */
+		DLLIST2_REMOVE(&class->head, &class->tail, user_class);
+		DLLIST2_APPEND(&class->head, &class->tail, user_class);
+	}
+	indexer_queue_remove_request(queue, request);
 
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+	e_debug(event_create_passthrough(request->event)->
+		set_name("indexer_queue_request_dequeued")->event(),
+		"Dequeued request for mailbox %s", request->mailbox);
+	event_unref(&request->event);
 }
 
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
@@ -192,12 +445,38 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 	indexer_queue_request_status_int(queue, request, percentage);
 }
 
-void indexer_queue_request_work(struct indexer_request *request)
+void indexer_queue_request_work(struct indexer_queue *queue,
+				struct indexer_request *request)
 {
+	struct indexer_queue_user *user;
+
+	i_assert(!request->working);
+
 	request->working = TRUE;
 	request->working_context_idx =
 		!array_is_created(&request->contexts) ? 0 :
 		array_count(&request->contexts);
+
+	user = indexer_queue_user_get(queue, request->username);
+	user->working_count++;
+	if (user->working_count >= INDEXER_QUEUE_USER_MAX_WORKING)
+		indexer_queue_user_unlink_all(queue, user);
+}
+
+static void indexer_queue_request_unwork(struct indexer_queue *queue,
+					 struct indexer_request *request)
+{
+	struct indexer_queue_user *user;
+
+	if (!request->working)
+		return;
+	request->working = FALSE;
+
+	user = hash_table_lookup(queue->users, request->username);
+	i_assert(user != NULL && user->working_count > 0);
+	user->working_count--;
+	indexer_queue_user_link_all(queue, user);
+	indexer_queue_user_free_if_unused(queue, user);
 }
 
 void indexer_queue_request_finish(struct indexer_queue *queue,
@@ -205,6 +484,7 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 				  bool success)
 {
 	struct indexer_request *request = *_request;
+	bool reindex_head = request->reindex_head;
 
 	*_request = NULL;
 
@@ -212,25 +492,27 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 
 	if (request->reindex_head || request->reindex_tail) {
 		i_assert(request->working);
-		request->working = FALSE;
+		indexer_queue_request_unwork(queue, request);
 		request->reindex_head = FALSE;
 		request->reindex_tail = FALSE;
 		if (request->working_context_idx > 0) {
 			array_delete(&request->contexts, 0,
 				     request->working_context_idx);
 		}
-		if (request->reindex_head)
-			DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-		else
-			DLLIST2_APPEND(&queue->head, &queue->tail, request);
+		request->priority = request->reindex_priority;
+		indexer_queue_add_request(queue, request, !reindex_head);
 		return;
 	}
 
+	indexer_queue_request_unwork(queue, request);
 	hash_table_remove(queue->requests, request);
 	if (array_is_created(&request->contexts))
 		array_free(&request->contexts);
+	if (request->event != NULL)
+		event_unref(&request->event);
 	i_free(request->username);
 	i_free(request->mailbox);
+	i_free(request->session_id);
 	i_free(request);
 
 	indexer_refresh_proctitle();
@@ -238,26 +520,35 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 
 void indexer_queue_cancel_all(struct indexer_queue *queue)
 {
-	struct indexer_request *request;
+	ARRAY(struct indexer_request *) queued_requests;
+	struct indexer_request *request, *const *requestp;
 	struct hash_iterate_context *iter;
 
 	/* remove all reindex-markers so when the current requests finish
 	   (or are cancelled) we don't try to retry them (especially during
 	   deinit where it crashes) */
+	i_array_init(&queued_requests, hash_table_count(queue->requests) + 1);
 	iter = hash_table_iterate_init(queue->requests);
-	while (hash_table_iterate(iter, queue->requests, &request, &request))
+	while (hash_table_iterate(iter, queue->requests, &request, &request)) {
 		request->reindex_head = request->reindex_tail = FALSE;
+		if (request->user != NULL)
+			array_push_back(&queued_requests, &request);
+	}
 	hash_table_iterate_deinit(&iter);
 
-	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		indexer_queue_request_remove(queue);
+	/* this includes the requests of users that are waiting for their
+	   earlier requests to finish */
+	array_foreach(&queued_requests, requestp) {
+		request = *requestp;
+		indexer_queue_remove_request(queue, request);
 		indexer_queue_request_finish(queue, &request, FALSE);
 	}
+	array_free(&queued_requests);
 }
 
 bool indexer_queue_is_empty(struct indexer_queue *queue)
 {
-	return queue->head == NULL;
+	return queue->queued_count == 0;
 }
 
 unsigned int indexer_queue_count(struct indexer_queue *queue)
@@ -3,13 +3,35 @@
 
 #include "indexer.h"
 
+/* Requests are queued separately for each priority class. The classes are
+   dequeued in proportion to their weights, so that higher priority requests
+   are handled first without completely starving the lower priorities.
+   Within a class the users are dequeued in round-robin order, so a single
+   user with many mailboxes can't delay everyone else. */
+enum indexer_request_priority {
+	/* Reindexing and optimizing, e.g. doveadm index -q */
+	INDEXER_REQUEST_PRIORITY_BULK = 0,
+	/* Indexing newly saved mails (fts_autoindex) */
+	INDEXER_REQUEST_PRIORITY_NEW_MAIL,
+	/* A client is waiting for the indexing to finish (SEARCH) */
+	INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+
+	INDEXER_REQUEST_PRIORITY_COUNT
+};
+
 struct indexer_request {
 	struct indexer_request *prev, *next;
+	struct indexer_queue_user *user;
 
 	char *username;
 	char *mailbox;
 	char *session_id;
 	unsigned int max_recent_msgs;
+	enum indexer_request_priority priority;
+	/* priority of the requests that came while working */
+	enum indexer_request_priority reindex_priority;
+	/* created when the request is queued, sent when it's dequeued */
+	struct event *event;
 
 	/* index messages in this mailbox */
 	bool index:1;
@@ -37,7 +59,10 @@ void indexer_queue_deinit(struct indexer_queue **queue);
 void indexer_queue_set_listen_callback(struct indexer_queue *queue,
 				       void (*callback)(struct indexer_queue *));
 	
+/* Add a request to the queue. If append is FALSE, the request is added to
+   the beginning of the user's queue within the priority class. */
 void indexer_queue_append(struct indexer_queue *queue, bool append,
+			  enum indexer_request_priority priority,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
 			  void *context);
@@ -49,7 +74,8 @@ void indexer_queue_cancel_all(struct indexer_queue *queue);
 bool indexer_queue_is_empty(struct indexer_queue *queue);
 unsigned int indexer_queue_count(struct indexer_queue *queue);
 
-/* Return the next request from the queue, without removing it. */
+/* Return the next request from the queue, without removing it. Users whose
+   previous requests are still being worked on are skipped. */
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
 /* Remove the next request from the queue. You must call
    indexer_queue_request_finish() to free its memory. */
@@ -59,7 +85,8 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
 				  int percentage);
 /* Start working on a request */
-void indexer_queue_request_work(struct indexer_request *request);
+void indexer_queue_request_work(struct indexer_queue *queue,
+				struct indexer_request *request);
 /* Finish the request and free its memory. */
 void indexer_queue_request_finish(struct indexer_queue *queue,
 				  struct indexer_request **request,
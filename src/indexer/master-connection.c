@@ -5,6 +5,7 @@
 #include "istream.h"
 #include "write-full.h"
 #include "strescape.h"
+#include "time-util.h"
 #include "process-title.h"
 #include "master-service.h"
 #include "master-service-settings.h"
@@ -22,6 +23,23 @@
 #define INDEXER_WORKER_HANDSHAKE "VERSION\tindexer-worker-master\t1\t0\n%u\n"
 #define INDEXER_MASTER_NAME "indexer-master-worker"
 
+/* Number of mails to start reading ahead while the earlier mails are being
+   indexed, unless mail_prefetch_count is larger. Only storages whose
+   prefetch starts reading the mail in the background benefit from this:
+   file-per-message storages (maildir, sdbox) via posix_fadvise() and
+   imapc/pop3c via pipelined commands. With mdbox and mbox the mails are
+   still read only when they're indexed. */
+#define INDEXER_WORKER_PREFETCH_COUNT 16
+
+struct index_mailbox_stage_times {
+	/* finding the mails and waiting for them to be read */
+	long long read_usecs;
+	/* parsing, caching and full text indexing the mails */
+	long long index_usecs;
+	/* committing the changes */
+	long long commit_usecs;
+};
+
 struct master_connection {
 	struct mail_storage_service_ctx *storage_service;
 
@@ -50,6 +68,39 @@ indexer_worker_refresh_proctitle(const char *username, const char *mailbox,
 	}
 }
 
+static void index_mailbox_stage_time(struct timeval *tv, long long *usecs)
+{
+	struct timeval tv_now;
+
+	if (gettimeofday(&tv_now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	*usecs += timeval_diff_usecs(&tv_now, tv);
+	*tv = tv_now;
+}
+
+static void
+index_mailbox_send_event(struct mailbox *box, unsigned int counter,
+			 uint32_t first_uid, uint32_t last_uid,
+			 const struct index_mailbox_stage_times *times)
+{
+	struct mail_user *user = mail_storage_get_user(mailbox_get_storage(box));
+	struct event_passthrough *e =
+		event_create_passthrough(user->event)->
+		set_name("indexer_worker_indexing_finished")->
+		add_str("mailbox", mailbox_get_vname(box))->
+		add_int("messages", counter)->
+		add_int("first_uid", first_uid)->
+		add_int("last_uid", last_uid)->
+		add_int("read_usecs", times->read_usecs)->
+		add_int("index_usecs", times->index_usecs)->
+		add_int("commit_usecs", times->commit_usecs);
+
+	e_debug(e->event(), "Mailbox %s: Indexed %u messages: read %lld us, "
+		"index %lld us, commit %lld us", mailbox_get_vname(box),
+		counter, times->read_usecs,
+		times->index_usecs, times->commit_usecs);
+}
+
 static int
 index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 {
@@ -64,6 +115,9 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 	struct mail_search_context *ctx;
 	struct mail *mail;
 	struct mailbox_metadata metadata;
+	struct index_mailbox_stage_times times;
+	struct timeval tv;
+	enum mail_fetch_field wanted_fields;
 	uint32_t seq, first_uid = 0, last_uid = 0;
 	char percentage_str[2+1+1];
 	unsigned int counter = 0, max, percentage, percentage_sent = 0;
@@ -89,17 +143,36 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 					  "indexing");
 	search_args = mail_search_build_init();
 	mail_search_build_add_seqset(search_args, seq, status.messages);
+	wanted_fields = metadata.precache_fields;
+	if (mail_user_plugin_getenv(mail_storage_get_user(storage),
+				    "fts") != NULL) {
+		/* full text indexing reads the whole mail. have the prefetch
+		   start reading it while the earlier mails are indexed. */
+		wanted_fields |= MAIL_FETCH_STREAM_HEADER |
+			MAIL_FETCH_STREAM_BODY;
+	}
 	ctx = mailbox_search_init(trans, search_args, NULL,
-				  metadata.precache_fields, NULL);
+				  wanted_fields, NULL);
 	mail_search_args_unref(&search_args);
+	if (mail_storage_get_settings(storage)->mail_prefetch_count <
+	    INDEXER_WORKER_PREFETCH_COUNT) {
+		mailbox_search_set_prefetch_count(ctx,
+			INDEXER_WORKER_PREFETCH_COUNT);
+	}
+
+	i_zero(&times);
+	if (gettimeofday(&tv, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 
 	max = status.messages + 1 - seq;
 	while (mailbox_search_next(ctx, &mail)) {
 		if (first_uid == 0)
 			first_uid = mail->uid;
 		last_uid = mail->uid;
+		index_mailbox_stage_time(&tv, &times.read_usecs);
 
 		mail_precache(mail);
+		index_mailbox_stage_time(&tv, &times.index_usecs);
 		if (++counter % 100 == 0) {
 			percentage = counter*100 / max;
 			if (percentage != percentage_sent && percentage < 100) {
@@ -123,6 +196,7 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 	}
 	const char *uids = first_uid == 0 ? "" :
 		t_strdup_printf(" (UIDs %u..%u)", first_uid, last_uid);
+	index_mailbox_stage_time(&tv, &times.read_usecs);
 	if (mailbox_transaction_commit(&trans) < 0) {
 		errstr = mailbox_get_last_internal_error(box, &error);
 		if (error != MAIL_ERROR_NOTFOUND)
@@ -131,6 +205,9 @@ index_mailbox_precache(struct master_connection *conn, struct mailbox *box)
 				mailbox_get_vname(box), errstr, counter, uids);
 		ret = -1;
 	} else {
+		index_mailbox_stage_time(&tv, &times.commit_usecs);
+		index_mailbox_send_event(box, counter, first_uid, last_uid,
+					 &times);
 		i_info("Indexed %u messages in %s%s",
 		       counter, mailbox_get_vname(box), uids);
 	}
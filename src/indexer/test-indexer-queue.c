@@ -0,0 +1,288 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "indexer-queue.h"
+#include "test-common.h"
+
+static string_t *test_finished;
+
+void indexer_refresh_proctitle(void)
+{
+}
+
+static void test_status_callback(int percentage, void *context)
+{
+	const char *name = context;
+
+	if (percentage == 100)
+		str_printfa(test_finished, "%s ", name);
+	else if (percentage < 0)
+		str_printfa(test_finished, "%s:fail ", name);
+}
+
+static struct indexer_queue *test_queue_init(void)
+{
+	test_finished = str_new(default_pool, 128);
+	return indexer_queue_init(test_status_callback);
+}
+
+static void test_queue_deinit(struct indexer_queue **queue)
+{
+	indexer_queue_deinit(queue);
+	str_free(&test_finished);
+}
+
+static void
+test_queue_add(struct indexer_queue *queue, bool append,
+	       enum indexer_request_priority priority,
+	       const char *username, const char *mailbox, const char *context)
+{
+	indexer_queue_append(queue, append, priority, username, mailbox,
+			     NULL, 0, (void *)context);
+}
+
+/* Dequeue the next request and start working on it */
+static struct indexer_request *test_queue_work(struct indexer_queue *queue)
+{
+	struct indexer_request *request;
+
+	request = indexer_queue_request_peek(queue);
+	if (request == NULL)
+		return NULL;
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(queue, request);
+	return request;
+}
+
+/* Dequeue and finish all the requests, returning the order of the
+   mailboxes. */
+static const char *test_queue_run(struct indexer_queue *queue)
+{
+	struct indexer_request *request;
+	string_t *str = t_str_new(128);
+
+	while ((request = test_queue_work(queue)) != NULL) {
+		str_printfa(str, "%s ", request->mailbox);
+		indexer_queue_request_finish(queue, &request, TRUE);
+	}
+	test_assert(indexer_queue_is_empty(queue));
+	test_assert(indexer_queue_count(queue) == 0);
+	return str_c(str);
+}
+
+static void test_indexer_queue_priority(void)
+{
+	static const struct {
+		enum indexer_request_priority priority;
+		char prefix;
+	} classes[] = {
+		{ INDEXER_REQUEST_PRIORITY_BULK, 'b' },
+		{ INDEXER_REQUEST_PRIORITY_NEW_MAIL, 'n' },
+		{ INDEXER_REQUEST_PRIORITY_INTERACTIVE, 'i' },
+	};
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+	string_t *order = t_str_new(32);
+	unsigned int i, j;
+
+	test_begin("indexer queue priority");
+	queue = test_queue_init();
+
+	/* a single request in each class */
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "bulk", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_NEW_MAIL,
+		       "user2", "new", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+		       "user3", "interactive", NULL);
+	test_assert(indexer_queue_count(queue) == 3);
+	test_assert_strcmp(test_queue_run(queue), "interactive new bulk ");
+	test_queue_deinit(&queue);
+
+	/* with all the classes busy they're dequeued in proportion to their
+	   weights 16:4:1, so the lower priorities don't starve */
+	queue = test_queue_init();
+	for (i = 0; i < N_ELEMENTS(classes); i++) {
+		for (j = 0; j < 20; j++) T_BEGIN {
+			test_queue_add(queue, TRUE, classes[i].priority,
+				t_strdup_printf("%c-user%u", classes[i].prefix, j),
+				t_strdup_printf("%c", classes[i].prefix), NULL);
+		} T_END;
+	}
+	for (i = 0; i < 21; i++) {
+		request = test_queue_work(queue);
+		str_append(order, request->mailbox);
+		indexer_queue_request_finish(queue, &request, TRUE);
+	}
+	test_assert_strcmp(str_c(order), "inbiiiiniiiiniiiiniii");
+	(void)test_queue_run(queue);
+	test_queue_deinit(&queue);
+
+	/* a prepended request moves to the higher priority class */
+	queue = test_queue_init();
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box1", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box2", NULL);
+	test_queue_add(queue, FALSE, INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+		       "user1", "box2", NULL);
+	/* ..but not to a lower one */
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_NEW_MAIL,
+		       "user2", "box3", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user2", "box3", NULL);
+	test_assert(indexer_queue_count(queue) == 3);
+	test_assert_strcmp(test_queue_run(queue), "box2 box3 box1 ");
+
+	test_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_fairness(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request, *request2;
+
+	test_begin("indexer queue fairness");
+	queue = test_queue_init();
+
+	/* users take turns within a class */
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "a1", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "a2", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "a3", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user2", "b1", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user2", "b2", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user3", "c1", NULL);
+	test_assert_strcmp(test_queue_run(queue), "a1 b1 c1 a2 b2 a3 ");
+
+	/* only one request per user is worked on at a time */
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "a1", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "a2", NULL);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user2", "b1", NULL);
+	request = test_queue_work(queue);
+	test_assert_strcmp(request->mailbox, "a1");
+	request2 = test_queue_work(queue);
+	test_assert_strcmp(request2->mailbox, "b1");
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	test_assert(!indexer_queue_is_empty(queue));
+	/* not even a more important request gets past it */
+	test_queue_add(queue, FALSE, INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+		       "user1", "a3", NULL);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	indexer_queue_request_finish(queue, &request2, TRUE);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	test_assert_strcmp(test_queue_run(queue), "a3 a2 ");
+
+	test_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_finish(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue finish");
+	queue = test_queue_init();
+
+	/* requests for the same mailbox are merged */
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box", "ctx1");
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box", "ctx2");
+	test_assert(indexer_queue_count(queue) == 1);
+	request = test_queue_work(queue);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	test_assert_strcmp(str_c(test_finished), "ctx1 ctx2 ");
+	test_assert(indexer_queue_is_empty(queue));
+
+	/* a request that comes while the mailbox is being indexed gets the
+	   mailbox reindexed afterwards with its own priority */
+	str_truncate(test_finished, 0);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box", "ctx1");
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user2", "box2", "ctx3");
+	request = test_queue_work(queue);
+	test_assert_strcmp(request->mailbox, "box");
+	test_queue_add(queue, FALSE, INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+		       "user1", "box", "ctx2");
+	indexer_queue_request_finish(queue, &request, TRUE);
+	test_assert_strcmp(str_c(test_finished), "ctx1 ");
+	test_assert(indexer_queue_count(queue) == 2);
+	test_assert_strcmp(test_queue_run(queue), "box box2 ");
+	test_assert_strcmp(str_c(test_finished), "ctx1 ctx2 ctx3 ");
+
+	/* failures are reported to all the contexts */
+	str_truncate(test_finished, 0);
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_NEW_MAIL,
+		       "user1", "box", "ctx1");
+	request = test_queue_work(queue);
+	indexer_queue_request_finish(queue, &request, FALSE);
+	test_assert_strcmp(str_c(test_finished), "ctx1:fail ");
+
+	test_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_cancel(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue cancel");
+	queue = test_queue_init();
+
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box1", "ctx1");
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user1", "box2", "ctx2");
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+		       "user2", "box3", "ctx3");
+	request = test_queue_work(queue);
+	test_assert_strcmp(request->mailbox, "box3");
+	/* reindexing is forgotten by the cancel */
+	test_queue_add(queue, TRUE, INDEXER_REQUEST_PRIORITY_BULK,
+		       "user2", "box3", "ctx4");
+
+	/* the queued requests are dropped, including the ones waiting for
+	   the user's earlier request to finish. They were never started, so
+	   there's no status to report. */
+	indexer_queue_cancel_all(queue);
+	test_assert(indexer_queue_is_empty(queue));
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	test_assert_strcmp(str_c(test_finished), "");
+	test_assert(indexer_queue_count(queue) == 1);
+
+	/* the request being worked on finishes normally */
+	str_truncate(test_finished, 0);
+	indexer_queue_request_finish(queue, &request, TRUE);
+	test_assert_strcmp(str_c(test_finished), "ctx3 ");
+	test_assert(indexer_queue_count(queue) == 0);
+
+	test_queue_deinit(&queue);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_indexer_queue_priority,
+		test_indexer_queue_fairness,
+		test_indexer_queue_finish,
+		test_indexer_queue_cancel,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -0,0 +1,212 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "istream.h"
+#include "ostream.h"
+#include "str.h"
+#include "strnum.h"
+#include "safe-mkstemp.h"
+#include "time-util.h"
+#include "ostream-zlib.h"
+#include "compression.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/* Compress and uncompress each given file separately with every available
+   compression handler, the same way mails are stored one per file, and
+   report the total compression ratio and throughput. With -t the zblock
+   format is also benchmarked with the given number of compression threads.
+   Usage: compression-bench [-l <level>] [-t <threads>] <file> [<file> ...] */
+
+#define DEFAULT_LEVEL 6
+
+ARRAY_DEFINE_TYPE(buffer_p, buffer_t *);
+
+static unsigned int bench_threads = 0;
+
+static void corpus_read(const char *path, buffer_t *buf)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_unref(&input);
+}
+
+/* The compressed data is written to a temporary file rather than a buffer,
+   because the compression ostreams won't finish while the parent stream's
+   buffer keeps growing. */
+static uoff_t
+bench_compress(const struct compression_handler *handler, int level,
+	       const buffer_t *plain, int fd)
+{
+	struct ostream *file_output, *output;
+	uoff_t compressed_size;
+
+	if (ftruncate(fd, 0) < 0)
+		i_fatal("ftruncate() failed: %m");
+	file_output = o_stream_create_fd_file(fd, 0, FALSE);
+	output = handler->create_ostream(file_output, level);
+	o_stream_nsend(output, plain->data, plain->used);
+	if (o_stream_finish(output) <= 0) {
+		i_fatal("%s: compression failed: %s", handler->name,
+			o_stream_get_error(output));
+	}
+	o_stream_destroy(&output);
+	compressed_size = file_output->offset;
+	o_stream_destroy(&file_output);
+	return compressed_size;
+}
+
+static void
+bench_uncompress(const struct compression_handler *handler, int fd,
+		 buffer_t *plain)
+{
+	struct istream *file_input, *input;
+	const unsigned char *data;
+	size_t size;
+
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		i_fatal("lseek() failed: %m");
+	file_input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	input = handler->create_istream(file_input, TRUE);
+	i_stream_unref(&file_input);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(plain, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		i_fatal("%s: uncompression failed: %s", handler->name,
+			i_stream_get_error(input));
+	}
+	i_stream_unref(&input);
+}
+
+static void
+bench_handler(const struct compression_handler *handler, int level,
+	      const ARRAY_TYPE(buffer_p) *corpus, size_t corpus_size, int fd)
+{
+	buffer_t *const *plainp, *uncompressed;
+	struct timeval tv_start, tv_end;
+	unsigned long long compress_usecs = 0, uncompress_usecs = 0;
+	uoff_t compressed_size = 0;
+
+	uncompressed = buffer_create_dynamic(default_pool, 1024*64);
+	array_foreach(corpus, plainp) T_BEGIN {
+		buffer_set_used_size(uncompressed, 0);
+
+		(void)gettimeofday(&tv_start, NULL);
+		compressed_size += bench_compress(handler, level, *plainp, fd);
+		(void)gettimeofday(&tv_end, NULL);
+		compress_usecs += timeval_diff_usecs(&tv_end, &tv_start);
+
+		(void)gettimeofday(&tv_start, NULL);
+		bench_uncompress(handler, fd, uncompressed);
+		(void)gettimeofday(&tv_end, NULL);
+		uncompress_usecs += timeval_diff_usecs(&tv_end, &tv_start);
+
+		if (!buffer_cmp(*plainp, uncompressed))
+			i_fatal("%s: uncompressed data differs", handler->name);
+	} T_END;
+	buffer_free(&uncompressed);
+
+	printf("%-10s %12"PRIuUOFF_T" bytes %6.2f%% %10.2f MB/s compress %10.2f MB/s uncompress\n",
+	       handler->name, compressed_size,
+	       corpus_size == 0 ? 0.0 : compressed_size * 100.0 / corpus_size,
+	       corpus_size / (compress_usecs / 1000000.0 + 1e-9) / (1024*1024),
+	       corpus_size / (uncompress_usecs / 1000000.0 + 1e-9) / (1024*1024));
+}
+
+#ifdef HAVE_ZLIB
+static struct ostream *
+bench_create_zblock_threads(struct ostream *output, int level)
+{
+	return o_stream_create_zblock_threads(output, level, bench_threads);
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+	ARRAY_TYPE(buffer_p) corpus;
+	buffer_t **plainp;
+	string_t *path;
+	size_t corpus_size = 0;
+	unsigned int i;
+	int c, fd, level = DEFAULT_LEVEL;
+
+	lib_init();
+	while ((c = getopt(argc, argv, "l:t:")) > 0) {
+		switch (c) {
+		case 'l':
+			if (str_to_int(optarg, &level) < 0 || level < 1)
+				i_fatal("Invalid level: %s", optarg);
+			break;
+		case 't':
+			if (str_to_uint(optarg, &bench_threads) < 0)
+				i_fatal("Invalid threads: %s", optarg);
+			break;
+		default:
+			i_fatal("Usage: %s [-l <level>] [-t <threads>] "
+				"<file> [<file> ...]", argv[0]);
+		}
+	}
+	argc -= optind; argv += optind;
+	if (argc == 0) {
+		i_fatal("Usage: compression-bench [-l <level>] [-t <threads>] "
+			"<file> [<file> ...]");
+	}
+
+	i_array_init(&corpus, argc);
+	for (; *argv != NULL; argv++) {
+		buffer_t *plain = buffer_create_dynamic(default_pool, 1024*64);
+
+		corpus_read(*argv, plain);
+		corpus_size += plain->used;
+		array_append(&corpus, &plain, 1);
+	}
+	path = t_str_new(128);
+	str_append(path, "/tmp/compression-bench.");
+	fd = safe_mkstemp(path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1)
+		i_fatal("safe_mkstemp(%s) failed: %m", str_c(path));
+	i_unlink(str_c(path));
+
+	printf("corpus: %u files, %zu bytes, level %d\n",
+	       array_count(&corpus), corpus_size, level);
+
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		if (compression_handlers[i].create_ostream == NULL ||
+		    (unsigned int)level > compression_handlers[i].max_level)
+			continue;
+		bench_handler(&compression_handlers[i], level,
+			      &corpus, corpus_size, fd);
+	}
+#ifdef HAVE_ZLIB
+	if (bench_threads > 0 && level <= 9) {
+		struct compression_handler handler =
+			*compression_lookup_handler("zblock");
+
+		handler.name = t_strdup_printf("zblock-t%u", bench_threads);
+		handler.create_ostream = bench_create_zblock_threads;
+		bench_handler(&handler, level, &corpus, corpus_size, fd);
+	}
+#endif
+
+	array_foreach_modifiable(&corpus, plainp)
+		buffer_free(plainp);
+	array_free(&corpus);
+	i_close_fd(&fd);
+	lib_deinit();
+	return 0;
+}
@@ -5,6 +5,7 @@
 #include "istream-zlib.h"
 #include "ostream-zlib.h"
 #include "iostream-lz4.h"
+#include "iostream-zblock.h"
 #include "compression.h"
 
 #ifndef HAVE_ZLIB
@@ -12,6 +13,8 @@
 #  define o_stream_create_gz NULL
 #  define i_stream_create_deflate NULL
 #  define o_stream_create_deflate NULL
+#  define i_stream_create_zblock NULL
+#  define o_stream_create_zblock NULL
 #endif
 #ifndef HAVE_BZLIB
 #  define i_stream_create_bz2 NULL
@@ -25,6 +28,10 @@
 #  define i_stream_create_lz4 NULL
 #  define o_stream_create_lz4 NULL
 #endif
+#ifndef HAVE_ZSTD
+#  define i_stream_create_zstd NULL
+#  define o_stream_create_zstd NULL
+#endif
 
 static bool is_compressed_zlib(struct istream *input)
 {
@@ -79,6 +86,29 @@ static bool is_compressed_lz4(struct istream *input)
 	return memcmp(data, IOSTREAM_LZ4_MAGIC, IOSTREAM_LZ4_MAGIC_LEN) == 0;
 }
 
+static bool is_compressed_zstd(struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_bytes(input, &data, &size, 4) <= 0)
+		return FALSE;
+	/* little-endian 0xFD2FB528 */
+	return memcmp(data, "\x28\xb5\x2f\xfd", 4) == 0;
+}
+
+static bool is_compressed_zblock(struct istream *input)
+{
+	const unsigned char *data;
+	size_t size;
+
+	if (i_stream_read_bytes(input, &data, &size,
+				IOSTREAM_ZBLOCK_MAGIC_LEN) <= 0)
+		return FALSE;
+	return memcmp(data, IOSTREAM_ZBLOCK_MAGIC,
+		      IOSTREAM_ZBLOCK_MAGIC_LEN) == 0;
+}
+
 const struct compression_handler *compression_lookup_handler(const char *name)
 {
 	unsigned int i;
@@ -123,14 +153,18 @@ compression_lookup_handler_from_ext(const char *path)
 
 const struct compression_handler compression_handlers[] = {
 	{ "gz", ".gz", is_compressed_zlib,
-	  i_stream_create_gz, o_stream_create_gz },
+	  i_stream_create_gz, o_stream_create_gz, 9, FALSE, FALSE },
 	{ "bz2", ".bz2", is_compressed_bzlib,
-	  i_stream_create_bz2, o_stream_create_bz2 },
+	  i_stream_create_bz2, o_stream_create_bz2, 9, FALSE, TRUE },
 	{ "deflate", NULL, NULL,
-	  i_stream_create_deflate, o_stream_create_deflate },
+	  i_stream_create_deflate, o_stream_create_deflate, 9, FALSE, TRUE },
 	{ "xz", ".xz", is_compressed_xz,
-	  i_stream_create_lzma, o_stream_create_lzma },
+	  i_stream_create_lzma, o_stream_create_lzma, 9, FALSE, TRUE },
 	{ "lz4", ".lz4", is_compressed_lz4,
-	  i_stream_create_lz4, o_stream_create_lz4 },
-	{ NULL, NULL, NULL, NULL, NULL }
+	  i_stream_create_lz4, o_stream_create_lz4, 9, FALSE, TRUE },
+	{ "zstd", ".zst", is_compressed_zstd,
+	  i_stream_create_zstd, o_stream_create_zstd, 22, FALSE, TRUE },
+	{ "zblock", ".zblk", is_compressed_zblock,
+	  i_stream_create_zblock, o_stream_create_zblock, 9, TRUE, FALSE },
+	{ NULL, NULL, NULL, NULL, NULL, 0, FALSE, FALSE }
 };
@@ -8,6 +8,14 @@ struct compression_handler {
 	struct istream *(*create_istream)(struct istream *input,
 					  bool log_errors);
 	struct ostream *(*create_ostream)(struct ostream *output, int level);
+	/* The highest level create_ostream() accepts. The lowest is 1. */
+	unsigned int max_level;
+	/* The istream can seek quickly to any offset, so there's no need to
+	   cache the uncompressed data for seeking backwards. */
+	bool fast_seek;
+	/* o_stream_flush() writes out all the data sent so far, so the
+	   stream can be used for interactive protocols. */
+	bool streamable;
 };
 
 extern const struct compression_handler compression_handlers[];
@@ -0,0 +1,49 @@
+#ifndef IOSTREAM_ZBLOCK_H
+#define IOSTREAM_ZBLOCK_H
+
+/*
+   Dovecot's seekable block-compressed files contain:
+
+   IOSTREAM_ZBLOCK_HEADER
+   n x (4 byte big-endian: block length, zlib-compressed block)
+   4 byte zero block length (end of blocks)
+   n x (8 byte big-endian: offset of the block's length prefix)
+   IOSTREAM_ZBLOCK_TRAILER
+
+   All blocks except the last one contain exactly block_size bytes of
+   uncompressed data, so the block containing any uncompressed offset is
+   found directly from the offset index. If the highest bit of the block
+   length is set, the block is stored uncompressed. All offsets are relative
+   to the beginning of the header.
+*/
+
+#define IOSTREAM_ZBLOCK_MAGIC "Dovecot-ZBLK\x0d\x2a\x9b\xc5"
+#define IOSTREAM_ZBLOCK_MAGIC_LEN (sizeof(IOSTREAM_ZBLOCK_MAGIC)-1)
+#define IOSTREAM_ZBLOCK_TRAILER_MAGIC "ZBLK"
+#define IOSTREAM_ZBLOCK_TRAILER_MAGIC_LEN \
+	(sizeof(IOSTREAM_ZBLOCK_TRAILER_MAGIC)-1)
+
+struct iostream_zblock_header {
+	unsigned char magic[IOSTREAM_ZBLOCK_MAGIC_LEN];
+	/* uncompressed block size in big-endian */
+	unsigned char block_size[4];
+};
+
+struct iostream_zblock_trailer {
+	/* uncompressed size of the whole stream in big-endian */
+	unsigned char uncompressed_size[8];
+	/* number of blocks (= offset index entries) in big-endian */
+	unsigned char block_count[4];
+	unsigned char magic[IOSTREAM_ZBLOCK_TRAILER_MAGIC_LEN];
+};
+
+/* Uncompressed size of each block */
+#define OSTREAM_ZBLOCK_BLOCK_SIZE (1024*64)
+/* Largest block size accepted when reading */
+#define ISTREAM_ZBLOCK_MAX_BLOCK_SIZE (1024*1024)
+
+#define IOSTREAM_ZBLOCK_PREFIX_LEN 4 /* big-endian size of block */
+#define IOSTREAM_ZBLOCK_STORED_FLAG 0x80000000U
+#define IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN 8
+
+#endif
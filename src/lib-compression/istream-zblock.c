@@ -0,0 +1,460 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZLIB
+
+#include "array.h"
+#include "buffer.h"
+#include "istream-private.h"
+#include "istream-zlib.h"
+#include "iostream-zblock.h"
+#include <zlib.h>
+
+struct zblock_istream {
+	struct istream_private istream;
+
+	struct stat last_parent_statbuf;
+
+	buffer_t *chunk_buf;
+	uint32_t block_size, chunk_size, chunk_left;
+	/* after the next block is uncompressed, skip over this many bytes
+	   of it. set by seeking. */
+	uint32_t block_skip;
+
+	/* offset index from the trailer */
+	ARRAY(uint64_t) block_offsets;
+	uoff_t uncompressed_size, blocks_end_offset;
+
+	bool log_errors:1;
+	bool header_read:1;
+	bool chunk_stored:1;
+	bool trailer_read:1;
+	bool trailer_failed:1;
+	bool blocks_end:1;
+};
+
+static void i_stream_zblock_close(struct iostream_private *stream,
+				  bool close_parent)
+{
+	struct zblock_istream *zstream = (struct zblock_istream *)stream;
+
+	buffer_free(&zstream->chunk_buf);
+	array_free(&zstream->block_offsets);
+	if (close_parent)
+		i_stream_close(zstream->istream.parent);
+}
+
+static void zblock_read_error(struct zblock_istream *zstream, const char *error)
+{
+	io_stream_set_error(&zstream->istream.iostream,
+			    "zblock.read(%s): %s at %"PRIuUOFF_T,
+			    i_stream_get_name(&zstream->istream.istream), error,
+			    i_stream_get_absolute_offset(&zstream->istream.istream));
+	if (zstream->log_errors)
+		i_error("%s", zstream->istream.iostream.error);
+}
+
+static int i_stream_zblock_read_header(struct zblock_istream *zstream)
+{
+	const struct iostream_zblock_header *hdr;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	ret = i_stream_read_bytes(zstream->istream.parent, &data, &size,
+				  sizeof(*hdr));
+	if (ret < 0 && zstream->istream.parent->stream_errno != 0) {
+		zstream->istream.istream.stream_errno =
+			zstream->istream.parent->stream_errno;
+		return ret;
+	}
+	if (ret == 0)
+		return 0;
+	hdr = (const void *)data;
+	if (ret < 0 || memcmp(hdr->magic, IOSTREAM_ZBLOCK_MAGIC,
+			      IOSTREAM_ZBLOCK_MAGIC_LEN) != 0) {
+		zblock_read_error(zstream, "wrong magic in header (not zblock file?)");
+		zstream->istream.istream.stream_errno = EINVAL;
+		return -1;
+	}
+	zstream->block_size = be32_to_cpu_unaligned(hdr->block_size);
+	if (zstream->block_size == 0 ||
+	    zstream->block_size > ISTREAM_ZBLOCK_MAX_BLOCK_SIZE) {
+		zblock_read_error(zstream, t_strdup_printf(
+			"invalid block size %u", zstream->block_size));
+		zstream->istream.istream.stream_errno = EINVAL;
+		return -1;
+	}
+	i_stream_skip(zstream->istream.parent, sizeof(*hdr));
+	zstream->header_read = TRUE;
+	return 1;
+}
+
+static bool
+i_stream_zblock_read_index(struct zblock_istream *zstream,
+			   uoff_t start_offset, unsigned int count)
+{
+	struct istream *parent = zstream->istream.parent;
+	const unsigned char *data;
+	uoff_t prev_offset = 0;
+	uint64_t offset;
+	size_t size;
+	int ret;
+
+	i_stream_seek(parent, start_offset);
+	while (array_count(&zstream->block_offsets) < count) {
+		ret = i_stream_read_bytes(parent, &data, &size,
+					  IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN);
+		if (ret <= 0)
+			return FALSE;
+		for (; size >= IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN &&
+		       array_count(&zstream->block_offsets) < count;
+		     size -= IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN) {
+			offset = be64_to_cpu_unaligned(data);
+			if (offset <= prev_offset ||
+			    offset >= zstream->blocks_end_offset)
+				return FALSE;
+			array_append(&zstream->block_offsets, &offset, 1);
+			prev_offset = offset;
+			data += IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN;
+			i_stream_skip(parent, IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN);
+		}
+	}
+	return TRUE;
+}
+
+static bool i_stream_zblock_try_read_trailer(struct zblock_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	const struct iostream_zblock_trailer *trailer;
+	const unsigned char *data;
+	uoff_t parent_size, trailer_offset, index_size, max_size;
+	unsigned int count;
+	size_t size;
+
+	/* the trailer can be used only if the parent is seekable and its
+	   size is known. otherwise fall back to reading sequentially. */
+	if (zstream->trailer_read)
+		return TRUE;
+	if (zstream->trailer_failed || !stream->parent->seekable)
+		return FALSE;
+	zstream->trailer_failed = TRUE;
+
+	if (!zstream->header_read) {
+		i_stream_seek(stream->parent, stream->parent_start_offset);
+		if (i_stream_zblock_read_header(zstream) <= 0)
+			return FALSE;
+		stream->parent_expected_offset = stream->parent->v_offset;
+	}
+	if (i_stream_get_size(stream->parent, TRUE, &parent_size) <= 0)
+		return FALSE;
+	if (parent_size < stream->parent_start_offset +
+	    sizeof(struct iostream_zblock_header) +
+	    IOSTREAM_ZBLOCK_PREFIX_LEN + sizeof(*trailer))
+		return FALSE;
+	trailer_offset = parent_size - sizeof(*trailer);
+
+	i_stream_seek(stream->parent, trailer_offset);
+	if (i_stream_read_bytes(stream->parent, &data, &size,
+				sizeof(*trailer)) <= 0)
+		return FALSE;
+	trailer = (const void *)data;
+	if (memcmp(trailer->magic, IOSTREAM_ZBLOCK_TRAILER_MAGIC,
+		   sizeof(trailer->magic)) != 0)
+		return FALSE;
+	count = be32_to_cpu_unaligned(trailer->block_count);
+	zstream->uncompressed_size =
+		be64_to_cpu_unaligned(trailer->uncompressed_size);
+
+	/* all blocks except the last one must be full */
+	max_size = (uoff_t)count * zstream->block_size;
+	if (zstream->uncompressed_size > max_size ||
+	    (count > 0 && zstream->uncompressed_size <=
+	     max_size - zstream->block_size))
+		return FALSE;
+	index_size = (uoff_t)count * IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN;
+	if (index_size > trailer_offset - stream->parent_start_offset -
+	    sizeof(struct iostream_zblock_header) - IOSTREAM_ZBLOCK_PREFIX_LEN)
+		return FALSE;
+	zstream->blocks_end_offset = trailer_offset - index_size -
+		IOSTREAM_ZBLOCK_PREFIX_LEN - stream->parent_start_offset;
+
+	array_clear(&zstream->block_offsets);
+	if (!i_stream_zblock_read_index(zstream, trailer_offset - index_size,
+					count)) {
+		array_clear(&zstream->block_offsets);
+		return FALSE;
+	}
+	zstream->trailer_read = TRUE;
+	zstream->trailer_failed = FALSE;
+	stream->cached_stream_size = zstream->uncompressed_size;
+	return TRUE;
+}
+
+static int i_stream_zblock_read_chunk_prefix(struct zblock_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	ret = i_stream_read_bytes(stream->parent, &data, &size,
+				  IOSTREAM_ZBLOCK_PREFIX_LEN);
+	if (ret < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		if (stream->istream.stream_errno == 0) {
+			zblock_read_error(zstream, "missing end of blocks");
+			stream->istream.stream_errno = EPIPE;
+		}
+		return -1;
+	}
+	if (ret == 0)
+		return 0;
+
+	zstream->chunk_size = be32_to_cpu_unaligned(data);
+	if (zstream->chunk_size == 0) {
+		/* end of blocks - the offset index and trailer follow */
+		zstream->blocks_end = TRUE;
+		stream->istream.eof = TRUE;
+		stream->cached_stream_size =
+			stream->istream.v_offset + stream->pos - stream->skip;
+		return -1;
+	}
+	zstream->chunk_stored =
+		(zstream->chunk_size & IOSTREAM_ZBLOCK_STORED_FLAG) != 0;
+	zstream->chunk_size &= ~IOSTREAM_ZBLOCK_STORED_FLAG;
+	if (zstream->chunk_size > compressBound(zstream->block_size) ||
+	    (zstream->chunk_stored &&
+	     zstream->chunk_size > zstream->block_size)) {
+		zblock_read_error(zstream, t_strdup_printf(
+			"invalid block size: %u", zstream->chunk_size));
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	zstream->chunk_left = zstream->chunk_size;
+	i_stream_skip(stream->parent, IOSTREAM_ZBLOCK_PREFIX_LEN);
+	buffer_set_used_size(zstream->chunk_buf, 0);
+	return 1;
+}
+
+static ssize_t i_stream_zblock_read(struct istream_private *stream)
+{
+	struct zblock_istream *zstream = (struct zblock_istream *)stream;
+	const unsigned char *data;
+	unsigned char *dest;
+	uLongf dest_size;
+	size_t size;
+	ssize_t ret;
+
+	if (zstream->blocks_end) {
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+	if (!zstream->header_read) {
+		if ((ret = i_stream_zblock_read_header(zstream)) <= 0)
+			return ret;
+	}
+
+	if (zstream->chunk_left == 0 && zstream->chunk_buf->used == 0) {
+		if ((ret = i_stream_zblock_read_chunk_prefix(zstream)) <= 0)
+			return ret;
+	}
+
+	/* read the whole compressed block into memory */
+	while (zstream->chunk_left > 0 &&
+	       (ret = i_stream_read_more(stream->parent, &data, &size)) > 0) {
+		if (size > zstream->chunk_left)
+			size = zstream->chunk_left;
+		buffer_append(zstream->chunk_buf, data, size);
+		i_stream_skip(stream->parent, size);
+		zstream->chunk_left -= size;
+	}
+	if (zstream->chunk_left > 0) {
+		if (ret == -1 && stream->parent->stream_errno == 0) {
+			zblock_read_error(zstream, "truncated block");
+			stream->istream.stream_errno = EPIPE;
+			return -1;
+		}
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return ret;
+	}
+	/* if we already have max_buffer_size amount of data, fail here */
+	if (stream->pos - stream->skip >= i_stream_get_max_buffer_size(&stream->istream))
+		return -2;
+
+	dest = i_stream_alloc(stream, zstream->block_size);
+	if (zstream->chunk_stored) {
+		memcpy(dest, zstream->chunk_buf->data, zstream->chunk_buf->used);
+		dest_size = zstream->chunk_buf->used;
+	} else {
+		dest_size = zstream->block_size;
+		ret = uncompress(dest, &dest_size, zstream->chunk_buf->data,
+				 zstream->chunk_buf->used);
+		if (ret == Z_MEM_ERROR) {
+			i_fatal_status(FATAL_OUTOFMEM,
+				"zblock.read(%s): Out of memory",
+				i_stream_get_name(&stream->istream));
+		}
+		if (ret != Z_OK || dest_size == 0) {
+			zblock_read_error(zstream, "corrupted block");
+			stream->istream.stream_errno = EINVAL;
+			return -1;
+		}
+	}
+	buffer_set_used_size(zstream->chunk_buf, 0);
+	if (zstream->block_skip >= dest_size) {
+		zblock_read_error(zstream, "block is smaller than expected");
+		stream->istream.stream_errno = EINVAL;
+		return -1;
+	}
+	stream->pos += dest_size;
+	stream->skip += zstream->block_skip;
+	ret = dest_size - zstream->block_skip;
+	zstream->block_skip = 0;
+	return ret;
+}
+
+static void i_stream_zblock_reset(struct zblock_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+
+	i_stream_seek(stream->parent, stream->parent_start_offset);
+	zstream->header_read = FALSE;
+	zstream->chunk_size = zstream->chunk_left = 0;
+	zstream->block_skip = 0;
+	buffer_set_used_size(zstream->chunk_buf, 0);
+
+	stream->parent_expected_offset = stream->parent_start_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = 0;
+	zstream->blocks_end = FALSE;
+}
+
+static void
+i_stream_zblock_seek(struct istream_private *stream, uoff_t v_offset,
+		     bool mark ATTR_UNUSED)
+{
+	struct zblock_istream *zstream = (struct zblock_istream *) stream;
+	uoff_t start_offset = stream->istream.v_offset - stream->skip;
+	uoff_t block_idx, block_offset;
+
+	if (v_offset >= start_offset && v_offset <= start_offset + stream->pos) {
+		/* seeking within what's already cached */
+		if (!i_stream_nonseekable_try_seek(stream, v_offset))
+			i_unreached();
+		return;
+	}
+
+	if (!i_stream_zblock_try_read_trailer(zstream)) {
+		/* have to seek backwards - reset state and retry */
+		if (v_offset < start_offset)
+			i_stream_zblock_reset(zstream);
+		if (!i_stream_nonseekable_try_seek(stream, v_offset))
+			i_unreached();
+		return;
+	}
+
+	/* jump directly to the block containing the offset */
+	if (v_offset < zstream->uncompressed_size) {
+		block_idx = v_offset / zstream->block_size;
+		i_assert(block_idx < array_count(&zstream->block_offsets));
+		block_offset = *array_idx(&zstream->block_offsets, block_idx);
+		zstream->block_skip = v_offset % zstream->block_size;
+	} else {
+		/* seeking to the end of stream */
+		block_offset = zstream->blocks_end_offset;
+		zstream->block_skip = 0;
+	}
+	zstream->chunk_size = zstream->chunk_left = 0;
+	buffer_set_used_size(zstream->chunk_buf, 0);
+	stream->parent_expected_offset =
+		stream->parent_start_offset + block_offset;
+	i_stream_seek(stream->parent, stream->parent_expected_offset);
+	stream->skip = stream->pos = 0;
+	stream->high_pos = 0;
+	stream->istream.v_offset = v_offset;
+	zstream->blocks_end = FALSE;
+}
+
+static int
+i_stream_zblock_stat(struct istream_private *stream, bool exact)
+{
+	struct zblock_istream *zstream = (struct zblock_istream *) stream;
+	const struct stat *st;
+	uoff_t old_offset;
+	ssize_t ret;
+
+	if (i_stream_stat(stream->parent, exact, &st) < 0) {
+		stream->istream.stream_errno = stream->parent->stream_errno;
+		return -1;
+	}
+	stream->statbuf = *st;
+	if (!exact) {
+		/* return the parent's size, see i_stream_default_stat() */
+		return 0;
+	}
+
+	if (stream->cached_stream_size == (uoff_t)-1 &&
+	    !i_stream_zblock_try_read_trailer(zstream) &&
+	    stream->istream.seekable) {
+		/* no usable trailer - read through the stream */
+		old_offset = stream->istream.v_offset;
+		do {
+			i_stream_skip(&stream->istream,
+				      i_stream_get_data_size(&stream->istream));
+		} while ((ret = i_stream_read(&stream->istream)) > 0);
+		i_assert(ret == -1);
+		if (stream->istream.stream_errno != 0)
+			return -1;
+		stream->cached_stream_size = stream->istream.v_offset;
+		i_stream_seek(&stream->istream, old_offset);
+	}
+	stream->statbuf.st_size = stream->cached_stream_size;
+	return 0;
+}
+
+static void i_stream_zblock_sync(struct istream_private *stream)
+{
+	struct zblock_istream *zstream = (struct zblock_istream *) stream;
+	const struct stat *st;
+
+	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
+		if (memcmp(&zstream->last_parent_statbuf,
+			   st, sizeof(*st)) == 0) {
+			/* a compressed file doesn't change unexpectedly,
+			   don't clear our caches unnecessarily */
+			return;
+		}
+		zstream->last_parent_statbuf = *st;
+	}
+	zstream->trailer_read = FALSE;
+	zstream->trailer_failed = FALSE;
+	stream->cached_stream_size = (uoff_t)-1;
+	i_stream_zblock_reset(zstream);
+}
+
+struct istream *i_stream_create_zblock(struct istream *input, bool log_errors)
+{
+	struct zblock_istream *zstream;
+
+	zstream = i_new(struct zblock_istream, 1);
+	zstream->log_errors = log_errors;
+
+	zstream->istream.iostream.close = i_stream_zblock_close;
+	zstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	zstream->istream.read = i_stream_zblock_read;
+	zstream->istream.seek = i_stream_zblock_seek;
+	zstream->istream.sync = i_stream_zblock_sync;
+	zstream->istream.stat = i_stream_zblock_stat;
+
+	zstream->istream.istream.readable_fd = FALSE;
+	zstream->istream.istream.blocking = input->blocking;
+	zstream->istream.istream.seekable = input->seekable;
+	zstream->chunk_buf = buffer_create_dynamic(default_pool, 1024);
+	i_array_init(&zstream->block_offsets, 16);
+
+	return i_stream_create(&zstream->istream, input,
+			       i_stream_get_fd(input), 0);
+}
+#endif
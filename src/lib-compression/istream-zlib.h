@@ -6,5 +6,7 @@ struct istream *i_stream_create_deflate(struct istream *input, bool log_errors);
 struct istream *i_stream_create_bz2(struct istream *input, bool log_errors);
 struct istream *i_stream_create_lzma(struct istream *input, bool log_errors);
 struct istream *i_stream_create_lz4(struct istream *input, bool log_errors);
+struct istream *i_stream_create_zstd(struct istream *input, bool log_errors);
+struct istream *i_stream_create_zblock(struct istream *input, bool log_errors);
 
 #endif
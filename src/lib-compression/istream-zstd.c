@@ -0,0 +1,228 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "istream-private.h"
+#include "istream-zlib.h"
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#define CHUNK_SIZE (1024*64)
+
+struct zstd_istream {
+	struct istream_private istream;
+
+	ZSTD_DStream *dstream;
+	uoff_t eof_offset;
+	struct stat last_parent_statbuf;
+
+	bool log_errors:1;
+	bool marked:1;
+	/* we're in the middle of a frame */
+	bool in_frame:1;
+};
+
+static void i_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+
+	if (zstream->dstream != NULL) {
+		(void)ZSTD_freeDStream(zstream->dstream);
+		zstream->dstream = NULL;
+	}
+	if (close_parent)
+		i_stream_close(zstream->istream.parent);
+}
+
+static void zstd_read_error(struct zstd_istream *zstream, const char *error)
+{
+	io_stream_set_error(&zstream->istream.iostream,
+			    "zstd.read(%s): %s at %"PRIuUOFF_T,
+			    i_stream_get_name(&zstream->istream.istream), error,
+			    i_stream_get_absolute_offset(&zstream->istream.istream));
+	if (zstream->log_errors)
+		i_error("%s", zstream->istream.iostream.error);
+}
+
+static void zstd_stream_end(struct zstd_istream *zstream)
+{
+	zstream->eof_offset = zstream->istream.istream.v_offset +
+		(zstream->istream.pos - zstream->istream.skip);
+	zstream->istream.cached_stream_size = zstream->eof_offset;
+}
+
+static ssize_t i_stream_zstd_read(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *)stream;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	const unsigned char *data;
+	uoff_t high_offset;
+	size_t size, out_size, zret;
+	int ret;
+
+	high_offset = stream->istream.v_offset + (stream->pos - stream->skip);
+	if (zstream->eof_offset == high_offset) {
+		stream->istream.eof = TRUE;
+		return -1;
+	}
+
+	if (!zstream->marked) {
+		if (!i_stream_try_alloc(stream, CHUNK_SIZE, &out_size))
+			return -2; /* buffer full */
+	} else {
+		/* try to avoid compressing, so we can quickly seek backwards */
+		if (!i_stream_try_alloc_avoid_compress(stream, CHUNK_SIZE, &out_size))
+			return -2; /* buffer full */
+	}
+
+	for (;;) {
+		ret = i_stream_read_more(stream->parent, &data, &size);
+		if (ret < 0 && stream->parent->stream_errno != 0) {
+			stream->istream.stream_errno =
+				stream->parent->stream_errno;
+			return -1;
+		}
+
+		/* even without any new input zstd may still have output
+		   left from the previous call */
+		input.src = data;
+		input.size = size;
+		input.pos = 0;
+		output.dst = stream->w_buffer + stream->pos;
+		output.size = out_size;
+		output.pos = 0;
+		zret = ZSTD_decompressStream(zstream->dstream, &output, &input);
+		i_stream_skip(stream->parent, input.pos);
+
+		if (ZSTD_isError(zret)) {
+			if (ZSTD_getErrorCode(zret) ==
+			    ZSTD_error_memory_allocation) {
+				i_fatal_status(FATAL_OUTOFMEM,
+					"zstd.read(%s): Out of memory",
+					i_stream_get_name(&stream->istream));
+			}
+			zstd_read_error(zstream, ZSTD_getErrorName(zret));
+			stream->istream.stream_errno = EINVAL;
+			return -1;
+		}
+		if (input.pos > 0 || output.pos > 0) {
+			/* 0 = frame is fully decoded and flushed */
+			zstream->in_frame = zret != 0;
+		}
+		if (output.pos > 0) {
+			stream->pos += output.pos;
+			return output.pos;
+		}
+
+		if (ret < 0) {
+			i_assert(stream->parent->eof);
+			if (zstream->in_frame) {
+				zstd_read_error(zstream, "truncated zstd frame");
+				stream->istream.stream_errno = EPIPE;
+				return -1;
+			}
+			zstd_stream_end(zstream);
+			stream->istream.eof = TRUE;
+			return -1;
+		}
+		if (ret == 0) {
+			/* no more input */
+			i_assert(!stream->istream.blocking);
+			return 0;
+		}
+	}
+}
+
+static void i_stream_zstd_init(struct zstd_istream *zstream)
+{
+	size_t zret;
+
+	if (zstream->dstream == NULL) {
+		zstream->dstream = ZSTD_createDStream();
+		if (zstream->dstream == NULL)
+			i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	}
+	zret = ZSTD_initDStream(zstream->dstream);
+	if (ZSTD_isError(zret)) {
+		i_fatal("ZSTD_initDStream() failed: %s",
+			ZSTD_getErrorName(zret));
+	}
+	zstream->in_frame = FALSE;
+}
+
+static void i_stream_zstd_reset(struct zstd_istream *zstream)
+{
+	struct istream_private *stream = &zstream->istream;
+
+	i_stream_seek(stream->parent, stream->parent_start_offset);
+	zstream->eof_offset = (uoff_t)-1;
+
+	stream->parent_expected_offset = stream->parent_start_offset;
+	stream->skip = stream->pos = 0;
+	stream->istream.v_offset = 0;
+
+	i_stream_zstd_init(zstream);
+}
+
+static void
+i_stream_zstd_seek(struct istream_private *stream, uoff_t v_offset, bool mark)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+
+	if (i_stream_nonseekable_try_seek(stream, v_offset))
+		return;
+
+	/* have to seek backwards - reset state and retry */
+	i_stream_zstd_reset(zstream);
+	if (!i_stream_nonseekable_try_seek(stream, v_offset))
+		i_unreached();
+
+	if (mark)
+		zstream->marked = TRUE;
+}
+
+static void i_stream_zstd_sync(struct istream_private *stream)
+{
+	struct zstd_istream *zstream = (struct zstd_istream *) stream;
+	const struct stat *st;
+
+	if (i_stream_stat(stream->parent, FALSE, &st) < 0) {
+		if (memcmp(&zstream->last_parent_statbuf,
+			   st, sizeof(*st)) == 0) {
+			/* a compressed file doesn't change unexpectedly,
+			   don't clear our caches unnecessarily */
+			return;
+		}
+		zstream->last_parent_statbuf = *st;
+	}
+	i_stream_zstd_reset(zstream);
+}
+
+struct istream *i_stream_create_zstd(struct istream *input, bool log_errors)
+{
+	struct zstd_istream *zstream;
+
+	zstream = i_new(struct zstd_istream, 1);
+	zstream->eof_offset = (uoff_t)-1;
+	zstream->log_errors = log_errors;
+
+	i_stream_zstd_init(zstream);
+
+	zstream->istream.iostream.close = i_stream_zstd_close;
+	zstream->istream.max_buffer_size = input->real_stream->max_buffer_size;
+	zstream->istream.read = i_stream_zstd_read;
+	zstream->istream.seek = i_stream_zstd_seek;
+	zstream->istream.sync = i_stream_zstd_sync;
+
+	zstream->istream.istream.readable_fd = FALSE;
+	zstream->istream.istream.blocking = input->blocking;
+	zstream->istream.istream.seekable = input->seekable;
+
+	return i_stream_create(&zstream->istream, input,
+			       i_stream_get_fd(input), 0);
+}
+#endif
@@ -0,0 +1,652 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZLIB
+
+#include "array.h"
+#include "buffer.h"
+#include "ostream-private.h"
+#include "ostream-zlib.h"
+#include "iostream-zblock.h"
+#include <zlib.h>
+#ifdef HAVE_COMPRESS_THREADS
+#  include <pthread.h>
+#endif
+
+#define BLOCK_SIZE OSTREAM_ZBLOCK_BLOCK_SIZE
+/* Maximum number of blocks queued per compression thread */
+#define ZBLOCK_JOBS_PER_THREAD 2
+
+enum zblock_job_state {
+	ZBLOCK_JOB_STATE_FREE = 0,
+	ZBLOCK_JOB_STATE_QUEUED,
+	ZBLOCK_JOB_STATE_RUNNING,
+	ZBLOCK_JOB_STATE_DONE
+};
+
+/* A block being compressed by a worker thread. The workers only touch the
+   job's own buffers and call zlib, so nothing in lib needs to be
+   thread-safe. */
+struct zblock_job {
+	struct zblock_job *queue_next;
+
+	enum zblock_job_state state;
+	int level;
+	unsigned char *input;
+	size_t input_size;
+	unsigned char *output;
+	uLongf output_size;
+	int zret;
+};
+
+#ifdef HAVE_COMPRESS_THREADS
+/* The worker threads are shared by all the zblock ostreams in the process.
+   They're started when a stream first queues a block and stopped by
+   lib_deinit(). */
+struct zblock_thread_pool {
+	pid_t pid;
+	pthread_t *threads;
+	unsigned int thread_count;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t queued_cond, done_cond;
+	/* queued jobs of all the streams, oldest first */
+	struct zblock_job *queue_head, *queue_tail;
+	bool shutdown;
+};
+
+static struct zblock_thread_pool zblock_pool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.queued_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+#endif
+
+struct zblock_ostream {
+	struct ostream_private ostream;
+	int level;
+
+	unsigned char compressbuf[BLOCK_SIZE];
+	unsigned int compressbuf_offset;
+	uoff_t uncompressed_size;
+	/* compressed block, when compressing in the calling thread */
+	unsigned char *blockbuf;
+
+	/* header, blocks or the trailer waiting to be sent to parent */
+	buffer_t *outbuf;
+	size_t outbuf_offset;
+	/* offset of the next block relative to the beginning of the header */
+	uoff_t block_offset;
+	ARRAY(uint64_t) block_offsets;
+
+#ifdef HAVE_COMPRESS_THREADS
+	unsigned int thread_count;
+	/* ring of jobs in the order they're written to the output. Allocated
+	   when the first full block is queued. */
+	struct zblock_job *jobs;
+	unsigned int jobs_count, jobs_head, jobs_used;
+#endif
+
+	bool trailer_written:1;
+};
+
+static int
+zblock_compress_block(const unsigned char *input, size_t input_size,
+		      unsigned char *output, uLongf *output_size, int level)
+{
+	*output_size = compressBound(input_size);
+	return compress2(output, output_size, input, input_size, level);
+}
+
+#ifdef HAVE_COMPRESS_THREADS
+static void *zblock_compress_thread(void *context ATTR_UNUSED)
+{
+	struct zblock_job *job;
+
+	pthread_mutex_lock(&zblock_pool.mutex);
+	for (;;) {
+		while (zblock_pool.queue_head == NULL && !zblock_pool.shutdown) {
+			pthread_cond_wait(&zblock_pool.queued_cond,
+					  &zblock_pool.mutex);
+		}
+		if ((job = zblock_pool.queue_head) == NULL)
+			break;
+		zblock_pool.queue_head = job->queue_next;
+		if (zblock_pool.queue_head == NULL)
+			zblock_pool.queue_tail = NULL;
+		job->queue_next = NULL;
+		job->state = ZBLOCK_JOB_STATE_RUNNING;
+		pthread_mutex_unlock(&zblock_pool.mutex);
+
+		job->zret = zblock_compress_block(job->input, job->input_size,
+						  job->output,
+						  &job->output_size,
+						  job->level);
+
+		pthread_mutex_lock(&zblock_pool.mutex);
+		job->state = ZBLOCK_JOB_STATE_DONE;
+		pthread_cond_broadcast(&zblock_pool.done_cond);
+	}
+	pthread_mutex_unlock(&zblock_pool.mutex);
+	return NULL;
+}
+
+static void zblock_thread_pool_deinit(void)
+{
+	unsigned int i;
+
+	if (zblock_pool.thread_count == 0 || zblock_pool.pid != getpid())
+		return;
+
+	pthread_mutex_lock(&zblock_pool.mutex);
+	zblock_pool.shutdown = TRUE;
+	pthread_cond_broadcast(&zblock_pool.queued_cond);
+	pthread_mutex_unlock(&zblock_pool.mutex);
+	for (i = 0; i < zblock_pool.thread_count; i++)
+		(void)pthread_join(zblock_pool.threads[i], NULL);
+	i_free(zblock_pool.threads);
+	zblock_pool.thread_count = 0;
+	zblock_pool.shutdown = FALSE;
+}
+
+/* Make sure the pool has at least thread_count threads. */
+static int
+zblock_thread_pool_start(unsigned int thread_count, const char **error_r)
+{
+	int ret;
+
+	if (zblock_pool.thread_count > 0 && zblock_pool.pid != getpid()) {
+		/* forked - the threads only exist in the parent */
+		i_assert(zblock_pool.queue_head == NULL);
+		zblock_pool.threads = NULL;
+		zblock_pool.thread_count = 0;
+	}
+	if (zblock_pool.thread_count >= thread_count)
+		return 0;
+
+	if (zblock_pool.thread_count == 0) {
+		zblock_pool.pid = getpid();
+		lib_atexit(zblock_thread_pool_deinit);
+	}
+	zblock_pool.threads = i_realloc_type(zblock_pool.threads, pthread_t,
+					     zblock_pool.thread_count,
+					     thread_count);
+	for (; zblock_pool.thread_count < thread_count;
+	     zblock_pool.thread_count++) {
+		ret = pthread_create(&zblock_pool.threads[zblock_pool.thread_count],
+				     NULL, zblock_compress_thread, NULL);
+		if (ret != 0) {
+			errno = ret;
+			*error_r = t_strdup_printf("pthread_create() failed: %m");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int o_stream_zblock_threads_init(struct zblock_ostream *zstream)
+{
+	const char *error;
+	unsigned int i;
+
+	if (zblock_thread_pool_start(zstream->thread_count, &error) < 0) {
+		zstream->ostream.ostream.stream_errno = errno;
+		io_stream_set_error(&zstream->ostream.iostream,
+				    "zblock: %s", error);
+		return -1;
+	}
+
+	zstream->jobs_count = zstream->thread_count * ZBLOCK_JOBS_PER_THREAD;
+	zstream->jobs = i_new(struct zblock_job, zstream->jobs_count);
+	for (i = 0; i < zstream->jobs_count; i++) {
+		zstream->jobs[i].level = zstream->level;
+		zstream->jobs[i].input = i_malloc(BLOCK_SIZE);
+		zstream->jobs[i].output = i_malloc(compressBound(BLOCK_SIZE));
+	}
+	return 0;
+}
+
+static void zblock_thread_pool_unqueue(struct zblock_job *job)
+{
+	struct zblock_job **jobp, *prev = NULL;
+
+	for (jobp = &zblock_pool.queue_head; *jobp != job;
+	     jobp = &(*jobp)->queue_next)
+		prev = *jobp;
+	*jobp = job->queue_next;
+	if (zblock_pool.queue_tail == job)
+		zblock_pool.queue_tail = prev;
+	job->queue_next = NULL;
+}
+
+static void o_stream_zblock_threads_deinit(struct zblock_ostream *zstream)
+{
+	struct zblock_job *job;
+	unsigned int i;
+
+	if (zstream->jobs == NULL)
+		return;
+
+	/* take back the queued jobs and wait for the running ones */
+	pthread_mutex_lock(&zblock_pool.mutex);
+	for (i = 0; i < zstream->jobs_used; i++) {
+		job = &zstream->jobs[(zstream->jobs_head + i) %
+				     zstream->jobs_count];
+		if (job->state == ZBLOCK_JOB_STATE_QUEUED)
+			zblock_thread_pool_unqueue(job);
+		while (job->state == ZBLOCK_JOB_STATE_RUNNING) {
+			pthread_cond_wait(&zblock_pool.done_cond,
+					  &zblock_pool.mutex);
+		}
+	}
+	pthread_mutex_unlock(&zblock_pool.mutex);
+	zstream->jobs_used = 0;
+
+	for (i = 0; i < zstream->jobs_count; i++) {
+		i_free(zstream->jobs[i].input);
+		i_free(zstream->jobs[i].output);
+	}
+	i_free(zstream->jobs);
+}
+#endif
+
+static void o_stream_zblock_close(struct iostream_private *stream,
+				  bool close_parent)
+{
+	struct zblock_ostream *zstream = (struct zblock_ostream *)stream;
+
+#ifdef HAVE_COMPRESS_THREADS
+	o_stream_zblock_threads_deinit(zstream);
+#endif
+	if (close_parent)
+		o_stream_close(zstream->ostream.parent);
+}
+
+static void o_stream_zblock_destroy(struct iostream_private *stream)
+{
+	struct zblock_ostream *zstream = (struct zblock_ostream *)stream;
+
+#ifdef HAVE_COMPRESS_THREADS
+	o_stream_zblock_threads_deinit(zstream);
+#endif
+	i_free(zstream->blockbuf);
+	buffer_free(&zstream->outbuf);
+	array_free(&zstream->block_offsets);
+	o_stream_unref(&zstream->ostream.parent);
+}
+
+static int o_stream_zblock_send_outbuf(struct zblock_ostream *zstream)
+{
+	ssize_t ret;
+	size_t size;
+
+	if (zstream->outbuf->used == 0)
+		return 1;
+
+	size = zstream->outbuf->used - zstream->outbuf_offset;
+	i_assert(size > 0);
+	ret = o_stream_send(zstream->ostream.parent,
+			    CONST_PTR_OFFSET(zstream->outbuf->data,
+					     zstream->outbuf_offset), size);
+	if (ret < 0) {
+		o_stream_copy_error_from_parent(&zstream->ostream);
+		return -1;
+	}
+	if ((size_t)ret != size) {
+		zstream->outbuf_offset += ret;
+		return 0;
+	}
+	zstream->outbuf_offset = 0;
+	buffer_set_used_size(zstream->outbuf, 0);
+	return 1;
+}
+
+static void
+o_stream_zblock_add_block(struct zblock_ostream *zstream,
+			  const unsigned char *input, size_t input_size,
+			  const unsigned char *output, uLongf output_size,
+			  int zret)
+{
+	unsigned char prefix[IOSTREAM_ZBLOCK_PREFIX_LEN];
+	uint32_t block_len;
+
+	i_assert(zstream->outbuf->used == 0);
+
+	if (zret == Z_MEM_ERROR) {
+		i_fatal_status(FATAL_OUTOFMEM, "zblock.write(%s): Out of memory",
+			       o_stream_get_name(&zstream->ostream.ostream));
+	} else if (zret != Z_OK) {
+		i_panic("zblock.write(%s): compress2() failed with %d",
+			o_stream_get_name(&zstream->ostream.ostream), zret);
+	}
+
+	array_append(&zstream->block_offsets, &zstream->block_offset, 1);
+	if (output_size < input_size)
+		block_len = output_size;
+	else {
+		/* incompressible - store as-is */
+		output = input;
+		output_size = input_size;
+		block_len = output_size | IOSTREAM_ZBLOCK_STORED_FLAG;
+	}
+	cpu32_to_be_unaligned(block_len, prefix);
+	buffer_append(zstream->outbuf, prefix, sizeof(prefix));
+	buffer_append(zstream->outbuf, output, output_size);
+	zstream->block_offset += zstream->outbuf->used;
+}
+
+#ifdef HAVE_COMPRESS_THREADS
+static int o_stream_zblock_job_finish(struct zblock_ostream *zstream, bool wait)
+{
+	struct zblock_job *job;
+	bool done;
+	int ret;
+
+	if (zstream->jobs_used == 0)
+		return 1;
+	if ((ret = o_stream_zblock_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	job = &zstream->jobs[zstream->jobs_head];
+	pthread_mutex_lock(&zblock_pool.mutex);
+	while (job->state != ZBLOCK_JOB_STATE_DONE && wait) {
+		pthread_cond_wait(&zblock_pool.done_cond,
+				  &zblock_pool.mutex);
+	}
+	done = job->state == ZBLOCK_JOB_STATE_DONE;
+	pthread_mutex_unlock(&zblock_pool.mutex);
+	if (!done)
+		return 1;
+
+	o_stream_zblock_add_block(zstream, job->input, job->input_size,
+				  job->output, job->output_size, job->zret);
+
+	/* the workers are done with the job */
+	job->state = ZBLOCK_JOB_STATE_FREE;
+	zstream->jobs_head = (zstream->jobs_head + 1) % zstream->jobs_count;
+	zstream->jobs_used--;
+	return 1;
+}
+
+static int o_stream_zblock_jobs_finish(struct zblock_ostream *zstream,
+				       bool wait)
+{
+	unsigned int jobs_used;
+	int ret;
+
+	do {
+		jobs_used = zstream->jobs_used;
+		if ((ret = o_stream_zblock_job_finish(zstream, wait)) <= 0)
+			return ret;
+	} while (zstream->jobs_used < jobs_used);
+	return 1;
+}
+
+static int o_stream_zblock_queue(struct zblock_ostream *zstream)
+{
+	struct zblock_job *job;
+	int ret;
+
+	if (zstream->jobs == NULL) {
+		if (o_stream_zblock_threads_init(zstream) < 0)
+			return -1;
+	}
+
+	/* write out the blocks that are already compressed and wait for
+	   the oldest block if the queue is full */
+	if ((ret = o_stream_zblock_jobs_finish(zstream, FALSE)) <= 0)
+		return ret;
+	while (zstream->jobs_used == zstream->jobs_count) {
+		if ((ret = o_stream_zblock_job_finish(zstream, TRUE)) <= 0)
+			return ret;
+	}
+
+	job = &zstream->jobs[(zstream->jobs_head + zstream->jobs_used) %
+			     zstream->jobs_count];
+	i_assert(job->state == ZBLOCK_JOB_STATE_FREE);
+	memcpy(job->input, zstream->compressbuf, zstream->compressbuf_offset);
+	job->input_size = zstream->compressbuf_offset;
+
+	pthread_mutex_lock(&zblock_pool.mutex);
+	job->state = ZBLOCK_JOB_STATE_QUEUED;
+	if (zblock_pool.queue_tail == NULL)
+		zblock_pool.queue_head = job;
+	else
+		zblock_pool.queue_tail->queue_next = job;
+	zblock_pool.queue_tail = job;
+	pthread_cond_signal(&zblock_pool.queued_cond);
+	pthread_mutex_unlock(&zblock_pool.mutex);
+	zstream->jobs_used++;
+
+	zstream->compressbuf_offset = 0;
+	return 1;
+}
+#endif
+
+static int o_stream_zblock_compress(struct zblock_ostream *zstream, bool last)
+{
+	uLongf output_size;
+	int ret, zret;
+
+	if (zstream->compressbuf_offset == 0)
+		return 1;
+#ifdef HAVE_COMPRESS_THREADS
+	/* When nothing is queued, the last block is compressed right away.
+	   So mails that fit into a single block never use the threads. */
+	if (zstream->thread_count > 0 && (!last || zstream->jobs_used > 0))
+		return o_stream_zblock_queue(zstream);
+#else
+	(void)last;
+#endif
+	if ((ret = o_stream_zblock_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	if (zstream->blockbuf == NULL)
+		zstream->blockbuf = i_malloc(compressBound(BLOCK_SIZE));
+
+	zret = zblock_compress_block(zstream->compressbuf,
+				     zstream->compressbuf_offset,
+				     zstream->blockbuf, &output_size,
+				     zstream->level);
+	o_stream_zblock_add_block(zstream, zstream->compressbuf,
+				  zstream->compressbuf_offset,
+				  zstream->blockbuf, output_size, zret);
+	zstream->compressbuf_offset = 0;
+	return 1;
+}
+
+static int o_stream_zblock_compress_finish(struct zblock_ostream *zstream)
+{
+	int ret;
+
+	if ((ret = o_stream_zblock_compress(zstream, TRUE)) <= 0)
+		return ret;
+#ifdef HAVE_COMPRESS_THREADS
+	while (zstream->thread_count > 0 && zstream->jobs_used > 0) {
+		if ((ret = o_stream_zblock_job_finish(zstream, TRUE)) <= 0)
+			return ret;
+	}
+#endif
+	return 1;
+}
+
+static void o_stream_zblock_write_trailer(struct zblock_ostream *zstream)
+{
+	struct iostream_zblock_trailer trailer;
+	const uint64_t *offsetp;
+	unsigned char *data;
+
+	i_assert(zstream->outbuf->used == 0);
+
+	data = buffer_append_space_unsafe(zstream->outbuf,
+					  IOSTREAM_ZBLOCK_PREFIX_LEN);
+	cpu32_to_be_unaligned(0, data);
+	array_foreach(&zstream->block_offsets, offsetp) {
+		data = buffer_append_space_unsafe(zstream->outbuf,
+			IOSTREAM_ZBLOCK_INDEX_ENTRY_LEN);
+		cpu64_to_be_unaligned(*offsetp, data);
+	}
+	cpu64_to_be_unaligned(zstream->uncompressed_size,
+			      trailer.uncompressed_size);
+	cpu32_to_be_unaligned(array_count(&zstream->block_offsets),
+			      trailer.block_count);
+	memcpy(trailer.magic, IOSTREAM_ZBLOCK_TRAILER_MAGIC,
+	       sizeof(trailer.magic));
+	buffer_append(zstream->outbuf, &trailer, sizeof(trailer));
+	zstream->trailer_written = TRUE;
+}
+
+static ssize_t
+o_stream_zblock_send_chunk(struct zblock_ostream *zstream,
+			   const void *data, size_t size)
+{
+	size_t max_size;
+	ssize_t added_bytes = 0;
+	int ret;
+
+	i_assert(zstream->outbuf->used == 0);
+
+	do {
+		max_size = I_MIN(size, sizeof(zstream->compressbuf) -
+				 zstream->compressbuf_offset);
+		memcpy(zstream->compressbuf + zstream->compressbuf_offset,
+		       data, max_size);
+		zstream->compressbuf_offset += max_size;
+		zstream->uncompressed_size += max_size;
+
+		data = CONST_PTR_OFFSET(data, max_size);
+		size -= max_size;
+		added_bytes += max_size;
+
+		if (zstream->compressbuf_offset == sizeof(zstream->compressbuf)) {
+			ret = o_stream_zblock_compress(zstream, FALSE);
+			if (ret <= 0)
+				return added_bytes != 0 ? added_bytes : ret;
+		}
+	} while (size > 0);
+
+	return added_bytes;
+}
+
+static int o_stream_zblock_flush(struct ostream_private *stream)
+{
+	struct zblock_ostream *zstream = (struct zblock_ostream *)stream;
+	int ret;
+
+	/* Only full blocks can be written before the stream is finished,
+	   otherwise the block offsets couldn't be calculated from the
+	   uncompressed offsets. */
+	if (stream->finished && !zstream->trailer_written) {
+		if ((ret = o_stream_zblock_compress_finish(zstream)) <= 0)
+			return ret;
+		if ((ret = o_stream_zblock_send_outbuf(zstream)) <= 0)
+			return ret;
+		o_stream_zblock_write_trailer(zstream);
+	}
+#ifdef HAVE_COMPRESS_THREADS
+	else if (zstream->thread_count > 0) {
+		if ((ret = o_stream_zblock_jobs_finish(zstream, FALSE)) <= 0)
+			return ret;
+	}
+#endif
+	if ((ret = o_stream_zblock_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	return o_stream_flush_parent(stream);
+}
+
+static size_t
+o_stream_zblock_get_buffer_used_size(const struct ostream_private *stream)
+{
+	const struct zblock_ostream *zstream =
+		(const struct zblock_ostream *)stream;
+
+	/* outbuf has already compressed data that we're trying to send to the
+	   parent stream. compressbuf isn't included in the return value,
+	   because it needs to be filled up or finished. */
+	return (zstream->outbuf->used - zstream->outbuf_offset) +
+		o_stream_get_buffer_used_size(stream->parent);
+}
+
+static size_t
+o_stream_zblock_get_buffer_avail_size(const struct ostream_private *stream)
+{
+	const struct zblock_ostream *zstream =
+		(const struct zblock_ostream *)stream;
+
+	/* We're only guaranteed to accept data to compressbuf. */
+	return sizeof(zstream->compressbuf) - zstream->compressbuf_offset;
+}
+
+static ssize_t
+o_stream_zblock_sendv(struct ostream_private *stream,
+		      const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct zblock_ostream *zstream = (struct zblock_ostream *)stream;
+	ssize_t ret, bytes = 0;
+	unsigned int i;
+
+	i_assert(!zstream->trailer_written);
+
+	if ((ret = o_stream_zblock_send_outbuf(zstream)) <= 0) {
+		/* error / we still couldn't flush existing data to
+		   parent stream. */
+		return ret;
+	}
+
+	for (i = 0; i < iov_count; i++) {
+		ret = o_stream_zblock_send_chunk(zstream, iov[i].iov_base,
+						 iov[i].iov_len);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+		if ((size_t)ret != iov[i].iov_len)
+			break;
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+struct ostream *
+o_stream_create_zblock_threads(struct ostream *output, int level,
+			       unsigned int threads)
+{
+	struct iostream_zblock_header hdr;
+	struct zblock_ostream *zstream;
+
+	i_assert(level >= 1 && level <= 9);
+
+	zstream = i_new(struct zblock_ostream, 1);
+	zstream->ostream.sendv = o_stream_zblock_sendv;
+	zstream->ostream.flush = o_stream_zblock_flush;
+	zstream->ostream.get_buffer_used_size =
+		o_stream_zblock_get_buffer_used_size;
+	zstream->ostream.get_buffer_avail_size =
+		o_stream_zblock_get_buffer_avail_size;
+	zstream->ostream.iostream.close = o_stream_zblock_close;
+	zstream->ostream.iostream.destroy = o_stream_zblock_destroy;
+	zstream->level = level;
+	i_array_init(&zstream->block_offsets, 64);
+#ifdef HAVE_COMPRESS_THREADS
+	zstream->thread_count = threads;
+#else
+	/* no thread support - compress in the calling thread */
+	(void)threads;
+#endif
+
+	memcpy(hdr.magic, IOSTREAM_ZBLOCK_MAGIC, sizeof(hdr.magic));
+	cpu32_to_be_unaligned(BLOCK_SIZE, hdr.block_size);
+	zstream->outbuf = buffer_create_dynamic(default_pool,
+		IOSTREAM_ZBLOCK_PREFIX_LEN + compressBound(BLOCK_SIZE));
+	buffer_append(zstream->outbuf, &hdr, sizeof(hdr));
+	zstream->block_offset = sizeof(hdr);
+	return o_stream_create(&zstream->ostream, output,
+			       o_stream_get_fd(output));
+}
+
+struct ostream *o_stream_create_zblock(struct ostream *output, int level)
+{
+	return o_stream_create_zblock_threads(output, level, 0);
+}
+#endif
@@ -6,5 +6,14 @@ struct ostream *o_stream_create_deflate(struct ostream *output, int level);
 struct ostream *o_stream_create_bz2(struct ostream *output, int level);
 struct ostream *o_stream_create_lzma(struct ostream *output, int level);
 struct ostream *o_stream_create_lz4(struct ostream *output, int level);
+struct ostream *o_stream_create_zstd(struct ostream *output, int level);
+struct ostream *o_stream_create_zblock(struct ostream *output, int level);
+/* Same as o_stream_create_zblock(), but compress the blocks in the given
+   number of threads. The threads are shared by all the streams in the
+   process. Falls back to compressing in the calling thread if Dovecot was
+   built without thread support. */
+struct ostream *
+o_stream_create_zblock_threads(struct ostream *output, int level,
+			       unsigned int threads);
 
 #endif
@@ -0,0 +1,249 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+
+#ifdef HAVE_ZSTD
+
+#include "ostream-private.h"
+#include "ostream-zlib.h"
+#include <zstd.h>
+#include <zstd_errors.h>
+
+#define CHUNK_SIZE (1024*64)
+
+struct zstd_ostream {
+	struct ostream_private ostream;
+	ZSTD_CStream *cstream;
+	ZSTD_outBuffer output;
+
+	unsigned char outbuf[CHUNK_SIZE];
+	unsigned int outbuf_offset, outbuf_used;
+
+	bool flushed:1;
+};
+
+static void o_stream_zstd_close(struct iostream_private *stream,
+				bool close_parent)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+
+	if (zstream->cstream != NULL) {
+		(void)ZSTD_freeCStream(zstream->cstream);
+		zstream->cstream = NULL;
+	}
+	if (close_parent)
+		o_stream_close(zstream->ostream.parent);
+}
+
+static void o_stream_zstd_check_error(struct zstd_ostream *zstream,
+				      size_t zret, const char *func)
+{
+	if (!ZSTD_isError(zret))
+		return;
+	if (ZSTD_getErrorCode(zret) == ZSTD_error_memory_allocation) {
+		i_fatal_status(FATAL_OUTOFMEM, "zstd.write(%s): Out of memory",
+			       o_stream_get_name(&zstream->ostream.ostream));
+	}
+	i_panic("zstd.write(%s): %s() failed: %s",
+		o_stream_get_name(&zstream->ostream.ostream), func,
+		ZSTD_getErrorName(zret));
+}
+
+static int o_stream_zstd_send_outbuf(struct zstd_ostream *zstream)
+{
+	ssize_t ret;
+	size_t size;
+
+	if (zstream->outbuf_used == 0)
+		return 1;
+
+	size = zstream->outbuf_used - zstream->outbuf_offset;
+	i_assert(size > 0);
+	ret = o_stream_send(zstream->ostream.parent,
+			    zstream->outbuf + zstream->outbuf_offset, size);
+	if (ret < 0) {
+		o_stream_copy_error_from_parent(&zstream->ostream);
+		return -1;
+	}
+	if ((size_t)ret != size) {
+		zstream->outbuf_offset += ret;
+		return 0;
+	}
+	zstream->outbuf_offset = 0;
+	zstream->outbuf_used = 0;
+	return 1;
+}
+
+static ssize_t
+o_stream_zstd_send_chunk(struct zstd_ostream *zstream,
+			 const void *data, size_t size)
+{
+	ZSTD_inBuffer input;
+	size_t zret;
+	int ret;
+
+	i_assert(zstream->outbuf_used == 0);
+
+	input.src = data;
+	input.size = size;
+	input.pos = 0;
+	while (input.pos < input.size) {
+		if (zstream->output.pos == zstream->output.size) {
+			/* previous block was compressed. send it and start
+			   compression for a new block. */
+			zstream->output.pos = 0;
+			zstream->outbuf_used = sizeof(zstream->outbuf);
+			if ((ret = o_stream_zstd_send_outbuf(zstream)) < 0)
+				return -1;
+			if (ret == 0) {
+				/* parent stream's buffer full */
+				break;
+			}
+		}
+
+		zret = ZSTD_compressStream(zstream->cstream,
+					   &zstream->output, &input);
+		o_stream_zstd_check_error(zstream, zret,
+					  "ZSTD_compressStream");
+	}
+
+	zstream->flushed = FALSE;
+	return input.pos;
+}
+
+static int
+o_stream_zstd_send_flush(struct zstd_ostream *zstream, bool final)
+{
+	size_t zret;
+	bool done = FALSE;
+	int ret;
+
+	if (zstream->flushed)
+		return 0;
+
+	if ((ret = o_stream_flush_parent_if_needed(&zstream->ostream)) <= 0)
+		return ret;
+	if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0)
+		return ret;
+
+	i_assert(zstream->outbuf_used == 0);
+	do {
+		/* flushing only finishes the current block, so the data
+		   compressed so far can be decompressed. the frame is ended
+		   only when the stream is finished. */
+		if (final) {
+			zret = ZSTD_endStream(zstream->cstream,
+					      &zstream->output);
+			o_stream_zstd_check_error(zstream, zret,
+						  "ZSTD_endStream");
+		} else {
+			zret = ZSTD_flushStream(zstream->cstream,
+						&zstream->output);
+			o_stream_zstd_check_error(zstream, zret,
+						  "ZSTD_flushStream");
+		}
+		done = zret == 0;
+
+		if (zstream->output.pos == zstream->output.size || done) {
+			zstream->outbuf_used = zstream->output.pos;
+			zstream->output.pos = 0;
+			if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0)
+				return ret;
+		}
+	} while (!done);
+
+	if (final)
+		zstream->flushed = TRUE;
+	return 0;
+}
+
+static int o_stream_zstd_flush(struct ostream_private *stream)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+
+	if (o_stream_zstd_send_flush(zstream, stream->finished) < 0)
+		return -1;
+
+	return o_stream_flush_parent(stream);
+}
+
+static size_t
+o_stream_zstd_get_buffer_used_size(const struct ostream_private *stream)
+{
+	const struct zstd_ostream *zstream =
+		(const struct zstd_ostream *)stream;
+
+	/* outbuf has already compressed data that we're trying to send to the
+	   parent stream. We're not including zstd's internal compression
+	   buffer size. */
+	return (zstream->outbuf_used - zstream->outbuf_offset) +
+		o_stream_get_buffer_used_size(stream->parent);
+}
+
+static size_t
+o_stream_zstd_get_buffer_avail_size(const struct ostream_private *stream)
+{
+	/* FIXME: not correct - this is counting compressed size, which may be
+	   too larger than uncompressed size in some situations. Fixing would
+	   require some kind of additional buffering. */
+	return o_stream_get_buffer_avail_size(stream->parent);
+}
+
+static ssize_t
+o_stream_zstd_sendv(struct ostream_private *stream,
+		    const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct zstd_ostream *zstream = (struct zstd_ostream *)stream;
+	ssize_t ret, bytes = 0;
+	unsigned int i;
+
+	if ((ret = o_stream_zstd_send_outbuf(zstream)) <= 0) {
+		/* error / we still couldn't flush existing data to
+		   parent stream. */
+		return ret;
+	}
+
+	for (i = 0; i < iov_count; i++) {
+		ret = o_stream_zstd_send_chunk(zstream, iov[i].iov_base,
+					       iov[i].iov_len);
+		if (ret < 0)
+			return -1;
+		bytes += ret;
+		if ((size_t)ret != iov[i].iov_len)
+			break;
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+struct ostream *o_stream_create_zstd(struct ostream *output, int level)
+{
+	struct zstd_ostream *zstream;
+	size_t zret;
+
+	i_assert(level >= 1 && level <= ZSTD_maxCLevel());
+
+	zstream = i_new(struct zstd_ostream, 1);
+	zstream->ostream.sendv = o_stream_zstd_sendv;
+	zstream->ostream.flush = o_stream_zstd_flush;
+	zstream->ostream.get_buffer_used_size =
+		o_stream_zstd_get_buffer_used_size;
+	zstream->ostream.get_buffer_avail_size =
+		o_stream_zstd_get_buffer_avail_size;
+	zstream->ostream.iostream.close = o_stream_zstd_close;
+
+	zstream->cstream = ZSTD_createCStream();
+	if (zstream->cstream == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	zret = ZSTD_initCStream(zstream->cstream, level);
+	if (ZSTD_isError(zret)) {
+		i_fatal("ZSTD_initCStream(level=%d) failed: %s",
+			level, ZSTD_getErrorName(zret));
+	}
+
+	zstream->output.dst = zstream->outbuf;
+	zstream->output.size = sizeof(zstream->outbuf);
+	return o_stream_create(&zstream->ostream, output,
+			       o_stream_get_fd(output));
+}
+#endif
@@ -7,7 +7,9 @@
 #include "sha1.h"
 #include "randgen.h"
 #include "test-common.h"
+#include "ostream-zlib.h"
 #include "compression.h"
+#include "iostream-zblock.h"
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -115,6 +117,93 @@ static void test_compression(void)
 	}
 }
 
+static void test_compression_flush(void)
+{
+	const char *str = "hello world";
+	struct ostream *buf_output, *output;
+	struct istream *test_input, *input;
+	const unsigned char *data;
+	size_t size;
+	unsigned int i;
+
+	test_begin("compression flush");
+	for (i = 0; compression_handlers[i].name != NULL; i++) {
+		const struct compression_handler *handler =
+			&compression_handlers[i];
+
+		if (handler->create_istream == NULL || !handler->streamable)
+			continue;
+
+		/* everything sent before the flush must be readable
+		   without waiting for the stream to be finished */
+		buffer_t *buf = t_buffer_create(128);
+		buf_output = o_stream_create_buffer(buf);
+		output = handler->create_ostream(buf_output, 1);
+		o_stream_nsend_str(output, str);
+		test_assert_idx(o_stream_flush(output) > 0, i);
+
+		test_input = test_istream_create_data(buf->data, buf->used);
+		test_istream_set_allow_eof(test_input, FALSE);
+		input = handler->create_istream(test_input, TRUE);
+		while (i_stream_read(input) > 0) ;
+		data = i_stream_get_data(input, &size);
+		test_assert_idx(size == strlen(str) &&
+				memcmp(data, str, size) == 0, i);
+		test_assert_idx(input->stream_errno == 0, i);
+		i_stream_unref(&input);
+		i_stream_unref(&test_input);
+
+		test_assert_idx(o_stream_finish(output) > 0, i);
+		o_stream_destroy(&output);
+		o_stream_destroy(&buf_output);
+	}
+	test_end();
+}
+
+static void test_zstd_flush(void)
+{
+	const struct compression_handler *zstd =
+		compression_lookup_handler("zstd");
+	struct ostream *buf_output, *output;
+	struct istream *test_input, *input;
+	buffer_t *buf = t_buffer_create(128);
+	const unsigned char *data;
+	size_t i, size;
+	unsigned int frames = 0;
+
+	if (zstd == NULL || zstd->create_ostream == NULL)
+		return; /* not compiled in */
+
+	test_begin("zstd flush");
+	buf_output = o_stream_create_buffer(buf);
+	output = zstd->create_ostream(buf_output, zstd->max_level);
+	o_stream_nsend_str(output, "hello ");
+	test_assert(o_stream_flush(output) > 0);
+	o_stream_nsend_str(output, "world");
+	test_assert(o_stream_flush(output) > 0);
+	test_assert(o_stream_finish(output) > 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+
+	/* flushing doesn't end the frame */
+	for (i = 0; i + 4 <= buf->used; i++) {
+		if (memcmp(CONST_PTR_OFFSET(buf->data, i),
+			   "\x28\xb5\x2f\xfd", 4) == 0)
+			frames++;
+	}
+	test_assert(frames == 1);
+
+	test_input = test_istream_create_data(buf->data, buf->used);
+	input = zstd->create_istream(test_input, TRUE);
+	while (i_stream_read(input) > 0) ;
+	data = i_stream_get_data(input, &size);
+	test_assert(size == 11 && memcmp(data, "hello world", 11) == 0);
+	test_assert(input->stream_errno == 0);
+	i_stream_unref(&input);
+	i_stream_unref(&test_input);
+	test_end();
+}
+
 static void test_gz(const char *str1, const char *str2)
 {
 	const struct compression_handler *gz = compression_lookup_handler("gz");
@@ -222,6 +311,145 @@ static void test_gz_large_header(void)
 	test_end();
 }
 
+static void
+test_zblock_seek_input(struct istream *input, const buffer_t *plain)
+{
+	const unsigned char *data;
+	size_t size;
+	uoff_t offset;
+	unsigned int i;
+
+	for (i = 0; i < 100; i++) {
+		offset = i_rand_limit(plain->used + 1);
+		i_stream_seek(input, offset);
+		if (offset == plain->used) {
+			test_assert_idx(i_stream_read_more(input, &data, &size) == -1 &&
+					input->stream_errno == 0, i);
+			continue;
+		}
+		test_assert_idx(i_stream_read_more(input, &data, &size) > 0, i);
+		size = I_MIN(size, plain->used - offset);
+		test_assert_idx(memcmp(data, CONST_PTR_OFFSET(plain->data, offset),
+				       size) == 0, i);
+	}
+}
+
+static void test_zblock_seek(void)
+{
+	const struct compression_handler *handler =
+		compression_lookup_handler("zblock");
+	struct istream *file_input, *input;
+	struct ostream *buf_output, *output;
+	buffer_t *plain, *compressed;
+	uoff_t size;
+	unsigned int i;
+
+	if (handler == NULL || handler->create_istream == NULL)
+		return; /* not compiled in */
+
+	test_begin("zblock seek");
+	plain = buffer_create_dynamic(default_pool, 1024*256);
+	for (i = 0; i < 1024*200 + 123; i++) {
+		buffer_append_c(plain, i_rand_limit(3) == 0 ?
+				i_rand_limit(256) : 'a' + i % 26);
+	}
+	compressed = buffer_create_dynamic(default_pool, 1024*64);
+	buf_output = o_stream_create_buffer(compressed);
+	output = handler->create_ostream(buf_output, 6);
+	o_stream_nsend(output, plain->data, plain->used);
+	test_assert(o_stream_finish(output) > 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+
+	/* seek using the offset index */
+	file_input = i_stream_create_from_data(compressed->data,
+					       compressed->used);
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(i_stream_get_size(input, TRUE, &size) == 1);
+	test_assert(size == plain->used);
+	test_zblock_seek_input(input, plain);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	/* without a trailer the stream is still readable sequentially */
+	file_input = i_stream_create_from_data(compressed->data,
+		compressed->used - sizeof(struct iostream_zblock_trailer));
+	input = handler->create_istream(file_input, FALSE);
+	test_assert(i_stream_get_size(input, TRUE, &size) == 1);
+	test_assert(size == plain->used);
+	test_zblock_seek_input(input, plain);
+	i_stream_destroy(&input);
+	i_stream_destroy(&file_input);
+
+	buffer_free(&plain);
+	buffer_free(&compressed);
+	test_end();
+}
+
+#ifdef HAVE_ZLIB
+static void test_zblock_threads(void)
+{
+	const struct compression_handler *handler =
+		compression_lookup_handler("zblock");
+	struct ostream *buf_output, *buf_output2, *output, *output2;
+	buffer_t *plain, *compressed, *compressed_mt, *compressed_mt2;
+	unsigned int i;
+
+	test_begin("zblock threads");
+	plain = buffer_create_dynamic(default_pool, 1024*1024);
+	for (i = 0; i < 1024*1024 + 4567; i++) {
+		buffer_append_c(plain, i_rand_limit(3) == 0 ?
+				i_rand_limit(256) : 'a' + i % 26);
+	}
+
+	compressed = buffer_create_dynamic(default_pool, 1024*64);
+	buf_output = o_stream_create_buffer(compressed);
+	output = handler->create_ostream(buf_output, 6);
+	o_stream_nsend(output, plain->data, plain->used);
+	test_assert(o_stream_finish(output) > 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+
+	/* the blocks are compressed independently, so the output must be
+	   identical regardless of the number of threads. The streams share
+	   the same worker threads. */
+	compressed_mt = buffer_create_dynamic(default_pool, 1024*64);
+	compressed_mt2 = buffer_create_dynamic(default_pool, 1024*64);
+	buf_output = o_stream_create_buffer(compressed_mt);
+	buf_output2 = o_stream_create_buffer(compressed_mt2);
+	output = o_stream_create_zblock_threads(buf_output, 6, 3);
+	output2 = o_stream_create_zblock_threads(buf_output2, 6, 2);
+	for (i = 0; i < plain->used; i += 1000) {
+		o_stream_nsend(output, CONST_PTR_OFFSET(plain->data, i),
+			       I_MIN(1000, plain->used - i));
+		o_stream_nsend(output2, CONST_PTR_OFFSET(plain->data, i),
+			       I_MIN(1000, plain->used - i));
+	}
+	test_assert(o_stream_finish(output) > 0);
+	test_assert(o_stream_finish(output2) > 0);
+	o_stream_destroy(&output);
+	o_stream_destroy(&output2);
+	o_stream_destroy(&buf_output);
+	o_stream_destroy(&buf_output2);
+	test_assert(buffer_cmp(compressed, compressed_mt));
+	test_assert(buffer_cmp(compressed, compressed_mt2));
+
+	/* destroying an unfinished stream takes back its queued blocks */
+	buffer_set_used_size(compressed_mt, 0);
+	buf_output = o_stream_create_buffer(compressed_mt);
+	output = o_stream_create_zblock_threads(buf_output, 6, 1);
+	o_stream_nsend(output, plain->data, plain->used);
+	o_stream_destroy(&output);
+	o_stream_destroy(&buf_output);
+
+	buffer_free(&plain);
+	buffer_free(&compressed);
+	buffer_free(&compressed_mt);
+	buffer_free(&compressed_mt2);
+	test_end();
+}
+#endif
+
 static void test_uncompress_file(const char *path)
 {
 	const struct compression_handler *handler;
@@ -310,9 +538,15 @@ int main(int argc, char *argv[])
 {
 	static void (*const test_functions[])(void) = {
 		test_compression,
+		test_compression_flush,
+		test_zstd_flush,
 		test_gz_concat,
 		test_gz_no_concat,
 		test_gz_large_header,
+		test_zblock_seek,
+#ifdef HAVE_ZLIB
+		test_zblock_threads,
+#endif
 		NULL
 	};
 	if (argc == 2) {
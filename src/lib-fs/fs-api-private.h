@@ -152,6 +152,7 @@ struct fs_iter {
 	void *async_context;
 };
 
+extern const struct fs fs_class_chunk;
 extern const struct fs fs_class_dict;
 extern const struct fs fs_class_posix;
 extern const struct fs fs_class_randomfail;
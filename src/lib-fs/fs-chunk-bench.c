@@ -0,0 +1,213 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hex-binary.h"
+#include "istream.h"
+#include "sha2.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "fs-api.h"
+
+#include <stdio.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+/* Write the given files as attachments to "sis posix" and to the chunk fs,
+   and report how much disk space each of them used. Files given multiple
+   times are written multiple times, so duplicates can be tested without
+   copying files around. SIS deduplicates only identical files, while the
+   chunk fs deduplicates also the unchanged parts of edited files.
+   Usage: fs-chunk-bench [-a <avg_size>] [-d <dir>] <file> [<file> ...] */
+
+#define DEFAULT_DIR ".fs-chunk-bench"
+
+ARRAY_DEFINE_TYPE(buffer_p, buffer_t *);
+
+struct bench_inode {
+	dev_t dev;
+	ino_t ino;
+};
+ARRAY_DEFINE_TYPE(bench_inode, struct bench_inode);
+
+struct bench_usage {
+	uoff_t bytes;
+	unsigned int files;
+};
+
+static void corpus_read(const char *path, buffer_t *buf)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_unref(&input);
+}
+
+/* Sum up the sizes of the files under the directory. Hard links are
+   counted only once. */
+static void
+bench_usage_add(const char *path, ARRAY_TYPE(bench_inode) *inodes,
+		struct bench_usage *usage)
+{
+	const struct bench_inode *inode;
+	struct bench_inode *new_inode;
+	struct dirent *d;
+	struct stat st;
+	DIR *dir;
+
+	if ((dir = opendir(path)) == NULL)
+		i_fatal("opendir(%s) failed: %m", path);
+	while ((d = readdir(dir)) != NULL) T_BEGIN {
+		const char *subpath;
+		bool seen = FALSE;
+
+		if (strcmp(d->d_name, ".") != 0 &&
+		    strcmp(d->d_name, "..") != 0) {
+			subpath = t_strdup_printf("%s/%s", path, d->d_name);
+			if (lstat(subpath, &st) < 0)
+				i_fatal("lstat(%s) failed: %m", subpath);
+			if (S_ISDIR(st.st_mode))
+				bench_usage_add(subpath, inodes, usage);
+			else {
+				array_foreach(inodes, inode) {
+					if (inode->ino == st.st_ino &&
+					    CMP_DEV_T(inode->dev, st.st_dev))
+						seen = TRUE;
+				}
+				if (!seen) {
+					new_inode = array_append_space(inodes);
+					new_inode->dev = st.st_dev;
+					new_inode->ino = st.st_ino;
+					usage->bytes += st.st_size;
+					usage->files++;
+				}
+			}
+		}
+	} T_END;
+	(void)closedir(dir);
+}
+
+static void
+bench_write(const char *name, const char *driver, const char *args,
+	    const char *dir, const ARRAY_TYPE(buffer_p) *corpus,
+	    size_t corpus_size)
+{
+	unsigned char digest[SHA256_RESULTLEN];
+	ARRAY_TYPE(bench_inode) inodes;
+	struct bench_usage usage;
+	struct fs_settings fs_set;
+	struct fs *fs;
+	struct fs_file *file;
+	buffer_t *const *plainp;
+	struct timeval start, end;
+	const char *error;
+	unsigned int n = 0;
+
+	if (unlink_directory(dir, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", dir, error);
+	if (mkdir(dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", dir);
+
+	i_zero(&fs_set);
+	if (fs_init(driver, args, &fs_set, &fs, &error) < 0)
+		i_fatal("fs_init(%s) failed: %s", driver, error);
+
+	(void)gettimeofday(&start, NULL);
+	array_foreach(corpus, plainp) T_BEGIN {
+		/* SIS requires the names to begin with "<hash>-" */
+		sha256_get_digest((*plainp)->data, (*plainp)->used, digest);
+		file = fs_file_init(fs, t_strdup_printf("%s-%u",
+				binary_to_hex(digest, sizeof(digest)), ++n),
+				FS_OPEN_MODE_CREATE);
+		if (fs_write(file, (*plainp)->data, (*plainp)->used) < 0)
+			i_fatal("fs_write() failed: %s", fs_file_last_error(file));
+		fs_file_deinit(&file);
+	} T_END;
+	(void)gettimeofday(&end, NULL);
+	fs_deinit(&fs);
+
+	i_zero(&usage);
+	i_array_init(&inodes, 1024);
+	bench_usage_add(dir, &inodes, &usage);
+	array_free(&inodes);
+
+	printf("%-12s %12"PRIuUOFF_T" %8u %6.1f%% %8.1f\n", name,
+	       usage.bytes, usage.files,
+	       corpus_size == 0 ? 0.0 : usage.bytes * 100.0 / corpus_size,
+	       timeval_diff_usecs(&end, &start) / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+	ARRAY_TYPE(buffer_p) corpus;
+	buffer_t **plainp;
+	const char *dir = DEFAULT_DIR, *sis_dir, *chunk_dir, *error;
+	unsigned int avg_size = 8192;
+	size_t corpus_size = 0;
+	int c;
+
+	lib_init();
+	while ((c = getopt(argc, argv, "a:d:")) > 0) {
+		switch (c) {
+		case 'a':
+			if (str_to_uint(optarg, &avg_size) < 0)
+				i_fatal("Invalid avg_size: %s", optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		default:
+			i_fatal("Usage: %s [-a <avg_size>] [-d <dir>] "
+				"<file> [<file> ...]", argv[0]);
+		}
+	}
+	argc -= optind; argv += optind;
+	if (argc == 0) {
+		i_fatal("Usage: fs-chunk-bench [-a <avg_size>] [-d <dir>] "
+			"<file> [<file> ...]");
+	}
+
+	i_array_init(&corpus, argc);
+	for (; argc > 0; argc--, argv++) {
+		buffer_t *buf = buffer_create_dynamic(default_pool, 4096);
+		corpus_read(*argv, buf);
+		corpus_size += buf->used;
+		array_append(&corpus, &buf, 1);
+	}
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+		i_fatal("mkdir(%s) failed: %m", dir);
+	sis_dir = t_strdup_printf("%s/sis", dir);
+	chunk_dir = t_strdup_printf("%s/chunk", dir);
+
+	printf("%u files, %"PRIuSIZE_T" bytes\n",
+	       array_count(&corpus), corpus_size);
+	printf("%-12s %12s %8s %7s %8s\n",
+	       "fs", "disk bytes", "files", "ratio", "msecs");
+	bench_write("sis", "sis", t_strdup_printf("posix:prefix=%s/", sis_dir),
+		    sis_dir, &corpus, corpus_size);
+	bench_write("chunk", "chunk",
+		    t_strdup_printf("dir=chunks:avg_size=%u:posix:prefix=%s/",
+				    avg_size, chunk_dir),
+		    chunk_dir, &corpus, corpus_size);
+
+	if (unlink_directory(dir, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", dir, error);
+	array_foreach_modifiable(&corpus, plainp)
+		buffer_free(plainp);
+	array_free(&corpus);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,1128 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "guid.h"
+#include "hash.h"
+#include "hex-binary.h"
+#include "llist.h"
+#include "sha2.h"
+#include "str.h"
+#include "istream-private.h"
+#include "ostream-private.h"
+#include "fs-api-private.h"
+
+#include <sys/stat.h>
+
+/* Files written via this wrapper are split into content-defined chunks: the
+   chunk boundaries are chosen by a rolling hash of the last 64 bytes, so
+   inserting or changing data only changes the chunks around the change.
+   Each chunk is written to the parent fs only once, as
+   <dir>/<first 2 hex digits of hash>/<sha256 of the chunk>. The file itself
+   contains only a manifest:
+
+   DOVECOT-CHUNK 1 <total size> <guid>
+   <sha256 in hex> <chunk size>
+   ...
+
+   Each file references its chunks via hard links named <hash>-<guid> next
+   to the chunk, and it reads the chunks through them. Deleting a file
+   deletes its links and also the <hash> file when no other links remain,
+   the same way as fs-sis does it. So the parent fs needs to support hard
+   links, i.e. it should be posix. */
+
+#define FS_CHUNK_MANIFEST_HEADER "DOVECOT-CHUNK 1 "
+#define FS_CHUNK_DEFAULT_AVG_SIZE (8*1024)
+#define FS_CHUNK_MIN_AVG_SIZE 256
+#define FS_CHUNK_MAX_AVG_SIZE (1024*1024)
+#define FS_CHUNK_DEFAULT_CACHE_SIZE (1024*1024)
+/* the rolling hash covers this many previous bytes */
+#define FS_CHUNK_WINDOW_SIZE 64
+
+struct chunk_fs_cache_entry {
+	struct chunk_fs_cache_entry *prev, *next;
+	char *hash;
+	buffer_t *data;
+};
+
+struct chunk_fs {
+	struct fs fs;
+	char *chunk_dir;
+	size_t min_size, max_size;
+	uint64_t mask;
+
+	/* LRU cache of chunk contents. head is the least recently used. */
+	HASH_TABLE(char *, struct chunk_fs_cache_entry *) cache;
+	struct chunk_fs_cache_entry *cache_head, *cache_tail;
+	size_t cache_size, cache_max_size;
+};
+
+struct chunk_fs_manifest_rec {
+	unsigned char hash[SHA256_RESULTLEN];
+	uoff_t offset;
+	size_t size;
+};
+ARRAY_DEFINE_TYPE(chunk_fs_manifest_rec, struct chunk_fs_manifest_rec);
+
+struct chunk_fs_file {
+	struct fs_file file;
+	struct chunk_fs *fs;
+	enum fs_open_mode open_mode;
+
+	/* Data not yet split into chunks. It's always less than max_size,
+	   since a chunk boundary can't be further away than that. */
+	buffer_t *write_buffer;
+	ARRAY_TYPE(chunk_fs_manifest_rec) write_recs;
+	guid_128_t write_guid;
+	uoff_t write_size, new_bytes;
+	unsigned int new_count;
+};
+
+struct chunk_ostream {
+	struct ostream_private ostream;
+	struct chunk_fs_file *file;
+};
+
+struct chunk_istream {
+	struct istream_private istream;
+	struct chunk_fs *fs;
+	struct event *event;
+
+	ARRAY_TYPE(chunk_fs_manifest_rec) recs;
+	guid_128_t guid;
+	uoff_t total_size;
+
+	unsigned int rec_idx;
+	size_t chunk_pos;
+	buffer_t *chunk_buf;
+	bool chunk_loaded;
+
+	uoff_t read_bytes, fetched_bytes;
+	unsigned int cache_hits, cache_misses;
+};
+
+/* Random values for the rolling hash. These must never change, or the
+   chunk boundaries of new files no longer match the existing ones. */
+static uint64_t chunk_gear[256];
+static bool chunk_gear_initialized = FALSE;
+
+static void fs_chunk_gear_init(void)
+{
+	uint64_t state = 0x5d0fa5c3a1e6b47fULL, z;
+	unsigned int i;
+
+	if (chunk_gear_initialized)
+		return;
+	/* splitmix64 */
+	for (i = 0; i < N_ELEMENTS(chunk_gear); i++) {
+		state += 0x9e3779b97f4a7c15ULL;
+		z = state;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		chunk_gear[i] = z ^ (z >> 31);
+	}
+	chunk_gear_initialized = TRUE;
+}
+
+static struct fs *fs_chunk_alloc(void)
+{
+	struct chunk_fs *fs;
+
+	fs = i_new(struct chunk_fs, 1);
+	fs->fs = fs_class_chunk;
+	return &fs->fs;
+}
+
+static int
+fs_chunk_parse_size(struct fs *_fs, const char *key, const char *value,
+		    unsigned int *size_r)
+{
+	if (str_to_uint(value, size_r) < 0) {
+		fs_set_error(_fs, "Invalid %s: %s", key, value);
+		return -1;
+	}
+	return 0;
+}
+
+static int
+fs_chunk_init(struct fs *_fs, const char *args, const struct fs_settings *set)
+{
+	struct chunk_fs *fs = (struct chunk_fs *)_fs;
+	const char *p, *key, *value, *parent_name, *parent_args, *error;
+	unsigned int avg_size = FS_CHUNK_DEFAULT_AVG_SIZE;
+	unsigned int cache_size = FS_CHUNK_DEFAULT_CACHE_SIZE;
+	unsigned int bits;
+
+	/* [dir=<path>:][avg_size=<bytes>:][cache_size=<bytes>:]<parent> */
+	while ((p = strchr(args, '=')) != NULL &&
+	       (strchr(args, ':') == NULL || p < strchr(args, ':'))) {
+		key = t_strdup_until(args, p);
+		value = p + 1;
+		args = strchr(value, ':');
+		if (args == NULL)
+			args = "";
+		else {
+			value = t_strdup_until(value, args);
+			args++;
+		}
+
+		if (strcmp(key, "dir") == 0) {
+			i_free(fs->chunk_dir);
+			fs->chunk_dir = i_strdup(value);
+		} else if (strcmp(key, "avg_size") == 0) {
+			if (fs_chunk_parse_size(_fs, key, value, &avg_size) < 0)
+				return -1;
+		} else if (strcmp(key, "cache_size") == 0) {
+			if (fs_chunk_parse_size(_fs, key, value,
+						&cache_size) < 0)
+				return -1;
+		} else {
+			fs_set_error(_fs, "Unknown parameter: %s", key);
+			return -1;
+		}
+	}
+	if (fs->chunk_dir == NULL || fs->chunk_dir[0] == '\0') {
+		fs_set_error(_fs, "dir parameter not given");
+		return -1;
+	}
+	if (avg_size < FS_CHUNK_MIN_AVG_SIZE ||
+	    avg_size > FS_CHUNK_MAX_AVG_SIZE ||
+	    (avg_size & (avg_size - 1)) != 0) {
+		fs_set_error(_fs, "avg_size must be a power of 2 between "
+			     "%u and %u", FS_CHUNK_MIN_AVG_SIZE,
+			     FS_CHUNK_MAX_AVG_SIZE);
+		return -1;
+	}
+	fs->cache_max_size = cache_size;
+	for (bits = 0; (1U << bits) < avg_size; bits++) ;
+	/* use the highest bits of the hash, since they depend on the whole
+	   window instead of only the last few bytes */
+	fs->mask = ~(uint64_t)0 << (64 - bits);
+	fs->min_size = avg_size / 4;
+	fs->max_size = avg_size * 8;
+	i_assert(fs->min_size >= FS_CHUNK_WINDOW_SIZE);
+
+	if (*args == '\0') {
+		fs_set_error(_fs, "Parent filesystem not given as parameter");
+		return -1;
+	}
+	parent_args = strchr(args, ':');
+	if (parent_args == NULL) {
+		parent_name = args;
+		parent_args = "";
+	} else {
+		parent_name = t_strdup_until(args, parent_args);
+		parent_args++;
+	}
+	if (fs_init(parent_name, parent_args, set, &_fs->parent, &error) < 0) {
+		fs_set_error(_fs, "%s", error);
+		return -1;
+	}
+
+	fs_chunk_gear_init();
+	hash_table_create(&fs->cache, default_pool, 0, str_hash, strcmp);
+	return 0;
+}
+
+static void
+fs_chunk_cache_remove(struct chunk_fs *fs, struct chunk_fs_cache_entry *entry)
+{
+	hash_table_remove(fs->cache, entry->hash);
+	DLLIST2_REMOVE(&fs->cache_head, &fs->cache_tail, entry);
+	fs->cache_size -= entry->data->used;
+	buffer_free(&entry->data);
+	i_free(entry->hash);
+	i_free(entry);
+}
+
+static void fs_chunk_deinit(struct fs *_fs)
+{
+	struct chunk_fs *fs = (struct chunk_fs *)_fs;
+
+	if (hash_table_is_created(fs->cache)) {
+		while (fs->cache_head != NULL)
+			fs_chunk_cache_remove(fs, fs->cache_head);
+		hash_table_destroy(&fs->cache);
+	}
+	fs_deinit(&_fs->parent);
+	i_free(fs->chunk_dir);
+	i_free(fs);
+}
+
+static const buffer_t *
+fs_chunk_cache_lookup(struct chunk_fs *fs, const char *hash)
+{
+	struct chunk_fs_cache_entry *entry;
+
+	entry = hash_table_lookup(fs->cache, hash);
+	if (entry == NULL)
+		return NULL;
+	/* move to the end of the LRU list */
+	DLLIST2_REMOVE(&fs->cache_head, &fs->cache_tail, entry);
+	DLLIST2_APPEND(&fs->cache_head, &fs->cache_tail, entry);
+	return entry->data;
+}
+
+static void
+fs_chunk_cache_add(struct chunk_fs *fs, const char *hash,
+		   const void *data, size_t size)
+{
+	struct chunk_fs_cache_entry *entry;
+
+	if (size > fs->cache_max_size)
+		return;
+	while (fs->cache_size + size > fs->cache_max_size)
+		fs_chunk_cache_remove(fs, fs->cache_head);
+
+	entry = i_new(struct chunk_fs_cache_entry, 1);
+	entry->hash = i_strdup(hash);
+	entry->data = buffer_create_dynamic(default_pool, size);
+	buffer_append(entry->data, data, size);
+	hash_table_insert(fs->cache, entry->hash, entry);
+	DLLIST2_APPEND(&fs->cache_head, &fs->cache_tail, entry);
+	fs->cache_size += size;
+}
+
+static const char *
+fs_chunk_get_path(struct chunk_fs *fs, const char *hash)
+{
+	return t_strdup_printf("%s/%c%c/%s", fs->chunk_dir,
+			       hash[0], hash[1], hash);
+}
+
+static const char *
+fs_chunk_get_link_path(struct chunk_fs *fs, const char *hash,
+		       const guid_128_t guid)
+{
+	return t_strdup_printf("%s-%s", fs_chunk_get_path(fs, hash),
+			       guid_128_to_string(guid));
+}
+
+static struct fs_file *fs_chunk_file_alloc(void)
+{
+	struct chunk_fs_file *file = i_new(struct chunk_fs_file, 1);
+	return &file->file;
+}
+
+static void
+fs_chunk_file_init(struct fs_file *_file, const char *path,
+		   enum fs_open_mode mode, enum fs_open_flags flags)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	struct chunk_fs *fs = (struct chunk_fs *)_file->fs;
+
+	file->file.path = i_strdup(path);
+	file->fs = fs;
+	file->open_mode = mode;
+	if (mode == FS_OPEN_MODE_APPEND) {
+		fs_set_error(_file->fs, "APPEND mode not supported");
+		return;
+	}
+	file->file.parent = fs_file_init_parent(_file, path, mode | flags);
+}
+
+static void fs_chunk_file_deinit(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	fs_file_deinit(&_file->parent);
+	buffer_free(&file->write_buffer);
+	if (array_is_created(&file->write_recs))
+		array_free(&file->write_recs);
+	i_free(file->file.path);
+	i_free(file);
+}
+
+static int
+fs_chunk_read_manifest(struct fs_file *_file,
+		       ARRAY_TYPE(chunk_fs_manifest_rec) *recs,
+		       uoff_t *total_size_r, guid_128_t guid_r)
+{
+	struct chunk_fs_manifest_rec *rec;
+	struct istream *input;
+	const char *line, *const *args;
+	uoff_t offset = 0, size;
+	buffer_t hash_buf;
+	int ret = 0;
+
+	input = fs_read_stream(_file->parent, IO_BLOCK_SIZE);
+	if ((line = i_stream_read_next_line(input)) == NULL) {
+		if (input->stream_errno != 0) {
+			errno = input->stream_errno;
+			fs_set_error(_file->fs, "%s", i_stream_get_error(input));
+		} else {
+			errno = EINVAL;
+			fs_set_error(_file->fs, "%s: Chunk manifest is empty",
+				     _file->path);
+		}
+		i_stream_unref(&input);
+		return -1;
+	}
+	args = !str_begins(line, FS_CHUNK_MANIFEST_HEADER) ? NULL :
+		t_strsplit(line + strlen(FS_CHUNK_MANIFEST_HEADER), " ");
+	if (args == NULL || str_array_length(args) != 2 ||
+	    str_to_uoff(args[0], total_size_r) < 0 ||
+	    guid_128_from_string(args[1], guid_r) < 0) {
+		errno = EINVAL;
+		fs_set_error(_file->fs, "%s: Invalid chunk manifest header",
+			     _file->path);
+		i_stream_unref(&input);
+		return -1;
+	}
+	while (recs != NULL && (line = i_stream_read_next_line(input)) != NULL) {
+		args = t_strsplit_spaces(line, " ");
+		rec = array_append_space(recs);
+		buffer_create_from_data(&hash_buf, rec->hash, sizeof(rec->hash));
+		if (str_array_length(args) != 2 ||
+		    strlen(args[0]) != sizeof(rec->hash) * 2 ||
+		    hex_to_binary(args[0], &hash_buf) < 0 ||
+		    str_to_uoff(args[1], &size) < 0 ||
+		    size == 0 || size > SSIZE_T_MAX) {
+			fs_set_error(_file->fs, "%s: Invalid chunk manifest "
+				     "line: %s", _file->path, line);
+			ret = -1;
+			break;
+		}
+		rec->size = size;
+		rec->offset = offset;
+		offset += rec->size;
+	}
+	if (ret == 0 && input->stream_errno != 0) {
+		fs_set_error(_file->fs, "%s", i_stream_get_error(input));
+		errno = input->stream_errno;
+		i_stream_unref(&input);
+		return -1;
+	}
+	if (ret == 0 && recs != NULL && offset != *total_size_r) {
+		fs_set_error(_file->fs, "%s: Chunk manifest size mismatch: "
+			     "%"PRIuUOFF_T" != %"PRIuUOFF_T, _file->path,
+			     offset, *total_size_r);
+		ret = -1;
+	}
+	i_stream_unref(&input);
+	if (ret < 0)
+		errno = EINVAL;
+	return ret;
+}
+
+static int
+i_stream_chunk_load(struct chunk_istream *cstream,
+		    const struct chunk_fs_manifest_rec *rec)
+{
+	struct chunk_fs *fs = cstream->fs;
+	struct fs_file *chunk_file;
+	struct istream *input;
+	const buffer_t *cached;
+	const unsigned char *data;
+	unsigned char digest[SHA256_RESULTLEN];
+	const char *hash, *path;
+	size_t size;
+	int ret = 0;
+
+	buffer_set_used_size(cstream->chunk_buf, 0);
+	hash = binary_to_hex(rec->hash, sizeof(rec->hash));
+	if ((cached = fs_chunk_cache_lookup(fs, hash)) != NULL) {
+		buffer_append_buf(cstream->chunk_buf, cached, 0, (size_t)-1);
+		cstream->cache_hits++;
+		return 0;
+	}
+
+	path = fs_chunk_get_link_path(fs, hash, cstream->guid);
+	chunk_file = fs_file_init_with_event(fs->fs.parent, cstream->event,
+					     path, FS_OPEN_MODE_READONLY);
+	input = fs_read_stream(chunk_file, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(cstream->chunk_buf, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0) {
+		io_stream_set_error(&cstream->istream.iostream,
+			"Couldn't read chunk %s: %s", path,
+			i_stream_get_error(input));
+		cstream->istream.istream.stream_errno = input->stream_errno;
+		ret = -1;
+	} else if (cstream->chunk_buf->used != rec->size) {
+		io_stream_set_error(&cstream->istream.iostream,
+			"Chunk %s has wrong size: %"PRIuSIZE_T" != "
+			"%"PRIuSIZE_T, path, cstream->chunk_buf->used,
+			rec->size);
+		cstream->istream.istream.stream_errno = EINVAL;
+		ret = -1;
+	} else {
+		sha256_get_digest(cstream->chunk_buf->data,
+				  cstream->chunk_buf->used, digest);
+		if (memcmp(digest, rec->hash, sizeof(digest)) != 0) {
+			io_stream_set_error(&cstream->istream.iostream,
+				"Chunk %s is corrupted: SHA-256 mismatch "
+				"(got %s)", path,
+				binary_to_hex(digest, sizeof(digest)));
+			cstream->istream.istream.stream_errno = EINVAL;
+			ret = -1;
+		}
+	}
+	i_stream_unref(&input);
+	fs_file_deinit(&chunk_file);
+	if (ret < 0)
+		return -1;
+
+	cstream->cache_misses++;
+	cstream->fetched_bytes += rec->size;
+	fs_chunk_cache_add(fs, hash, cstream->chunk_buf->data,
+			   cstream->chunk_buf->used);
+	return 0;
+}
+
+static ssize_t i_stream_chunk_read(struct istream_private *stream)
+{
+	struct chunk_istream *cstream = (struct chunk_istream *)stream;
+	const struct chunk_fs_manifest_rec *rec;
+	size_t avail, size;
+	int ret;
+
+	for (;;) {
+		if (cstream->rec_idx >= array_count(&cstream->recs)) {
+			stream->istream.eof = TRUE;
+			return -1;
+		}
+		rec = array_idx(&cstream->recs, cstream->rec_idx);
+		if (cstream->chunk_pos < rec->size)
+			break;
+		cstream->rec_idx++;
+		cstream->chunk_pos = 0;
+		cstream->chunk_loaded = FALSE;
+	}
+
+	if (!cstream->chunk_loaded) {
+		T_BEGIN {
+			ret = i_stream_chunk_load(cstream, rec);
+		} T_END;
+		if (ret < 0)
+			return -1;
+		cstream->chunk_loaded = TRUE;
+	}
+
+	if (!i_stream_try_alloc(stream, 1, &avail))
+		return -2;
+	size = I_MIN(avail, rec->size - cstream->chunk_pos);
+	memcpy(stream->w_buffer + stream->pos,
+	       CONST_PTR_OFFSET(cstream->chunk_buf->data, cstream->chunk_pos),
+	       size);
+	stream->pos += size;
+	cstream->chunk_pos += size;
+	cstream->read_bytes += size;
+	return size;
+}
+
+static void
+i_stream_chunk_seek(struct istream_private *stream, uoff_t v_offset,
+		    bool mark ATTR_UNUSED)
+{
+	struct chunk_istream *cstream = (struct chunk_istream *)stream;
+	const struct chunk_fs_manifest_rec *recs;
+	unsigned int count, idx, left, right;
+
+	stream->istream.v_offset = v_offset;
+	stream->skip = stream->pos = 0;
+
+	recs = array_get(&cstream->recs, &count);
+	if (v_offset >= cstream->total_size) {
+		idx = count;
+	} else {
+		/* find the last chunk beginning at or before v_offset */
+		left = 0; right = count;
+		while (right - left > 1) {
+			idx = (left + right) / 2;
+			if (recs[idx].offset <= v_offset)
+				left = idx;
+			else
+				right = idx;
+		}
+		idx = left;
+	}
+	if (idx != cstream->rec_idx) {
+		cstream->rec_idx = idx;
+		cstream->chunk_loaded = FALSE;
+	}
+	cstream->chunk_pos = idx == count ? 0 : v_offset - recs[idx].offset;
+}
+
+static int
+i_stream_chunk_stat(struct istream_private *stream, bool exact ATTR_UNUSED)
+{
+	struct chunk_istream *cstream = (struct chunk_istream *)stream;
+
+	stream->statbuf.st_size = cstream->total_size;
+	return 0;
+}
+
+static void i_stream_chunk_destroy(struct iostream_private *stream)
+{
+	struct chunk_istream *cstream = (struct chunk_istream *)stream;
+
+	e_debug(event_create_passthrough(cstream->event)->
+		set_name("fs_chunk_read_finished")->
+		add_int("read_bytes", cstream->read_bytes)->
+		add_int("fetched_bytes", cstream->fetched_bytes)->
+		add_int("cache_hits", cstream->cache_hits)->
+		add_int("cache_misses", cstream->cache_misses)->event(),
+		"Read %"PRIuUOFF_T" bytes: Fetched %"PRIuUOFF_T" bytes "
+		"in %u chunks, %u chunks found from cache",
+		cstream->read_bytes, cstream->fetched_bytes,
+		cstream->cache_misses, cstream->cache_hits);
+
+	buffer_free(&cstream->chunk_buf);
+	array_free(&cstream->recs);
+	event_unref(&cstream->event);
+	i_free(cstream->istream.w_buffer);
+}
+
+static struct istream *
+fs_chunk_read_stream(struct fs_file *_file, size_t max_buffer_size)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	struct chunk_istream *cstream;
+	struct istream *input;
+
+	if (_file->parent == NULL) {
+		return i_stream_create_error_str(EINVAL, "%s",
+						 fs_file_last_error(_file));
+	}
+
+	cstream = i_new(struct chunk_istream, 1);
+	i_array_init(&cstream->recs, 32);
+	if (fs_chunk_read_manifest(_file, &cstream->recs,
+				   &cstream->total_size, cstream->guid) < 0) {
+		array_free(&cstream->recs);
+		i_free(cstream);
+		input = i_stream_create_error_str(errno, "%s",
+						  fs_file_last_error(_file));
+		i_stream_set_name(input, _file->path);
+		return input;
+	}
+	cstream->fs = file->fs;
+	cstream->event = _file->event;
+	event_ref(cstream->event);
+	cstream->chunk_buf = buffer_create_dynamic(default_pool,
+						   file->fs->min_size * 4);
+
+	cstream->istream.max_buffer_size = max_buffer_size;
+	cstream->istream.iostream.destroy = i_stream_chunk_destroy;
+	cstream->istream.read = i_stream_chunk_read;
+	cstream->istream.seek = i_stream_chunk_seek;
+	cstream->istream.stat = i_stream_chunk_stat;
+
+	cstream->istream.istream.readable_fd = FALSE;
+	cstream->istream.istream.blocking = TRUE;
+	cstream->istream.istream.seekable = TRUE;
+	input = i_stream_create(&cstream->istream, NULL, -1, 0);
+	i_stream_set_name(input, _file->path);
+	return input;
+}
+
+static ssize_t fs_chunk_read(struct fs_file *_file, void *buf, size_t size)
+{
+	return fs_read_via_stream(_file, buf, size);
+}
+
+static size_t
+fs_chunk_find_boundary(const struct chunk_fs *fs,
+		       const unsigned char *data, size_t size)
+{
+	uint64_t hash = 0;
+	size_t i;
+
+	if (size <= fs->min_size)
+		return size;
+	if (size > fs->max_size)
+		size = fs->max_size;
+
+	/* fill the window before the first allowed boundary, so the
+	   boundary depends only on the content around it */
+	for (i = fs->min_size - FS_CHUNK_WINDOW_SIZE; i < fs->min_size; i++)
+		hash = (hash << 1) + chunk_gear[data[i]];
+	for (; i < size; i++) {
+		hash = (hash << 1) + chunk_gear[data[i]];
+		if ((hash & fs->mask) == 0)
+			return i + 1;
+	}
+	return size;
+}
+
+/* Write the chunk unless it already exists, and link the file to it.
+   Returns 1 if the chunk was new, 0 if it already existed, -1 on error. */
+static int
+fs_chunk_write_chunk(struct chunk_fs_file *file, const char *hash,
+		     const unsigned char *data, size_t size)
+{
+	struct fs_file *chunk_file, *link_file;
+	bool retried = FALSE, retry;
+	int ret;
+
+	link_file = fs_file_init_parent(&file->file,
+		fs_chunk_get_link_path(file->fs, hash, file->write_guid),
+		FS_OPEN_MODE_CREATE);
+	do {
+		retry = FALSE;
+		chunk_file = fs_file_init_parent(&file->file,
+				fs_chunk_get_path(file->fs, hash),
+				FS_OPEN_MODE_CREATE);
+		if ((ret = fs_exists(chunk_file)) > 0) {
+			/* already stored */
+			ret = 0;
+		} else if (ret == 0) {
+			if (fs_write(chunk_file, data, size) == 0)
+				ret = 1;
+			else if (errno != EEXIST)
+				ret = -1;
+			/* else someone else just wrote the same chunk */
+		}
+		if (ret >= 0 && fs_copy(chunk_file, link_file) < 0 &&
+		    errno != EEXIST) {
+			/* EEXIST means that the same chunk is used more than
+			   once in this file. ENOENT means that the last file
+			   referencing the chunk was just deleted along with
+			   the chunk, so write it again. */
+			if (errno == ENOENT && !retried)
+				retry = retried = TRUE;
+			else
+				ret = -1;
+		}
+		fs_file_deinit(&chunk_file);
+	} while (retry);
+	fs_file_deinit(&link_file);
+	return ret;
+}
+
+/* Remove the file's link to the chunk. If it was the last link, delete the
+   chunk as well. */
+static void
+fs_chunk_unref_chunk(struct fs_file *_file, const char *hash,
+		     const guid_128_t guid)
+{
+	struct chunk_fs *fs = (struct chunk_fs *)_file->fs;
+	struct fs_file *chunk_file, *link_file;
+	struct stat st1, st2;
+
+	link_file = fs_file_init_parent(_file,
+		fs_chunk_get_link_path(fs, hash, guid), FS_OPEN_MODE_READONLY);
+	if (fs_stat(link_file, &st1) < 0) {
+		/* ENOENT: the chunk is used more than once in the file and
+		   its link was already deleted */
+		if (errno != ENOENT)
+			e_error(_file->event, "%s", fs_file_last_error(link_file));
+		fs_file_deinit(&link_file);
+		return;
+	}
+	if (st1.st_nlink == 2) {
+		/* this may be the last link. if the chunk file is the same,
+		   delete it. */
+		chunk_file = fs_file_init_parent(_file,
+			fs_chunk_get_path(fs, hash), FS_OPEN_MODE_READONLY);
+		if (fs_stat(chunk_file, &st2) == 0 &&
+		    st1.st_ino == st2.st_ino &&
+		    CMP_DEV_T(st1.st_dev, st2.st_dev)) {
+			if (fs_delete(chunk_file) < 0 && errno != ENOENT) {
+				e_error(_file->event, "%s",
+					fs_file_last_error(chunk_file));
+			}
+		}
+		fs_file_deinit(&chunk_file);
+	}
+	if (fs_delete(link_file) < 0 && errno != ENOENT)
+		e_error(_file->event, "%s", fs_file_last_error(link_file));
+	fs_file_deinit(&link_file);
+}
+
+static void fs_chunk_write_begin(struct chunk_fs_file *file)
+{
+	if (file->write_buffer == NULL) {
+		file->write_buffer = buffer_create_dynamic(default_pool,
+							   file->fs->max_size);
+		i_array_init(&file->write_recs, 64);
+	} else {
+		buffer_set_used_size(file->write_buffer, 0);
+		array_clear(&file->write_recs);
+	}
+	guid_128_generate(file->write_guid);
+	file->write_size = 0;
+	file->new_bytes = 0;
+	file->new_count = 0;
+}
+
+static void fs_chunk_write_abort(struct chunk_fs_file *file)
+{
+	const struct chunk_fs_manifest_rec *rec;
+
+	/* drop the links to the chunks written so far */
+	array_foreach(&file->write_recs, rec) T_BEGIN {
+		fs_chunk_unref_chunk(&file->file,
+			binary_to_hex(rec->hash, sizeof(rec->hash)),
+			file->write_guid);
+	} T_END;
+	array_clear(&file->write_recs);
+	buffer_set_used_size(file->write_buffer, 0);
+}
+
+static int
+fs_chunk_write_chunks(struct chunk_fs_file *file, bool last)
+{
+	struct chunk_fs_manifest_rec *rec;
+	const unsigned char *data = file->write_buffer->data;
+	size_t pos = 0, size = file->write_buffer->used, chunk_size;
+	int ret = 0;
+
+	/* a boundary is always found within max_size bytes, so cut chunks
+	   only while there's that much data available. the rest is kept
+	   until more data arrives or the file is finished. */
+	while (size - pos >= file->fs->max_size || (last && pos < size)) {
+		chunk_size = fs_chunk_find_boundary(file->fs, data + pos,
+						    size - pos);
+		rec = array_append_space(&file->write_recs);
+		rec->offset = file->write_size;
+		rec->size = chunk_size;
+		sha256_get_digest(data + pos, chunk_size, rec->hash);
+		ret = fs_chunk_write_chunk(file,
+			binary_to_hex(rec->hash, sizeof(rec->hash)),
+			data + pos, chunk_size);
+		if (ret < 0) {
+			array_delete(&file->write_recs,
+				     array_count(&file->write_recs) - 1, 1);
+			break;
+		}
+		if (ret > 0) {
+			file->new_count++;
+			file->new_bytes += chunk_size;
+		}
+		file->write_size += chunk_size;
+		pos += chunk_size;
+	}
+	buffer_delete(file->write_buffer, 0, pos);
+	return ret < 0 ? -1 : 0;
+}
+
+static int
+fs_chunk_write_more(struct chunk_fs_file *file,
+		    const void *data, size_t size)
+{
+	int ret;
+
+	buffer_append(file->write_buffer, data, size);
+	if (file->write_buffer->used < file->fs->max_size)
+		return 0;
+	T_BEGIN {
+		ret = fs_chunk_write_chunks(file, FALSE);
+	} T_END;
+	return ret;
+}
+
+static int fs_chunk_write_manifest(struct chunk_fs_file *file)
+{
+	const struct chunk_fs_manifest_rec *rec;
+	string_t *manifest;
+
+	manifest = t_str_new(128 + array_count(&file->write_recs) *
+			     (SHA256_RESULTLEN * 2 + 12));
+	str_printfa(manifest, FS_CHUNK_MANIFEST_HEADER"%"PRIuUOFF_T" %s\n",
+		    file->write_size, guid_128_to_string(file->write_guid));
+	array_foreach(&file->write_recs, rec) {
+		binary_to_hex_append(manifest, rec->hash, sizeof(rec->hash));
+		str_printfa(manifest, " %"PRIuSIZE_T"\n", rec->size);
+	}
+	return fs_write(file->file.parent, str_data(manifest),
+			str_len(manifest));
+}
+
+static int fs_chunk_write_finish(struct chunk_fs_file *file)
+{
+	unsigned int count;
+
+	if (fs_chunk_write_chunks(file, TRUE) < 0)
+		return -1;
+
+	count = array_count(&file->write_recs);
+	if (fs_chunk_write_manifest(file) < 0)
+		return -1;
+
+	e_debug(event_create_passthrough(file->file.event)->
+		set_name("fs_chunk_written")->
+		add_int("size", file->write_size)->
+		add_int("chunks", count)->
+		add_int("new_chunks", file->new_count)->
+		add_int("new_bytes", file->new_bytes)->event(),
+		"Wrote %"PRIuUOFF_T" bytes in %u chunks: "
+		"%u new chunks with %"PRIuUOFF_T" bytes",
+		file->write_size, count, file->new_count, file->new_bytes);
+	array_clear(&file->write_recs);
+	return 0;
+}
+
+static int fs_chunk_write(struct fs_file *_file, const void *data, size_t size)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	int ret;
+
+	if (_file->parent == NULL)
+		return -1;
+	fs_chunk_write_begin(file);
+	T_BEGIN {
+		buffer_append(file->write_buffer, data, size);
+		ret = fs_chunk_write_finish(file);
+	} T_END;
+	if (ret < 0)
+		fs_chunk_write_abort(file);
+	return ret;
+}
+
+static ssize_t
+o_stream_chunk_sendv(struct ostream_private *stream,
+		     const struct const_iovec *iov, unsigned int iov_count)
+{
+	struct chunk_ostream *cstream = (struct chunk_ostream *)stream;
+	size_t bytes = 0;
+	unsigned int i;
+
+	for (i = 0; i < iov_count; i++) {
+		if (fs_chunk_write_more(cstream->file, iov[i].iov_base,
+					iov[i].iov_len) < 0) {
+			io_stream_set_error(&stream->iostream, "%s",
+				fs_file_last_error(&cstream->file->file));
+			stream->ostream.stream_errno = errno;
+			return -1;
+		}
+		bytes += iov[i].iov_len;
+	}
+	stream->ostream.offset += bytes;
+	return bytes;
+}
+
+static struct ostream *o_stream_create_chunk(struct chunk_fs_file *file)
+{
+	struct chunk_ostream *cstream;
+
+	cstream = i_new(struct chunk_ostream, 1);
+	cstream->file = file;
+	cstream->ostream.sendv = o_stream_chunk_sendv;
+	cstream->ostream.max_buffer_size = (size_t)-1;
+	cstream->ostream.ostream.blocking = TRUE;
+	return o_stream_create(&cstream->ostream, NULL, -1);
+}
+
+static void fs_chunk_write_stream(struct fs_file *_file)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+
+	i_assert(_file->output == NULL);
+
+	if (_file->parent == NULL) {
+		_file->output = o_stream_create_error_str(EINVAL, "%s",
+						fs_file_last_error(_file));
+	} else {
+		/* chunks are written as soon as their boundaries are found.
+		   only the manifest is written at finish. */
+		fs_chunk_write_begin(file);
+		_file->output = o_stream_create_chunk(file);
+	}
+	o_stream_set_name(_file->output, _file->path);
+}
+
+static int fs_chunk_write_stream_finish(struct fs_file *_file, bool success)
+{
+	struct chunk_fs_file *file = (struct chunk_fs_file *)_file;
+	int ret = -1;
+
+	if (_file->output != NULL)
+		o_stream_destroy(&_file->output);
+	if (_file->parent == NULL)
+		return -1;
+
+	if (success) T_BEGIN {
+		ret = fs_chunk_write_finish(file);
+	} T_END;
+	if (ret < 0) {
+		fs_chunk_write_abort(file);
+		return -1;
+	}
+	return 1;
+}
+
+static int fs_chunk_delete(struct fs_file *_file)
+{
+	ARRAY_TYPE(chunk_fs_manifest_rec) recs;
+	const struct chunk_fs_manifest_rec *rec;
+	guid_128_t guid;
+	uoff_t size;
+	int ret;
+
+	if (_file->parent == NULL)
+		return -1;
+
+	i_array_init(&recs, 32);
+	T_BEGIN {
+		ret = fs_chunk_read_manifest(_file, &recs, &size, guid);
+	} T_END;
+	if (ret < 0 && errno != EINVAL) {
+		array_free(&recs);
+		return -1;
+	}
+	/* delete the manifest first, so there are never readable files
+	   with missing chunks. a broken manifest is deleted, but its
+	   chunks are left alone. */
+	if (fs_delete(_file->parent) < 0)
+		ret = -1;
+	else if (ret == 0) {
+		array_foreach(&recs, rec) T_BEGIN {
+			fs_chunk_unref_chunk(_file,
+				binary_to_hex(rec->hash, sizeof(rec->hash)),
+				guid);
+		} T_END;
+	} else {
+		ret = 0;
+	}
+	array_free(&recs);
+	return ret;
+}
+
+/* Link the file to a chunk used by the source file. */
+static int
+fs_chunk_copy_chunk(struct chunk_fs_file *file, const char *hash,
+		    const guid_128_t src_guid)
+{
+	struct fs_file *chunk_file, *link_file, *src_link_file;
+	int ret;
+
+	chunk_file = fs_file_init_parent(&file->file,
+		fs_chunk_get_path(file->fs, hash), FS_OPEN_MODE_CREATE);
+	link_file = fs_file_init_parent(&file->file,
+		fs_chunk_get_link_path(file->fs, hash, file->write_guid),
+		FS_OPEN_MODE_CREATE);
+	ret = fs_copy(chunk_file, link_file);
+	if (ret < 0 && errno == ENOENT) {
+		/* the last other file referencing the chunk was just deleted
+		   along with the chunk. the source file's own link still
+		   has the same data, so restore the chunk from it. */
+		src_link_file = fs_file_init_parent(&file->file,
+			fs_chunk_get_link_path(file->fs, hash, src_guid),
+			FS_OPEN_MODE_READONLY);
+		if (fs_copy(src_link_file, chunk_file) == 0 || errno == EEXIST)
+			ret = fs_copy(chunk_file, link_file);
+		fs_file_deinit(&src_link_file);
+	}
+	if (ret < 0 && errno == EEXIST) {
+		/* the same chunk is used more than once in this file */
+		ret = 0;
+	}
+	fs_file_deinit(&link_file);
+	fs_file_deinit(&chunk_file);
+	return ret;
+}
+
+/* Copying the manifest alone would make both files share the same chunk
+   links, and deleting either file would delete the other one's chunks.
+   So the copy gets its own GUID and links. */
+static int fs_chunk_copy(struct fs_file *_src, struct fs_file *_dest)
+{
+	struct chunk_fs_file *dest = (struct chunk_fs_file *)_dest;
+	ARRAY_TYPE(chunk_fs_manifest_rec) recs;
+	const struct chunk_fs_manifest_rec *rec;
+	guid_128_t src_guid;
+	uoff_t size;
+	int ret;
+
+	if (_src == NULL) {
+		/* the copy is never started asynchronously */
+		fs_set_error(_dest->fs, "Asynchronous copy not supported");
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (_src->parent == NULL || _dest->parent == NULL)
+		return -1;
+
+	i_array_init(&recs, 32);
+	T_BEGIN {
+		ret = fs_chunk_read_manifest(_src, &recs, &size, src_guid);
+	} T_END;
+	if (ret < 0) {
+		array_free(&recs);
+		return -1;
+	}
+
+	fs_chunk_write_begin(dest);
+	array_foreach(&recs, rec) {
+		T_BEGIN {
+			ret = fs_chunk_copy_chunk(dest,
+				binary_to_hex(rec->hash, sizeof(rec->hash)),
+				src_guid);
+		} T_END;
+		if (ret < 0)
+			break;
+		array_push_back(&dest->write_recs, rec);
+	}
+	array_free(&recs);
+	dest->write_size = size;
+
+	if (ret == 0) T_BEGIN {
+		ret = fs_chunk_write_manifest(dest);
+	} T_END;
+	if (ret < 0) {
+		fs_chunk_write_abort(dest);
+		return -1;
+	}
+	array_clear(&dest->write_recs);
+	return 0;
+}
+
+static int fs_chunk_stat(struct fs_file *_file, struct stat *st_r)
+{
+	guid_128_t guid;
+	uoff_t size;
+	int ret;
+
+	if (fs_stat(_file->parent, st_r) < 0)
+		return -1;
+	T_BEGIN {
+		ret = fs_chunk_read_manifest(_file, NULL, &size, guid);
+	} T_END;
+	if (ret < 0)
+		return -1;
+	st_r->st_size = size;
+	return 0;
+}
+
+const struct fs fs_class_chunk = {
+	.name = "chunk",
+	.v = {
+		fs_chunk_alloc,
+		fs_chunk_init,
+		fs_chunk_deinit,
+		fs_wrapper_get_properties,
+		fs_chunk_file_alloc,
+		fs_chunk_file_init,
+		fs_chunk_file_deinit,
+		fs_wrapper_file_close,
+		fs_wrapper_file_get_path,
+		fs_wrapper_set_async_callback,
+		fs_wrapper_wait_async,
+		fs_wrapper_set_metadata,
+		fs_wrapper_get_metadata,
+		fs_wrapper_prefetch,
+		fs_chunk_read,
+		fs_chunk_read_stream,
+		fs_chunk_write,
+		fs_chunk_write_stream,
+		fs_chunk_write_stream_finish,
+		fs_wrapper_lock,
+		fs_wrapper_unlock,
+		fs_wrapper_exists,
+		fs_chunk_stat,
+		fs_chunk_copy,
+		fs_wrapper_rename,
+		fs_chunk_delete,
+		fs_wrapper_iter_alloc,
+		fs_wrapper_iter_init,
+		NULL,
+		NULL,
+		NULL,
+		fs_wrapper_get_nlinks,
+	}
+};
@@ -1,8 +1,11 @@
 /* Copyright (c) 2016-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "str.h"
+#include "istream.h"
 #include "ostream.h"
+#include "istream-fs-file.h"
 #include "fs-test.h"
 #include "test-common.h"
 
@@ -75,6 +78,74 @@ static void test_fs_async_copy(const char *test_name, struct fs *fs)
 	test_end();
 }
 
+static void test_fs_async_read_input(struct ioloop *ioloop)
+{
+	io_loop_stop(ioloop);
+}
+
+static void test_fs_async_read(const char *test_name, struct fs *fs)
+{
+	struct ioloop *ioloop;
+	struct fs_file *file;
+	struct test_fs_file *test_file;
+	struct istream *input;
+	struct io *io;
+	const unsigned char *data;
+	size_t size;
+	string_t *contents;
+
+	test_begin(t_strdup_printf("%s: async read", test_name));
+	ioloop = io_loop_create();
+
+	/* the test fs doesn't persist files. write via the fs (to get any
+	   metadata headers added) and copy the result to the read file. */
+	contents = t_str_new(64);
+	file = fs_file_init(fs, "foo", FS_OPEN_MODE_REPLACE);
+	test_assert(fs_write(file, "source", 6) == 0);
+	test_file = test_fs_file_get(fs, "foo");
+	str_append_str(contents, test_file->contents);
+	fs_file_deinit(&file);
+
+	file = fs_file_init(fs, "foo", FS_OPEN_MODE_READONLY |
+			    FS_OPEN_FLAG_ASYNC);
+	test_file = test_fs_file_get(fs, "foo");
+	str_append_str(test_file->contents, contents);
+	test_file->wait_async_read = TRUE;
+	input = i_stream_create_fs_file(&file, IO_BLOCK_SIZE);
+	test_assert(input->blocking);
+	i_stream_set_blocking(input, FALSE);
+	test_assert(i_stream_read(input) == 0);
+
+	/* the istream notifies the ioloop once the async read finishes */
+	io = io_add_istream(input, test_fs_async_read_input, ioloop);
+	test_file->wait_async = FALSE;
+	test_istream_set_size(test_file->input, test_file->contents->used);
+	test_assert(test_file->async_callback != NULL);
+	test_file->async_callback(test_file->async_context);
+	io_loop_run(ioloop);
+
+	test_assert(i_stream_read_more(input, &data, &size) > 0 &&
+		    size == 6 && memcmp(data, "source", 6) == 0);
+	io_remove(&io);
+	i_stream_unref(&input);
+
+	/* blocking streams wait for the async read to finish */
+	file = fs_file_init(fs, "foo", FS_OPEN_MODE_READONLY |
+			    FS_OPEN_FLAG_ASYNC);
+	test_file = test_fs_file_get(fs, "foo");
+	str_append_str(test_file->contents, contents);
+	test_file->wait_async = FALSE;
+	test_file->wait_async_read = TRUE;
+	input = i_stream_create_fs_file(&file, IO_BLOCK_SIZE);
+	test_assert(i_stream_read_more(input, &data, &size) > 0 &&
+		    size == 6 && memcmp(data, "source", 6) == 0);
+	test_assert(!test_file->wait_async_read);
+	i_stream_unref(&input);
+
+	io_loop_destroy(&ioloop);
+	test_end();
+}
+
 void test_fs_async(const char *test_name, enum fs_properties properties,
 		   const char *driver, const char *args)
 {
@@ -92,6 +163,7 @@ void test_fs_async(const char *test_name, enum fs_properties properties,
 
 	test_fs_async_write(test_name, fs);
 	test_fs_async_copy(test_name, fs);
+	test_fs_async_read(test_name, fs);
 
 	fs_deinit(&fs);
 }
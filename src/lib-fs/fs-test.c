@@ -91,8 +91,20 @@ fs_test_set_async_callback(struct fs_file *_file,
 	file->async_context = context;
 }
 
-static void fs_test_wait_async(struct fs *_fs ATTR_UNUSED)
+static void fs_test_wait_async(struct fs *_fs)
 {
+	struct fs_file *_file;
+	struct test_fs_file *file;
+
+	/* finish all the pending async reads */
+	for (_file = _fs->files; _file != NULL; _file = _file->next) {
+		file = (struct test_fs_file *)_file;
+		if (file->wait_async_read && file->input != NULL) {
+			file->wait_async_read = FALSE;
+			test_istream_set_size(file->input,
+					      file->contents->used);
+		}
+	}
 }
 
 static void
@@ -155,6 +167,8 @@ fs_test_read_stream(struct fs_file *_file, size_t max_buffer_size ATTR_UNUSED)
 		return i_stream_create_error(EIO);
 	input = test_istream_create_data(file->contents->data,
 					 file->contents->used);
+	if (file->wait_async_read)
+		test_istream_set_size(input, 0);
 	i_stream_add_destroy_callback(input, fs_test_stream_destroyed, file);
 	if (!file->seekable)
 		input->seekable = FALSE;
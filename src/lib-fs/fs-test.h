@@ -27,6 +27,9 @@ struct test_fs_file {
 	bool closed;
 	bool io_failure;
 	bool wait_async;
+	/* read stream returns nothing until the test sets its size or
+	   fs_wait_async() is called */
+	bool wait_async_read;
 };
 
 struct test_fs_iter {
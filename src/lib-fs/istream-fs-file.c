@@ -19,10 +19,20 @@ static void i_stream_fs_file_close(struct iostream_private *stream,
 	fs_file_deinit(&fstream->file);
 }
 
+static void i_stream_fs_file_async_callback(void *context)
+{
+	struct fs_file_istream *fstream = context;
+
+	/* more data can be read now (or the read failed) */
+	i_stream_set_input_pending(&fstream->istream.istream, TRUE);
+}
+
 static ssize_t i_stream_fs_file_read(struct istream_private *stream)
 {
 	struct fs_file_istream *fstream = (struct fs_file_istream *)stream;
 	struct istream *input;
+	bool async = (fstream->file->flags & FS_OPEN_FLAG_ASYNC) != 0;
+	ssize_t ret;
 
 	if (fstream->istream.parent == NULL) {
 		input = fs_read_stream(fstream->file,
@@ -30,10 +40,27 @@ static ssize_t i_stream_fs_file_read(struct istream_private *stream)
 		i_stream_init_parent(stream, input);
 		i_stream_unref(&input);
 	}
+	if (async && stream->parent->blocking) {
+		/* i_stream_set_blocking() changed also the fs's stream, but
+		   it can't really block. Blocking is emulated below. */
+		i_stream_set_blocking(stream->parent, FALSE);
+	}
 
 	i_stream_seek(stream->parent, stream->parent_start_offset +
 		      stream->istream.v_offset);
-	return i_stream_read_copy_from_parent(&stream->istream);
+	while ((ret = i_stream_read_copy_from_parent(&stream->istream)) == 0 &&
+	       async) {
+		if (!stream->istream.blocking) {
+			/* async read is still in progress. get notified when
+			   it finishes, so io_add_istream() can be used to wait
+			   for it. */
+			fs_file_set_async_callback(fstream->file,
+				i_stream_fs_file_async_callback, fstream);
+			break;
+		}
+		fs_wait_async(fstream->file->fs);
+	}
+	return ret;
 }
 
 struct istream *
@@ -49,8 +76,13 @@ i_stream_create_fs_file(struct fs_file **file, size_t max_buffer_size)
 	fstream->istream.read = i_stream_fs_file_read;
 	fstream->istream.stream_size_passthrough = TRUE;
 
-	fstream->istream.istream.blocking =
-		((*file)->flags & FS_OPEN_FLAG_ASYNC) == 0;
+	/* Reads from FS_OPEN_FLAG_ASYNC files wait for the async operation
+	   to finish, unless the stream is changed to be non-blocking with
+	   i_stream_set_blocking(). This way the callers that expect blocking
+	   streams (e.g. mail_get_stream()) keep working with async files. */
+	fstream->istream.istream.blocking = TRUE;
+	fstream->istream.istream.async_input =
+		((*file)->flags & FS_OPEN_FLAG_ASYNC) != 0;
 	fstream->istream.istream.seekable =
 		((*file)->flags & FS_OPEN_FLAG_SEEKABLE) != 0;
 
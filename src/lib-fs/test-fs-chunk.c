@@ -0,0 +1,508 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+#include "fs-api.h"
+#include "safe-mkdir.h"
+#include "test-common.h"
+#include "unlink-directory.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define TEST_DIR ".test-fs-chunk"
+#define TEST_DATA_SIZE (256*1024)
+
+static void test_data_fill(buffer_t *buf, size_t size)
+{
+	uint32_t state = 12345;
+	unsigned char c;
+
+	while (size-- > 0) {
+		state = state * 1103515245 + 12345;
+		c = state >> 16;
+		buffer_append_c(buf, c);
+	}
+}
+
+static struct fs *test_fs_chunk_init(void)
+{
+	struct fs_settings fs_set;
+	struct fs *fs;
+	const char *error;
+
+	/* each test starts with an empty directory */
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_fatal("Couldn't prepare test directory (%s): %s", TEST_DIR, error);
+	if (safe_mkdir(TEST_DIR, 0700, (uid_t)-1, (gid_t)-1) != 1)
+		i_fatal("Couldn't create test directory %s", TEST_DIR);
+
+	i_zero(&fs_set);
+	if (fs_init("chunk", "dir=chunks:avg_size=4096:posix:prefix="
+		    TEST_DIR"/", &fs_set, &fs, &error) < 0)
+		i_fatal("fs_init() failed: %s", error);
+	return fs;
+}
+
+static void test_fs_chunk_write(struct fs *fs, const char *path,
+				const buffer_t *data)
+{
+	struct fs_file *file;
+
+	file = fs_file_init(fs, path, FS_OPEN_MODE_REPLACE);
+	test_assert(fs_write(file, data->data, data->used) == 0);
+	fs_file_deinit(&file);
+}
+
+static void test_fs_chunk_read(struct fs *fs, const char *path,
+			       const buffer_t *data)
+{
+	struct fs_file *file;
+	struct istream *input;
+	const unsigned char *rdata;
+	size_t size;
+	uoff_t offset = 0;
+	const struct stat *st;
+	bool match = TRUE;
+
+	file = fs_file_init(fs, path, FS_OPEN_MODE_READONLY);
+	input = fs_read_stream(file, 1024);
+	while (i_stream_read_more(input, &rdata, &size) > 0) {
+		if (offset + size > data->used ||
+		    memcmp(rdata, CONST_PTR_OFFSET(data->data, offset),
+			   size) != 0)
+			match = FALSE;
+		offset += size;
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+	test_assert(match);
+	test_assert(offset == data->used);
+	test_assert(i_stream_stat(input, TRUE, &st) == 0 &&
+		    st->st_size == (off_t)data->used);
+	i_stream_unref(&input);
+	fs_file_deinit(&file);
+}
+
+static void test_fs_chunk_get_hashes(struct fs *fs, const char *path,
+				     ARRAY_TYPE(const_string) *hashes)
+{
+	struct fs_file *file;
+	struct istream *input;
+	const char *line;
+
+	/* read the manifest directly from the parent */
+	file = fs_file_init(fs_get_parent(fs), path, FS_OPEN_MODE_READONLY);
+	input = fs_read_stream(file, 1024);
+	test_assert((line = i_stream_read_next_line(input)) != NULL &&
+		    str_begins(line, "DOVECOT-CHUNK 1 "));
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		line = t_strcut(line, ' ');
+		array_append(hashes, &line, 1);
+	}
+	test_assert(input->stream_errno == 0);
+	i_stream_unref(&input);
+	fs_file_deinit(&file);
+}
+
+/* Returns the number of files in the chunk directory */
+static unsigned int test_fs_chunk_count_files(void)
+{
+	DIR *dir, *subdir;
+	struct dirent *d, *d2;
+	const char *path;
+	unsigned int count = 0;
+
+	dir = opendir(TEST_DIR"/chunks");
+	if (dir == NULL)
+		return 0;
+	while ((d = readdir(dir)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		path = t_strdup_printf(TEST_DIR"/chunks/%s", d->d_name);
+		if ((subdir = opendir(path)) == NULL)
+			i_fatal("opendir(%s) failed: %m", path);
+		while ((d2 = readdir(subdir)) != NULL) {
+			if (d2->d_name[0] != '.')
+				count++;
+		}
+		(void)closedir(subdir);
+	}
+	(void)closedir(dir);
+	return count;
+}
+
+static void test_fs_chunk_delete_file(struct fs *fs, const char *path)
+{
+	struct fs_file *file;
+
+	file = fs_file_init(fs, path, FS_OPEN_MODE_READONLY);
+	test_assert(fs_delete(file) == 0);
+	fs_file_deinit(&file);
+}
+
+static void test_fs_chunk_roundtrip(void)
+{
+	struct fs *fs;
+	struct fs_file *file;
+	struct ostream *output;
+	struct stat st;
+	buffer_t *data;
+
+	test_begin("fs-chunk roundtrip");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+
+	/* write via stream */
+	file = fs_file_init(fs, "stream", FS_OPEN_MODE_REPLACE);
+	output = fs_write_stream(file);
+	o_stream_nsend(output, data->data, data->used);
+	test_assert(fs_write_stream_finish(file, &output) > 0);
+	test_assert(fs_stat(file, &st) == 0 && st.st_size == TEST_DATA_SIZE);
+	fs_file_deinit(&file);
+	test_fs_chunk_read(fs, "stream", data);
+
+	/* write via fs_write() */
+	test_fs_chunk_write(fs, "direct", data);
+	test_fs_chunk_read(fs, "direct", data);
+
+	/* empty file */
+	buffer_set_used_size(data, 0);
+	test_fs_chunk_write(fs, "empty", data);
+	test_fs_chunk_read(fs, "empty", data);
+
+	file = fs_file_init(fs, "direct", FS_OPEN_MODE_READONLY);
+	test_assert(fs_delete(file) == 0);
+	test_assert(fs_exists(file) == 0);
+	fs_file_deinit(&file);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_dedup(void)
+{
+	ARRAY_TYPE(const_string) hashes1, hashes2;
+	const char *const *h1, *const *h2;
+	unsigned int i, j, count1, count2, shared = 0;
+	struct fs *fs;
+	buffer_t *data;
+
+	test_begin("fs-chunk dedup");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+	test_fs_chunk_write(fs, "orig", data);
+
+	/* inserting data in the middle changes only the chunks around it */
+	buffer_insert(data, TEST_DATA_SIZE/2, "0123456789", 10);
+	for (i = 0; i < 9; i++)
+		buffer_insert(data, TEST_DATA_SIZE/2, "abcdefghij", 10);
+	test_fs_chunk_write(fs, "modified", data);
+	test_fs_chunk_read(fs, "modified", data);
+
+	t_array_init(&hashes1, 128);
+	t_array_init(&hashes2, 128);
+	test_fs_chunk_get_hashes(fs, "orig", &hashes1);
+	test_fs_chunk_get_hashes(fs, "modified", &hashes2);
+	h1 = array_get(&hashes1, &count1);
+	h2 = array_get(&hashes2, &count2);
+	for (i = 0; i < count2; i++) {
+		for (j = 0; j < count1; j++) {
+			if (strcmp(h2[i], h1[j]) == 0) {
+				shared++;
+				break;
+			}
+		}
+	}
+	test_assert(count1 > 10);
+	test_assert(shared + 3 >= count2);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_seek(void)
+{
+	static const uoff_t offsets[] = {
+		TEST_DATA_SIZE - 1, 0, 4095, 4096, 100000, TEST_DATA_SIZE/2
+	};
+	struct fs *fs;
+	struct fs_file *file;
+	struct istream *input;
+	const unsigned char *rdata;
+	buffer_t *data;
+	unsigned int i;
+	size_t size;
+
+	test_begin("fs-chunk seek");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+	test_fs_chunk_write(fs, "seek", data);
+
+	file = fs_file_init(fs, "seek", FS_OPEN_MODE_READONLY);
+	input = fs_read_stream(file, 1024);
+	for (i = 0; i < N_ELEMENTS(offsets); i++) {
+		i_stream_seek(input, offsets[i]);
+		test_assert_idx(i_stream_read_more(input, &rdata, &size) > 0, i);
+		test_assert_idx(size > 0 && rdata[0] ==
+			((const unsigned char *)data->data)[offsets[i]], i);
+	}
+	i_stream_seek(input, TEST_DATA_SIZE);
+	test_assert(i_stream_read_more(input, &rdata, &size) == -1);
+	test_assert(input->eof && input->stream_errno == 0);
+	i_stream_unref(&input);
+	fs_file_deinit(&file);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_write_incremental(void)
+{
+	ARRAY_TYPE(const_string) hashes1, hashes2;
+	const char *const *h1, *const *h2;
+	struct fs *fs;
+	struct fs_file *file;
+	struct ostream *output;
+	buffer_t *data;
+	unsigned int i, count1, count2;
+	size_t pos;
+
+	test_begin("fs-chunk incremental write");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+
+	/* chunks are written while the data is still being sent */
+	file = fs_file_init(fs, "incremental", FS_OPEN_MODE_REPLACE);
+	output = fs_write_stream(file);
+	for (pos = 0; pos < TEST_DATA_SIZE/2; pos += 1000) {
+		o_stream_nsend(output, CONST_PTR_OFFSET(data->data, pos),
+			       I_MIN(1000, TEST_DATA_SIZE/2 - pos));
+	}
+	test_assert(test_fs_chunk_count_files() > 0);
+	o_stream_nsend(output, CONST_PTR_OFFSET(data->data, TEST_DATA_SIZE/2),
+		       TEST_DATA_SIZE/2);
+	test_assert(fs_write_stream_finish(file, &output) > 0);
+	fs_file_deinit(&file);
+	test_fs_chunk_read(fs, "incremental", data);
+
+	/* ..and the chunks are the same as when writing it all at once */
+	test_fs_chunk_write(fs, "all-at-once", data);
+	t_array_init(&hashes1, 128);
+	t_array_init(&hashes2, 128);
+	test_fs_chunk_get_hashes(fs, "incremental", &hashes1);
+	test_fs_chunk_get_hashes(fs, "all-at-once", &hashes2);
+	h1 = array_get(&hashes1, &count1);
+	h2 = array_get(&hashes2, &count2);
+	test_assert(count1 == count2);
+	for (i = 0; i < count1 && i < count2; i++)
+		test_assert_idx(strcmp(h1[i], h2[i]) == 0, i);
+
+	/* aborting the write drops the chunks that were already written */
+	test_fs_chunk_delete_file(fs, "incremental");
+	test_fs_chunk_delete_file(fs, "all-at-once");
+	test_assert(test_fs_chunk_count_files() == 0);
+	file = fs_file_init(fs, "aborted", FS_OPEN_MODE_REPLACE);
+	output = fs_write_stream(file);
+	o_stream_nsend(output, data->data, data->used);
+	test_assert(test_fs_chunk_count_files() > 0);
+	fs_write_stream_abort_error(file, &output, "test abort");
+	fs_file_deinit(&file);
+	test_assert(test_fs_chunk_count_files() == 0);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_delete(void)
+{
+	struct fs *fs;
+	buffer_t *data, *data2;
+	unsigned int count;
+
+	test_begin("fs-chunk delete");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+	data2 = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	buffer_append_buf(data2, data, 0, (size_t)-1);
+	buffer_insert(data2, TEST_DATA_SIZE/2, "inserted", 8);
+	/* the same content twice within one file */
+	buffer_append_buf(data2, data, 0, TEST_DATA_SIZE/4);
+
+	test_fs_chunk_write(fs, "file1", data);
+	count = test_fs_chunk_count_files();
+	test_fs_chunk_write(fs, "file2", data2);
+	test_fs_chunk_write(fs, "file3", data);
+	test_assert(test_fs_chunk_count_files() > count);
+
+	/* shared chunks stay as long as some file uses them */
+	test_fs_chunk_delete_file(fs, "file1");
+	test_fs_chunk_read(fs, "file2", data2);
+	test_fs_chunk_read(fs, "file3", data);
+	test_fs_chunk_delete_file(fs, "file3");
+	test_fs_chunk_read(fs, "file2", data2);
+	test_fs_chunk_delete_file(fs, "file2");
+	test_assert(test_fs_chunk_count_files() == 0);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_copy_file(struct fs *fs, const char *src_path,
+				    const char *dest_path)
+{
+	struct fs_file *src, *dest;
+
+	src = fs_file_init(fs, src_path, FS_OPEN_MODE_READONLY);
+	dest = fs_file_init(fs, dest_path, FS_OPEN_MODE_CREATE);
+	test_assert(fs_copy(src, dest) == 0);
+	fs_file_deinit(&dest);
+	fs_file_deinit(&src);
+}
+
+static void test_fs_chunk_copy(void)
+{
+	ARRAY_TYPE(const_string) hashes;
+	const char *const *hash, *path;
+	struct fs *fs;
+	buffer_t *data;
+	unsigned int count;
+
+	test_begin("fs-chunk copy");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+	test_fs_chunk_write(fs, "file1", data);
+	count = test_fs_chunk_count_files();
+
+	/* the copy has its own links to the chunks, so it stays readable
+	   after the source is deleted */
+	test_fs_chunk_copy_file(fs, "file1", "file2");
+	test_fs_chunk_read(fs, "file2", data);
+	test_assert(test_fs_chunk_count_files() > count);
+	test_fs_chunk_delete_file(fs, "file1");
+	test_assert(test_fs_chunk_count_files() == count);
+	test_fs_chunk_read(fs, "file2", data);
+	test_fs_chunk_delete_file(fs, "file2");
+	test_assert(test_fs_chunk_count_files() == 0);
+
+	/* a chunk deleted in the middle of the copy is restored from the
+	   source file's link */
+	test_fs_chunk_write(fs, "file1", data);
+	t_array_init(&hashes, 128);
+	test_fs_chunk_get_hashes(fs, "file1", &hashes);
+	hash = array_idx(&hashes, 1);
+	path = t_strdup_printf(TEST_DIR"/chunks/%c%c/%s",
+			       (*hash)[0], (*hash)[1], *hash);
+	i_unlink(path);
+	test_fs_chunk_copy_file(fs, "file1", "file2");
+	test_fs_chunk_delete_file(fs, "file1");
+	test_fs_chunk_read(fs, "file2", data);
+	test_fs_chunk_delete_file(fs, "file2");
+	test_assert(test_fs_chunk_count_files() == 0);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_corrupted(void)
+{
+	ARRAY_TYPE(const_string) hashes;
+	struct fs *fs;
+	struct fs_file *file;
+	struct istream *input;
+	const unsigned char *rdata;
+	const char *const *hash, *path;
+	buffer_t *data;
+	size_t size;
+	int fd;
+
+	test_begin("fs-chunk corrupted");
+	fs = test_fs_chunk_init();
+	data = buffer_create_dynamic(pool_datastack_create(), TEST_DATA_SIZE);
+	test_data_fill(data, TEST_DATA_SIZE);
+	test_fs_chunk_write(fs, "corrupted", data);
+
+	/* change a byte in the middle of the second chunk */
+	t_array_init(&hashes, 128);
+	test_fs_chunk_get_hashes(fs, "corrupted", &hashes);
+	hash = array_idx(&hashes, 1);
+	path = t_strdup_printf(TEST_DIR"/chunks/%c%c/%s",
+			       (*hash)[0], (*hash)[1], *hash);
+	if ((fd = open(path, O_WRONLY)) == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (pwrite(fd, "X", 1, 100) != 1)
+		i_fatal("pwrite(%s) failed: %m", path);
+	i_close_fd(&fd);
+
+	file = fs_file_init(fs, "corrupted", FS_OPEN_MODE_READONLY);
+	input = fs_read_stream(file, 1024);
+	while (i_stream_read_more(input, &rdata, &size) > 0)
+		i_stream_skip(input, size);
+	test_assert(input->stream_errno == EINVAL);
+	test_assert(strstr(i_stream_get_error(input),
+			   "SHA-256 mismatch") != NULL);
+	test_assert(input->v_offset > 0 && input->v_offset < TEST_DATA_SIZE);
+	i_stream_unref(&input);
+	fs_file_deinit(&file);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+static void test_fs_chunk_bad_args(void)
+{
+	static const char *const args[] = {
+		"posix",
+		"dir=chunks",
+		"dir=chunks:avg_size=1000:posix",
+		"dir=chunks:avg_size=128:posix",
+		"dir=chunks:foo=bar:posix",
+	};
+	struct fs_settings fs_set;
+	struct fs *fs;
+	const char *error;
+	unsigned int i;
+
+	test_begin("fs-chunk bad args");
+	i_zero(&fs_set);
+	for (i = 0; i < N_ELEMENTS(args); i++)
+		test_assert_idx(fs_init("chunk", args[i], &fs_set, &fs, &error) < 0, i);
+	test_end();
+}
+
+static void test_fs_chunk(void)
+{
+	const char *error;
+
+	test_fs_chunk_roundtrip();
+	test_fs_chunk_dedup();
+	test_fs_chunk_seek();
+	test_fs_chunk_write_incremental();
+	test_fs_chunk_delete();
+	test_fs_chunk_copy();
+	test_fs_chunk_corrupted();
+	test_fs_chunk_bad_args();
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_error("Couldn't remove test directory (%s): %s", TEST_DIR, error);
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fs_chunk,
+		NULL
+	};
+	return test_run(test_functions);
+}
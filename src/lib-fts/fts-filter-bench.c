@@ -0,0 +1,180 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "istream.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "fts-language.h"
+#include "fts-tokenizer.h"
+#include "fts-filter.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+/* Measure the filter pipeline's throughput with per-token and batched
+   filtering. Usage: fts-filter-bench [<iterations>] */
+
+#define DEFAULT_ITERATIONS 100
+#define BATCH_SIZE 128
+
+static const char *const stopword_settings[] = {
+	"stopwords_dir", TEST_STOPWORDS_DIR, NULL
+};
+static struct fts_language english_language = { .name = "en" };
+
+static const char *const corpus_files[] = {
+	UDHRDIR"/udhr_fra.txt",
+	TEST_STOPWORDS_DIR"/stopwords_de.txt",
+	TEST_STOPWORDS_DIR"/stopwords_en.txt",
+	TEST_STOPWORDS_DIR"/stopwords_fi.txt",
+	TEST_STOPWORDS_DIR"/stopwords_ru.txt",
+};
+
+static void corpus_read_tokens(const char *path, pool_t pool,
+			       ARRAY_TYPE(const_string) *tokens)
+{
+	const char *const settings[] = { "algorithm", "tr29", NULL };
+	struct fts_tokenizer *tok;
+	struct istream *input;
+	buffer_t *data;
+	const unsigned char *input_data;
+	const char *token, *error;
+	size_t size;
+
+	if (fts_tokenizer_create(fts_tokenizer_generic, NULL, settings,
+				 &tok, &error) < 0)
+		i_fatal("fts_tokenizer_create() failed: %s", error);
+
+	data = buffer_create_dynamic(default_pool, 1024*16);
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &input_data, &size) > 0) {
+		buffer_append(data, input_data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_unref(&input);
+
+	while (fts_tokenizer_next(tok, data->data, data->used,
+				  &token, &error) > 0) {
+		token = p_strdup(pool, token);
+		array_push_back(tokens, &token);
+	}
+	while (fts_tokenizer_final(tok, &token, &error) > 0) {
+		token = p_strdup(pool, token);
+		array_push_back(tokens, &token);
+	}
+	buffer_free(&data);
+	fts_tokenizer_unref(&tok);
+}
+
+static struct fts_filter *
+bench_filter_create(const struct fts_filter *filter_class,
+		    struct fts_filter *parent, const char *const *settings)
+{
+	struct fts_filter *filter;
+	const char *error;
+
+	if (fts_filter_create(filter_class, parent, &english_language,
+			      settings, &filter, &error) < 0)
+		i_fatal("fts_filter_create() failed: %s", error);
+	if (parent != NULL)
+		fts_filter_unref(&parent);
+	return filter;
+}
+
+static void
+bench_report(const char *name, unsigned long long input_count,
+	     unsigned long long output_count,
+	     const struct timeval *tv_start, const struct timeval *tv_end)
+{
+	double secs = timeval_diff_usecs(tv_end, tv_start) / 1000000.0;
+
+	printf("%-8s %10llu -> %10llu tokens %8.2f s %12.0f tokens/s\n",
+	       name, input_count, output_count, secs, input_count / secs);
+}
+
+static void
+bench_filter(struct fts_filter *filter,
+	     const ARRAY_TYPE(const_string) *corpus, unsigned int iterations)
+{
+	ARRAY_TYPE(const_string) batch;
+	const char *const *tokens, *token, *error;
+	struct timeval tv_start, tv_end;
+	unsigned long long input_count, output_count;
+	unsigned int i, j, n, count;
+
+	tokens = array_get(corpus, &count);
+	input_count = (unsigned long long)count * iterations;
+
+	output_count = 0;
+	(void)gettimeofday(&tv_start, NULL);
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < count; j++) T_BEGIN {
+			token = tokens[j];
+			if (fts_filter_filter(filter, &token, &error) < 0)
+				i_fatal("fts_filter_filter() failed: %s", error);
+			if (token != NULL)
+				output_count++;
+		} T_END;
+	}
+	(void)gettimeofday(&tv_end, NULL);
+	bench_report("single", input_count, output_count, &tv_start, &tv_end);
+
+	output_count = 0;
+	(void)gettimeofday(&tv_start, NULL);
+	for (i = 0; i < iterations; i++) {
+		for (j = 0; j < count; j += n) T_BEGIN {
+			n = I_MIN(count - j, BATCH_SIZE);
+			t_array_init(&batch, BATCH_SIZE);
+			array_append(&batch, tokens + j, n);
+			if (fts_filter_filter_batch(filter, &batch, &error) < 0)
+				i_fatal("fts_filter_filter_batch() failed: %s", error);
+			output_count += array_count(&batch);
+		} T_END;
+	}
+	(void)gettimeofday(&tv_end, NULL);
+	bench_report("batch", input_count, output_count, &tv_start, &tv_end);
+}
+
+int main(int argc, char *argv[])
+{
+	ARRAY_TYPE(const_string) corpus;
+	struct fts_filter *filter;
+	unsigned int i, iterations = DEFAULT_ITERATIONS;
+	pool_t pool;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &iterations) < 0)
+		i_fatal("Usage: %s [<iterations>]", argv[0]);
+
+	fts_tokenizers_init();
+	fts_filters_init();
+
+	pool = pool_alloconly_create("fts filter bench", 1024*64);
+	p_array_init(&corpus, pool, 1024);
+	for (i = 0; i < N_ELEMENTS(corpus_files); i++)
+		corpus_read_tokens(corpus_files[i], pool, &corpus);
+	printf("corpus: %u tokens, %u iterations\n",
+	       array_count(&corpus), iterations);
+
+	filter = bench_filter_create(fts_filter_lowercase, NULL, NULL);
+#ifdef HAVE_LIBICU
+	filter = bench_filter_create(fts_filter_normalizer_icu, filter, NULL);
+#endif
+	filter = bench_filter_create(fts_filter_stopwords, filter,
+				     stopword_settings);
+#ifdef HAVE_FTS_STEMMER
+	filter = bench_filter_create(fts_filter_stemmer_snowball, filter, NULL);
+#endif
+	bench_filter(filter, &corpus, iterations);
+	fts_filter_unref(&filter);
+
+	pool_unref(&pool);
+	fts_filters_deinit();
+	fts_tokenizers_deinit();
+	lib_deinit();
+	return 0;
+}
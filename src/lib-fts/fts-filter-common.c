@@ -18,3 +18,17 @@ void fts_filter_truncate_token(string_t *token, size_t max_length)
 	str_truncate(token, len);
 	i_assert(len <= max_length);
 }
+
+bool fts_filter_token_is_ascii_lowercase(const char *token,
+					 size_t max_length)
+{
+	const unsigned char *p = (const unsigned char *)token;
+	size_t i;
+
+	for (i = 0; p[i] != '\0'; i++) {
+		if (p[i] >= 0x80 || (p[i] >= 'A' && p[i] <= 'Z') ||
+		    p[i] == ' ' || i == max_length)
+			return FALSE;
+	}
+	return TRUE;
+}
@@ -2,5 +2,10 @@
 #define FTS_FILTER_COMMON_H
 
 void fts_filter_truncate_token(string_t *token, size_t max_length);
+/* Returns TRUE if the token consists only of ASCII characters other than
+   uppercase letters and spaces, and it's at most max_length bytes.
+   Lowercasing and the default ICU normalization don't change such tokens. */
+bool fts_filter_token_is_ascii_lowercase(const char *token,
+					 size_t max_length);
 
 #endif
@@ -4,10 +4,10 @@
 #include "str.h"
 #include "fts-language.h"
 #include "fts-filter-private.h"
+#include "fts-filter-common.h"
 
 #ifdef HAVE_LIBICU
 #  include "fts-icu.h"
-#  include "fts-filter-common.h"
 #endif
 
 static int
@@ -48,6 +48,8 @@ fts_filter_lowercase_filter(struct fts_filter *filter ATTR_UNUSED,
                             const char **token,
                             const char **error_r ATTR_UNUSED)
 {
+	if (fts_filter_token_is_ascii_lowercase(*token, filter->max_length))
+		return 1;
 #ifdef HAVE_LIBICU
 	str_truncate(filter->token, 0);
 	fts_icu_lcase(filter->token, *token);
@@ -59,12 +61,43 @@ fts_filter_lowercase_filter(struct fts_filter *filter ATTR_UNUSED,
 	return 1;
 }
 
+static int
+fts_filter_lowercase_filter_batch(struct fts_filter *filter,
+				  struct fts_filter_batch *batch,
+				  const char **error_r ATTR_UNUSED)
+{
+	const char *token;
+	size_t start_pos;
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++) {
+		token = batch->tokens[i];
+		if (fts_filter_token_is_ascii_lowercase(token,
+							filter->max_length))
+			continue;
+
+		start_pos = str_len(batch->buf);
+#ifdef HAVE_LIBICU
+		str_truncate(filter->token, 0);
+		fts_icu_lcase(filter->token, token);
+		fts_filter_truncate_token(filter->token, filter->max_length);
+		str_append_str(batch->buf, filter->token);
+#else
+		str_append(batch->buf, token);
+		str_lcase(str_c_modifiable(batch->buf) + start_pos);
+#endif
+		fts_filter_batch_replace(batch, i, start_pos);
+	}
+	return 0;
+}
+
 static const struct fts_filter fts_filter_lowercase_real = {
 	.class_name = "lowercase",
 	.v = {
 		fts_filter_lowercase_create,
 		fts_filter_lowercase_filter,
-		NULL
+		NULL,
+		fts_filter_lowercase_filter_batch
 	}
 };
 
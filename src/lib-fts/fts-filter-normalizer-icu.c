@@ -11,10 +11,16 @@
 #ifdef HAVE_LIBICU
 #include "fts-icu.h"
 
+#define FTS_FILTER_NORMALIZER_ICU_DEFAULT_ID \
+	"Any-Lower; NFKD; [: Nonspacing Mark :] Remove; NFC; [\\x20] Remove"
+
 struct fts_filter_normalizer_icu {
 	struct fts_filter filter;
 	pool_t pool;
 	const char *transliterator_id;
+	/* The default transliterator doesn't change ASCII tokens that have
+	   no uppercase letters or spaces. */
+	bool ascii_lowercase_unchanged;
 
 	UTransliterator *transliterator;
 	ARRAY_TYPE(icu_utf16) utf16_token, trans_token;
@@ -40,7 +46,7 @@ fts_filter_normalizer_icu_create(const struct fts_language *lang ATTR_UNUSED,
 	struct fts_filter_normalizer_icu *np;
 	pool_t pp;
 	unsigned int i, max_length = 250;
-	const char *id = "Any-Lower; NFKD; [: Nonspacing Mark :] Remove; NFC; [\\x20] Remove";
+	const char *id = FTS_FILTER_NORMALIZER_ICU_DEFAULT_ID;
 
 	for (i = 0; settings[i] != NULL; i += 2) {
 		const char *key = settings[i], *value = settings[i+1];
@@ -65,6 +71,8 @@ fts_filter_normalizer_icu_create(const struct fts_language *lang ATTR_UNUSED,
 	np->pool = pp;
 	np->filter = *fts_filter_normalizer_icu;
 	np->transliterator_id = p_strdup(pp, id);
+	np->ascii_lowercase_unchanged =
+		strcmp(id, FTS_FILTER_NORMALIZER_ICU_DEFAULT_ID) == 0;
 	p_array_init(&np->utf16_token, pp, 64);
 	p_array_init(&np->trans_token, pp, 64);
 	np->utf8_token = buffer_create_dynamic(pp, 128);
@@ -74,19 +82,16 @@ fts_filter_normalizer_icu_create(const struct fts_language *lang ATTR_UNUSED,
 }
 
 static int
-fts_filter_normalizer_icu_filter(struct fts_filter *filter, const char **token,
-				 const char **error_r)
+fts_filter_normalizer_icu_translate(struct fts_filter_normalizer_icu *np,
+				    const char *token, const char **error_r)
 {
-	struct fts_filter_normalizer_icu *np =
-		(struct fts_filter_normalizer_icu *)filter;
-
 	if (np->transliterator == NULL)
 		if (fts_icu_transliterator_create(np->transliterator_id,
 		                                  &np->transliterator,
 		                                  error_r) < 0)
 			return -1;
 
-	fts_icu_utf8_to_utf16(&np->utf16_token, *token);
+	fts_icu_utf8_to_utf16(&np->utf16_token, token);
 	array_append_zero(&np->utf16_token);
 	array_pop_back(&np->utf16_token);
 	array_clear(&np->trans_token);
@@ -101,10 +106,59 @@ fts_filter_normalizer_icu_filter(struct fts_filter *filter, const char **token,
 	fts_icu_utf16_to_utf8(np->utf8_token, array_front(&np->trans_token),
 			      array_count(&np->trans_token));
 	fts_filter_truncate_token(np->utf8_token, np->filter.max_length);
+	return 1;
+}
+
+static int
+fts_filter_normalizer_icu_filter(struct fts_filter *filter, const char **token,
+				 const char **error_r)
+{
+	struct fts_filter_normalizer_icu *np =
+		(struct fts_filter_normalizer_icu *)filter;
+	int ret;
+
+	if (np->ascii_lowercase_unchanged &&
+	    fts_filter_token_is_ascii_lowercase(*token, filter->max_length))
+		return 1;
+
+	if ((ret = fts_filter_normalizer_icu_translate(np, *token, error_r)) <= 0)
+		return ret;
 	*token = str_c(np->utf8_token);
 	return 1;
 }
 
+static int
+fts_filter_normalizer_icu_filter_batch(struct fts_filter *filter,
+				       struct fts_filter_batch *batch,
+				       const char **error_r)
+{
+	struct fts_filter_normalizer_icu *np =
+		(struct fts_filter_normalizer_icu *)filter;
+	size_t start_pos;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < batch->count; i++) {
+		if (np->ascii_lowercase_unchanged &&
+		    fts_filter_token_is_ascii_lowercase(batch->tokens[i],
+							filter->max_length))
+			continue;
+
+		ret = fts_filter_normalizer_icu_translate(np, batch->tokens[i],
+							  error_r);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			fts_filter_batch_remove(batch, i);
+		else {
+			start_pos = str_len(batch->buf);
+			str_append_str(batch->buf, np->utf8_token);
+			fts_filter_batch_replace(batch, i, start_pos);
+		}
+	}
+	return 0;
+}
+
 #else
 
 static int
@@ -125,6 +179,14 @@ fts_filter_normalizer_icu_filter(struct fts_filter *filter ATTR_UNUSED,
 	return -1;
 }
 
+static int
+fts_filter_normalizer_icu_filter_batch(struct fts_filter *filter ATTR_UNUSED,
+				       struct fts_filter_batch *batch ATTR_UNUSED,
+				       const char **error_r ATTR_UNUSED)
+{
+	return -1;
+}
+
 static void
 fts_filter_normalizer_icu_destroy(struct fts_filter *normalizer ATTR_UNUSED)
 {
@@ -137,7 +199,8 @@ static const struct fts_filter fts_filter_normalizer_icu_real = {
 	.v = {
 		fts_filter_normalizer_icu_create,
 		fts_filter_normalizer_icu_filter,
-		fts_filter_normalizer_icu_destroy
+		fts_filter_normalizer_icu_destroy,
+		fts_filter_normalizer_icu_filter_batch
 	}
 };
 
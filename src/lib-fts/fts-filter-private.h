@@ -10,8 +10,21 @@
  function is called to get an instance of a registered filter class.
  The filter() function is called with tokens for the specific filter.
  The destroy function is called to destroy an instance of a filter.
+ The optional filter_batch() function is called with multiple tokens at
+ once. If it's not implemented, filter() is called for each token.
 
 */
+struct fts_filter_batch {
+	const char **tokens;
+	unsigned int count;
+
+	/* Modified tokens are written here. The buffer is reused by the
+	   filter for the following batches. */
+	string_t *buf;
+	/* Offset+1 in buf for each modified token, 0 if unmodified */
+	size_t *offsets;
+};
+
 struct fts_filter_vfuncs {
 	int (*create)(const struct fts_language *lang,
 	              const char *const *settings,
@@ -21,6 +34,9 @@ struct fts_filter_vfuncs {
 		      const char **error_r);
 
 	void (*destroy)(struct fts_filter *filter);
+	int (*filter_batch)(struct fts_filter *filter,
+			    struct fts_filter_batch *batch,
+			    const char **error_r);
 };
 
 struct fts_filter {
@@ -28,8 +44,17 @@ struct fts_filter {
 	struct fts_filter_vfuncs v;
 	struct fts_filter *parent;
 	string_t *token;
+	string_t *batch_buf;
 	size_t max_length;
 	int refcount;
 };
 
+/* Replace batch->tokens[idx] with the string that was appended to
+   batch->buf starting from start_pos. */
+void fts_filter_batch_replace(struct fts_filter_batch *batch,
+			      unsigned int idx, size_t start_pos);
+/* Drop batch->tokens[idx] from the output. */
+void fts_filter_batch_remove(struct fts_filter_batch *batch,
+			     unsigned int idx);
+
 #endif
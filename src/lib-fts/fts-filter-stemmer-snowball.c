@@ -1,6 +1,7 @@
 /* Copyright (c) 2014-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "str.h"
 #include "fts-language.h"
 #include "fts-filter-private.h"
 
@@ -91,6 +92,44 @@ fts_filter_stemmer_snowball_filter(struct fts_filter *filter,
 	return 1;
 }
 
+static int
+fts_filter_stemmer_snowball_filter_batch(struct fts_filter *filter,
+					 struct fts_filter_batch *batch,
+					 const char **error_r)
+{
+	struct fts_filter_stemmer_snowball *sp =
+		(struct fts_filter_stemmer_snowball *) filter;
+	const sb_symbol *base;
+	const char *token;
+	size_t len, base_len, start_pos;
+	unsigned int i;
+
+	if (sp->stemmer == NULL) {
+		if (fts_filter_stemmer_snowball_create_stemmer(sp, error_r) < 0)
+			return -1;
+	}
+
+	for (i = 0; i < batch->count; i++) {
+		token = batch->tokens[i];
+		len = strlen(token);
+		base = sb_stemmer_stem(sp->stemmer,
+				       (const unsigned char *)token, len);
+		if (base == NULL) {
+			i_fatal_status(FATAL_OUTOFMEM,
+				       "sb_stemmer_stem(len=%"PRIuSIZE_T") failed: "
+				       "Out of memory", len);
+		}
+		base_len = sb_stemmer_length(sp->stemmer);
+		if (base_len == len && memcmp(base, token, len) == 0)
+			continue;
+
+		start_pos = str_len(batch->buf);
+		str_append_data(batch->buf, base, base_len);
+		fts_filter_batch_replace(batch, i, start_pos);
+	}
+	return 0;
+}
+
 #else
 
 static int
@@ -115,6 +154,14 @@ fts_filter_stemmer_snowball_filter(struct fts_filter *filter ATTR_UNUSED,
 	return -1;
 }
 
+static int
+fts_filter_stemmer_snowball_filter_batch(struct fts_filter *filter ATTR_UNUSED,
+					 struct fts_filter_batch *batch ATTR_UNUSED,
+					 const char **error_r ATTR_UNUSED)
+{
+	return -1;
+}
+
 #endif
 
 static const struct fts_filter fts_filter_stemmer_snowball_real = {
@@ -122,7 +169,8 @@ static const struct fts_filter fts_filter_stemmer_snowball_real = {
 	.v = {
 		fts_filter_stemmer_snowball_create,
 		fts_filter_stemmer_snowball_filter,
-		fts_filter_stemmer_snowball_destroy
+		fts_filter_stemmer_snowball_destroy,
+		fts_filter_stemmer_snowball_filter_batch
 	}
 };
 
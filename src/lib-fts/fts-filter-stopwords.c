@@ -101,6 +101,16 @@ fts_filter_stopwords_create(const struct fts_language *lang,
 	return 0;
 }
 
+static int
+fts_filter_stopwords_init_list(struct fts_filter_stopwords *sp,
+			       const char **error_r)
+{
+	if (hash_table_is_created(sp->stopwords))
+		return 0;
+	hash_table_create(&sp->stopwords, sp->pool, 0, str_hash, strcmp);
+	return fts_filter_stopwords_read_list(sp, error_r);
+}
+
 static int
 fts_filter_stopwords_filter(struct fts_filter *filter, const char **token,
 			    const char **error_r)
@@ -108,20 +118,36 @@ fts_filter_stopwords_filter(struct fts_filter *filter, const char **token,
 	struct fts_filter_stopwords *sp =
 		(struct fts_filter_stopwords *) filter;
 
-	if (!hash_table_is_created(sp->stopwords)) {
-		hash_table_create(&sp->stopwords, sp->pool, 0, str_hash, strcmp);
-		if (fts_filter_stopwords_read_list(sp, error_r) < 0)
-			return -1;
-	}
+	if (fts_filter_stopwords_init_list(sp, error_r) < 0)
+		return -1;
 	return hash_table_lookup(sp->stopwords, *token) == NULL ? 1 : 0;
 }
 
+static int
+fts_filter_stopwords_filter_batch(struct fts_filter *filter,
+				  struct fts_filter_batch *batch,
+				  const char **error_r)
+{
+	struct fts_filter_stopwords *sp =
+		(struct fts_filter_stopwords *) filter;
+	unsigned int i;
+
+	if (fts_filter_stopwords_init_list(sp, error_r) < 0)
+		return -1;
+	for (i = 0; i < batch->count; i++) {
+		if (hash_table_lookup(sp->stopwords, batch->tokens[i]) != NULL)
+			fts_filter_batch_remove(batch, i);
+	}
+	return 0;
+}
+
 const struct fts_filter fts_filter_stopwords_real = {
 	.class_name = "stopwords",
 	.v = {
 		fts_filter_stopwords_create,
 		fts_filter_stopwords_filter,
-		fts_filter_stopwords_destroy
+		fts_filter_stopwords_destroy,
+		fts_filter_stopwords_filter_batch
 	}
 };
 const struct fts_filter *fts_filter_stopwords = &fts_filter_stopwords_real;
@@ -106,6 +106,8 @@ void fts_filter_unref(struct fts_filter **_fpp)
 
 	if (fp->parent != NULL)
 		fts_filter_unref(&fp->parent);
+	if (fp->batch_buf != NULL)
+		str_free(&fp->batch_buf);
 	if (fp->v.destroy != NULL)
 		fp->v.destroy(fp);
 	else {
@@ -138,3 +140,120 @@ int fts_filter_filter(struct fts_filter *filter, const char **token,
 	}
 	return ret;
 }
+
+void fts_filter_batch_replace(struct fts_filter_batch *batch,
+			      unsigned int idx, size_t start_pos)
+{
+	i_assert(idx < batch->count);
+	i_assert(start_pos < str_len(batch->buf));
+
+	/* the buffer may still grow, so remember only the offset */
+	buffer_append_c(batch->buf, '\0');
+	batch->offsets[idx] = start_pos + 1;
+}
+
+void fts_filter_batch_remove(struct fts_filter_batch *batch,
+			     unsigned int idx)
+{
+	i_assert(idx < batch->count);
+
+	batch->tokens[idx] = NULL;
+	batch->offsets[idx] = 0;
+}
+
+static int
+fts_filter_filter_batch_default(struct fts_filter *filter,
+				struct fts_filter_batch *batch,
+				const char **error_r)
+{
+	const char *token;
+	size_t start_pos;
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < batch->count; i++) {
+		token = batch->tokens[i];
+		ret = filter->v.filter(filter, &token, error_r);
+		if (ret < 0)
+			return -1;
+		if (ret == 0)
+			fts_filter_batch_remove(batch, i);
+		else if (token != batch->tokens[i]) {
+			/* the token may be in a buffer that the next filter()
+			   call overwrites */
+			start_pos = str_len(batch->buf);
+			str_append(batch->buf, token);
+			fts_filter_batch_replace(batch, i, start_pos);
+		}
+	}
+	return 0;
+}
+
+static void fts_filter_batch_finish(struct fts_filter_batch *batch)
+{
+	unsigned int i, j;
+
+	for (i = j = 0; i < batch->count; i++) {
+		if (batch->tokens[i] == NULL)
+			continue;
+		if (batch->offsets[i] != 0) {
+			batch->tokens[j] = CONST_PTR_OFFSET(batch->buf->data,
+							    batch->offsets[i] - 1);
+		} else {
+			batch->tokens[j] = batch->tokens[i];
+		}
+		i_assert(batch->tokens[j][0] != '\0');
+		j++;
+	}
+	batch->count = j;
+}
+
+static int
+fts_filter_filter_batch_real(struct fts_filter *filter,
+			     struct fts_filter_batch *batch,
+			     const char **error_r)
+{
+	int ret;
+
+	/* Recurse to parent. */
+	if (filter->parent != NULL) {
+		if (fts_filter_filter_batch_real(filter->parent, batch,
+						 error_r) < 0)
+			return -1;
+	}
+	if (batch->count == 0)
+		return 0;
+
+	if (filter->batch_buf == NULL)
+		filter->batch_buf = str_new(default_pool, 256);
+	str_truncate(filter->batch_buf, 0);
+	batch->buf = filter->batch_buf;
+	batch->offsets = t_new(size_t, batch->count);
+
+	if (filter->v.filter_batch != NULL)
+		ret = filter->v.filter_batch(filter, batch, error_r);
+	else
+		ret = fts_filter_filter_batch_default(filter, batch, error_r);
+	if (ret < 0)
+		return -1;
+	fts_filter_batch_finish(batch);
+	return 0;
+}
+
+int fts_filter_filter_batch(struct fts_filter *filter,
+			    ARRAY_TYPE(const_string) *tokens,
+			    const char **error_r)
+{
+	struct fts_filter_batch batch;
+	unsigned int count;
+
+	i_zero(&batch);
+	batch.tokens = array_get_modifiable(tokens, &count);
+	batch.count = count;
+	if (fts_filter_filter_batch_real(filter, &batch, error_r) < 0) {
+		array_clear(tokens);
+		return -1;
+	}
+	array_delete(tokens, batch.count, count - batch.count);
+	return 0;
+}
@@ -67,5 +67,13 @@ void fts_filter_unref(struct fts_filter **filter);
 */
 int fts_filter_filter(struct fts_filter *filter, const char **token,
 		      const char **error_r);
+/* Filter multiple tokens at once. The tokens that are filtered out are
+   removed from the array and the rest are replaced with their filtered
+   versions. The returned tokens are valid until the next call to the
+   filter or until the current data stack frame is freed. Returns 0 if ok,
+   -1 on error (and the array is cleared). */
+int fts_filter_filter_batch(struct fts_filter *filter,
+			    ARRAY_TYPE(const_string) *tokens,
+			    const char **error_r);
 
 #endif
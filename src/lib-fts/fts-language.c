@@ -3,8 +3,11 @@
 #include "lib.h"
 #include "array.h"
 #include "llist.h"
+#include "hash.h"
+#include "istream.h"
 #include "fts-language.h"
 
+#include <ctype.h>
 
 #ifdef HAVE_LIBEXTTEXTCAT_TEXTCAT_H
 #  include <libexttextcat/textcat.h>
@@ -18,15 +21,36 @@
 #  endif
 #endif
 
-#define DETECT_STR_MAX_LEN 200
+/* The most commonly detected language is trusted without running textcat
+   after it has been detected this many more times than other languages. */
+#define LANGUAGE_CACHE_MIN_SCORE 4
+#define LANGUAGE_CACHE_MAX_SCORE 16
+/* Text is assumed to be in the cached language if at least this many
+   (and this large percentage) of its words are the language's stopwords. */
+#define LANGUAGE_CACHE_MIN_STOPWORDS 3
+#define LANGUAGE_CACHE_MIN_STOPWORD_PERCENTAGE 20
+
+#define STOPWORDS_FILE_FORMAT "%s/stopwords_%s.txt"
+#define STOPWORDS_CUTCHARS "|#\t "
+#define STOPWORDS_DISALLOWED_CHARS "/\\<>.,\":()\t\n\r"
 
 struct fts_language_list {
 	pool_t pool;
 	ARRAY_TYPE(fts_language) languages;
 	const char *textcat_config;
 	const char *textcat_datadir;
+	const char *stopwords_dir;
 	void *textcat_handle;
 	bool textcat_failed;
+
+	/* Most commonly detected language and its stopwords */
+	const struct fts_language *cache_lang;
+	unsigned int cache_score;
+	pool_t cache_pool;
+	HASH_TABLE(const char *, const char *) cache_stopwords;
+	bool cache_stopwords_read;
+
+	struct fts_language_detect_stats stats;
 };
 
 pool_t fts_languages_pool;
@@ -104,7 +128,7 @@ int fts_language_list_init(const char *const *settings,
 	struct fts_language_list *lp;
 	pool_t pool;
 	unsigned int i;
-	const char *conf = NULL, *data = NULL;
+	const char *conf = NULL, *data = NULL, *stopwords_dir = NULL;
 
 	for (i = 0; settings[i] != NULL; i += 2) {
 		const char *key = settings[i], *value = settings[i+1];
@@ -113,6 +137,8 @@ int fts_language_list_init(const char *const *settings,
 			conf = value;
 		else if (strcmp(key, "fts_language_data") == 0)
 			data = value;
+		else if (strcmp(key, "fts_language_stopwords_dir") == 0)
+			stopwords_dir = value;
 		else {
 			*error_r = t_strdup_printf("Unknown setting: %s", key);
 			return -1;
@@ -130,6 +156,8 @@ int fts_language_list_init(const char *const *settings,
 		lp->textcat_datadir = p_strdup(pool, data);
 	else
 		lp->textcat_datadir = NULL;
+	lp->stopwords_dir = p_strdup(pool, stopwords_dir != NULL ?
+				     stopwords_dir : DATADIR"/stopwords");
 	p_array_init(&lp->languages, pool, 32);
 	*list_r = lp;
 	return 0;
@@ -144,6 +172,9 @@ void fts_language_list_deinit(struct fts_language_list **list)
 	if (lp->textcat_handle != NULL)
 		textcat_Done(lp->textcat_handle);
 #endif
+	if (hash_table_is_created(lp->cache_stopwords))
+		hash_table_destroy(&lp->cache_stopwords);
+	pool_unref(&lp->cache_pool);
 	pool_unref(&lp->pool);
 }
 
@@ -270,7 +301,7 @@ fts_language_detect_textcat(struct fts_language_list *list ATTR_UNUSED,
 	if (candp == NULL)
 		i_fatal_status(FATAL_OUTOFMEM, "textcat_GetCLassifyFullOutput failed: malloc() returned NULL");
 	cnt = textcat_ClassifyFull(list->textcat_handle, (const void *)text,
-				   I_MIN(size, DETECT_STR_MAX_LEN), candp);
+				   I_MIN(size, FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE), candp);
 	if (cnt > 0) {
 		T_BEGIN {
 			match = fts_language_match_lists(list, candp, cnt, lang_r);
@@ -284,7 +315,7 @@ fts_language_detect_textcat(struct fts_language_list *list ATTR_UNUSED,
 		textcat_ReleaseClassifyFullOutput(list->textcat_handle, candp);
 		switch (cnt) {
 		case TEXTCAT_RESULT_SHORT:
-			i_assert(size < DETECT_STR_MAX_LEN);
+			i_assert(size < FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE);
 			return FTS_LANGUAGE_RESULT_SHORT;
 		case TEXTCAT_RESULT_UNKNOWN:
 			return FTS_LANGUAGE_RESULT_UNKNOWN;
@@ -297,12 +328,127 @@ fts_language_detect_textcat(struct fts_language_list *list ATTR_UNUSED,
 #endif
 }
 
+static void fts_language_cache_reset(struct fts_language_list *list,
+				     const struct fts_language *lang)
+{
+	list->cache_lang = lang;
+	list->cache_score = 1;
+	list->cache_stopwords_read = FALSE;
+	if (hash_table_is_created(list->cache_stopwords))
+		hash_table_destroy(&list->cache_stopwords);
+	if (list->cache_pool != NULL)
+		p_clear(list->cache_pool);
+}
+
+static void fts_language_cache_update(struct fts_language_list *list,
+				      const struct fts_language *lang)
+{
+	if (list->cache_lang == lang) {
+		if (list->cache_score < LANGUAGE_CACHE_MAX_SCORE)
+			list->cache_score++;
+	} else if (list->cache_lang == NULL || --list->cache_score == 0) {
+		fts_language_cache_reset(list, lang);
+	}
+}
+
+static int fts_language_cache_read_stopwords(struct fts_language_list *list)
+{
+	struct istream *input;
+	const char *line, *word, *path;
+	size_t len;
+	int ret = 0;
+
+	if (list->cache_pool == NULL) {
+		list->cache_pool = pool_alloconly_create(
+			MEMPOOL_GROWING"fts_language_cache", 1024);
+	}
+	hash_table_create(&list->cache_stopwords, list->cache_pool, 0,
+			  str_hash, strcmp);
+
+	path = t_strdup_printf(STOPWORDS_FILE_FORMAT,
+			       list->stopwords_dir, list->cache_lang->name);
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		len = strcspn(line, STOPWORDS_CUTCHARS);
+		if (len == 0)
+			continue;
+		if (strcspn(line, STOPWORDS_DISALLOWED_CHARS) < len)
+			continue;
+		word = p_strndup(list->cache_pool, line, len);
+		hash_table_update(list->cache_stopwords, word, word);
+	}
+	if (input->stream_errno == ENOENT) {
+		/* no stopwords for this language - it can't be cached */
+		ret = -1;
+	} else if (input->stream_errno != 0) {
+		i_error("Failed to read stopword list %s: %s",
+			path, i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_destroy(&input);
+	return ret;
+}
+
+static bool
+fts_language_cache_match(struct fts_language_list *list,
+			 const unsigned char *text, size_t size)
+{
+	unsigned int words = 0, stopwords = 0;
+	size_t i, start;
+	const char *lookup_word;
+	char *word;
+
+	if (list->cache_lang == NULL ||
+	    list->cache_score < LANGUAGE_CACHE_MIN_SCORE)
+		return FALSE;
+	if (!list->cache_stopwords_read) {
+		list->cache_stopwords_read = TRUE;
+		T_BEGIN {
+			if (fts_language_cache_read_stopwords(list) < 0)
+				hash_table_clear(list->cache_stopwords, FALSE);
+		} T_END;
+	}
+	if (hash_table_count(list->cache_stopwords) == 0)
+		return FALSE;
+
+	/* Count the stopwords in the text. Only ASCII is treated as
+	   separators and lowercased, which is good enough for this. */
+	size = I_MIN(size, FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE);
+	word = t_malloc_no0(size + 1);
+	for (i = 0; i < size; ) {
+		while (i < size && text[i] < 0x80 &&
+		       !i_isalnum(text[i]) && text[i] != '\'')
+			i++;
+		for (start = i; i < size; i++) {
+			if (text[i] < 0x80 &&
+			    !i_isalnum(text[i]) && text[i] != '\'')
+				break;
+			word[i - start] = i_tolower(text[i]);
+		}
+		if (i == start)
+			break;
+		if (i == size && size == FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE) {
+			/* the last word may have been truncated */
+			break;
+		}
+		word[i - start] = '\0';
+		words++;
+		lookup_word = word;
+		if (hash_table_lookup(list->cache_stopwords, lookup_word) != NULL)
+			stopwords++;
+	}
+	return stopwords >= LANGUAGE_CACHE_MIN_STOPWORDS &&
+		stopwords * 100 >= words * LANGUAGE_CACHE_MIN_STOPWORD_PERCENTAGE;
+}
+
 enum fts_language_result
 fts_language_detect(struct fts_language_list *list,
-		    const unsigned char *text ATTR_UNUSED,
-		    size_t size ATTR_UNUSED,
-                    const struct fts_language **lang_r)
+		    const unsigned char *text, size_t size,
+		    const struct fts_language **lang_r)
 {
+	enum fts_language_result ret;
+	bool match;
+
 	i_assert(array_count(&list->languages) > 0);
 
 	/* if there's only a single wanted language, return it always. */
@@ -312,5 +458,26 @@ fts_language_detect(struct fts_language_list *list,
 		*lang_r = *langp;
 		return FTS_LANGUAGE_RESULT_OK;
 	}
-	return fts_language_detect_textcat(list, text, size, lang_r);
+
+	T_BEGIN {
+		match = fts_language_cache_match(list, text, size);
+	} T_END;
+	if (match) {
+		list->stats.cache_hit_count++;
+		*lang_r = list->cache_lang;
+		return FTS_LANGUAGE_RESULT_OK;
+	}
+
+	ret = fts_language_detect_textcat(list, text, size, lang_r);
+	if (ret != FTS_LANGUAGE_RESULT_SHORT)
+		list->stats.detect_count++;
+	if (ret == FTS_LANGUAGE_RESULT_OK)
+		fts_language_cache_update(list, *lang_r);
+	return ret;
+}
+
+void fts_language_list_get_stats(struct fts_language_list *list,
+				 struct fts_language_detect_stats *stats_r)
+{
+	*stats_r = list->stats;
 }
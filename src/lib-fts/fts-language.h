@@ -3,6 +3,9 @@
 
 struct fts_language_list;
 
+/* Language detection looks at most this many bytes of the text. */
+#define FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE 200
+
 enum fts_language_result {
 	/* Provided sample is too short. */
 	FTS_LANGUAGE_RESULT_SHORT,
@@ -20,6 +23,14 @@ struct fts_language {
 };
 ARRAY_DEFINE_TYPE(fts_language, const struct fts_language *);
 
+struct fts_language_detect_stats {
+	/* Number of times the full language detection was run */
+	unsigned int detect_count;
+	/* Number of times the text was found to be in the most commonly
+	   detected language without running the full detection */
+	unsigned int cache_hit_count;
+};
+
 /* Used for raw data that is indexed. This data shouldn't go through any
    language-specific filters. */
 extern const struct fts_language fts_language_data;
@@ -62,10 +73,16 @@ fts_language_list_get_first(struct fts_language_list *list);
 
 /* If text was detected to be one of the languages in the list,
    returns FTS_LANGUAGE_RESULT_OK and (a pointer to) the language (in
-   the list). */
+   the list). Only the first FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE bytes of
+   the text are looked at. Once the same language has been detected
+   repeatedly, text containing enough of its stopwords is assumed to be in
+   it without running the full detection. */
 enum fts_language_result
 fts_language_detect(struct fts_language_list *list,
 		    const unsigned char *text, size_t size,
                     const struct fts_language **lang_r);
+/* Returns the language detection statistics for the list. */
+void fts_language_list_get_stats(struct fts_language_list *list,
+				 struct fts_language_detect_stats *stats_r);
 
 #endif
@@ -0,0 +1,115 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "istream.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "fts-tokenizer.h"
+
+#include <stdio.h>
+#include <sys/time.h>
+
+/* Measure the generic tokenizer's throughput over the corpora shipped with
+   lib-fts. Usage: fts-tokenizer-bench [<iterations>] */
+
+#define DEFAULT_ITERATIONS 100
+
+static const char *const corpus_files[] = {
+	UDHRDIR"/udhr_fra.txt",
+	TEST_STOPWORDS_DIR"/stopwords_da.txt",
+	TEST_STOPWORDS_DIR"/stopwords_de.txt",
+	TEST_STOPWORDS_DIR"/stopwords_en.txt",
+	TEST_STOPWORDS_DIR"/stopwords_es.txt",
+	TEST_STOPWORDS_DIR"/stopwords_fi.txt",
+	TEST_STOPWORDS_DIR"/stopwords_fr.txt",
+	TEST_STOPWORDS_DIR"/stopwords_it.txt",
+	TEST_STOPWORDS_DIR"/stopwords_nl.txt",
+	TEST_STOPWORDS_DIR"/stopwords_no.txt",
+	TEST_STOPWORDS_DIR"/stopwords_pt.txt",
+	TEST_STOPWORDS_DIR"/stopwords_ro.txt",
+	TEST_STOPWORDS_DIR"/stopwords_ru.txt",
+	TEST_STOPWORDS_DIR"/stopwords_sv.txt",
+	TEST_STOPWORDS_DIR"/stopwords_tr.txt",
+};
+
+static const char *const algorithm_settings[][5] = {
+	{ "algorithm", "simple", NULL },
+	{ "algorithm", "tr29", NULL },
+	{ "algorithm", "tr29", "wb5a", "yes", NULL },
+};
+
+static void corpus_read(const char *path, buffer_t *corpus)
+{
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		buffer_append(corpus, data, size);
+		i_stream_skip(input, size);
+	}
+	if (input->stream_errno != 0)
+		i_fatal("read(%s) failed: %s", path, i_stream_get_error(input));
+	i_stream_unref(&input);
+	/* keep the files' words apart */
+	buffer_append_c(corpus, '\n');
+}
+
+static void
+bench_algorithm(const char *const *settings, const buffer_t *corpus,
+		unsigned int iterations)
+{
+	struct fts_tokenizer *tok;
+	const char *token, *error;
+	struct timeval tv_start, tv_end;
+	unsigned long long token_count = 0;
+	unsigned int i;
+	double secs;
+
+	if (fts_tokenizer_create(fts_tokenizer_generic, NULL, settings,
+				 &tok, &error) < 0)
+		i_fatal("fts_tokenizer_create() failed: %s", error);
+
+	(void)gettimeofday(&tv_start, NULL);
+	for (i = 0; i < iterations; i++) T_BEGIN {
+		while (fts_tokenizer_next(tok, corpus->data, corpus->used,
+					  &token, &error) > 0)
+			token_count++;
+		while (fts_tokenizer_final(tok, &token, &error) > 0)
+			token_count++;
+	} T_END;
+	(void)gettimeofday(&tv_end, NULL);
+	fts_tokenizer_unref(&tok);
+
+	secs = timeval_diff_usecs(&tv_end, &tv_start) / 1000000.0;
+	printf("%-20s %10llu tokens %8.2f s %12.0f tokens/s %8.2f MB/s\n",
+	       t_strarray_join(settings + 1, " "), token_count, secs,
+	       token_count / secs,
+	       (double)corpus->used * iterations / secs / (1024*1024));
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i, iterations = DEFAULT_ITERATIONS;
+	buffer_t *corpus;
+
+	lib_init();
+	if (argc > 1 && str_to_uint(argv[1], &iterations) < 0)
+		i_fatal("Usage: %s [<iterations>]", argv[0]);
+
+	fts_tokenizers_init();
+	corpus = buffer_create_dynamic(default_pool, 1024*64);
+	for (i = 0; i < N_ELEMENTS(corpus_files); i++)
+		corpus_read(corpus_files[i], corpus);
+	printf("corpus: %zu bytes, %u iterations\n", corpus->used, iterations);
+
+	for (i = 0; i < N_ELEMENTS(algorithm_settings); i++)
+		bench_algorithm(algorithm_settings[i], corpus, iterations);
+
+	buffer_free(&corpus);
+	fts_tokenizers_deinit();
+	lib_deinit();
+	return 0;
+}
@@ -27,6 +27,13 @@ static unsigned char fts_ascii_word_breaks[128] = {
 	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 0  /* 112-127: {|}~ */
 };
 
+/* letter_type() results for U+0000 - U+00FF, i.e. ASCII and Latin-1.
+   Filled when the first tokenizer is created. */
+static unsigned char latin1_letter_types[256];
+static bool latin1_letter_types_initialized = FALSE;
+
+static void latin1_letter_types_init(void);
+
 static int
 fts_tokenizer_generic_create(const char *const *settings,
 			     struct fts_tokenizer **tokenizer_r,
@@ -86,6 +93,9 @@ fts_tokenizer_generic_create(const char *const *settings,
 		return -1;
 	}
 
+	if (!latin1_letter_types_initialized)
+		latin1_letter_types_init();
+
 	tok = i_new(struct generic_fts_tokenizer, 1);
 	if (algo == BOUNDARY_ALGORITHM_TR29)
 		tok->tokenizer.v = &generic_tokenizer_vfuncs_tr29;
@@ -318,7 +328,7 @@ fts_tokenizer_generic_simple_next(struct fts_tokenizer *_tok,
    HYPHEN.
    TODO
 */
-static enum letter_type letter_type(unichar_t c)
+static enum letter_type letter_type_lookup(unichar_t c)
 {
 	unsigned int idx;
 
@@ -361,6 +371,22 @@ static enum letter_type letter_type(unichar_t c)
 	return LETTER_TYPE_OTHER;
 }
 
+static void latin1_letter_types_init(void)
+{
+	unichar_t c;
+
+	for (c = 0; c < N_ELEMENTS(latin1_letter_types); c++)
+		latin1_letter_types[c] = letter_type_lookup(c);
+	latin1_letter_types_initialized = TRUE;
+}
+
+static inline enum letter_type letter_type(unichar_t c)
+{
+	if (c < N_ELEMENTS(latin1_letter_types))
+		return latin1_letter_types[c];
+	return letter_type_lookup(c);
+}
+
 static bool letter_panic(struct generic_fts_tokenizer *tok ATTR_UNUSED)
 {
 	i_panic("Letter type should not be used.");
@@ -699,6 +725,46 @@ uni_found_word_boundary(struct generic_fts_tokenizer *tok, enum letter_type lt)
 	return FALSE;
 }
 
+/* Skip over a run of ASCII and Latin-1 letters and digits in the middle of
+   a word. Between ALetters and Numerics none of the rules can break (WB5,
+   WB8, WB9, WB10), so only the previous types need to be updated. WB5a can
+   break between letters, so leave it to the full rules while it can still
+   apply. Returns the number of bytes skipped. */
+static size_t
+tr29_skip_word_run(struct generic_fts_tokenizer *tok,
+		   const unsigned char *data, size_t size)
+{
+	enum letter_type lt;
+	size_t i = 0, char_size;
+	unichar_t c;
+
+	if (tok->prev_type != LETTER_TYPE_ALETTER &&
+	    tok->prev_type != LETTER_TYPE_NUMERIC)
+		return 0;
+	if (tok->seen_wb5a ||
+	    (tok->wb5a && tok->token->used <= FTS_WB5A_PREFIX_MAX_LENGTH))
+		return 0;
+
+	while (i < size) {
+		if (data[i] < 0x80) {
+			c = data[i];
+			char_size = 1;
+		} else if ((data[i] == 0xc2 || data[i] == 0xc3) &&
+			   i + 1 < size && (data[i+1] & 0xc0) == 0x80) {
+			c = ((data[i] & 0x1f) << 6) | (data[i+1] & 0x3f);
+			char_size = 2;
+		} else {
+			break;
+		}
+		lt = latin1_letter_types[c];
+		if (lt != LETTER_TYPE_ALETTER && lt != LETTER_TYPE_NUMERIC)
+			break;
+		shift_prev_type(tok, lt);
+		i += char_size;
+	}
+	return i;
+}
+
 static int
 fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 				const unsigned char *data, size_t size,
@@ -713,6 +779,10 @@ fts_tokenizer_generic_tr29_next(struct fts_tokenizer *_tok,
 	int char_size;
 
 	for (i = 0; i < size; ) {
+		i += tr29_skip_word_run(tok, data + i, size - i);
+		if (i == size)
+			break;
+
 		char_start_i = i;
 		char_size = uni_utf8_get_char_n(data + i, size - i, &c);
 		i_assert(char_size > 0);
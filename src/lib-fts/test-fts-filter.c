@@ -1,6 +1,7 @@
 /* Copyright (c) 2014-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "sha2.h"
 #include "str.h"
 #include "unichar.h"
@@ -973,6 +974,142 @@ static void test_fts_filter_english_possessive(void)
 	test_end();
 }
 
+static void
+test_fts_filter_batch_compare(struct fts_filter *filter,
+			      const char *const *input, unsigned int count)
+{
+	ARRAY_TYPE(const_string) tokens;
+	const char *const *batch_tokens;
+	const char *token, *error;
+	unsigned int i, j, batch_count;
+	int ret;
+
+	t_array_init(&tokens, count);
+	array_append(&tokens, input, count);
+	test_assert(fts_filter_filter_batch(filter, &tokens, &error) == 0);
+	batch_tokens = array_get(&tokens, &batch_count);
+
+	for (i = j = 0; i < count; i++) {
+		token = input[i];
+		ret = fts_filter_filter(filter, &token, &error);
+		test_assert_idx(ret >= 0, i);
+		if (ret <= 0)
+			continue;
+		test_assert_idx(j < batch_count, i);
+		if (j < batch_count)
+			test_assert_idx(null_strcmp(batch_tokens[j], token) == 0, i);
+		j++;
+	}
+	test_assert(j == batch_count);
+}
+
+static void test_fts_filter_batch_lowercase_stopwords(void)
+{
+	static const char *input[] = {
+		"The", "quick", "brown", "fox", "jumps", "over", "the",
+		"LAZY", "dog", "AND", "it", "was", "a", "Good", "Day"
+	};
+	static const char *output[] = {
+		"quick", "brown", "fox", "jumps", "over", "lazy", "dog", "good",
+		"day"
+	};
+	struct fts_filter *filter, *lowercase;
+	ARRAY_TYPE(const_string) tokens;
+	const char *const *batch_tokens;
+	const char *error;
+	unsigned int i, count;
+
+	test_begin("fts filter batch lowercase and stopwords");
+	test_assert(fts_filter_create(fts_filter_lowercase, NULL, &english_language, NULL, &lowercase, &error) == 0);
+	test_assert(fts_filter_create(fts_filter_stopwords, lowercase, &english_language, stopword_settings, &filter, &error) == 0);
+	fts_filter_unref(&lowercase);
+
+	t_array_init(&tokens, N_ELEMENTS(input));
+	array_append(&tokens, input, N_ELEMENTS(input));
+	test_assert(fts_filter_filter_batch(filter, &tokens, &error) == 0);
+	batch_tokens = array_get(&tokens, &count);
+	test_assert(count == N_ELEMENTS(output));
+	for (i = 0; i < count && i < N_ELEMENTS(output); i++)
+		test_assert_idx(strcmp(batch_tokens[i], output[i]) == 0, i);
+
+	/* the buffers are reused by the next batch */
+	test_fts_filter_batch_compare(filter, input, N_ELEMENTS(input));
+	fts_filter_unref(&filter);
+	test_end();
+}
+
+static void test_fts_filter_batch_stopwords_fail(void)
+{
+	const char *settings[] = {"stopwords_dir", "/nonexistent", NULL};
+	struct fts_filter *filter;
+	ARRAY_TYPE(const_string) tokens;
+	const char *token = "foo", *error;
+
+	test_begin("fts filter batch error");
+	test_assert(fts_filter_create(fts_filter_stopwords, NULL, &english_language, settings, &filter, &error) == 0);
+	t_array_init(&tokens, 1);
+	array_push_back(&tokens, &token);
+	test_assert(fts_filter_filter_batch(filter, &tokens, &error) < 0 &&
+		    error != NULL);
+	test_assert(array_count(&tokens) == 0);
+	fts_filter_unref(&filter);
+	test_end();
+}
+
+#ifdef HAVE_LIBICU
+static void test_fts_filter_batch_normalizer_french(void)
+{
+	const char *const upper_settings[] = {"id", "Any-Upper", NULL};
+	const char *const ascii_tokens[] = { "abc", "d-e", "x1" };
+	struct fts_filter *lowercase, *norm, *filter;
+	ARRAY_TYPE(const_string) words;
+	FILE *input;
+	char buf[250], *p, *word;
+	const char *token, *error, *const *tokens;
+	unsigned int i, count;
+
+	test_begin("fts filter batch normalizer French UDHR");
+	test_assert(fts_filter_create(fts_filter_lowercase, NULL, &french_language, NULL, &lowercase, &error) == 0);
+	test_assert(fts_filter_create(fts_filter_normalizer_icu, lowercase, NULL, NULL, &norm, &error) == 0);
+	test_assert(fts_filter_create(fts_filter_stopwords, norm, &french_language, stopword_settings, &filter, &error) == 0);
+	fts_filter_unref(&lowercase);
+	fts_filter_unref(&norm);
+
+	t_array_init(&words, 128);
+	input = fopen(t_strconcat(UDHRDIR, UDHR_FRA_NAME, NULL), "r");
+	test_assert(input != NULL);
+	while (input != NULL && fgets(buf, sizeof(buf), input) != NULL) {
+		for (p = buf; (word = strsep(&p, " \t\n,.;:()")) != NULL; ) {
+			if (*word == '\0')
+				continue;
+			token = t_strdup(word);
+			array_push_back(&words, &token);
+		}
+		if (array_count(&words) >= 100) {
+			tokens = array_get(&words, &count);
+			test_fts_filter_batch_compare(filter, tokens, count);
+			array_clear(&words);
+		}
+	}
+	if (input != NULL)
+		fclose(input);
+	tokens = array_get(&words, &count);
+	test_fts_filter_batch_compare(filter, tokens, count);
+	fts_filter_unref(&filter);
+
+	/* the ASCII fast path must not be used with non-default ids */
+	test_assert(fts_filter_create(fts_filter_normalizer_icu, NULL, NULL, upper_settings, &norm, &error) == 0);
+	test_fts_filter_batch_compare(norm, ascii_tokens, N_ELEMENTS(ascii_tokens));
+	for (i = 0; i < N_ELEMENTS(ascii_tokens); i++) {
+		token = ascii_tokens[i];
+		test_assert_idx(fts_filter_filter(norm, &token, &error) > 0 &&
+				strcmp(token, t_str_ucase(ascii_tokens[i])) == 0, i);
+	}
+	fts_filter_unref(&norm);
+	test_end();
+}
+#endif
+
 /* TODO: Functions to test 1. ref-unref pairs 2. multiple registers +
   an unregister + find */
 
@@ -1014,6 +1151,11 @@ int main(void)
 #endif
 #endif
 		test_fts_filter_english_possessive,
+		test_fts_filter_batch_lowercase_stopwords,
+		test_fts_filter_batch_stopwords_fail,
+#ifdef HAVE_LIBICU
+		test_fts_filter_batch_normalizer_french,
+#endif
 		NULL
 	};
 	int ret;
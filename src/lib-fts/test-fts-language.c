@@ -278,6 +278,53 @@ static void test_fts_language_detect_unknown(void)
 	fts_language_list_deinit(&lp);
 	test_end();
 }
+
+/* Detect the most common language without textcat */
+static void test_fts_language_detect_cache(void)
+{
+	const char *const cache_settings[] =
+		{"fts_language_config", TEXTCAT_DATADIR"/fpdb.conf",
+		 "fts_language_data", TEXTCAT_DATADIR"/",
+		 "fts_language_stopwords_dir", TEST_STOPWORDS_DIR, NULL};
+	struct fts_language_list *lp = NULL;
+	const struct fts_language *lang_r = NULL;
+	struct fts_language_detect_stats stats;
+	const unsigned char english[]  = "Article 1. All human beings are "\
+		"born free and equal in dignity and rights. They are endowed "\
+		"with reason and conscience and should act towards one "\
+		"another in a spirit of brotherhood.";
+	const unsigned char finnish[]  =
+		"Kaikki ihmiset syntyv\xC3\xA4t vapaina ja "\
+		"tasavertaisina arvoltaan ja oikeuksiltaan. Heille on "\
+		"annettu j\xC3\xA4rki ja omatunto, ja heid\xC3\xA4n on "\
+		"toimittava toisiaan kohtaan veljeyden hengess\xC3\xA4.";
+	const char names[] = "fi, de, sv, fr, en";
+	const char *unknown, *error;
+	unsigned int i;
+
+	test_begin("fts language detect cache");
+	test_assert(fts_language_list_init(cache_settings, &lp, &error) == 0);
+	test_assert(fts_language_list_add_names(lp, names, &unknown) == TRUE);
+	for (i = 0; i < 5; i++) {
+		test_assert_idx(fts_language_detect(lp, english,
+						    sizeof(english)-1, &lang_r)
+				== FTS_LANGUAGE_RESULT_OK, i);
+		test_assert_idx(strcmp(lang_r->name, "en") == 0, i);
+	}
+	fts_language_list_get_stats(lp, &stats);
+	test_assert(stats.detect_count == 4);
+	test_assert(stats.cache_hit_count == 1);
+
+	test_assert(fts_language_detect(lp, finnish, sizeof(finnish)-1, &lang_r)
+	            == FTS_LANGUAGE_RESULT_OK);
+	test_assert(strcmp(lang_r->name, "fi") == 0);
+	fts_language_list_get_stats(lp, &stats);
+	test_assert(stats.detect_count == 5);
+	test_assert(stats.cache_hit_count == 1);
+	fts_language_list_deinit(&lp);
+	test_end();
+}
+
 static void test_fts_language_find_builtin(void)
 {
 	const struct fts_language *lp;
@@ -312,6 +359,7 @@ int main(void)
 		test_fts_language_detect_finnish_as_english,
 		test_fts_language_detect_na,
 		test_fts_language_detect_unknown,
+		test_fts_language_detect_cache,
 		test_fts_language_find_builtin,
 		test_fts_language_register,
 		NULL
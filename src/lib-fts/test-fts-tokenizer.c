@@ -313,6 +313,52 @@ static void test_fts_tokenizer_generic_tr29_wb5a(void)
 	test_end();
 }
 
+static void test_fts_tokenizer_generic_tr29_latin1(void)
+{
+	/* runs of ASCII and Latin-1 letters and digits are handled by a
+	   fast path, which must give the same results as the full rules */
+	static const char *const input =
+		"\xC3\x85ngstr\xC3\xB6m's caf\xC3\xA9""2go na\xC3\xAFve x1y2 "
+		"d\xC3\xA9j\xC3\xA0-vu 3.14 1,000 l'\xC3\xA9t\xC3\xA9 "
+		"qu'aujourd'hui ABC123def \xC3\xB1""and\xC3\xBA stra\xC3\x9F""e "
+		"\xC5\x93uvre \xC2\xBD \xC2\xB5s \xC2\xAA\xC2\xBA "
+		"\xC3\x80\xC3\x97\xC3\x96\xC3\xB7\xC3\xB8 soft\xC2\xADhyphen "
+		"a_b 12_34 longlonglonglonglonglonglonglong\xC3\xA9\xC3\xA9 "
+		"d'abc d'\xC3\xA9t\xC3\xA9 aa'bb 9'9";
+	static const char *const expected_output[] = {
+		"\xC3\x85ngstr\xC3\xB6m's", "caf\xC3\xA9""2go", "na\xC3\xAFve",
+		"x1y2", "d\xC3\xA9j\xC3\xA0", "vu", "3", "14", "1,000",
+		"l'\xC3\xA9t\xC3\xA9", "qu'aujourd'hui", "ABC123def",
+		"\xC3\xB1""and\xC3\xBA", "stra\xC3\x9F""e", "\xC5\x93uvre",
+		"\xC2\xB5s", "\xC2\xAA\xC2\xBA", "\xC3\x80", "\xC3\x96",
+		"\xC3\xB8", "soft\xC2\xADhyphen", "a_b", "12_34",
+		"longlonglonglonglonglonglonglo", "d'abc", "d'\xC3\xA9t\xC3\xA9",
+		"aa'bb", "9", "9", NULL
+	};
+	static const char *const expected_output_wb5a[] = {
+		"\xC3\x85ngstr\xC3\xB6m's", "caf\xC3\xA9""2go", "na\xC3\xAFve",
+		"x1y2", "d\xC3\xA9j\xC3\xA0", "vu", "3", "14", "1,000",
+		"l", "\xC3\xA9t\xC3\xA9", "qu", "aujourd'hui", "ABC123def",
+		"\xC3\xB1""and\xC3\xBA", "stra\xC3\x9F""e", "\xC5\x93uvre",
+		"\xC2\xB5s", "\xC2\xAA\xC2\xBA", "\xC3\x80", "\xC3\x96",
+		"\xC3\xB8", "soft\xC2\xADhyphen", "a_b", "12_34",
+		"longlonglonglonglonglonglonglo", "d", "abc", "d",
+		"\xC3\xA9t\xC3\xA9", "aa'bb", "9", "9", NULL
+	};
+	struct fts_tokenizer *tok;
+	const char *error;
+
+	test_begin("fts tokenizer generic TR29 Latin-1");
+	test_assert(fts_tokenizer_create(fts_tokenizer_generic, NULL, tr29_settings, &tok, &error) == 0);
+	test_tokenizer_inputs(tok, &input, 1, expected_output);
+	fts_tokenizer_unref(&tok);
+
+	test_assert(fts_tokenizer_create(fts_tokenizer_generic, NULL, tr29_settings_wb5a, &tok, &error) == 0);
+	test_tokenizer_inputs(tok, &input, 1, expected_output_wb5a);
+	fts_tokenizer_unref(&tok);
+	test_end();
+}
+
 static void test_fts_tokenizer_address_only(void)
 {
 	static const char input[] = TEST_INPUT_ADDRESS;
@@ -570,6 +616,7 @@ int main(void)
 		test_fts_tokenizer_generic_only,
 		test_fts_tokenizer_generic_tr29_only,
 		test_fts_tokenizer_generic_tr29_wb5a,
+		test_fts_tokenizer_generic_tr29_latin1,
 		test_fts_tokenizer_address_only,
 		test_fts_tokenizer_address_parent_simple,
 		test_fts_tokenizer_address_parent_tr29,
@@ -0,0 +1,146 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "time-util.h"
+#include "imap-seqset.h"
+#include "imap-parser.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+/* Parse typical command lines (after the tag and command name) repeatedly
+   the same way imap does it, with and without the single-pass fast path.
+   The full parser is used when a non-zero argument count is given to
+   imap_parser_read_args(), which returns the same arguments for these lines.
+   When the first argument is a sequence set, it's also looked up the same
+   way as FETCH and STORE do. The last line has [] which the fast path
+   doesn't handle, so it shows the cost of falling back to the full parser.
+   Each measurement is the fastest of a few rounds to reduce noise.
+   Usage: imap-parser-bench [-n <iterations>] */
+
+#define DEFAULT_ITERATIONS 200000
+#define BENCH_ROUNDS 5
+#define BENCH_FULL_PARSER_COUNT 100
+
+static const char *const bench_lines[] = {
+	"1:* (FLAGS)",
+	"1:100 (UID FLAGS RFC822.SIZE INTERNALDATE)",
+	"1,5:10,15,20:30 +FLAGS.SILENT (\\Seen \\Deleted)",
+	"1:5 Trash",
+	"1:* (UID FLAGS BODY.PEEK[HEADER.FIELDS (FROM SUBJECT)])",
+};
+
+/* The parser stops at the end of the line. Skip over it the same way as
+   imap does before the next command. */
+static void bench_skip_line(struct istream *input)
+{
+	const unsigned char *data, *p;
+	size_t size;
+
+	data = i_stream_get_data(input, &size);
+	p = memchr(data, '\n', size);
+	i_assert(p != NULL);
+	i_stream_skip(input, p - data + 1);
+}
+
+static unsigned long long
+bench_parse_round(const char *line, unsigned int count,
+		  unsigned int iterations)
+{
+	struct istream *input;
+	struct imap_parser *parser;
+	const struct imap_arg *args;
+	const char *str;
+	string_t *data;
+	struct timeval tv_start, tv_end;
+	unsigned int i, lines_per_input = 1000;
+
+	data = t_str_new(1024);
+	for (i = 0; i < lines_per_input; i++) {
+		str_append(data, line);
+		str_append(data, "\r\n");
+	}
+	input = i_stream_create_from_data(str_data(data), str_len(data));
+	parser = imap_parser_create(input, NULL, (size_t)-1);
+
+	(void)gettimeofday(&tv_start, NULL);
+	for (i = 0; i < iterations; i++) {
+		if (i % lines_per_input == 0) {
+			i_stream_seek(input, 0);
+			(void)i_stream_read(input);
+		}
+		if (imap_parser_read_args(parser, count, 0, &args) < 0)
+			i_fatal("Couldn't parse: %s", line);
+		if (imap_arg_get_atom(&args[0], &str) &&
+		    imap_parser_get_seqset(parser, str) == NULL) T_BEGIN {
+			ARRAY_TYPE(seq_range) seqset;
+
+			t_array_init(&seqset, 8);
+			(void)imap_seq_set_parse(str, &seqset);
+		} T_END;
+		imap_parser_reset(parser);
+		bench_skip_line(input);
+	}
+	(void)gettimeofday(&tv_end, NULL);
+
+	imap_parser_unref(&parser);
+	i_stream_unref(&input);
+	return timeval_diff_usecs(&tv_end, &tv_start);
+}
+
+/* The parsers are run in turns, so both are equally affected by any
+   changes in the system load. */
+static void
+bench_parse(const char *line, unsigned int iterations,
+	    unsigned long long *full_usecs_r, unsigned long long *fast_usecs_r)
+{
+	unsigned long long usecs;
+	unsigned int i;
+
+	*full_usecs_r = *fast_usecs_r = ULLONG_MAX;
+	for (i = 0; i < BENCH_ROUNDS; i++) {
+		usecs = bench_parse_round(line, BENCH_FULL_PARSER_COUNT,
+					  iterations);
+		*full_usecs_r = I_MIN(*full_usecs_r, usecs);
+		usecs = bench_parse_round(line, 0, iterations);
+		*fast_usecs_r = I_MIN(*fast_usecs_r, usecs);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long full_usecs, fast_usecs;
+	unsigned int i, iterations = DEFAULT_ITERATIONS;
+	int c;
+
+	lib_init();
+	while ((c = getopt(argc, argv, "n:")) > 0) {
+		switch (c) {
+		case 'n':
+			if (str_to_uint(optarg, &iterations) < 0 ||
+			    iterations == 0)
+				i_fatal("Invalid iterations: %s", optarg);
+			break;
+		default:
+			i_fatal("Usage: %s [-n <iterations>]", argv[0]);
+		}
+	}
+
+	printf("%8s %8s %7s  %s\n", "full ns", "fast ns", "speedup", "line");
+	for (i = 0; i < N_ELEMENTS(bench_lines); i++) T_BEGIN {
+		bench_parse(bench_lines[i], iterations,
+			    &full_usecs, &fast_usecs);
+		printf("%8.1f %8.1f %6.2fx  %s\n",
+		       full_usecs * 1000.0 / iterations,
+		       fast_usecs * 1000.0 / iterations,
+		       fast_usecs == 0 ? 0.0 : (double)full_usecs / fast_usecs,
+		       bench_lines[i]);
+	} T_END;
+	lib_deinit();
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include "istream.h"
 #include "ostream.h"
 #include "strescape.h"
+#include "imap-seqset.h"
 #include "imap-parser.h"
 
 /* We use this macro to read atoms from input. It should probably contain
@@ -57,6 +58,11 @@ struct imap_parser {
 	enum imap_parser_error error;
 	const char *error_msg;
 
+	/* The first argument of the line, if it was parsed as a sequence set
+	   already while reading the line. */
+	const char *seqset_str;
+	ARRAY_TYPE(seq_range) seqset;
+
 	bool literal_minus:1;
 	bool literal_skip_crlf:1;
 	bool literal_nonsync:1;
@@ -131,6 +137,7 @@ void imap_parser_reset(struct imap_parser *parser)
 
 	parser->error = IMAP_PARSE_ERROR_NONE;
 	parser->error_msg = NULL;
+	parser->seqset_str = NULL;
 
 	parser->literal_skip_crlf = FALSE;
 	parser->eol = FALSE;
@@ -183,17 +190,22 @@ static struct imap_arg *imap_arg_create(struct imap_parser *parser)
 	return arg;
 }
 
-static void imap_parser_open_list(struct imap_parser *parser)
+static void
+imap_parser_open_list_count(struct imap_parser *parser, unsigned int count)
 {
 	parser->list_arg = imap_arg_create(parser);
 	parser->list_arg->type = IMAP_ARG_LIST;
-	p_array_init(&parser->list_arg->_data.list, parser->pool,
-		     LIST_INIT_COUNT);
+	p_array_init(&parser->list_arg->_data.list, parser->pool, count);
 	parser->cur_list = &parser->list_arg->_data.list;
 
 	parser->cur_type = ARG_PARSE_NONE;
 }
 
+static void imap_parser_open_list(struct imap_parser *parser)
+{
+	imap_parser_open_list_count(parser, LIST_INIT_COUNT);
+}
+
 static bool imap_parser_close_list(struct imap_parser *parser)
 {
 	struct imap_arg *arg;
@@ -775,6 +787,182 @@ static int finish_line(struct imap_parser *parser, unsigned int count,
 	return ret;
 }
 
+/* Returns length of the line if it's fully available in the input buffer and
+   contains only atoms and non-nested lists of atoms, e.g. "1:* (FLAGS)".
+   Returns 0 if the line must be parsed with the full parser. */
+static size_t
+imap_parser_get_simple_line_len(struct imap_parser *parser,
+				const unsigned char *data, size_t data_size,
+				unsigned int *root_count_r)
+{
+	bool in_list = FALSE, in_atom = FALSE;
+	size_t i;
+
+	*root_count_r = 0;
+	for (i = 0; i < data_size; i++) {
+		switch (data[i]) {
+		case ' ':
+			in_atom = FALSE;
+			break;
+		case '(':
+			if (in_list || in_atom)
+				return 0;
+			in_list = TRUE;
+			*root_count_r += 1;
+			break;
+		case ')':
+			if (!in_list)
+				return 0;
+			in_list = in_atom = FALSE;
+			break;
+		case '\r':
+			if (i+1 == data_size || data[i+1] != '\n')
+				return 0;
+			/* fall through */
+		case '\n':
+			if (in_list ||
+			    parser->line_size + i > parser->max_line_size)
+				return 0;
+			return i;
+		case '~':
+			/* might be literal8 */
+			if (!in_atom)
+				return 0;
+			break;
+		default:
+			if (IS_ATOM_PARSER_INPUT(data[i]) ||
+			    (data[i] & 0x80) != 0)
+				return 0;
+			if (!in_atom && !in_list)
+				*root_count_r += 1;
+			in_atom = TRUE;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Returns the number of atoms in the list beginning at data[0]. */
+static unsigned int
+imap_parser_get_simple_list_count(const unsigned char *data, size_t size)
+{
+	unsigned int count = 0;
+	bool in_atom = FALSE;
+	size_t i;
+
+	for (i = 1; i < size && data[i] != ')'; i++) {
+		if (data[i] == ' ')
+			in_atom = FALSE;
+		else if (!in_atom) {
+			in_atom = TRUE;
+			count++;
+		}
+	}
+	return count;
+}
+
+static bool imap_parser_is_seqset(const char *str)
+{
+	for (; *str != '\0'; str++) {
+		if ((*str < '0' || *str > '9') &&
+		    *str != ':' && *str != ',' && *str != '*')
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void imap_parser_read_simple_line(struct imap_parser *parser,
+					 const unsigned char *data,
+					 size_t line_len,
+					 unsigned int root_count)
+{
+	struct imap_arg *arg;
+	char *line;
+	size_t i, start;
+
+	/* The arrays are allocated with their final sizes, and all the atoms
+	   point to a single copy of the line. */
+	if (root_count + 1 > LIST_INIT_COUNT) {
+		p_array_init(&parser->root_list, parser->pool,
+			     root_count + 1);
+	}
+	line = imap_parser_strdup(parser, data, line_len);
+
+	for (i = 0; i < line_len; ) {
+		switch (data[i]) {
+		case ' ':
+			i++;
+			break;
+		case '(':
+			imap_parser_open_list_count(parser,
+				imap_parser_get_simple_list_count(data + i,
+							line_len - i) + 1);
+			i++;
+			break;
+		case ')':
+			(void)imap_parser_close_list(parser);
+			i++;
+			break;
+		default:
+			start = i;
+			while (i < line_len && data[i] != ' ' &&
+			       data[i] != ')')
+				i++;
+			line[i] = '\0';
+
+			arg = imap_arg_create(parser);
+			arg->type = i - start == 3 &&
+				i_memcasecmp(data + start, "NIL", 3) == 0 ?
+				IMAP_ARG_NIL : IMAP_ARG_ATOM;
+			arg->_data.str = line + start;
+			arg->str_len = i - start;
+			if (array_count(&parser->root_list) == 1 &&
+			    parser->list_arg == NULL &&
+			    imap_parser_is_seqset(arg->_data.str)) {
+				/* most likely FETCH, STORE, COPY or similar */
+				p_array_init(&parser->seqset, parser->pool, 8);
+				if (imap_seq_set_parse(arg->_data.str,
+						       &parser->seqset) == 0)
+					parser->seqset_str = arg->_data.str;
+			}
+			break;
+		}
+	}
+	parser->line_size += line_len;
+	i_stream_skip(parser->input, line_len);
+	parser->eol = TRUE;
+}
+
+/* Fast path for the most common commands (e.g. "UID FETCH 1:* (FLAGS)",
+   "NOOP", "IDLE"): if the whole line is already in the input buffer and it
+   contains nothing that needs the parser's state machine, parse it in one
+   pass. Returns FALSE if the full parser must be used. */
+static bool
+imap_parser_try_read_simple_line(struct imap_parser *parser,
+				 unsigned int count)
+{
+	const unsigned char *data;
+	size_t data_size, line_len;
+	unsigned int root_count;
+
+	if (count != 0 || parser->eol || parser->cur_type != ARG_PARSE_NONE ||
+	    parser->cur_pos != 0 || parser->list_arg != NULL ||
+	    array_count(&parser->root_list) > 0 ||
+	    (parser->flags & (IMAP_PARSE_FLAG_INSIDE_LIST |
+			      IMAP_PARSE_FLAG_SERVER_TEXT |
+			      IMAP_PARSE_FLAG_STOP_AT_LIST)) != 0)
+		return FALSE;
+
+	parser->seqset_str = NULL;
+	data = i_stream_get_data(parser->input, &data_size);
+	line_len = imap_parser_get_simple_line_len(parser, data, data_size,
+						   &root_count);
+	if (line_len == 0)
+		return FALSE;
+	imap_parser_read_simple_line(parser, data, line_len, root_count);
+	return TRUE;
+}
+
 int imap_parser_read_args(struct imap_parser *parser, unsigned int count,
 			  enum imap_parser_flags flags,
 			  const struct imap_arg **args_r)
@@ -788,6 +976,9 @@ int imap_parser_read_args(struct imap_parser *parser, unsigned int count,
 		parser->literal_size_return = FALSE;
 	}
 
+	if (imap_parser_try_read_simple_line(parser, count))
+		return finish_line(parser, count, args_r);
+
 	while (!parser->eol && (count == 0 || IS_UNFINISHED(parser) ||
 				array_count(&parser->root_list) < count)) {
 		if (!imap_parser_read_arg(parser))
@@ -924,3 +1115,11 @@ const char *imap_parser_read_word(struct imap_parser *parser)
 		return NULL;
 	}
 }
+
+const ARRAY_TYPE(seq_range) *
+imap_parser_get_seqset(struct imap_parser *parser, const char *str)
+{
+	if (parser->seqset_str == NULL || parser->seqset_str != str)
+		return NULL;
+	return &parser->seqset;
+}
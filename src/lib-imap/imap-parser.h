@@ -1,6 +1,7 @@
 #ifndef IMAP_PARSER_H
 #define IMAP_PARSER_H
 
+#include "seq-range-array.h"
 #include "imap-arg.h"
 
 enum imap_parser_flags {
@@ -102,4 +103,12 @@ int imap_parser_finish_line(struct imap_parser *parser, unsigned int count,
    Returns NULL if more data is needed. */
 const char *imap_parser_read_word(struct imap_parser *parser);
 
+/* Returns the sequence set already parsed from str, or NULL if it wasn't
+   parsed. Only the first argument of a line is parsed, and only when it was
+   read in one go, so this is only an optimization: callers must fall back to
+   imap_seq_set_parse(). str must be the argument string returned by
+   imap_parser_read_args() for the current line. */
+const ARRAY_TYPE(seq_range) *
+imap_parser_get_seqset(struct imap_parser *parser, const char *str);
+
 #endif
@@ -1,6 +1,7 @@
 /* Copyright (c) 2009-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "str.h"
 #include "istream.h"
 #include "imap-parser.h"
 #include "test-common.h"
@@ -51,10 +52,168 @@ static void test_imap_parser_crlf(void)
 	test_end();
 }
 
+static bool test_imap_args_equal(const struct imap_arg *args1,
+				 const struct imap_arg *args2)
+{
+	for (;; args1++, args2++) {
+		if (args1->type != args2->type)
+			return FALSE;
+		switch (args1->type) {
+		case IMAP_ARG_EOL:
+			return TRUE;
+		case IMAP_ARG_LIST:
+			if (!test_imap_args_equal(imap_arg_as_list(args1),
+						  imap_arg_as_list(args2)))
+				return FALSE;
+			break;
+		case IMAP_ARG_NIL:
+		case IMAP_ARG_ATOM:
+			if (strcmp(imap_arg_as_astring(args1),
+				   imap_arg_as_astring(args2)) != 0)
+				return FALSE;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static void test_imap_parser_simple_line(void)
+{
+	static const char *test_inputs[] = {
+		"1:* (FLAGS)\r\n",
+		"1,3:5 (UID FLAGS BODY.PEEK[HEADER.FIELDS (FROM)])\r\n",
+		"  1:*   +FLAGS.SILENT  (\\Seen $Forwarded) \r\n",
+		"1 (FLAGS)(UID)NIL x\n",
+		"1 ()\r\n",
+		"~foo\r\n",
+		"1 \"str\" {3+}\r\nfoo\r\n",
+		"1 (a (b))\r\n",
+		"1 (a\r\n",
+		"1 a)\r\n",
+		"1 a(b\r\n",
+		"1\rx\n",
+	};
+	struct istream *input, *input2;
+	struct imap_parser *parser, *parser2;
+	const struct imap_arg *args, *args2;
+	unsigned int i, j, len;
+	int ret, ret2 = -2;
+
+	test_begin("imap parser simple line");
+	for (i = 0; i < N_ELEMENTS(test_inputs); i++) {
+		/* whole line in the buffer */
+		input = test_istream_create(test_inputs[i]);
+		parser = imap_parser_create(input, NULL, 1024);
+		(void)i_stream_read(input);
+		ret = imap_parser_read_args(parser, 0, 0, &args);
+
+		/* the same line read one byte at a time */
+		input2 = test_istream_create(test_inputs[i]);
+		parser2 = imap_parser_create(input2, NULL, 1024);
+		len = strlen(test_inputs[i]);
+		for (j = 1; j <= len; j++) {
+			test_istream_set_size(input2, j);
+			(void)i_stream_read(input2);
+			ret2 = imap_parser_read_args(parser2, 0, 0, &args2);
+			if (ret2 != -2)
+				break;
+		}
+		test_assert_idx(ret == ret2, i);
+		test_assert_idx(input->v_offset == input2->v_offset, i);
+		if (ret >= 0 && ret == ret2)
+			test_assert_idx(test_imap_args_equal(args, args2), i);
+		else if (ret == -1 && ret == ret2) {
+			test_assert_idx(strcmp(imap_parser_get_error(parser, NULL),
+				imap_parser_get_error(parser2, NULL)) == 0, i);
+		}
+		imap_parser_unref(&parser);
+		imap_parser_unref(&parser2);
+		i_stream_unref(&input);
+		i_stream_unref(&input2);
+	}
+	test_end();
+}
+
+static void test_imap_parser_seqset(void)
+{
+	static const struct {
+		const char *input;
+		const char *seqset;
+	} tests[] = {
+		{ "1:3,5,7:* (FLAGS)\r\n", "1-3,5,7-4294967295" },
+		{ "10:5 +FLAGS (\\Seen)\r\n", "5-10" },
+		{ "1 2\r\n", "1" },
+		/* only the first argument is parsed */
+		{ "(FLAGS) 1:5\r\n", NULL },
+		{ "FLAGS 1:5\r\n", NULL },
+		/* invalid sets are left for imap_seq_set_parse() to fail */
+		{ "0:5 (FLAGS)\r\n", NULL },
+		{ "1:: (FLAGS)\r\n", NULL },
+		/* not a simple line */
+		{ "1:5 \"str\"\r\n", NULL },
+	};
+	struct istream *input;
+	struct imap_parser *parser;
+	const struct imap_arg *args;
+	const ARRAY_TYPE(seq_range) *seqset;
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+	unsigned int i;
+
+	test_begin("imap parser seqset");
+	for (i = 0; i < N_ELEMENTS(tests); i++) {
+		input = test_istream_create(tests[i].input);
+		parser = imap_parser_create(input, NULL, 1024);
+		(void)i_stream_read(input);
+		test_assert_idx(imap_parser_read_args(parser, 0, 0, &args) > 0, i);
+
+		seqset = imap_parser_get_seqset(parser, args[0]._data.str);
+		test_assert_idx((seqset != NULL) == (tests[i].seqset != NULL), i);
+		if (seqset != NULL && tests[i].seqset != NULL) {
+			str_truncate(str, 0);
+			array_foreach(seqset, range) {
+				if (str_len(str) > 0)
+					str_append_c(str, ',');
+				str_printfa(str, "%u", range->seq1);
+				if (range->seq1 != range->seq2)
+					str_printfa(str, "-%u", range->seq2);
+			}
+			test_assert_idx(strcmp(str_c(str), tests[i].seqset) == 0, i);
+		}
+		/* it's returned only for the same argument string */
+		test_assert_idx(imap_parser_get_seqset(parser,
+			t_strdup(args[0]._data.str)) == NULL, i);
+
+		/* and not for the next line */
+		imap_parser_reset(parser);
+		test_assert_idx(imap_parser_get_seqset(parser,
+						       args[0]._data.str) == NULL, i);
+		imap_parser_unref(&parser);
+		i_stream_unref(&input);
+	}
+
+	/* byte-at-a-time input uses the full parser, which doesn't parse it */
+	input = test_istream_create(tests[0].input);
+	parser = imap_parser_create(input, NULL, 1024);
+	for (i = 1; i <= strlen(tests[0].input); i++) {
+		test_istream_set_size(input, i);
+		(void)i_stream_read(input);
+		if (imap_parser_read_args(parser, 0, 0, &args) != -2)
+			break;
+	}
+	test_assert(imap_parser_get_seqset(parser, args[0]._data.str) == NULL);
+	imap_parser_unref(&parser);
+	i_stream_unref(&input);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_imap_parser_crlf,
+		test_imap_parser_simple_line,
+		test_imap_parser_seqset,
 		NULL
 	};
 	return test_run(test_functions);
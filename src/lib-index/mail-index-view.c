@@ -4,8 +4,11 @@
 #include "array.h"
 #include "buffer.h"
 #include "llist.h"
+#include "nfs-workarounds.h"
 #include "mail-index-view-private.h"
-#include "mail-transaction-log.h"
+#include "mail-transaction-log-private.h"
+
+#include <sys/stat.h>
 
 struct mail_index_view *
 mail_index_view_dup_private(const struct mail_index_view *src)
@@ -84,6 +87,28 @@ bool mail_index_view_is_inconsistent(struct mail_index_view *view)
 	return view->inconsistent;
 }
 
+bool mail_index_view_have_log_changes(struct mail_index_view *view)
+{
+	struct mail_transaction_log_file *head = view->index->log->head;
+	struct stat st;
+
+	if (mail_index_view_is_inconsistent(view) || head == NULL)
+		return TRUE;
+	if (view->log_file_head_seq != head->hdr.file_seq ||
+	    view->log_file_head_offset != head->sync_offset)
+		return TRUE;
+	if (MAIL_TRANSACTION_LOG_FILE_IN_MEMORY(head))
+		return FALSE;
+
+	/* anything appended by other processes (or a rotated log) shows up
+	   as a different file size or inode */
+	if (nfs_safe_stat(head->filepath, &st) < 0)
+		return TRUE;
+	return st.st_ino != head->st_ino ||
+		!CMP_DEV_T(st.st_dev, head->st_dev) ||
+		(uoff_t)st.st_size != head->sync_offset;
+}
+
 struct mail_index *mail_index_view_get_index(struct mail_index_view *view)
 {
 	return view->index;
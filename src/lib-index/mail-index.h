@@ -369,6 +369,10 @@ struct mail_index *mail_index_view_get_index(struct mail_index_view *view);
 uint32_t mail_index_view_get_messages_count(struct mail_index_view *view);
 /* Returns TRUE if we lost track of changes for some reason. */
 bool mail_index_view_is_inconsistent(struct mail_index_view *view);
+/* Returns TRUE if the transaction log may contain changes that the view
+   hasn't seen yet. This only stat()s the log file, so it's much cheaper than
+   refreshing the index. */
+bool mail_index_view_have_log_changes(struct mail_index_view *view);
 /* Returns number of transactions open for the view. */
 unsigned int
 mail_index_view_get_transaction_count(struct mail_index_view *view);
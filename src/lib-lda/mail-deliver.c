@@ -13,6 +13,7 @@
 #include "lda-settings.h"
 #include "mail-storage.h"
 #include "mail-namespace.h"
+#include "mail-cache.h"
 #include "mail-storage-private.h"
 #include "mail-duplicate.h"
 #include "mail-deliver.h"
@@ -365,6 +366,50 @@ mail_deliver_open_mail(struct mailbox *box, uint32_t uid,
 	return mail;
 }
 
+static bool mail_deliver_want_body_snippet(struct mailbox *box)
+{
+	struct mailbox_metadata metadata;
+	const struct mailbox_cache_field *field;
+
+	if (mailbox_get_metadata(box, MAILBOX_METADATA_CACHE_FIELDS,
+				 &metadata) < 0)
+		return FALSE;
+	array_foreach(metadata.cache_fields, field) {
+		if (strcmp(field->name, "body.snippet") == 0) {
+			return (field->decision & ~MAIL_CACHE_DECISION_FORCED) !=
+				MAIL_CACHE_DECISION_NO;
+		}
+	}
+	return FALSE;
+}
+
+static void
+mail_deliver_precompute_cache_fields(struct mail_deliver_context *ctx,
+				     struct mailbox *box)
+{
+	struct mail_deliver_session *session = ctx->session;
+	struct timeval start_time;
+	const char *snippet;
+
+	/* The same mail is often delivered to many users. Generate the
+	   expensive cache fields only once for the source mail when the
+	   first destination mailbox wants them, and give them to all the
+	   following saves. */
+	if (session->cache_fields_precomputed ||
+	    !mail_deliver_want_body_snippet(box))
+		return;
+	session->cache_fields_precomputed = TRUE;
+
+	io_loop_time_refresh();
+	start_time = ioloop_timeval;
+	if (mail_get_special(ctx->src_mail, MAIL_FETCH_BODY_SNIPPET,
+			     &snippet) == 0 && snippet[0] != '\0')
+		session->body_snippet = p_strdup(session->pool, snippet);
+	io_loop_time_refresh();
+	ctx->cache_precompute_usecs +=
+		timeval_diff_usecs(&ioloop_timeval, &start_time);
+}
+
 int mail_deliver_save(struct mail_deliver_context *ctx, const char *mailbox,
 		      enum mail_flags flags, const char *const *keywords,
 		      struct mail_storage **storage_r)
@@ -421,6 +466,10 @@ int mail_deliver_save(struct mail_deliver_context *ctx, const char *mailbox,
 	}
 	mailbox_save_set_flags(save_ctx, flags, kw);
 
+	mail_deliver_precompute_cache_fields(ctx, box);
+	if (ctx->session->body_snippet != NULL)
+		mailbox_save_set_body_snippet(save_ctx, ctx->session->body_snippet);
+
 	headers_ctx = mailbox_header_lookup_init(box, lda_log_wanted_headers);
 	dest_mail = mailbox_save_get_dest_mail(save_ctx);
 	mail_add_temp_wanted_fields(dest_mail, lda_log_wanted_fetch_fields, NULL);
@@ -592,7 +641,8 @@ int mail_deliver(struct mail_deliver_context *ctx,
 	ret = mail_do_deliver(ctx, storage_r);
 
 	e = event_create_passthrough(ctx->event)->
-		set_name("mail_delivery_finished");
+		set_name("mail_delivery_finished")->
+		add_int("cache_precompute_usecs", ctx->cache_precompute_usecs);
 	e_debug(e->event(), "Local delivery finished");
 
 	muser->deliver_ctx = NULL;
@@ -18,6 +18,11 @@ struct mail_deliver_session {
 
 	/* List of INBOX GUIDs where this mail has already been saved to */
 	ARRAY(guid_128_t) inbox_guids;
+
+	/* Cacheable fields computed once for the mail and given to each
+	   destination mailbox that wants them cached. */
+	const char *body_snippet;
+	bool cache_fields_precomputed:1;
 };
 
 struct mail_deliver_input {
@@ -73,6 +78,9 @@ struct mail_deliver_context {
 
 	unsigned int session_time_msecs;
 	struct timeval delivery_time_started;
+	/* Time spent by this delivery precomputing the cacheable fields
+	   shared with the other deliveries of the session */
+	unsigned long long cache_precompute_usecs;
 
 	struct mail_duplicate_db *dup_db;
 
@@ -167,7 +167,7 @@ void dbox_notify_changes(struct mailbox *box)
 					&dir) <= 0)
 			return;
 		path = t_strdup_printf("%s/"MAIL_INDEX_PREFIX".log", dir);
-		mailbox_watch_add(box, path);
+		mailbox_watch_add_index_log(box, path);
 	}
 }
 
@@ -3,6 +3,7 @@
 #include "lib.h"
 #include "array.h"
 #include "hash.h"
+#include "bsearch-insert-pos.h"
 #include "ostream.h"
 #include "mkdir-parents.h"
 #include "unlink-old-files.h"
@@ -429,8 +430,45 @@ int mdbox_map_get_file_msgs(struct mdbox_map *map, uint32_t file_id,
 	return 0;
 }
 
+static int
+mdbox_map_zero_ref_file_cmp(const struct mdbox_map_zero_ref_file *f1,
+			    const struct mdbox_map_zero_ref_file *f2)
+{
+	if (f1->file_id < f2->file_id)
+		return -1;
+	if (f1->file_id > f2->file_id)
+		return 1;
+	return 0;
+}
+
+static void
+mdbox_map_zero_ref_file_add(ARRAY_TYPE(mdbox_map_zero_ref_file) *files,
+			    const struct mdbox_map_mail_index_record *rec)
+{
+	struct mdbox_map_zero_ref_file *file, new_file;
+	unsigned int idx, count;
+
+	/* messages in the same file are usually next to each others */
+	file = array_get_modifiable(files, &count);
+	if (count > 0 && file[count-1].file_id == rec->file_id) {
+		file[count-1].zero_ref_size += rec->size;
+		return;
+	}
+
+	i_zero(&new_file);
+	new_file.file_id = rec->file_id;
+	if (array_bsearch_insert_pos(files, &new_file,
+				     mdbox_map_zero_ref_file_cmp, &idx)) {
+		file = array_idx_modifiable(files, idx);
+		file->zero_ref_size += rec->size;
+	} else {
+		new_file.zero_ref_size = rec->size;
+		array_insert(files, idx, &new_file, 1);
+	}
+}
+
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r)
+				 ARRAY_TYPE(mdbox_map_zero_ref_file) *files_r)
 {
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
@@ -461,7 +499,7 @@ int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
 				      &data, &expunged);
 		if (data != NULL && !expunged) {
 			rec = data;
-			seq_range_array_add(file_ids_r, rec->file_id);
+			mdbox_map_zero_ref_file_add(files_r, rec);
 		}
 	}
 	return 0;
@@ -1012,13 +1050,16 @@ mdbox_map_find_appendable_file(struct mdbox_map_append_context *ctx,
 			       struct ostream **output_r)
 {
 	struct mdbox_map *map = ctx->map;
+	struct mdbox_storage *storage = map->storage;
 	ARRAY_TYPE(seq_range) checked_file_ids;
 	const struct mail_index_header *hdr;
 	const struct mdbox_map_mail_index_record *rec;
-	unsigned int backwards_lookup_count;
+	struct mdbox_map_mail_index_record last_rec;
+	unsigned int backwards_lookup_count, locked_count = 0;
 	uint32_t seq, seq1, uid;
 	time_t stamp;
 	bool retry_later;
+	int ret = 0;
 
 	if (mail_size >= map->set->mdbox_rotate_size)
 		return 0;
@@ -1036,9 +1077,34 @@ mdbox_map_find_appendable_file(struct mdbox_map_append_context *ctx,
 			return -1;
 	}
 
+	/* first try the file we appended to the last time. other sessions
+	   are less likely to be appending to it than to the newest file. */
+	if (storage->last_append_file_id != 0 &&
+	    storage->last_append_end_offset + mail_size <
+	    			map->set->mdbox_rotate_size &&
+	    !seq_range_exists(&checked_file_ids,
+			      storage->last_append_file_id) &&
+	    !mdbox_map_is_appending(ctx, storage->last_append_file_id)) {
+		i_zero(&last_rec);
+		last_rec.file_id = storage->last_append_file_id;
+		last_rec.offset = storage->last_append_end_offset;
+		seq_range_array_add(&checked_file_ids, last_rec.file_id);
+
+		if (!mdbox_map_file_try_append(ctx, want_altpath, &last_rec,
+					       stamp, mail_size, file_append_r,
+					       output_r, &retry_later))
+			storage->last_append_file_id = 0;
+		if (*file_append_r != NULL)
+			return 1;
+		if (retry_later)
+			locked_count++;
+	}
+
 	for (seq = hdr->messages_count; seq > 0; seq--) {
-		if (mdbox_map_lookup_seq(map, seq, &rec) < 0)
-			return -1;
+		if (mdbox_map_lookup_seq(map, seq, &rec) < 0) {
+			ret = -1;
+			break;
+		}
 
 		if (seq_range_exists(&checked_file_ids, rec->file_id))
 			continue;
@@ -1070,16 +1136,27 @@ mdbox_map_find_appendable_file(struct mdbox_map_append_context *ctx,
 		}
 		/* NOTE: we've now refreshed map view. there are no guarantees
 		   about sequences anymore. */
-		if (*file_append_r != NULL)
-			return 1;
-		/* FIXME: use retry_later somehow */
+		if (*file_append_r != NULL) {
+			ret = 1;
+			break;
+		}
+		if (retry_later)
+			locked_count++;
 		if (uid == 1 ||
 		    !mail_index_lookup_seq_range(map->view, 1, uid-1,
 						 &seq1, &seq))
 			break;
 		seq++;
 	}
-	return 0;
+	if (locked_count > 0) {
+		e_debug(event_create_passthrough(storage->storage.storage.event)->
+			set_name("mdbox_map_append_files_locked")->
+			add_int("locked_count", locked_count)->
+			add_int("found", ret > 0 ? 1 : 0)->event(),
+			"Skipped %u m.* files locked by other sessions",
+			locked_count);
+	}
+	return ret;
 }
 
 int mdbox_map_append_next(struct mdbox_map_append_context *ctx,
@@ -1411,6 +1488,21 @@ int mdbox_map_append_flush(struct mdbox_map_append_context *ctx)
 	return 0;
 }
 
+static void
+mdbox_map_append_remember_last(struct mdbox_map_append_context *ctx)
+{
+	struct mdbox_storage *storage = ctx->map->storage;
+	const struct mdbox_map_append *last;
+	struct mdbox_file *mfile;
+
+	if (array_count(&ctx->appends) == 0)
+		return;
+	last = array_back(&ctx->appends);
+	mfile = (struct mdbox_file *)last->file_append->file;
+	storage->last_append_file_id = mfile->file_id;
+	storage->last_append_end_offset = last->offset + last->size;
+}
+
 int mdbox_map_append_commit(struct mdbox_map_append_context *ctx)
 {
 	struct dbox_file_append_context **file_appends;
@@ -1418,6 +1510,7 @@ int mdbox_map_append_commit(struct mdbox_map_append_context *ctx)
 
 	i_assert(ctx->trans == NULL);
 
+	mdbox_map_append_remember_last(ctx);
 	file_appends = array_get_modifiable(&ctx->file_appends, &count);
 	for (i = 0; i < count; i++) {
 		if (dbox_file_append_commit(&file_appends[i]) < 0)
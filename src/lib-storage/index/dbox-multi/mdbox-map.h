@@ -30,6 +30,13 @@ struct mdbox_map_file_msg {
 };
 ARRAY_DEFINE_TYPE(mdbox_map_file_msg, struct mdbox_map_file_msg);
 
+struct mdbox_map_zero_ref_file {
+	uint32_t file_id;
+	/* total size of the file's messages with zero refcount */
+	uoff_t zero_ref_size;
+};
+ARRAY_DEFINE_TYPE(mdbox_map_zero_ref_file, struct mdbox_map_zero_ref_file);
+
 struct mdbox_map *
 mdbox_map_init(struct mdbox_storage *storage, struct mailbox_list *root_list);
 void mdbox_map_deinit(struct mdbox_map **map);
@@ -103,9 +110,10 @@ int mdbox_map_update_refcounts(struct mdbox_map_transaction_context *ctx,
 			       const ARRAY_TYPE(uint32_t) *map_uids, int diff);
 int mdbox_map_remove_file_id(struct mdbox_map *map, uint32_t file_id);
 
-/* Return all files containing messages with zero refcount. */
+/* Return all files containing messages with zero refcount, sorted by
+   file_id. */
 int mdbox_map_get_zero_ref_files(struct mdbox_map *map,
-				 ARRAY_TYPE(seq_range) *file_ids_r);
+				 ARRAY_TYPE(mdbox_map_zero_ref_file) *files_r);
 
 struct mdbox_map_append_context *
 mdbox_map_append_begin(struct mdbox_map_atomic_context *atomic);
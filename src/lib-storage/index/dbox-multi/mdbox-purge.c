@@ -6,6 +6,8 @@
 #include "ostream.h"
 #include "str.h"
 #include "hash.h"
+#include "sleep.h"
+#include "time-util.h"
 #include "dbox-attachment.h"
 #include "mdbox-storage.h"
 #include "mdbox-storage-rebuild.h"
@@ -14,6 +16,7 @@
 #include "mdbox-sync.h"
 
 #include <dirent.h>
+#include <sys/time.h>
 
 /*
    Altmoving works like:
@@ -48,6 +51,19 @@ struct mdbox_purge_context {
 
 	struct mdbox_map_atomic_context *atomic;
 	struct mdbox_map_append_context *append_ctx;
+
+	/* mdbox_purge_max_bytes_per_sec throttling, 0 if disabled */
+	uoff_t max_bytes_per_sec;
+	struct timeval throttle_start;
+	uoff_t throttle_bytes;
+	unsigned long long throttle_usecs;
+
+	/* statistics of the file currently being purged */
+	uoff_t file_copied_bytes;
+	unsigned int file_copied_count, file_expunged_count;
+	/* statistics of all the purged files */
+	unsigned int total_files_count;
+	uoff_t total_copied_bytes, total_reclaimed_bytes;
 };
 
 static int mdbox_map_file_msg_offset_cmp(const struct mdbox_map_file_msg *m1,
@@ -234,6 +250,28 @@ mdbox_purge_save_msg(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	return ret;
 }
 
+static void mdbox_purge_throttle(struct mdbox_purge_context *ctx, uoff_t bytes)
+{
+	struct timeval now;
+	long long elapsed_usecs, wanted_usecs;
+
+	if (ctx->max_bytes_per_sec == 0)
+		return;
+
+	/* only the file being purged is locked here, not the map. so
+	   sleeping doesn't block deliveries or other purges. */
+	ctx->throttle_bytes += bytes;
+	if (gettimeofday(&now, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	elapsed_usecs = timeval_diff_usecs(&now, &ctx->throttle_start);
+	wanted_usecs = ctx->throttle_bytes * 1000000ULL /
+		ctx->max_bytes_per_sec;
+	if (wanted_usecs > elapsed_usecs) {
+		i_sleep_usecs(wanted_usecs - elapsed_usecs);
+		ctx->throttle_usecs += wanted_usecs - elapsed_usecs;
+	}
+}
+
 static int
 mdbox_file_purge_check_refcounts(struct mdbox_purge_context *ctx,
 				 const ARRAY_TYPE(mdbox_map_file_msg) *msgs_arr)
@@ -286,6 +324,29 @@ mdbox_purge_attachments(struct mdbox_purge_context *ctx,
 	return ret;
 }
 
+static void
+mdbox_file_purge_finished(struct mdbox_purge_context *ctx, uint32_t file_id,
+			  uoff_t file_size)
+{
+	uoff_t reclaimed_bytes = file_size - ctx->file_copied_bytes;
+
+	ctx->total_files_count++;
+	ctx->total_copied_bytes += ctx->file_copied_bytes;
+	ctx->total_reclaimed_bytes += reclaimed_bytes;
+
+	e_debug(event_create_passthrough(ctx->storage->storage.storage.event)->
+		set_name("mdbox_purge_file_finished")->
+		add_int("file_id", file_id)->
+		add_int("copied_count", ctx->file_copied_count)->
+		add_int("expunged_count", ctx->file_expunged_count)->
+		add_int("copied_bytes", ctx->file_copied_bytes)->
+		add_int("reclaimed_bytes", reclaimed_bytes)->
+		event(), "Purged "MDBOX_MAIL_FILE_FORMAT": "
+		"%u mails copied, %u expunged, %"PRIuUOFF_T" bytes reclaimed",
+		file_id, ctx->file_copied_count, ctx->file_expunged_count,
+		reclaimed_bytes);
+}
+
 static int
 mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		 uint32_t file_id)
@@ -305,6 +366,9 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 	i_assert(ctx->atomic == NULL);
 	i_assert(ctx->append_ctx == NULL);
 
+	ctx->file_copied_bytes = 0;
+	ctx->file_copied_count = ctx->file_expunged_count = 0;
+
 	if ((ret = dbox_file_try_lock(file)) <= 0)
 		return ret;
 
@@ -365,6 +429,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 				break;
 			seq_range_array_add(&expunged_map_uids,
 					    msgs[i].map_uid);
+			ctx->file_expunged_count++;
 		} else {
 			/* non-expunged message. write it to output file. */
 			i_stream_seek(file->input, offset);
@@ -372,6 +437,9 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 			if (ret <= 0)
 				break;
 			array_push_back(&copied_map_uids, &msgs[i].map_uid);
+			ctx->file_copied_bytes += file->input->v_offset - offset;
+			ctx->file_copied_count++;
+			mdbox_purge_throttle(ctx, file->input->v_offset - offset);
 		}
 		offset = file->input->v_offset;
 	}
@@ -425,6 +493,7 @@ mdbox_file_purge(struct mdbox_purge_context *ctx, struct dbox_file *file,
 		(void)dbox_file_unlink(file);
 		if (mdbox_map_remove_file_id(ctx->storage->map, file_id) < 0)
 			ret = -1;
+		mdbox_file_purge_finished(ctx, file_id, st.st_size);
 	} else {
 		dbox_file_unlock(file);
 	}
@@ -473,6 +542,14 @@ mdbox_purge_alloc(struct mdbox_storage *storage)
 	ctx->pool = pool;
 	ctx->storage = storage;
 	ctx->lowest_primary_file_id = (uint32_t)-1;
+	/* throttling sleeps, so it's done only when the caller allows it.
+	   e.g. dsync purges while it has a remote connection to handle. */
+	if (storage->storage.storage.purge_throttle)
+		ctx->max_bytes_per_sec =
+			storage->set->mdbox_purge_max_bytes_per_sec;
+	if (ctx->max_bytes_per_sec > 0 &&
+	    gettimeofday(&ctx->throttle_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 	i_array_init(&ctx->primary_file_ids, 64);
 	i_array_init(&ctx->purge_file_ids, 64);
 	hash_table_create_direct(&ctx->altmoves, pool, 0);
@@ -643,19 +720,71 @@ static int mdbox_altmove_add_files(struct mdbox_purge_context *ctx)
 	return ret;
 }
 
+static int
+mdbox_purge_file_id_cmp(const struct mdbox_map_zero_ref_file *f1,
+			const struct mdbox_map_zero_ref_file *f2)
+{
+	if (f1->file_id < f2->file_id)
+		return -1;
+	if (f1->file_id > f2->file_id)
+		return 1;
+	return 0;
+}
+
+static int
+mdbox_purge_file_order_cmp(const struct mdbox_map_zero_ref_file *f1,
+			   const struct mdbox_map_zero_ref_file *f2)
+{
+	/* most reclaimable bytes first */
+	if (f1->zero_ref_size > f2->zero_ref_size)
+		return -1;
+	if (f1->zero_ref_size < f2->zero_ref_size)
+		return 1;
+	return mdbox_purge_file_id_cmp(f1, f2);
+}
+
+static void
+mdbox_purge_get_file_order(struct mdbox_purge_context *ctx,
+			   ARRAY_TYPE(mdbox_map_zero_ref_file) *zero_ref_files,
+			   ARRAY_TYPE(mdbox_map_zero_ref_file) *files_r)
+{
+	const struct mdbox_map_zero_ref_file *zero_ref_file;
+	struct mdbox_map_zero_ref_file file;
+	struct seq_range_iter iter;
+	unsigned int i = 0;
+
+	i_zero(&file);
+	seq_range_array_iter_init(&iter, &ctx->purge_file_ids);
+	while (seq_range_array_iter_nth(&iter, i++, &file.file_id)) {
+		/* files that are only altmoved have nothing to reclaim */
+		zero_ref_file = array_bsearch(zero_ref_files, &file,
+					      mdbox_purge_file_id_cmp);
+		file.zero_ref_size = zero_ref_file == NULL ? 0 :
+			zero_ref_file->zero_ref_size;
+		array_push_back(files_r, &file);
+	}
+	array_sort(files_r, mdbox_purge_file_order_cmp);
+}
+
 int mdbox_purge(struct mail_storage *_storage)
 {
 	struct mdbox_storage *storage = (struct mdbox_storage *)_storage;
 	struct mdbox_purge_context *ctx;
 	struct dbox_file *file;
-	struct seq_range_iter iter;
-	unsigned int i = 0;
+	ARRAY_TYPE(mdbox_map_zero_ref_file) zero_ref_files, purge_files;
+	const struct mdbox_map_zero_ref_file *zero_ref_file, *purge_file;
+	unsigned int i, count;
 	uint32_t file_id;
 	bool deleted;
 	int ret;
 
 	ctx = mdbox_purge_alloc(storage);
-	ret = mdbox_map_get_zero_ref_files(storage->map, &ctx->purge_file_ids);
+	i_array_init(&zero_ref_files, 64);
+	ret = mdbox_map_get_zero_ref_files(storage->map, &zero_ref_files);
+	array_foreach(&zero_ref_files, zero_ref_file) {
+		seq_range_array_add(&ctx->purge_file_ids,
+				    zero_ref_file->file_id);
+	}
 	if (storage->alt_storage_dir != NULL) {
 		if (mdbox_purge_get_primary_files(ctx) < 0)
 			ret = -1;
@@ -666,9 +795,11 @@ int mdbox_purge(struct mail_storage *_storage)
 		}
 	}
 
-	seq_range_array_iter_init(&iter, &ctx->purge_file_ids); i = 0;
-	while (ret == 0 &&
-	       seq_range_array_iter_nth(&iter, i++, &file_id)) T_BEGIN {
+	i_array_init(&purge_files, array_count(&ctx->purge_file_ids) + 1);
+	mdbox_purge_get_file_order(ctx, &zero_ref_files, &purge_files);
+	purge_file = array_get(&purge_files, &count);
+	for (i = 0; i < count && ret == 0; i++) T_BEGIN {
+		file_id = purge_file[i].file_id;
 		file = mdbox_file_init(storage, file_id);
 		if (dbox_file_open(file, &deleted) > 0 && !deleted) {
 			if (mdbox_file_purge(ctx, file, file_id) < 0)
@@ -679,6 +810,19 @@ int mdbox_purge(struct mail_storage *_storage)
 		}
 		dbox_file_unref(&file);
 	} T_END;
+
+	e_debug(event_create_passthrough(_storage->event)->
+		set_name("mdbox_purge_finished")->
+		add_int("files_count", ctx->total_files_count)->
+		add_int("copied_bytes", ctx->total_copied_bytes)->
+		add_int("reclaimed_bytes", ctx->total_reclaimed_bytes)->
+		add_int("throttle_usecs", ctx->throttle_usecs)->
+		event(), "Purged %u files: %"PRIuUOFF_T" bytes copied, "
+		"%"PRIuUOFF_T" bytes reclaimed, throttled %llu ms",
+		ctx->total_files_count, ctx->total_copied_bytes,
+		ctx->total_reclaimed_bytes, ctx->throttle_usecs/1000);
+	array_free(&purge_files);
+	array_free(&zero_ref_files);
 	mdbox_purge_free(&ctx);
 
 	if (storage->corrupted) {
@@ -36,6 +36,13 @@ struct mdbox_storage {
 	ARRAY_TYPE(uint32_t) move_to_alt_map_uids;
 	ARRAY_TYPE(uint32_t) move_from_alt_map_uids;
 
+	/* The m.* file this storage last appended to and its size after the
+	   append. The next save first tries to append to the same file, so
+	   concurrent sessions tend to keep writing to their own files instead
+	   of all competing for the newest one. */
+	uint32_t last_append_file_id;
+	uint32_t last_append_end_offset;
+
 	/* if non-zero, storage should be rebuilt (except if rebuild_count
 	   has changed from this value) */
 	uint32_t corrupted_rebuild_count;
@@ -6,15 +6,31 @@
 #include "istream.h"
 #include "istream-concat.h"
 #include "istream-header-filter.h"
+#include "ostream.h"
+#include "safe-mkstemp.h"
+#include "unlink-directory.h"
 #include "message-header-parser.h"
 #include "imap-arg.h"
 #include "imap-date.h"
 #include "imap-quote.h"
 #include "imap-bodystructure.h"
 #include "imap-resp-code.h"
+#include "imap-util.h"
 #include "imapc-mail.h"
 #include "imapc-storage.h"
 
+#include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define IMAPC_BODY_CACHE_DIR_NAME "dovecot.imapc-bodies"
+/* When imapc_body_cache_max_size is reached, remove the oldest cached bodies
+   until the cache is this much of the maximum. This way the directory isn't
+   scanned again for each new body. */
+#define IMAPC_BODY_CACHE_EVICT_PERCENTAGE 90
+
 static void imapc_mail_set_failure(struct imapc_mail *mail,
 				   const struct imapc_command_reply *reply)
 {
@@ -140,37 +156,15 @@ headers_merge(pool_t pool, const char *const *h1, const char *const *h2)
 	return array_front(&headers);
 }
 
-static bool
-imapc_mail_try_merge_fetch(struct imapc_mailbox *mbox, string_t *str)
-{
-	const char *s1 = str_c(str);
-	const char *s2 = str_c(mbox->pending_fetch_cmd);
-	const char *p1, *p2;
-
-	i_assert(str_begins(s1, "UID FETCH "));
-	i_assert(str_begins(s2, "UID FETCH "));
-
-	/* skip over UID range */
-	p1 = strchr(s1+10, ' ');
-	p2 = strchr(s2+10, ' ');
-
-	if (null_strcmp(p1, p2) != 0)
-		return FALSE;
-	/* append the new UID to the pending FETCH UID range */
-	str_truncate(str, p1-s1);
-	str_insert(mbox->pending_fetch_cmd, p2-s2, ",");
-	str_insert(mbox->pending_fetch_cmd, p2-s2+1, str_c(str) + 10);
-	return TRUE;
-}
-
 static void
 imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
 {
 	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
 
 	if (mbox->pending_fetch_request != NULL &&
-	    !imapc_mail_try_merge_fetch(mbox, str)) {
-		/* send the previous FETCH and create a new one */
+	    strcmp(str_c(mbox->pending_fetch_cmd), str_c(str)) != 0) {
+		/* different FETCH items - send the previous FETCH and
+		   create a new one */
 		imapc_mail_fetch_flush(mbox);
 	}
 	if (mbox->pending_fetch_request == NULL) {
@@ -178,9 +172,14 @@ imapc_mail_delayed_send_or_merge(struct imapc_mail *mail, string_t *str)
 			i_new(struct imapc_fetch_request, 1);
 		i_array_init(&mbox->pending_fetch_request->mails, 4);
 		i_assert(mbox->pending_fetch_cmd->used == 0);
+		i_assert(array_count(&mbox->pending_fetch_uids) == 0);
 		str_append_str(mbox->pending_fetch_cmd, str);
 	}
 	array_push_back(&mbox->pending_fetch_request->mails, &mail);
+	/* adjacent UIDs are merged into ranges, so prefetching a
+	   contiguous block of mails stays a short "UID FETCH n:m" */
+	seq_range_array_add(&mbox->pending_fetch_uids,
+			    mail->imail.mail.mail.uid);
 
 	if (mbox->to_pending_fetch_send == NULL &&
 	    array_count(&mbox->pending_fetch_request->mails) >
@@ -250,7 +249,7 @@ imapc_mail_send_fetch(struct mail *_mail, enum mail_fetch_field fields,
 		fields |= MAIL_FETCH_STREAM_HEADER;
 
 	str = t_str_new(64);
-	str_printfa(str, "UID FETCH %u (", _mail->uid);
+	str_append_c(str, '(');
 	if ((fields & MAIL_FETCH_RECEIVED_DATE) != 0)
 		str_append(str, "INTERNALDATE ");
 	if ((fields & (MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE)) != 0)
@@ -327,6 +326,298 @@ static void imapc_mail_cache_get(struct imapc_mail *mail,
 	imapc_mail_init_stream(mail);
 }
 
+static const char *
+imapc_mailbox_get_body_cache_dir(struct imapc_mailbox *mbox)
+{
+	const char *index_dir;
+
+	if (!IMAPC_BOX_HAS_FEATURE(mbox, IMAPC_FEATURE_BODY_CACHE))
+		return NULL;
+	if (mailbox_get_path_to(&mbox->box, MAILBOX_LIST_PATH_TYPE_INDEX,
+				&index_dir) <= 0)
+		return NULL;
+	return t_strconcat(index_dir, "/"IMAPC_BODY_CACHE_DIR_NAME, NULL);
+}
+
+static const char *
+imapc_mailbox_get_body_cache_path(struct imapc_mailbox *mbox, uint32_t uid)
+{
+	const char *dir;
+
+	/* the cached bodies are valid only for the current UIDVALIDITY */
+	if (mbox->sync_uid_validity == 0)
+		return NULL;
+	if ((dir = imapc_mailbox_get_body_cache_dir(mbox)) == NULL)
+		return NULL;
+	return t_strdup_printf("%s/%u.%u", dir, mbox->sync_uid_validity, uid);
+}
+
+static void imapc_mail_body_cache_get(struct imapc_mail *mail)
+{
+	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
+	const char *path;
+	int fd;
+
+	if (mail->body_fetched || mail->imail.data.stream != NULL)
+		return;
+
+	path = imapc_mailbox_get_body_cache_path(mbox,
+						 mail->imail.mail.mail.uid);
+	if (path == NULL)
+		return;
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT) {
+			mailbox_set_critical(&mbox->box,
+				"open(%s) failed: %m", path);
+		}
+		return;
+	}
+	i_close_fd(&mail->fd);
+	mail->fd = fd;
+	mail->imail.data.stream = i_stream_create_fd(fd, 0);
+	mail->header_fetched = TRUE;
+	mail->body_fetched = TRUE;
+	imapc_mail_init_stream(mail);
+}
+
+struct imapc_body_cache_file {
+	const char *name;
+	time_t mtime;
+	uoff_t size;
+};
+
+static int
+imapc_body_cache_file_cmp(const struct imapc_body_cache_file *f1,
+			  const struct imapc_body_cache_file *f2)
+{
+	if (f1->mtime < f2->mtime)
+		return -1;
+	if (f1->mtime > f2->mtime)
+		return 1;
+	return strcmp(f1->name, f2->name);
+}
+
+static bool imapc_body_cache_fname_is_valid(const char *fname)
+{
+	/* <uidvalidity>.<uid> - skip temp files */
+	if (!i_isdigit(*fname))
+		return FALSE;
+	while (i_isdigit(*fname)) fname++;
+	if (*fname++ != '.' || !i_isdigit(*fname))
+		return FALSE;
+	while (i_isdigit(*fname)) fname++;
+	return *fname == '\0';
+}
+
+/* Count the size of the cached bodies. If it's above
+   imapc_body_cache_max_size, remove the oldest files until the cache is
+   below IMAPC_BODY_CACHE_EVICT_PERCENTAGE of it. */
+static void
+imapc_mail_body_cache_evict(struct imapc_mailbox *mbox, const char *dir)
+{
+	uoff_t max_size = mbox->storage->set->imapc_body_cache_max_size;
+	ARRAY(struct imapc_body_cache_file) files;
+	struct imapc_body_cache_file *file;
+	struct dirent *d;
+	struct stat st;
+	string_t *path;
+	size_t dir_len;
+	uoff_t total_size = 0;
+	DIR *dirp;
+
+	dirp = opendir(dir);
+	if (dirp == NULL) {
+		if (errno != ENOENT) {
+			mailbox_set_critical(&mbox->box,
+				"opendir(%s) failed: %m", dir);
+		}
+		return;
+	}
+	t_array_init(&files, 64);
+	path = t_str_new(256);
+	str_printfa(path, "%s/", dir);
+	dir_len = str_len(path);
+	errno = 0;
+	while ((d = readdir(dirp)) != NULL) {
+		if (!imapc_body_cache_fname_is_valid(d->d_name))
+			continue;
+		str_truncate(path, dir_len);
+		str_append(path, d->d_name);
+		if (stat(str_c(path), &st) < 0) {
+			if (errno != ENOENT) {
+				mailbox_set_critical(&mbox->box,
+					"stat(%s) failed: %m", str_c(path));
+			}
+			continue;
+		}
+		file = array_append_space(&files);
+		file->name = t_strdup(d->d_name);
+		file->mtime = st.st_mtime;
+		file->size = st.st_size;
+		total_size += st.st_size;
+		errno = 0;
+	}
+	if (errno != 0)
+		mailbox_set_critical(&mbox->box, "readdir(%s) failed: %m", dir);
+	if (closedir(dirp) < 0)
+		mailbox_set_critical(&mbox->box, "closedir(%s) failed: %m", dir);
+
+	if (max_size != 0 && total_size > max_size) {
+		uoff_t target_size =
+			max_size / 100 * IMAPC_BODY_CACHE_EVICT_PERCENTAGE;
+
+		array_sort(&files, imapc_body_cache_file_cmp);
+		array_foreach_modifiable(&files, file) {
+			if (total_size <= target_size)
+				break;
+			str_truncate(path, dir_len);
+			str_append(path, file->name);
+			if (i_unlink_if_exists(str_c(path)) >= 0)
+				total_size -= file->size;
+		}
+	}
+	mbox->body_cache_size = total_size;
+}
+
+static void
+imapc_mail_body_cache_add_size(struct imapc_mailbox *mbox, uoff_t size)
+{
+	uoff_t max_size = mbox->storage->set->imapc_body_cache_max_size;
+
+	if (mbox->body_cache_size != (uoff_t)-1)
+		mbox->body_cache_size += size;
+	if (mbox->body_cache_size == (uoff_t)-1 ||
+	    (max_size != 0 && mbox->body_cache_size > max_size))
+		imapc_mail_body_cache_evict(mbox,
+			imapc_mailbox_get_body_cache_dir(mbox));
+}
+
+static void imapc_mail_body_cache_save(struct imapc_mail *mail)
+{
+	struct imapc_mailbox *mbox = IMAPC_MAILBOX(mail->imail.mail.mail.box);
+	struct istream *input = mail->imail.data.stream;
+	struct ostream *output;
+	const char *path, *dir;
+	string_t *temp_path;
+	uoff_t size = 0;
+	bool failed = FALSE;
+	int fd;
+
+	path = imapc_mailbox_get_body_cache_path(mbox,
+						 mail->imail.mail.mail.uid);
+	if (path == NULL)
+		return;
+
+	temp_path = t_str_new(256);
+	str_append(temp_path, path);
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1 && errno == ENOENT) {
+		dir = imapc_mailbox_get_body_cache_dir(mbox);
+		if (mailbox_mkdir(&mbox->box, dir,
+				  MAILBOX_LIST_PATH_TYPE_INDEX) < 0)
+			return;
+		str_truncate(temp_path, 0);
+		str_append(temp_path, path);
+		fd = safe_mkstemp_hostpid(temp_path, 0600,
+					  (uid_t)-1, (gid_t)-1);
+	}
+	if (fd == -1) {
+		mailbox_set_critical(&mbox->box,
+			"safe_mkstemp(%s) failed: %m", str_c(temp_path));
+		return;
+	}
+
+	output = o_stream_create_fd_file(fd, 0, FALSE);
+	switch (o_stream_send_istream(output, input)) {
+	case OSTREAM_SEND_ISTREAM_RESULT_FINISHED:
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT:
+	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT:
+		i_unreached();
+	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT:
+		mailbox_set_critical(&mbox->box, "read(%s) failed: %s",
+				     i_stream_get_name(input),
+				     i_stream_get_error(input));
+		failed = TRUE;
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT:
+		mailbox_set_critical(&mbox->box, "write(%s) failed: %s",
+				     str_c(temp_path),
+				     o_stream_get_error(output));
+		failed = TRUE;
+		break;
+	}
+	if (!failed && o_stream_finish(output) < 0) {
+		mailbox_set_critical(&mbox->box, "write(%s) failed: %s",
+				     str_c(temp_path),
+				     o_stream_get_error(output));
+		failed = TRUE;
+	}
+	size = output->offset;
+	o_stream_destroy(&output);
+	i_close_fd(&fd);
+
+	if (!failed && rename(str_c(temp_path), path) < 0) {
+		mailbox_set_critical(&mbox->box, "rename(%s, %s) failed: %m",
+				     str_c(temp_path), path);
+		failed = TRUE;
+	}
+	if (failed)
+		i_unlink(str_c(temp_path));
+	else
+		imapc_mail_body_cache_add_size(mbox, size);
+	i_stream_seek(input, 0);
+}
+
+static void
+imapc_mail_body_cache_expunge_path(struct imapc_mailbox *mbox,
+				   const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		if (errno != ENOENT) {
+			mailbox_set_critical(&mbox->box,
+				"stat(%s) failed: %m", path);
+		}
+		return;
+	}
+	if (i_unlink_if_exists(path) > 0 &&
+	    mbox->body_cache_size != (uoff_t)-1) {
+		mbox->body_cache_size -=
+			I_MIN(mbox->body_cache_size, (uoff_t)st.st_size);
+	}
+}
+
+void imapc_mail_body_cache_expunge(struct imapc_mailbox *mbox, uint32_t uid)
+{
+	T_BEGIN {
+		const char *path =
+			imapc_mailbox_get_body_cache_path(mbox, uid);
+
+		if (path != NULL)
+			imapc_mail_body_cache_expunge_path(mbox, path);
+	} T_END;
+}
+
+void imapc_mail_body_cache_reset(struct imapc_mailbox *mbox)
+{
+	T_BEGIN {
+		const char *dir = imapc_mailbox_get_body_cache_dir(mbox);
+		const char *error;
+
+		if (dir != NULL &&
+		    unlink_directory(dir, UNLINK_DIRECTORY_FLAG_RMDIR,
+				     &error) < 0) {
+			mailbox_set_critical(&mbox->box, "%s", error);
+			mbox->body_cache_size = (uoff_t)-1;
+		} else {
+			mbox->body_cache_size = 0;
+		}
+	} T_END;
+}
+
 static enum mail_fetch_field
 imapc_mail_get_wanted_fetch_fields(struct imapc_mail *mail)
 {
@@ -372,6 +663,9 @@ void imapc_mail_try_init_stream_from_cache(struct imapc_mail *mail)
 
 	if (mbox->prev_mail_cache.uid == _mail->uid)
 		imapc_mail_cache_get(mail, &mbox->prev_mail_cache);
+	T_BEGIN {
+		imapc_mail_body_cache_get(mail);
+	} T_END;
 }
 
 bool imapc_mail_prefetch(struct mail *_mail)
@@ -509,11 +803,20 @@ void imapc_mail_fetch_flush(struct imapc_mailbox *mbox)
 	imapc_command_set_flags(cmd, IMAPC_COMMAND_FLAG_RETRIABLE);
 	array_push_back(&mbox->fetch_requests, &mbox->pending_fetch_request);
 
-	imapc_command_send(cmd, str_c(mbox->pending_fetch_cmd));
+	T_BEGIN {
+		string_t *str = t_str_new(128);
+
+		str_append(str, "UID FETCH ");
+		imap_write_seq_range(str, &mbox->pending_fetch_uids);
+		str_append_c(str, ' ');
+		str_append_str(str, mbox->pending_fetch_cmd);
+		imapc_command_send(cmd, str_c(str));
+	} T_END;
 
 	mbox->pending_fetch_request = NULL;
 	timeout_remove(&mbox->to_pending_fetch_send);
 	str_truncate(mbox->pending_fetch_cmd, 0);
+	array_clear(&mbox->pending_fetch_uids);
 }
 
 static bool imapc_find_lfile_arg(const struct imapc_untagged_reply *reply,
@@ -696,6 +999,9 @@ imapc_fetch_stream(struct imapc_mail *mail,
 		i_stream_unref(&inputs[0]);
 		i_stream_unref(&inputs[1]);
 	}
+	if (have_header && have_body) T_BEGIN {
+		imapc_mail_body_cache_save(mail);
+	} T_END;
 
 	imapc_mail_init_stream(mail);
 }
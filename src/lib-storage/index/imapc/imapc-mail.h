@@ -48,4 +48,9 @@ void imapc_mail_fetch_update(struct imapc_mail *mail,
 void imapc_mail_update_access_parts(struct index_mail *mail);
 void imapc_mail_command_flush(struct imapc_mailbox *mbox);
 
+/* Remove the cached body of an expunged mail (imapc_features=body-cache) */
+void imapc_mail_body_cache_expunge(struct imapc_mailbox *mbox, uint32_t uid);
+/* Remove all cached bodies, e.g. after UIDVALIDITY changed */
+void imapc_mail_body_cache_reset(struct imapc_mailbox *mbox);
+
 #endif
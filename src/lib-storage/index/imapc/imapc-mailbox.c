@@ -162,6 +162,7 @@ imapc_mailbox_index_expunge(struct imapc_mailbox *mbox, uint32_t uid)
 {
 	uint32_t lseq;
 
+	imapc_mail_body_cache_expunge(mbox, uid);
 	if (mail_index_lookup_seq(mbox->sync_view, uid, &lseq))
 		mail_index_expunge(mbox->delayed_sync_trans, lseq);
 	else if (mail_index_lookup_seq(mbox->delayed_sync_view, uid, &lseq)) {
@@ -759,6 +760,7 @@ static void imapc_sync_uid_validity(struct imapc_mailbox *mbox)
 		if (hdr->uid_validity != 0) {
 			/* uidvalidity changed, reset the entire mailbox */
 			mail_index_reset(mbox->delayed_sync_trans);
+			imapc_mail_body_cache_reset(mbox);
 			mbox->sync_fetch_first_uid = 1;
 			/* The reset needs to be committed before FETCH 1:*
 			   results are received. */
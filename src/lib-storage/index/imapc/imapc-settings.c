@@ -33,6 +33,7 @@ static const struct setting_define imapc_setting_defines[] = {
 	DEF(SET_UINT, imapc_connection_retry_count),
 	DEF(SET_TIME_MSECS, imapc_connection_retry_interval),
 	DEF(SET_SIZE, imapc_max_line_length),
+	DEF(SET_SIZE, imapc_body_cache_max_size),
 
 	DEF(SET_STR, pop3_deleted_flag),
 
@@ -59,6 +60,7 @@ static const struct imapc_settings imapc_default_settings = {
 	.imapc_connection_retry_count = 1,
 	.imapc_connection_retry_interval = 1000,
 	.imapc_max_line_length = 0,
+	.imapc_body_cache_max_size = 100*1024*1024,
 
 	.pop3_deleted_flag = ""
 };
@@ -105,6 +107,7 @@ static const struct imapc_feature_list imapc_feature_list[] = {
 	{ "send-id", IMAPC_FEATURE_SEND_ID },
 	{ "fetch-empty-is-expunged", IMAPC_FEATURE_FETCH_EMPTY_IS_EXPUNGED },
 	{ "no-msn-updates", IMAPC_FEATURE_NO_MSN_UPDATES },
+	{ "body-cache", IMAPC_FEATURE_BODY_CACHE },
 	{ NULL, 0 }
 };
 
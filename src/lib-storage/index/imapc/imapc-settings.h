@@ -21,6 +21,7 @@ enum imapc_features {
 	IMAPC_FEATURE_SEND_ID			= 0x2000,
 	IMAPC_FEATURE_FETCH_EMPTY_IS_EXPUNGED	= 0x4000,
 	IMAPC_FEATURE_NO_MSN_UPDATES		= 0x8000,
+	IMAPC_FEATURE_BODY_CACHE		= 0x10000,
 };
 /* </settings checks> */
 
@@ -48,6 +49,9 @@ struct imapc_settings {
 	unsigned int imapc_connection_retry_count;
 	unsigned int imapc_connection_retry_interval;
 	uoff_t imapc_max_line_length;
+	/* imapc_features=body-cache: maximum size of the cached bodies in
+	   each mailbox, 0 = unlimited */
+	uoff_t imapc_body_cache_max_size;
 
 	const char *pop3_deleted_flag;
 
@@ -505,6 +505,8 @@ imapc_mailbox_alloc(struct mail_storage *storage, struct mailbox_list *list,
 	p_array_init(&mbox->fetch_requests, pool, 16);
 	p_array_init(&mbox->delayed_expunged_uids, pool, 16);
 	mbox->pending_fetch_cmd = str_new(pool, 128);
+	p_array_init(&mbox->pending_fetch_uids, pool, 16);
+	mbox->body_cache_size = (uoff_t)-1;
 	mbox->prev_mail_cache.fd = -1;
 	imapc_mailbox_register_callbacks(mbox);
 	return &mbox->box;
@@ -103,12 +103,18 @@ struct imapc_mailbox {
 	struct timeout *to_idle_check, *to_idle_delay;
 
 	ARRAY(struct imapc_fetch_request *) fetch_requests;
-	/* if non-empty, contains the latest FETCH command we're going to be
-	   sending soon (but still waiting to see if we can increase its
-	   UID range) */
+	/* if non-empty, contains the FETCH items of the latest FETCH command
+	   we're going to be sending soon (but still waiting to see if we can
+	   increase its UID range) */
 	string_t *pending_fetch_cmd;
+	ARRAY_TYPE(seq_range) pending_fetch_uids;
 	struct imapc_fetch_request *pending_fetch_request;
 	struct timeout *to_pending_fetch_send;
+	/* imapc_features=body-cache: total size of the cached bodies, or
+	   (uoff_t)-1 if it hasn't been counted yet. Other processes may
+	   change the cache too, so this is only an estimate between the
+	   directory scans. */
+	uoff_t body_cache_size;
 
 	ARRAY(struct imapc_mailbox_event_callback) untagged_callbacks;
 	ARRAY(struct imapc_mailbox_event_callback) resp_text_callbacks;
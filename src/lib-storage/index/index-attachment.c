@@ -406,6 +406,7 @@ int index_attachment_stream_get(struct fs *fs, const char *attachment_dir,
 	struct istream_attachment_connector *conn;
 	struct istream *input;
 	struct fs_file *file;
+	enum fs_open_flags open_flags = FS_OPEN_FLAG_SEEKABLE;
 	const char *path;
 	int ret;
 
@@ -419,11 +420,17 @@ int index_attachment_stream_get(struct fs *fs, const char *attachment_dir,
 	}
 	conn = istream_attachment_connector_begin(*stream, full_size);
 
+	/* The attachment streams still behave as blocking streams, but
+	   callers that can handle it (e.g. IMAP FETCH) can make them
+	   non-blocking with i_stream_set_blocking(). */
+	if ((fs_get_properties(fs) & FS_PROPERTY_ASYNC) != 0)
+		open_flags |= FS_OPEN_FLAG_ASYNC;
+
 	array_foreach(&extrefs_arr, extref) {
 		path = t_strdup_printf("%s/%s%s", attachment_dir,
 				       extref->path, path_suffix);
 		file = fs_file_init(fs, path, FS_OPEN_MODE_READONLY |
-				    FS_OPEN_FLAG_SEEKABLE);
+				    open_flags);
 		input = i_stream_create_fs_file(&file, IO_BLOCK_SIZE);
 
 		ret = istream_attachment_connector_add(conn, input,
@@ -2446,6 +2446,14 @@ void index_mail_save_finish(struct mail_save_context *ctx)
 {
 	struct index_mail *imail = INDEX_MAIL(ctx->dest_mail);
 
+	if (ctx->data.body_snippet != NULL &&
+	    imail->data.body_snippet == NULL) {
+		/* the caller already generated the snippet - don't read
+		   through the message again to generate it. */
+		imail->data.body_snippet =
+			p_strdup(imail->mail.data_pool, ctx->data.body_snippet);
+		imail->data.save_body_snippet = FALSE;
+	}
 	index_mail_save_finish_make_snippet(imail);
 
 	if (ctx->data.from_envelope != NULL &&
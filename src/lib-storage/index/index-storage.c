@@ -942,6 +942,7 @@ void index_save_context_free(struct mail_save_context *ctx)
 	i_free_and_null(ctx->data.from_envelope);
 	i_free_and_null(ctx->data.guid);
 	i_free_and_null(ctx->data.pop3_uidl);
+	i_free_and_null(ctx->data.body_snippet);
 	index_attachment_save_free(ctx);
 	i_zero(&ctx->data);
 
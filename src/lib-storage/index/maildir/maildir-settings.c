@@ -16,6 +16,7 @@ static const struct setting_define maildir_setting_defines[] = {
 	DEF(SET_BOOL, maildir_very_dirty_syncs),
 	DEF(SET_BOOL, maildir_broken_filename_sizes),
 	DEF(SET_BOOL, maildir_empty_new),
+	DEF(SET_BOOL, maildir_uidlist_binary),
 
 	SETTING_DEFINE_LIST_END
 };
@@ -24,7 +25,8 @@ static const struct maildir_settings maildir_default_settings = {
 	.maildir_copy_with_hardlinks = TRUE,
 	.maildir_very_dirty_syncs = FALSE,
 	.maildir_broken_filename_sizes = FALSE,
-	.maildir_empty_new = FALSE
+	.maildir_empty_new = FALSE,
+	.maildir_uidlist_binary = FALSE
 };
 
 static const struct setting_parser_info maildir_setting_parser_info = {
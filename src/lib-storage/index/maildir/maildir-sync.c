@@ -176,6 +176,7 @@
 #include "buffer.h"
 #include "hash.h"
 #include "str.h"
+#include "time-util.h"
 #include "eacces-error.h"
 #include "nfs-workarounds.h"
 #include "maildir-storage.h"
@@ -188,6 +189,7 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #define MAILDIR_FILENAME_FLAG_FOUND 128
 
@@ -226,6 +228,9 @@ struct maildir_sync_context {
 	struct maildir_uidlist_sync_ctx *uidlist_sync_ctx;
 	struct maildir_index_sync_context *index_sync_ctx;
 
+	/* number of stat()s done by the current maildir_scan_dir() */
+	unsigned int stat_count;
+
 	bool partial:1;
 	bool locked:1;
 	bool racing:1;
@@ -302,11 +307,14 @@ static int maildir_fix_duplicate(struct maildir_sync_context *ctx,
 	path1 = t_strconcat(dir, "/", fname1, NULL);
 	path2 = t_strconcat(dir, "/", fname2, NULL);
 
-	if (stat(path1, &st1) < 0 || stat(path2, &st2) < 0) {
-		/* most likely the files just don't exist anymore.
-		   don't really care about other errors much. */
+	/* if the files don't exist anymore, it's most likely because of a
+	   race condition. don't really care about other errors much. */
+	ctx->stat_count++;
+	if (stat(path1, &st1) < 0)
+		return 0;
+	ctx->stat_count++;
+	if (stat(path2, &st2) < 0)
 		return 0;
-	}
 	if (st1.st_ino == st2.st_ino &&
 	    CMP_DEV_T(st1.st_dev, st2.st_dev)) {
 		/* Files are the same. this means either a race condition
@@ -408,11 +416,17 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 	struct stat st;
 	enum maildir_uidlist_rec_flag flags;
 	unsigned int time_diff, i, readdir_count = 0, move_count = 0;
+	unsigned int skip_count = 0, dup_count = 0;
+	size_t src_prefix_len, dest_prefix_len;
+	struct timeval tv_start, tv_end;
 	time_t start_time;
 	int ret = 1;
 	bool move_new, dir_changed = FALSE;
 
 	path = new_dir ? ctx->new_dir : ctx->cur_dir;
+	ctx->stat_count = 0;
+	if (gettimeofday(&tv_start, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 	for (i = 0;; i++) {
 		dirp = opendir(path);
 		if (dirp != NULL)
@@ -435,6 +449,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 	}
 
 #ifdef HAVE_DIRFD
+	ctx->stat_count++;
 	if (fstat(dirfd(dirp), &st) < 0) {
 		mailbox_set_critical(&ctx->mbox->box,
 			"fstat(%s) failed: %m", path);
@@ -442,6 +457,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		return -1;
 	}
 #else
+	ctx->stat_count++;
 	if (maildir_stat(ctx->mbox, path, &st) < 0) {
 		(void)closedir(dirp);
 		return -1;
@@ -461,6 +477,10 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 
 	src = t_str_new(1024);
 	dest = t_str_new(1024);
+	str_printfa(src, "%s/", ctx->new_dir);
+	str_printfa(dest, "%s/", ctx->cur_dir);
+	src_prefix_len = str_len(src);
+	dest_prefix_len = str_len(dest);
 
 	move_new = new_dir && ctx->locked &&
 		((ctx->mbox->box.flags & MAILBOX_FLAG_DROP_RECENT) != 0 ||
@@ -470,6 +490,13 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 	for (; (dp = readdir(dirp)) != NULL; errno = 0) {
 		if (dp->d_name[0] == '.')
 			continue;
+#ifdef HAVE_DIRENT_D_TYPE
+		if (dp->d_type == DT_DIR) {
+			/* not a mail. d_type tells this without stat() */
+			skip_count++;
+			continue;
+		}
+#endif
 
 		if (dp->d_name[0] == MAILDIR_INFO_SEP) {
 			/* don't even try to use file with empty base name */
@@ -483,10 +510,10 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		if (move_new) {
 			i_assert(dp->d_name[0] != '\0');
 
-			str_truncate(src, 0);
-			str_truncate(dest, 0);
-			str_printfa(src, "%s/%s", ctx->new_dir, dp->d_name);
-			str_printfa(dest, "%s/%s", ctx->cur_dir, dp->d_name);
+			str_truncate(src, src_prefix_len);
+			str_truncate(dest, dest_prefix_len);
+			str_append(src, dp->d_name);
+			str_append(dest, dp->d_name);
 			if (strchr(dp->d_name, MAILDIR_INFO_SEP) == NULL) {
 				str_append(dest, MAILDIR_FLAGS_FULL_SEP);
 			}
@@ -531,6 +558,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 				break;
 
 			/* possibly duplicate - try fixing it */
+			dup_count++;
 			T_BEGIN {
 				ret = maildir_fix_duplicate(ctx, path,
 							    dp->d_name);
@@ -564,6 +592,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 		/* save the exact new times. the new mtimes should be >=
 		   "start_time", but just in case something weird happens and
 		   mtime doesn't update, use "start_time". */
+		ctx->stat_count++;
 		if (stat(ctx->new_dir, &st) == 0) {
 			ctx->mbox->maildir_hdr.new_check_time =
 				I_MAX(st.st_mtime, start_time);
@@ -571,6 +600,7 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 			ctx->mbox->maildir_hdr.new_mtime_nsecs =
 				ST_MTIME_NSEC(st);
 		}
+		ctx->stat_count++;
 		if (stat(ctx->cur_dir, &st) == 0) {
 			ctx->mbox->maildir_hdr.new_check_time =
 				I_MAX(st.st_mtime, start_time);
@@ -579,6 +609,24 @@ maildir_scan_dir(struct maildir_sync_context *ctx, bool new_dir, bool final,
 				ST_MTIME_NSEC(st);
 		}
 	}
+	if (gettimeofday(&tv_end, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	e_debug(event_create_passthrough(ctx->mbox->box.event)->
+		set_name("maildir_dir_scanned")->
+		add_str("dir", new_dir ? "new" : "cur")->
+		add_int("readdir_count", readdir_count)->
+		add_int("rename_count", move_count)->
+		add_int("stat_count", ctx->stat_count)->
+		add_int("skip_count", skip_count)->
+		add_int("duplicate_count", dup_count)->
+		add_int("why", why)->
+		add_int("duration_usecs",
+			timeval_diff_usecs(&tv_end, &tv_start))->
+		event(), "Scanned %s: %u readdir()s, %u rename()s, "
+		"%u stat()s, %u skipped, %u duplicates",
+		path, readdir_count, move_count, ctx->stat_count,
+		skip_count, dup_count);
+
 	time_diff = time(NULL) - start_time;
 	if (time_diff >= MAILDIR_SYNC_TIME_WARN_SECS) {
 		i_warning("Maildir: Scanning %s took %u seconds "
@@ -22,10 +22,27 @@
    entry: <uid> [<key><value> ...] :<filename>
 
    See enum maildir_uidlist_*_ext_key for used keys.
+
+   --
+
+   Version 4 format is an optional binary format, written only when
+   maildir_uidlist_binary=yes. The header line is the same as in version 3,
+   followed by:
+
+   4 byte big-endian: record count
+   4 byte big-endian: names size
+   record count x (4 byte big-endian each: uid, name offset,
+                   extensions offset or (uint32_t)-1)
+   names: <filename>\0 and <extensions>\0\0 strings
+
+   Records are sorted by UID. Records appended later are written after the
+   binary part as version 3 entry lines, until the file is compacted.
 */
 
 #include "lib.h"
 #include "array.h"
+#include "buffer.h"
+#include "byteorder.h"
 #include "hash.h"
 #include "istream.h"
 #include "ostream.h"
@@ -45,8 +62,19 @@
 #define UIDLIST_ESTALE_RETRY_COUNT NFS_ESTALE_RETRY_COUNT
 
 #define UIDLIST_VERSION 3
+#define UIDLIST_VERSION_BINARY 4
 #define UIDLIST_COMPRESS_PERCENTAGE 75
 
+/* Size of the counts following the header line in the binary format */
+#define UIDLIST_BINARY_HDR_SIZE (4*2)
+/* Size of a record in the binary format */
+#define UIDLIST_BINARY_REC_SIZE (4*3)
+#define UIDLIST_BINARY_NO_EXTENSIONS ((uint32_t)-1)
+/* Compact the binary file once the appended text lines reach this
+   percentage of the records (and at least the minimum count) */
+#define UIDLIST_BINARY_TAIL_COMPACT_PERCENTAGE 10
+#define UIDLIST_BINARY_TAIL_COMPACT_MIN_COUNT 100
+
 #define UIDLIST_IS_LOCKED(uidlist) \
 	((uidlist)->lock_count > 0)
 
@@ -81,10 +109,18 @@ struct maildir_uidlist {
 	HASH_TABLE_TYPE(path_to_maildir_uidlist_rec) files;
 	unsigned int change_counter;
 
-	unsigned int version;
+	/* version of the currently read file and the version that is
+	   wanted for new files */
+	unsigned int version, write_version;
 	unsigned int uid_validity, next_uid, prev_read_uid, last_seen_uid;
 	unsigned int hdr_next_uid;
 	unsigned int read_records_count, read_line_count;
+	/* number of binary records and text lines read from the file. Error
+	   messages use this instead of read_line_count for version 4 files,
+	   since the binary part has no lines. */
+	unsigned int read_file_record_count;
+	/* number of text records after the binary part */
+	unsigned int binary_tail_count;
 	uoff_t last_read_offset;
 	string_t *hdr_extensions;
 
@@ -274,6 +310,8 @@ struct maildir_uidlist *maildir_uidlist_init(struct maildir_mailbox *mbox)
 			  maildir_filename_base_hash,
 			  maildir_filename_base_cmp);
 	uidlist->next_uid = 1;
+	uidlist->write_version = mbox->storage->set->maildir_uidlist_binary ?
+		UIDLIST_VERSION_BINARY : UIDLIST_VERSION;
 	uidlist->hdr_extensions = str_new(default_pool, 128);
 
 	uidlist->dotlock_settings.use_io_notify = TRUE;
@@ -304,6 +342,7 @@ static void maildir_uidlist_close(struct maildir_uidlist *uidlist)
 	}
 	uidlist->last_read_offset = 0;
 	uidlist->read_line_count = 0;
+	uidlist->read_file_record_count = 0;
 }
 
 static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
@@ -312,6 +351,7 @@ static void maildir_uidlist_reset(struct maildir_uidlist *uidlist)
 	uidlist->last_seen_uid = 0;
 	uidlist->initial_hdr_read = FALSE;
 	uidlist->read_records_count = 0;
+	uidlist->binary_tail_count = 0;
 
 	hash_table_clear(uidlist->files, FALSE);
 	array_clear(&uidlist->records);
@@ -343,6 +383,16 @@ static int maildir_uid_cmp(struct maildir_uidlist_rec *const *rec1,
 		(*rec1)->uid > (*rec2)->uid ? 1 : 0;
 }
 
+static const char *
+maildir_uidlist_get_read_pos(struct maildir_uidlist *uidlist)
+{
+	if (uidlist->version != UIDLIST_VERSION_BINARY)
+		return t_strdup_printf("line %u", uidlist->read_line_count);
+	if (uidlist->read_file_record_count == 0)
+		return "header";
+	return t_strdup_printf("record %u", uidlist->read_file_record_count);
+}
+
 static void ATTR_FORMAT(2, 3)
 maildir_uidlist_set_corrupted(struct maildir_uidlist *uidlist,
 			      const char *fmt, ...)
@@ -353,12 +403,12 @@ maildir_uidlist_set_corrupted(struct maildir_uidlist *uidlist,
 	if (uidlist->retry_rewind) {
 		mailbox_set_critical(uidlist->box,
 			"Broken or unexpectedly changed file %s "
-			"line %u: %s - re-reading from beginning",
-			uidlist->path, uidlist->read_line_count,
+			"%s: %s - re-reading from beginning",
+			uidlist->path, maildir_uidlist_get_read_pos(uidlist),
 			t_strdup_vprintf(fmt, args));
 	} else {
-		mailbox_set_critical(uidlist->box, "Broken file %s line %u: %s",
-			uidlist->path, uidlist->read_line_count,
+		mailbox_set_critical(uidlist->box, "Broken file %s %s: %s",
+			uidlist->path, maildir_uidlist_get_read_pos(uidlist),
 			t_strdup_vprintf(fmt, args));
 	}
 	va_end(args);
@@ -369,7 +419,7 @@ static void maildir_uidlist_update_hdr(struct maildir_uidlist *uidlist,
 {
 	struct maildir_index_header *mhdr = uidlist->mhdr;
 
-	if (mhdr->uidlist_mtime == 0 && uidlist->version != UIDLIST_VERSION) {
+	if (mhdr->uidlist_mtime == 0 && uidlist->version < UIDLIST_VERSION) {
 		/* upgrading from older version. don't update the
 		   uidlist times until it uses the new format */
 		uidlist->recreate = TRUE;
@@ -444,41 +494,25 @@ maildir_uidlist_read_extended(struct maildir_uidlist *uidlist,
 	return TRUE;
 }
 
-static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
-				 const char *line)
+static int
+maildir_uidlist_read_uid(struct maildir_uidlist *uidlist, uint32_t uid)
 {
-	struct maildir_uidlist_rec *rec, *old_rec, *const *recs;
-	unsigned int count;
-	uint32_t uid;
-
-	uid = 0;
-	while (*line >= '0' && *line <= '9') {
-		uid = uid*10 + (*line - '0');
-		line++;
-	}
-
-	if (uid == 0 || *line != ' ') {
-		/* invalid file */
-		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
-					      line);
-		return FALSE;
-	}
 	if (uid <= uidlist->prev_read_uid) {
 		maildir_uidlist_set_corrupted(uidlist, 
 					      "UIDs not ordered (%u >= %u)",
 					      uid, uidlist->prev_read_uid);
-		return FALSE;
+		return -1;
 	}
 	if (uid >= (uint32_t)-1) {
 		maildir_uidlist_set_corrupted(uidlist,
 					      "UID too high (%u)", uid);
-		return FALSE;
+		return -1;
 	}
 	uidlist->prev_read_uid = uid;
 
 	if (uid <= uidlist->last_seen_uid) {
 		/* we already have this */
-		return TRUE;
+		return 0;
 	}
         uidlist->last_seen_uid = uid;
 
@@ -486,38 +520,27 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		maildir_uidlist_set_corrupted(uidlist, 
 			"UID larger than next_uid (%u >= %u)",
 			uid, uidlist->next_uid);
-		return FALSE;
+		return -1;
 	}
+	return 1;
+}
 
-	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
-	rec->uid = uid;
-	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
-
-	while (*line == ' ') line++;
-
-	if (uidlist->version == UIDLIST_VERSION) {
-		/* read extended fields */
-		bool ret;
-
-		T_BEGIN {
-			ret = maildir_uidlist_read_extended(uidlist, &line,
-							    rec);
-		} T_END;
-		if (!ret) {
-			maildir_uidlist_set_corrupted(uidlist, 
-				"Invalid extended fields: %s", line);
-			return FALSE;
-		}
-	}
+static bool
+maildir_uidlist_add_read_rec(struct maildir_uidlist *uidlist,
+			     struct maildir_uidlist_rec *rec,
+			     const char *filename)
+{
+	struct maildir_uidlist_rec *old_rec, *const *recs;
+	unsigned int count;
+	uint32_t uid = rec->uid;
 
-	if (strchr(line, '/') != NULL) {
-		maildir_uidlist_set_corrupted(uidlist, 
-			"%s: Broken filename at line %u: %s",
-			uidlist->path, uidlist->read_line_count, line);
+	if (strchr(filename, '/') != NULL) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Broken filename: %s", filename);
 		return FALSE;
 	}
 
-	old_rec = hash_table_lookup(uidlist->files, line);
+	old_rec = hash_table_lookup(uidlist->files, filename);
 	if (old_rec == NULL) {
 		/* no conflicts */
 	} else if (old_rec->uid == uid) {
@@ -539,9 +562,10 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 	} else {
 		/* This can happen if expunged file is moved back and the file
 		   was appended to uidlist. */
-		i_warning("%s: Duplicate file entry at line %u: "
+		i_warning("%s: Duplicate file entry at %s: "
 			  "%s (uid %u -> %u)%s",
-			  uidlist->path, uidlist->read_line_count, line,
+			  uidlist->path, maildir_uidlist_get_read_pos(uidlist),
+			  filename,
 			  old_rec->uid, uid, uidlist->retry_rewind ?
 			  " - retrying by re-reading from beginning" : "");
 		if (uidlist->retry_rewind)
@@ -561,12 +585,183 @@ static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
 		uidlist->unsorted = TRUE;
 	}
 
-	rec->filename = p_strdup(uidlist->record_pool, line);
+	/* the binary format has already allocated the filename */
+	if (rec->filename == NULL)
+		rec->filename = p_strdup(uidlist->record_pool, filename);
 	hash_table_update(uidlist->files, rec->filename, rec);
 	array_push_back(&uidlist->records, &rec);
 	return TRUE;
 }
 
+static bool maildir_uidlist_next(struct maildir_uidlist *uidlist,
+				 const char *line)
+{
+	struct maildir_uidlist_rec *rec;
+	uint32_t uid;
+	int ret;
+
+	uid = 0;
+	while (*line >= '0' && *line <= '9') {
+		uid = uid*10 + (*line - '0');
+		line++;
+	}
+
+	if (uid == 0 || *line != ' ') {
+		/* invalid file */
+		maildir_uidlist_set_corrupted(uidlist, "Invalid data: %s",
+					      line);
+		return FALSE;
+	}
+	if ((ret = maildir_uidlist_read_uid(uidlist, uid)) <= 0)
+		return ret == 0;
+
+	rec = p_new(uidlist->record_pool, struct maildir_uidlist_rec, 1);
+	rec->uid = uid;
+	rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+
+	while (*line == ' ') line++;
+
+	if (uidlist->version >= UIDLIST_VERSION) {
+		/* read extended fields */
+		bool ret;
+
+		T_BEGIN {
+			ret = maildir_uidlist_read_extended(uidlist, &line,
+							    rec);
+		} T_END;
+		if (!ret) {
+			maildir_uidlist_set_corrupted(uidlist, 
+				"Invalid extended fields: %s", line);
+			return FALSE;
+		}
+	}
+	return maildir_uidlist_add_read_rec(uidlist, rec, line);
+}
+
+static int
+maildir_uidlist_read_binary_data(struct maildir_uidlist *uidlist,
+				 struct istream *input, size_t size,
+				 const unsigned char **data_r)
+{
+	size_t data_size;
+	int ret;
+
+	ret = i_stream_read_bytes(input, data_r, &data_size, size);
+	if (ret > 0)
+		return 1;
+	if (input->stream_errno != 0)
+		return -1;
+	maildir_uidlist_set_corrupted(uidlist, "Truncated binary data");
+	return 0;
+}
+
+static bool
+maildir_uidlist_binary_ext_is_valid(const char *names, uint32_t names_size,
+				    uint32_t ext_offset)
+{
+	const char *p = names + ext_offset, *end = names + names_size;
+
+	if (ext_offset >= names_size)
+		return FALSE;
+	while (*p != '\0') {
+		if (!MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p))
+			return FALSE;
+		/* names always end with NUL, so strlen() stays within them */
+		p += strlen(p) + 1;
+		if (p >= end)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int maildir_uidlist_read_binary(struct maildir_uidlist *uidlist,
+				       struct istream *input)
+{
+	struct maildir_uidlist_rec *recs, *rec;
+	const unsigned char *data;
+	char *names;
+	uint32_t i, count, names_size, uid, name_offset, ext_offset;
+	size_t recs_size;
+	int ret;
+
+	uidlist->binary_tail_count = 0;
+
+	ret = maildir_uidlist_read_binary_data(uidlist, input,
+					       UIDLIST_BINARY_HDR_SIZE, &data);
+	if (ret <= 0)
+		return ret;
+	count = be32_to_cpu_unaligned(data);
+	names_size = be32_to_cpu_unaligned(data + 4);
+	i_stream_skip(input, UIDLIST_BINARY_HDR_SIZE);
+
+	if (count > (SSIZE_T_MAX - names_size) / UIDLIST_BINARY_REC_SIZE ||
+	    (count > 0 && names_size == 0)) {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Invalid binary header (count=%u, names_size=%u)",
+			count, names_size);
+		return 0;
+	}
+	if (count == 0)
+		return 1;
+
+	recs_size = (size_t)count * UIDLIST_BINARY_REC_SIZE;
+	ret = maildir_uidlist_read_binary_data(uidlist, input,
+					       recs_size + names_size, &data);
+	if (ret <= 0)
+		return ret;
+	if (data[recs_size + names_size - 1] != '\0') {
+		maildir_uidlist_set_corrupted(uidlist,
+			"Binary names don't end with NUL");
+		return 0;
+	}
+
+	/* allocate all the records and names at once */
+	names = p_malloc(uidlist->record_pool, names_size);
+	memcpy(names, data + recs_size, names_size);
+	recs = p_new(uidlist->record_pool, struct maildir_uidlist_rec, count);
+
+	for (i = 0; i < count; i++, data += UIDLIST_BINARY_REC_SIZE) {
+		uid = be32_to_cpu_unaligned(data);
+		name_offset = be32_to_cpu_unaligned(data + 4);
+		ext_offset = be32_to_cpu_unaligned(data + 8);
+		uidlist->read_records_count++;
+		uidlist->read_file_record_count++;
+
+		if (uid == 0 || name_offset >= names_size ||
+		    names[name_offset] == '\0') {
+			maildir_uidlist_set_corrupted(uidlist,
+				"Invalid binary record (uid=%u)", uid);
+			return 0;
+		}
+		if ((ret = maildir_uidlist_read_uid(uidlist, uid)) < 0)
+			return 0;
+		if (ret == 0)
+			continue;
+
+		rec = &recs[i];
+		rec->uid = uid;
+		rec->flags = MAILDIR_UIDLIST_REC_FLAG_NONSYNCED;
+		rec->filename = names + name_offset;
+		if (ext_offset != UIDLIST_BINARY_NO_EXTENSIONS) {
+			if (!maildir_uidlist_binary_ext_is_valid(names,
+					names_size, ext_offset)) {
+				maildir_uidlist_set_corrupted(uidlist,
+					"Invalid binary extensions for uid %u",
+					uid);
+				return 0;
+			}
+			if (names[ext_offset] != '\0') {
+				rec->extensions =
+					(unsigned char *)names + ext_offset;
+			}
+		}
+		if (!maildir_uidlist_add_read_rec(uidlist, rec, rec->filename))
+			return 0;
+	}
+	i_stream_skip(input, recs_size + names_size);
+	return 1;
+}
+
 static int
 maildir_uidlist_read_v3_header(struct maildir_uidlist *uidlist,
 			       const char *line,
@@ -634,6 +829,7 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
                 return input->stream_errno == 0 ? 0 : -1;
 	}
 	uidlist->read_line_count = 1;
+	uidlist->read_file_record_count = 0;
 
 	if (*line < '0' || *line > '9' || line[1] != ' ') {
 		maildir_uidlist_set_corrupted(uidlist,
@@ -653,6 +849,7 @@ static int maildir_uidlist_read_header(struct maildir_uidlist *uidlist,
 		}
 		break;
 	case UIDLIST_VERSION:
+	case UIDLIST_VERSION_BINARY:
 		T_BEGIN {
 			ret = maildir_uidlist_read_v3_header(uidlist, line,
 							     &uid_validity,
@@ -773,9 +970,16 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
 		uidlist->retry_rewind = last_read_offset != 0 && try_retry;
 
 		ret = 1;
-		while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (last_read_offset == 0 &&
+		    uidlist->version == UIDLIST_VERSION_BINARY)
+			ret = maildir_uidlist_read_binary(uidlist, input);
+		while (ret > 0 &&
+		       (line = i_stream_read_next_line(input)) != NULL) {
 			uidlist->read_records_count++;
 			uidlist->read_line_count++;
+			uidlist->read_file_record_count++;
+			if (uidlist->version == UIDLIST_VERSION_BINARY)
+				uidlist->binary_tail_count++;
 			if (!maildir_uidlist_next(uidlist, line)) {
 				if (!uidlist->retry_rewind)
 					ret = 0;
@@ -816,6 +1020,11 @@ maildir_uidlist_update_read(struct maildir_uidlist *uidlist,
                 /* success */
 		if (readonly)
 			uidlist->recreate_on_change = TRUE;
+		else if (uidlist->version >= UIDLIST_VERSION &&
+			 uidlist->version != uidlist->write_version) {
+			/* maildir_uidlist_binary setting was changed */
+			uidlist->recreate = TRUE;
+		}
 		uidlist->fd = fd;
 		uidlist->fd_dev = st.st_dev;
 		uidlist->fd_ino = st.st_ino;
@@ -1234,6 +1443,67 @@ maildir_uidlist_generate_uid_validity(struct maildir_uidlist *uidlist)
 		maildir_get_uidvalidity_next(uidlist->box->list);
 }
 
+static void
+maildir_uidlist_write_binary(struct maildir_uidlist *uidlist,
+			     struct ostream *output)
+{
+	struct maildir_uidlist_iter_ctx *iter;
+	struct maildir_uidlist_rec *rec;
+	buffer_t *recs, *names;
+	unsigned char hdr[UIDLIST_BINARY_HDR_SIZE];
+	unsigned char recbuf[UIDLIST_BINARY_REC_SIZE];
+	const unsigned char *p;
+	const char *strp;
+	uint32_t count = 0, ext_offset;
+
+	recs = buffer_create_dynamic(default_pool,
+		array_count(&uidlist->records) * UIDLIST_BINARY_REC_SIZE + 1);
+	names = buffer_create_dynamic(default_pool,
+		array_count(&uidlist->records) * 64 + 1);
+
+	iter = maildir_uidlist_iter_init(uidlist);
+	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
+		uidlist->read_records_count++;
+		cpu32_to_be_unaligned(rec->uid, recbuf);
+		cpu32_to_be_unaligned(names->used, recbuf + 4);
+
+		strp = strchr(rec->filename, *MAILDIR_INFO_SEP_S);
+		if (strp == NULL)
+			buffer_append(names, rec->filename,
+				      strlen(rec->filename) + 1);
+		else {
+			buffer_append(names, rec->filename,
+				      strp - rec->filename);
+			buffer_append_c(names, '\0');
+		}
+
+		if (rec->extensions == NULL)
+			ext_offset = UIDLIST_BINARY_NO_EXTENSIONS;
+		else {
+			ext_offset = names->used;
+			for (p = rec->extensions; *p != '\0'; ) {
+				i_assert(MAILDIR_UIDLIST_REC_EXT_KEY_IS_VALID(*p));
+				p += strlen((const char *)p) + 1;
+			}
+			buffer_append(names, rec->extensions,
+				      p - rec->extensions + 1);
+		}
+		cpu32_to_be_unaligned(ext_offset, recbuf + 8);
+		buffer_append(recs, recbuf, sizeof(recbuf));
+		count++;
+	}
+	maildir_uidlist_iter_deinit(&iter);
+
+	cpu32_to_be_unaligned(count, hdr);
+	cpu32_to_be_unaligned(names->used, hdr + 4);
+	o_stream_nsend(output, hdr, sizeof(hdr));
+	o_stream_nsend(output, recs->data, recs->used);
+	o_stream_nsend(output, names->data, names->used);
+	buffer_free(&recs);
+	buffer_free(&names);
+	uidlist->binary_tail_count = 0;
+}
+
 static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 				    const char *path, unsigned int first_idx,
 				    uoff_t *file_size_r)
@@ -1255,7 +1525,7 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 
 	if (output->offset == 0) {
 		i_assert(first_idx == 0);
-		uidlist->version = UIDLIST_VERSION;
+		uidlist->version = uidlist->write_version;
 
 		if (uidlist->uid_validity == 0)
 			maildir_uidlist_generate_uid_validity(uidlist);
@@ -1276,6 +1546,11 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 		}
 		str_append_c(str, '\n');
 		o_stream_nsend(output, str_data(str), str_len(str));
+		if (uidlist->version == UIDLIST_VERSION_BINARY) {
+			/* all the records were written */
+			maildir_uidlist_write_binary(uidlist, output);
+			first_idx = array_count(&uidlist->records);
+		}
 	}
 
 	iter = maildir_uidlist_iter_init(uidlist);
@@ -1284,6 +1559,8 @@ static int maildir_uidlist_write_fd(struct maildir_uidlist *uidlist, int fd,
 
 	while (maildir_uidlist_iter_next_rec(iter, &rec)) {
 		uidlist->read_records_count++;
+		if (uidlist->version == UIDLIST_VERSION_BINARY)
+			uidlist->binary_tail_count++;
 		str_truncate(str, 0);
 		str_printfa(str, "%u", rec->uid);
 		if (rec->extensions != NULL) {
@@ -1493,12 +1770,20 @@ int maildir_uidlist_update(struct maildir_uidlist *uidlist)
 
 static bool maildir_uidlist_want_compress(struct maildir_uidlist_sync_ctx *ctx)
 {
-	unsigned int min_rewrite_count;
+	unsigned int min_rewrite_count, tail_count;
 
 	if (!ctx->uidlist->locked_refresh)
 		return FALSE;
 	if (ctx->uidlist->recreate)
 		return TRUE;
+	if (ctx->uidlist->version == UIDLIST_VERSION_BINARY) {
+		tail_count = ctx->uidlist->binary_tail_count +
+			ctx->new_files_count;
+		if (tail_count >= UIDLIST_BINARY_TAIL_COMPACT_MIN_COUNT &&
+		    tail_count * 100 / UIDLIST_BINARY_TAIL_COMPACT_PERCENTAGE >=
+		    array_count(&ctx->uidlist->records))
+			return TRUE;
+	}
 
 	min_rewrite_count =
 		(ctx->uidlist->read_records_count + ctx->new_files_count) *
@@ -1515,7 +1800,7 @@ static bool maildir_uidlist_want_recreate(struct maildir_uidlist_sync_ctx *ctx)
 
 	if (ctx->finish_change_counter != uidlist->change_counter)
 		return TRUE;
-	if (uidlist->fd == -1 || uidlist->version != UIDLIST_VERSION ||
+	if (uidlist->fd == -1 || uidlist->version != uidlist->write_version ||
 	    !uidlist->have_mailbox_guid)
 		return TRUE;
 	return maildir_uidlist_want_compress(ctx);
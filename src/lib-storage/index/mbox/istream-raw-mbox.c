@@ -160,7 +160,7 @@ static ssize_t i_stream_raw_mbox_read(struct istream_private *stream)
 {
 	static const char *mbox_from = "\nFrom ";
 	struct raw_mbox_istream *rstream = (struct raw_mbox_istream *)stream;
-	const unsigned char *buf;
+	const unsigned char *buf, *p;
 	const char *fromp;
 	char *sender;
 	time_t received_time;
@@ -279,6 +279,18 @@ static ssize_t i_stream_raw_mbox_read(struct istream_private *stream)
         fromp = mbox_from; from_start_pos = from_after_pos = (size_t)-1;
 	eoh_char = rstream->body_offset == (uoff_t)-1 ? '\n' : -1;
 	for (i = stream->pos; i < pos; i++) {
+		if (fromp == mbox_from && buf[i] != '\n') {
+			/* Only LF can begin a From-line, finish a pending
+			   From-line check or end the headers. Skip to the next
+			   one with memchr(), which is much faster than looking
+			   at each byte here. */
+			p = memchr(buf + i, '\n', pos - i);
+			if (p == NULL) {
+				i = pos;
+				break;
+			}
+			i = p - buf;
+		}
 		if (buf[i] == eoh_char &&
 		    ((i > 0 && buf[i-1] == '\n') ||
                      (i > 1 && buf[i-1] == '\r' && buf[i-2] == '\n') ||
@@ -184,6 +184,8 @@ struct mail_storage {
 	/* Failed to create shared attribute dict, don't try again */
 	bool shared_attr_dict_failed:1;
 	bool last_error_is_internal:1;
+	/* mail_storage_set_purge_throttle() was called */
+	bool purge_throttle:1;
 };
 
 struct mail_attachment_part {
@@ -416,6 +418,9 @@ struct mailbox {
 	void *notify_context;
 	struct timeout *to_notify, *to_notify_delay;
 	struct mailbox_notify_file *notify_files;
+	/* Number of change notifications sent/skipped because the view had
+	   already seen all the changes. */
+	unsigned int notify_count, notify_skip_count;
 
 	/* Increased by one for each new struct mailbox. */
 	unsigned int generation_sequence;
@@ -467,6 +472,8 @@ struct mailbox {
 	/* Using LAYOUT=index and mailbox is being opened with a corrupted
 	   mailbox name. Try to revert to the previously known good name. */
 	bool corrupted_mailbox_name:1;
+	/* The only watched file is the index transaction log */
+	bool notify_index_log_only:1;
 };
 
 struct mail_vfuncs {
@@ -677,6 +684,8 @@ struct mail_save_data {
 	uint32_t uid, stub_seq;
 	char *guid, *pop3_uidl, *from_envelope;
 	uint32_t pop3_order;
+	/* Body snippet already generated by the caller */
+	char *body_snippet;
 
 	struct ostream *output;
 	struct mail_save_attachment *attach;
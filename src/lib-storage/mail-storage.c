@@ -695,6 +695,12 @@ int mail_storage_purge(struct mail_storage *storage)
 		storage->v.purge(storage);
 }
 
+void mail_storage_set_purge_throttle(struct mail_storage *storage,
+				     bool throttle)
+{
+	storage->purge_throttle = throttle;
+}
+
 const char *mail_storage_get_last_error(struct mail_storage *storage,
 					enum mail_error *error_r)
 {
@@ -2272,6 +2278,12 @@ mailbox_search_init(struct mailbox_transaction_context *t,
 				     wanted_fields, wanted_headers);
 }
 
+void mailbox_search_set_prefetch_count(struct mail_search_context *ctx,
+				       unsigned int count)
+{
+	ctx->max_mails = count < UINT_MAX ? count + 1 : UINT_MAX;
+}
+
 int mailbox_search_deinit(struct mail_search_context **_ctx)
 {
 	struct mail_search_context *ctx = *_ctx;
@@ -2579,6 +2591,15 @@ void mailbox_save_set_pop3_order(struct mail_save_context *ctx,
 	ctx->data.pop3_order = order;
 }
 
+void mailbox_save_set_body_snippet(struct mail_save_context *ctx,
+				   const char *snippet)
+{
+	i_assert(*snippet != '\0');
+
+	i_free(ctx->data.body_snippet);
+	ctx->data.body_snippet = i_strdup(snippet);
+}
+
 struct mail *mailbox_save_get_dest_mail(struct mail_save_context *ctx)
 {
 	return ctx->dest_mail;
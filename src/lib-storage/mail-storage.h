@@ -487,6 +487,12 @@ void mail_storage_set_callbacks(struct mail_storage *storage,
 /* Purge storage's mailboxes (freeing disk space from expunged mails),
    if supported by the storage. Otherwise just a no-op. */
 int mail_storage_purge(struct mail_storage *storage);
+/* Allow purging to be slowed down with storage-specific settings, such as
+   mdbox_purge_max_bytes_per_sec. The process sleeps while it's throttled,
+   so this must be enabled only by callers that have nothing else to do
+   while purging, such as doveadm purge. */
+void mail_storage_set_purge_throttle(struct mail_storage *storage,
+				     bool throttle);
 
 /* Returns the error message of last occurred error. */
 const char * ATTR_NOWARN_UNUSED_RESULT
@@ -730,6 +736,11 @@ mailbox_search_init(struct mailbox_transaction_context *t,
 		    const enum mail_sort_type *sort_program,
 		    enum mail_fetch_field wanted_fields,
 		    struct mailbox_header_lookup_ctx *wanted_headers);
+/* Set the number of mails the search may prefetch before they're returned
+   by mailbox_search_next*(). The default is mail_prefetch_count. This must
+   be called before the first mailbox_search_next*() call. */
+void mailbox_search_set_prefetch_count(struct mail_search_context *ctx,
+				       unsigned int count);
 /* Deinitialize search request. */
 int mailbox_search_deinit(struct mail_search_context **ctx);
 /* Search the next message. Returns TRUE if found, FALSE if not. */
@@ -832,6 +843,11 @@ void mailbox_save_set_pop3_uidl(struct mail_save_context *ctx,
    of the mailbox. Not all backends support this. */
 void mailbox_save_set_pop3_order(struct mail_save_context *ctx,
 				 unsigned int order);
+/* Set the message's body snippet, which the caller has already generated
+   (e.g. when delivering the same mail to multiple users). This avoids
+   generating it again when the snippet is added to cache. */
+void mailbox_save_set_body_snippet(struct mail_save_context *ctx,
+				   const char *snippet);
 /* Returns the destination mail */
 struct mail *mailbox_save_get_dest_mail(struct mail_save_context *ctx);
 /* Begin saving the message. All mail_save_set_*() calls must have been called
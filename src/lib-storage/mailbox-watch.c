@@ -22,6 +22,14 @@ struct mailbox_notify_file {
 static void notify_delay_callback(struct mailbox *box)
 {
 	timeout_remove(&box->to_notify_delay);
+	if (box->notify_index_log_only && box->view != NULL &&
+	    !mail_index_view_have_log_changes(box->view)) {
+		/* the log was changed only by ourself or the changes were
+		   already synced - there's nothing new to notify about. */
+		box->notify_skip_count++;
+		return;
+	}
+	box->notify_count++;
 	box->notify_callback(box, box->notify_context);
 }
 
@@ -84,10 +92,29 @@ void mailbox_watch_add(struct mailbox *box, const char *path)
 	}
 }
 
+void mailbox_watch_add_index_log(struct mailbox *box, const char *path)
+{
+	i_assert(box->notify_files == NULL || box->notify_index_log_only);
+
+	mailbox_watch_add(box, path);
+	box->notify_index_log_only = TRUE;
+}
+
 void mailbox_watch_remove_all(struct mailbox *box)
 {
 	struct mailbox_notify_file *file;
 
+	if (box->notify_count > 0 || box->notify_skip_count > 0) {
+		e_debug(event_create_passthrough(box->event)->
+			set_name("mailbox_notify_finished")->
+			add_int("notify_count", box->notify_count)->
+			add_int("notify_skip_count", box->notify_skip_count)->
+			event(), "Change notifications: %u sent, %u skipped",
+			box->notify_count, box->notify_skip_count);
+		box->notify_count = box->notify_skip_count = 0;
+	}
+	box->notify_index_log_only = FALSE;
+
 	while (box->notify_files != NULL) {
 		file = box->notify_files;
 		box->notify_files = file->next;
@@ -2,6 +2,10 @@
 #define MAILBOX_WATCH_H
 
 void mailbox_watch_add(struct mailbox *box, const char *path);
+/* Like mailbox_watch_add(), but path is the mailbox's index transaction log
+   and it's the only watched file. Notifications are skipped when box->view
+   has already seen everything in the log. */
+void mailbox_watch_add_index_log(struct mailbox *box, const char *path);
 void mailbox_watch_remove_all(struct mailbox *box);
 
 /* Create a new temporary ioloop, add all the watches back and call
@@ -0,0 +1,617 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "hostpid.h"
+#include "net.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "write-full.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "mail-storage-service.h"
+#include "mail-storage-private.h"
+#include "mail-search-build.h"
+#include "test-common.h"
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define TEST_BODY_CACHE_DIR_NAME "dovecot.imapc-bodies"
+
+struct test_user {
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+};
+
+static struct mail_storage_service_ctx *storage_service;
+static struct ioloop *test_ioloop;
+static const char *test_dir;
+static const char *server_state_path, *server_log_path;
+
+static struct ip_addr bind_ip;
+static in_port_t bind_port = 0;
+static int fd_listen = -1;
+static pid_t server_pid = (pid_t)-1;
+
+/*
+ * Test server
+ */
+
+/* The server's INBOX is described by server_state_path:
+   "<uidvalidity> <uid> <uid> ..." It's re-read for each command, so the
+   client can change it between the tests. All the received commands are
+   appended to server_log_path without their tags. */
+struct test_server {
+	struct istream *input;
+	struct ostream *output;
+
+	uint32_t uid_validity;
+	ARRAY(uint32_t) uids;
+};
+
+static const char *test_mail_body(uint32_t uid)
+{
+	return t_strdup_printf("Subject: message %u\r\n\r\nbody %u\r\n",
+			       uid, uid);
+}
+
+static void test_server_read_state(struct test_server *server)
+{
+	const char *const *args;
+	string_t *str = t_str_new(128);
+	char buf[1024];
+	ssize_t ret;
+	uint32_t uid;
+	int fd;
+
+	fd = open(server_state_path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", server_state_path);
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		str_append_data(str, buf, ret);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", server_state_path);
+	i_close_fd(&fd);
+
+	args = t_strsplit_spaces(str_c(str), " \n");
+	if (str_to_uint32(args[0], &server->uid_validity) < 0)
+		i_unreached();
+	array_clear(&server->uids);
+	for (args++; *args != NULL; args++) {
+		if (str_to_uint32(*args, &uid) < 0)
+			i_unreached();
+		array_push_back(&server->uids, &uid);
+	}
+}
+
+static void test_server_log(const char *line)
+{
+	int fd;
+
+	fd = open(server_log_path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", server_log_path);
+	if (write_full(fd, t_strconcat(line, "\n", NULL), strlen(line)+1) < 0)
+		i_fatal("write(%s) failed: %m", server_log_path);
+	i_close_fd(&fd);
+}
+
+static bool
+test_server_seqset_match(const char *set, uint32_t num, uint32_t max)
+{
+	const char *const *ranges = t_strsplit(set, ",");
+	const char *p;
+	uint32_t n1, n2;
+
+	for (; *ranges != NULL; ranges++) {
+		p = strchr(*ranges, ':');
+		if (p == NULL) {
+			n1 = n2 = strcmp(*ranges, "*") == 0 ? max :
+				(uint32_t)strtoul(*ranges, NULL, 10);
+		} else {
+			n1 = (uint32_t)strtoul(*ranges, NULL, 10);
+			n2 = strcmp(p+1, "*") == 0 ? max :
+				(uint32_t)strtoul(p+1, NULL, 10);
+		}
+		if (n1 > n2) {
+			uint32_t tmp = n1; n1 = n2; n2 = tmp;
+		}
+		if (num >= n1 && num <= n2)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static void
+test_server_fetch(struct test_server *server, const char *args, bool uid_set)
+{
+	const char *set, *items, *body;
+	const uint32_t *uids;
+	unsigned int i, count, max;
+	string_t *str = t_str_new(256);
+	const char *p;
+
+	p = strchr(args, ' ');
+	i_assert(p != NULL);
+	set = t_strdup_until(args, p);
+	items = p + 1;
+
+	uids = array_get(&server->uids, &count);
+	max = count == 0 ? 0 : (uid_set ? uids[count-1] : count);
+	for (i = 0; i < count; i++) {
+		if (!test_server_seqset_match(set, uid_set ? uids[i] : i+1,
+					      max))
+			continue;
+		body = test_mail_body(uids[i]);
+		str_truncate(str, 0);
+		str_printfa(str, "* %u FETCH (UID %u", i+1, uids[i]);
+		if (strstr(items, "FLAGS") != NULL)
+			str_append(str, " FLAGS ()");
+		if (strstr(items, "INTERNALDATE") != NULL)
+			str_append(str, " INTERNALDATE \"01-Jan-2018 00:00:00 +0000\"");
+		if (strstr(items, "RFC822.SIZE") != NULL)
+			str_printfa(str, " RFC822.SIZE %u",
+				    (unsigned int)strlen(body));
+		if (strstr(items, "BODY.PEEK[]") != NULL) {
+			str_printfa(str, " BODY[] {%u}\r\n%s",
+				    (unsigned int)strlen(body), body);
+		} else if (strstr(items, "BODY.PEEK[HEADER]") != NULL) {
+			p = strstr(body, "\r\n\r\n") + 4;
+			str_printfa(str, " BODY[HEADER] {%u}\r\n",
+				    (unsigned int)(p - body));
+			str_append_data(str, body, p - body);
+		}
+		str_append(str, ")\r\n");
+		o_stream_nsend(server->output, str_data(str), str_len(str));
+	}
+}
+
+static void
+test_server_command(struct test_server *server, const char *tag,
+		    const char *cmd, const char *args)
+{
+	const char *reply = "OK";
+	unsigned int count;
+
+	test_server_read_state(server);
+	count = array_count(&server->uids);
+
+	if (strcasecmp(cmd, "LOGIN") == 0)
+		reply = "OK [CAPABILITY IMAP4rev1] Logged in";
+	else if (strcasecmp(cmd, "CAPABILITY") == 0)
+		o_stream_nsend_str(server->output, "* CAPABILITY IMAP4rev1\r\n");
+	else if (strcasecmp(cmd, "LIST") == 0 || strcasecmp(cmd, "LSUB") == 0) {
+		if (strcmp(args, "\"\" \"\"") == 0) {
+			o_stream_nsend_str(server->output, t_strdup_printf(
+				"* %s (\\Noselect) \"/\" \"\"\r\n", cmd));
+		} else {
+			o_stream_nsend_str(server->output, t_strdup_printf(
+				"* %s () \"/\" INBOX\r\n", cmd));
+		}
+	} else if (strcasecmp(cmd, "SELECT") == 0 ||
+		   strcasecmp(cmd, "EXAMINE") == 0) {
+		o_stream_nsend_str(server->output, t_strdup_printf(
+			"* %u EXISTS\r\n"
+			"* OK [UIDVALIDITY %u] UIDs valid\r\n"
+			"* OK [UIDNEXT %u] Predicted next UID\r\n",
+			count, server->uid_validity, count == 0 ? 1 :
+			*array_idx(&server->uids, count-1) + 1));
+		reply = "OK [READ-WRITE] Selected";
+	} else if (strcasecmp(cmd, "UID") == 0 &&
+		   strncasecmp(args, "FETCH ", 6) == 0)
+		test_server_fetch(server, args + 6, TRUE);
+	else if (strcasecmp(cmd, "FETCH") == 0)
+		test_server_fetch(server, args, FALSE);
+	else if (strcasecmp(cmd, "LOGOUT") == 0)
+		o_stream_nsend_str(server->output, "* BYE Logging out\r\n");
+	o_stream_nsend_str(server->output,
+			   t_strdup_printf("%s %s\r\n", tag, reply));
+	(void)o_stream_flush(server->output);
+}
+
+static void test_server_connection(int fd)
+{
+	struct test_server server;
+	const char *line, *p, *tag, *cmd, *args;
+
+	i_zero(&server);
+	i_array_init(&server.uids, 8);
+	server.input = i_stream_create_fd(fd, (size_t)-1);
+	server.output = o_stream_create_fd(fd, (size_t)-1);
+	o_stream_set_no_error_handling(server.output, TRUE);
+
+	o_stream_nsend_str(server.output,
+			   "* OK [CAPABILITY IMAP4rev1] ready\r\n");
+	(void)o_stream_flush(server.output);
+	while ((line = i_stream_read_next_line(server.input)) != NULL) T_BEGIN {
+		p = strchr(line, ' ');
+		i_assert(p != NULL);
+		tag = t_strdup_until(line, p);
+		test_server_log(p + 1);
+		cmd = p + 1;
+		p = strchr(cmd, ' ');
+		if (p == NULL)
+			args = "";
+		else {
+			args = p + 1;
+			cmd = t_strdup_until(cmd, p);
+		}
+		test_server_command(&server, tag, cmd, args);
+	} T_END;
+
+	array_free(&server.uids);
+	i_stream_unref(&server.input);
+	o_stream_unref(&server.output);
+}
+
+static void test_server_run(void)
+{
+	int fd;
+
+	/* serve one connection at a time */
+	fd_set_nonblock(fd_listen, FALSE);
+	for (;;) {
+		fd = net_accept(fd_listen, NULL, NULL);
+		if (fd < 0)
+			i_fatal("test server: accept() failed: %m");
+		fd_set_nonblock(fd, FALSE);
+		test_server_connection(fd);
+		i_close_fd(&fd);
+	}
+}
+
+static void test_server_start(void)
+{
+	if (net_addr2ip("127.0.0.1", &bind_ip) < 0)
+		i_unreached();
+	fd_listen = net_listen(&bind_ip, &bind_port, 128);
+	if (fd_listen == -1) {
+		i_fatal("listen(%s:%u) failed: %m",
+			net_ip2addr(&bind_ip), bind_port);
+	}
+
+	if ((server_pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (server_pid == 0) {
+		/* child: server - runs until it's killed */
+		server_pid = (pid_t)-1;
+		hostpid_init();
+		test_server_run();
+		exit(0);
+	}
+	i_close_fd(&fd_listen);
+}
+
+static void test_server_kill(void)
+{
+	if (server_pid != (pid_t)-1) {
+		(void)kill(server_pid, SIGKILL);
+		(void)waitpid(server_pid, NULL, 0);
+	}
+	server_pid = (pid_t)-1;
+}
+
+static void test_server_set_state(const char *state)
+{
+	int fd;
+
+	fd = open(server_state_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", server_state_path);
+	if (write_full(fd, state, strlen(state)) < 0)
+		i_fatal("write(%s) failed: %m", server_state_path);
+	i_close_fd(&fd);
+}
+
+/* Returns the commands the server has received since the previous call */
+static const char *test_server_log_pop(void)
+{
+	string_t *str = t_str_new(256);
+	char buf[1024];
+	ssize_t ret;
+	int fd;
+
+	fd = open(server_log_path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return "";
+		i_fatal("open(%s) failed: %m", server_log_path);
+	}
+	while ((ret = read(fd, buf, sizeof(buf))) > 0)
+		str_append_data(str, buf, ret);
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", server_log_path);
+	i_close_fd(&fd);
+	i_unlink(server_log_path);
+	return str_c(str);
+}
+
+/*
+ * Test client
+ */
+
+static void
+test_user_init(struct test_user *tuser, const char *username,
+	       const char *max_size)
+{
+	const char *error;
+
+	struct mail_storage_service_input input = {
+		.userdb_fields = (const char *const[]){
+			"mail=imapc:~/imapc",
+			t_strdup_printf("home=%s/%s", test_dir, username),
+			"imapc_host=127.0.0.1",
+			t_strdup_printf("imapc_port=%u", bind_port),
+			"imapc_user=testuser",
+			"imapc_password=testpass",
+			"imapc_features=body-cache",
+			t_strdup_printf("imapc_body_cache_max_size=%s",
+					max_size),
+			"mail_prefetch_count=10",
+			NULL
+		},
+		.username = username,
+		.no_userdb_lookup = TRUE,
+	};
+
+	i_zero(tuser);
+	if (mail_storage_service_lookup_next(storage_service, &input,
+					     &tuser->service_user,
+					     &tuser->user, &error) < 0)
+		i_fatal("mail_storage_service_lookup_next(%s) failed: %s",
+			username, error);
+}
+
+static void test_user_deinit(struct test_user *tuser)
+{
+	mail_user_deinit(&tuser->user);
+	mail_storage_service_user_unref(&tuser->service_user);
+}
+
+static struct mailbox *test_mailbox_open(struct test_user *tuser)
+{
+	struct mail_namespace *ns;
+	struct mailbox *box;
+
+	ns = mail_namespace_find_inbox(tuser->user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	return box;
+}
+
+/* Read the bodies of all the mails with prefetching, and return their UIDs */
+static const char *test_mailbox_read_bodies(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	string_t *uids = t_str_new(64);
+	string_t *body = t_str_new(128);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(trans, search_args, NULL,
+					 MAIL_FETCH_STREAM_HEADER |
+					 MAIL_FETCH_STREAM_BODY, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		test_assert(mail_get_stream(mail, NULL, NULL, &input) == 0);
+		str_truncate(body, 0);
+		while (i_stream_read_more(input, &data, &size) > 0) {
+			str_append_data(body, data, size);
+			i_stream_skip(input, size);
+		}
+		test_assert_strcmp(str_c(body), test_mail_body(mail->uid));
+		str_printfa(uids, "%u ", mail->uid);
+	}
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	mailbox_transaction_rollback(&trans);
+	return str_c(uids);
+}
+
+/* Returns the files in the mailbox's body cache directory */
+static const char *test_body_cache_files(struct mailbox *box)
+{
+	ARRAY_TYPE(const_string) names;
+	const char *index_dir, *dir, *name;
+	struct dirent *d;
+	DIR *dirp;
+
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&index_dir) > 0);
+	dir = t_strconcat(index_dir, "/"TEST_BODY_CACHE_DIR_NAME, NULL);
+	if ((dirp = opendir(dir)) == NULL) {
+		if (errno == ENOENT)
+			return "";
+		i_fatal("opendir(%s) failed: %m", dir);
+	}
+	t_array_init(&names, 8);
+	while ((d = readdir(dirp)) != NULL) {
+		if (d->d_name[0] == '.')
+			continue;
+		name = t_strdup(d->d_name);
+		array_push_back(&names, &name);
+	}
+	if (closedir(dirp) < 0)
+		i_fatal("closedir(%s) failed: %m", dir);
+	array_sort(&names, i_strcmp_p);
+	array_append_zero(&names);
+	return t_strarray_join(array_front(&names), " ");
+}
+
+static void test_imapc_fetch_ranges(void)
+{
+	struct test_user tuser;
+	struct mailbox *box;
+	const char *log;
+
+	test_begin("imapc fetch UID ranges");
+	test_server_set_state("1000 1 2 3 5 8 9");
+	test_user_init(&tuser, "user1", "0");
+
+	box = test_mailbox_open(&tuser);
+	(void)test_server_log_pop();
+	test_assert_strcmp(test_mailbox_read_bodies(box), "1 2 3 5 8 9 ");
+	/* the prefetched mails are fetched with a single command, which has
+	   the adjacent UIDs merged into ranges */
+	log = test_server_log_pop();
+	test_assert_strcmp(log, "UID FETCH 1:3,5,8:9 (BODY.PEEK[])\n");
+	mailbox_free(&box);
+
+	test_user_deinit(&tuser);
+	test_end();
+}
+
+static void test_imapc_body_cache(void)
+{
+	struct test_user tuser;
+	struct mailbox *box;
+	const char *log;
+
+	test_begin("imapc body cache");
+	test_server_set_state("1000 1 2 3");
+	test_user_init(&tuser, "user2", "0");
+
+	box = test_mailbox_open(&tuser);
+	test_assert_strcmp(test_mailbox_read_bodies(box), "1 2 3 ");
+	test_assert_strcmp(test_body_cache_files(box),
+			   "1000.1 1000.2 1000.3");
+	mailbox_free(&box);
+
+	/* cache hit - the bodies aren't fetched again */
+	(void)test_server_log_pop();
+	box = test_mailbox_open(&tuser);
+	test_assert_strcmp(test_mailbox_read_bodies(box), "1 2 3 ");
+	log = test_server_log_pop();
+	test_assert(strstr(log, "BODY.PEEK[]") == NULL);
+	mailbox_free(&box);
+
+	/* an expunged mail's body is removed from the cache */
+	test_server_set_state("1000 1 3");
+	box = test_mailbox_open(&tuser);
+	test_assert_strcmp(test_body_cache_files(box), "1000.1 1000.3");
+	test_assert_strcmp(test_mailbox_read_bodies(box), "1 3 ");
+	log = test_server_log_pop();
+	test_assert(strstr(log, "BODY.PEEK[]") == NULL);
+	mailbox_free(&box);
+
+	/* UIDVALIDITY change drops the whole cache */
+	test_server_set_state("2000 1 2");
+	box = test_mailbox_open(&tuser);
+	test_assert_strcmp(test_body_cache_files(box), "");
+	(void)test_server_log_pop();
+	test_assert_strcmp(test_mailbox_read_bodies(box), "1 2 ");
+	log = test_server_log_pop();
+	test_assert(strstr(log, "UID FETCH 1:2 (") != NULL);
+	test_assert_strcmp(test_body_cache_files(box), "2000.1 2000.2");
+	mailbox_free(&box);
+
+	test_user_deinit(&tuser);
+	test_end();
+}
+
+static void test_imapc_body_cache_max_size(void)
+{
+	struct test_user tuser;
+	struct mailbox *box;
+	struct stat st;
+	const char *const *files, *index_dir;
+	uoff_t total_size = 0;
+	unsigned int body_size = strlen(test_mail_body(1));
+
+	test_begin("imapc body cache max size");
+	test_server_set_state("1000 1 2 3 4 5 6 7 8");
+	/* room for three bodies */
+	test_user_init(&tuser, "user3",
+		       t_strdup_printf("%u", body_size * 3 + body_size / 2));
+
+	box = test_mailbox_open(&tuser);
+	test_assert_strcmp(test_mailbox_read_bodies(box),
+			   "1 2 3 4 5 6 7 8 ");
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&index_dir) > 0);
+	files = t_strsplit_spaces(test_body_cache_files(box), " ");
+	test_assert(str_array_length(files) > 0 &&
+		    str_array_length(files) <= 3);
+	for (; *files != NULL; files++) {
+		const char *path = t_strdup_printf("%s/%s/%s", index_dir,
+			TEST_BODY_CACHE_DIR_NAME, *files);
+		if (stat(path, &st) < 0)
+			i_fatal("stat(%s) failed: %m", path);
+		total_size += st.st_size;
+	}
+	test_assert(total_size <= body_size * 3 + body_size / 2);
+	/* the latest body is kept */
+	test_assert(strstr(test_body_cache_files(box), "1000.8") != NULL);
+	mailbox_free(&box);
+
+	test_user_deinit(&tuser);
+	test_end();
+}
+
+static void test_imapc_storage(void)
+{
+	const char *error;
+	char path_buf[4096];
+
+	if (getcwd(path_buf, sizeof(path_buf)) == NULL)
+		i_fatal("getcwd() failed: %m");
+	test_dir = t_strdup_printf("%s/.test-imapc-storage", path_buf);
+	(void)unlink_directory(test_dir, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(test_dir, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", test_dir);
+	server_state_path = t_strconcat(test_dir, "/server-state", NULL);
+	server_log_path = t_strconcat(test_dir, "/server-log", NULL);
+
+	test_server_start();
+	test_ioloop = io_loop_create();
+	storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+
+	test_imapc_fetch_ranges();
+	test_imapc_body_cache();
+	test_imapc_body_cache_max_size();
+
+	mail_storage_service_deinit(&storage_service);
+	io_loop_destroy(&test_ioloop);
+	test_server_kill();
+
+	if (unlink_directory(test_dir, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0)
+		i_error("unlink_directory(%s) failed: %s", test_dir, error);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*const test_functions[])(void) = {
+		test_imapc_storage,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-imapc-storage",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(test_functions);
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -0,0 +1,198 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "ostream.h"
+#include "str.h"
+#include "fs-test.h"
+#include "index-attachment.h"
+#include "test-common.h"
+
+#define TEST_MSG_HDR "Subject: test\n\n"
+#define TEST_MSG_ATTACHMENT "attachment body\n"
+#define TEST_MSG_TRAILER "\ntrailer\n"
+
+struct test_fetch_ctx {
+	struct ioloop *ioloop;
+	struct istream *input;
+	struct ostream *output;
+	struct io *io;
+	struct test_fs_file *att_file;
+
+	unsigned int wait_input_count;
+	bool other_cmd_done;
+	bool other_cmd_done_before_body;
+	bool body_done;
+};
+
+static void test_fetch_send(struct test_fetch_ctx *ctx);
+
+static void test_fetch_input(struct test_fetch_ctx *ctx)
+{
+	io_remove(&ctx->io);
+	test_fetch_send(ctx);
+}
+
+static void test_fetch_send(struct test_fetch_ctx *ctx)
+{
+	enum ostream_send_istream_result res;
+
+	/* this is what imap-fetch-body does */
+	test_assert(ctx->input->async_input);
+	i_stream_set_blocking(ctx->input, FALSE);
+	res = o_stream_send_istream(ctx->output, ctx->input);
+	i_stream_set_blocking(ctx->input, TRUE);
+
+	switch (res) {
+	case OSTREAM_SEND_ISTREAM_RESULT_FINISHED:
+		ctx->body_done = TRUE;
+		io_loop_stop(ctx->ioloop);
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_INPUT:
+		ctx->wait_input_count++;
+		ctx->io = io_add_istream(ctx->input, test_fetch_input, ctx);
+		break;
+	case OSTREAM_SEND_ISTREAM_RESULT_WAIT_OUTPUT:
+	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_INPUT:
+	case OSTREAM_SEND_ISTREAM_RESULT_ERROR_OUTPUT:
+		test_assert(FALSE);
+		io_loop_stop(ctx->ioloop);
+		break;
+	}
+}
+
+static void test_other_cmd(struct test_fetch_ctx *ctx)
+{
+	/* e.g. a pipelined NOOP. It gets handled while the body is still
+	   waiting for the fs. */
+	ctx->other_cmd_done = TRUE;
+	ctx->other_cmd_done_before_body = !ctx->body_done;
+
+	/* now let the async read finish */
+	ctx->att_file->wait_async = FALSE;
+	ctx->att_file->wait_async_read = FALSE;
+	test_istream_set_size(ctx->att_file->input,
+			      ctx->att_file->contents->used);
+	test_assert(ctx->att_file->async_callback != NULL);
+	ctx->att_file->async_callback(ctx->att_file->async_context);
+}
+
+static struct istream *
+test_attachment_stream_get(struct fs *fs, struct test_fs_file **att_file_r)
+{
+	struct istream *input;
+	struct test_fs_file *att_file;
+	const char *ext_refs, *error;
+
+	input = i_stream_create_from_data(TEST_MSG_HDR TEST_MSG_TRAILER,
+		strlen(TEST_MSG_HDR TEST_MSG_TRAILER));
+	ext_refs = t_strdup_printf("%u %u - foo",
+				   (unsigned int)strlen(TEST_MSG_HDR),
+				   (unsigned int)strlen(TEST_MSG_ATTACHMENT));
+	test_assert(index_attachment_stream_get(fs, "attachments", "", &input,
+		strlen(TEST_MSG_HDR TEST_MSG_ATTACHMENT TEST_MSG_TRAILER),
+		ext_refs, &error) == 0);
+
+	att_file = test_fs_file_get(fs, "attachments/foo");
+	test_assert((att_file->file.flags & FS_OPEN_FLAG_ASYNC) != 0);
+	buffer_append(att_file->contents, TEST_MSG_ATTACHMENT,
+		      strlen(TEST_MSG_ATTACHMENT));
+	att_file->wait_async_read = TRUE;
+	*att_file_r = att_file;
+	return input;
+}
+
+static struct fs *test_fs_init(void)
+{
+	struct fs_settings fs_set;
+	struct fs *fs;
+	const char *error;
+
+	i_zero(&fs_set);
+	if (fs_init("test", "", &fs_set, &fs, &error) < 0)
+		i_fatal("fs_init() failed: %s", error);
+	test_fs_get(fs)->properties = FS_PROPERTY_ASYNC;
+	return fs;
+}
+
+static void test_index_attachment_async_fetch(void)
+{
+	struct test_fetch_ctx ctx;
+	struct timeout *to;
+	struct fs *fs;
+	buffer_t *output_buf;
+
+	test_begin("index attachment async fetch");
+	i_zero(&ctx);
+	ctx.ioloop = io_loop_create();
+	fs = test_fs_init();
+
+	ctx.input = test_attachment_stream_get(fs, &ctx.att_file);
+	/* mail streams are always blocking by default */
+	test_assert(ctx.input->blocking);
+
+	output_buf = buffer_create_dynamic(pool_datastack_create(), 128);
+	ctx.output = o_stream_create_buffer(output_buf);
+
+	test_fetch_send(&ctx);
+	test_assert(ctx.wait_input_count == 1);
+	test_assert(!ctx.body_done);
+
+	to = timeout_add_short(0, test_other_cmd, &ctx);
+	io_loop_run(ctx.ioloop);
+	timeout_remove(&to);
+
+	test_assert(ctx.other_cmd_done);
+	test_assert(ctx.other_cmd_done_before_body);
+	test_assert(ctx.body_done);
+	test_assert(ctx.input->blocking);
+	test_assert_strcmp(str_c(output_buf),
+		TEST_MSG_HDR TEST_MSG_ATTACHMENT TEST_MSG_TRAILER);
+
+	io_remove(&ctx.io);
+	o_stream_destroy(&ctx.output);
+	i_stream_unref(&ctx.input);
+	fs_deinit(&fs);
+	io_loop_destroy(&ctx.ioloop);
+	test_end();
+}
+
+static void test_index_attachment_async_blocking_read(void)
+{
+	struct test_fs_file *att_file;
+	struct istream *input;
+	struct fs *fs;
+	const unsigned char *data;
+	size_t size;
+	string_t *str = t_str_new(128);
+
+	test_begin("index attachment async blocking read");
+	fs = test_fs_init();
+
+	/* callers that don't change the stream to non-blocking wait for the
+	   async reads to finish */
+	input = test_attachment_stream_get(fs, &att_file);
+	att_file->wait_async = FALSE;
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+	test_assert_strcmp(str_c(str),
+		TEST_MSG_HDR TEST_MSG_ATTACHMENT TEST_MSG_TRAILER);
+	i_stream_unref(&input);
+
+	fs_deinit(&fs);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_index_attachment_async_fetch,
+		test_index_attachment_async_blocking_read,
+		NULL
+	};
+	return test_run(test_functions);
+}
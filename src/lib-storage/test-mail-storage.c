@@ -2,6 +2,10 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "istream.h"
+#include "str.h"
+#include "byteorder.h"
+#include "write-full.h"
 #include "mkdir-parents.h"
 #include "unlink-directory.h"
 #include "hex-binary.h"
@@ -11,6 +15,9 @@
 #include "mail-storage-service.h"
 #include "mail-storage-private.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 static void test_init_storage(struct mail_storage *storage_r)
 {
 	i_zero(storage_r);
@@ -659,6 +666,305 @@ static void test_mailbox_list_mbox(void)
 	test_end();
 }
 
+static void test_mailbox_save_body_snippet(void)
+{
+	static const char *mail_input =
+		"Subject: snippet\r\n\r\nThe real body text\r\n";
+	const char *const extra_input[] = {
+		"mail_always_cache_fields=body.snippet",
+		NULL
+	};
+	struct test_mail_storage_ctx ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	struct mail *mail;
+	const char *snippet;
+	ssize_t ret;
+
+	i_zero(&ctx);
+	test_begin("mailbox_save_set_body_snippet");
+
+	test_mail_init(&ctx);
+	if (test_mail_init_user("testuser", "maildir", "", ".",
+				extra_input, &ctx) < 0)
+		i_unreached();
+
+	ns = mail_namespace_find_inbox(ctx.user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+
+	/* the given snippet is cached instead of generating it from the
+	   message body */
+	trans = mailbox_transaction_begin(box,
+		MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	mailbox_save_set_body_snippet(save_ctx, "0precomputed snippet");
+	input = i_stream_create_from_data(mail_input, strlen(mail_input));
+	test_assert(mailbox_save_begin(&save_ctx, input) == 0);
+	do {
+		test_assert(mailbox_save_continue(save_ctx) == 0);
+		ret = i_stream_read(input);
+	} while (ret > 0);
+	test_assert(mailbox_save_finish(&save_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	i_stream_unref(&input);
+
+	test_assert(mailbox_sync(box, 0) == 0);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	mail->lookup_abort = MAIL_LOOKUP_ABORT_NOT_IN_CACHE;
+	test_assert(mail_get_special(mail, MAIL_FETCH_BODY_SNIPPET,
+				     &snippet) == 0);
+	test_assert_strcmp(snippet, "0precomputed snippet");
+	mail_free(&mail);
+	mailbox_transaction_rollback(&trans);
+	mailbox_free(&box);
+
+	test_mail_deinit_user(&ctx);
+	test_mail_deinit(&ctx);
+
+	test_end();
+}
+
+static void test_mailbox_save_mail(struct mailbox *box)
+{
+	static const char *mail_input = "Subject: test\r\n\r\nbody\r\n";
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	ssize_t ret;
+
+	trans = mailbox_transaction_begin(box,
+		MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	save_ctx = mailbox_save_alloc(trans);
+	input = i_stream_create_from_data(mail_input, strlen(mail_input));
+	test_assert(mailbox_save_begin(&save_ctx, input) == 0);
+	do {
+		test_assert(mailbox_save_continue(save_ctx) == 0);
+		ret = i_stream_read(input);
+	} while (ret > 0);
+	test_assert(mailbox_save_finish(&save_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	i_stream_unref(&input);
+}
+
+static void test_mailbox_view_have_log_changes(void)
+{
+	struct test_mail_storage_ctx ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box, *box2;
+
+	i_zero(&ctx);
+	test_begin("mail_index_view_have_log_changes");
+
+	test_mail_init(&ctx);
+	if (test_mail_init_user("testuser", "sdbox", "", "/", NULL, &ctx) < 0)
+		i_unreached();
+
+	ns = mail_namespace_find_inbox(ctx.user->namespaces);
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	box2 = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert(mailbox_sync(box2, 0) == 0);
+	test_assert(!mail_index_view_have_log_changes(box->view));
+
+	/* changes made by another view are seen */
+	test_mailbox_save_mail(box2);
+	test_assert(mail_index_view_have_log_changes(box->view));
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert(!mail_index_view_have_log_changes(box->view));
+
+	/* own changes are seen once synced */
+	test_mailbox_save_mail(box);
+	test_assert(mailbox_sync(box, 0) == 0);
+	test_assert(!mail_index_view_have_log_changes(box->view));
+	test_assert(mail_index_view_have_log_changes(box2->view));
+
+	mailbox_free(&box);
+	mailbox_free(&box2);
+
+	test_mail_deinit_user(&ctx);
+	test_mail_deinit(&ctx);
+
+	test_end();
+}
+
+static const char *test_maildir_uidlist_path(struct mailbox *box)
+{
+	const char *path;
+
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_CONTROL,
+					&path) > 0);
+	return t_strconcat(path, "/dovecot-uidlist", NULL);
+}
+
+static string_t *test_maildir_uidlist_read(const char *path)
+{
+	string_t *str = t_str_new(256);
+	struct istream *input;
+	const unsigned char *data;
+	size_t size;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		i_fatal("open(%s) failed: %m", path);
+	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
+	while (i_stream_read_more(input, &data, &size) > 0) {
+		str_append_data(str, data, size);
+		i_stream_skip(input, size);
+	}
+	test_assert(input->stream_errno == 0);
+	i_stream_unref(&input);
+	return str;
+}
+
+static void test_maildir_uidlist_write(const char *path, const string_t *str)
+{
+	int fd;
+
+	if ((fd = open(path, O_WRONLY | O_TRUNC)) == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (write_full(fd, str_data(str), str_len(str)) < 0)
+		i_fatal("write(%s) failed: %m", path);
+	i_close_fd(&fd);
+}
+
+/* Open the mailbox with a freshly read uidlist and check that all the mails
+   can still be read. */
+static void test_maildir_uidlist_verify(struct mail_namespace *ns,
+					enum mailbox_sync_flags sync_flags,
+					unsigned int mail_count)
+{
+	struct mailbox *box;
+	struct mailbox_status status;
+	struct mailbox_transaction_context *trans;
+	struct mail *mail;
+	struct istream *input;
+	uint32_t seq;
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_sync(box, sync_flags) == 0);
+	mailbox_get_open_status(box, STATUS_MESSAGES, &status);
+	test_assert(status.messages == mail_count);
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	mail = mail_alloc(trans, 0, NULL);
+	for (seq = 1; seq <= status.messages; seq++) {
+		mail_set_seq(mail, seq);
+		test_assert(mail_get_stream(mail, NULL, NULL, &input) == 0);
+	}
+	mail_free(&mail);
+	mailbox_transaction_rollback(&trans);
+	mailbox_free(&box);
+}
+
+/* Returns the offset of the binary part following the header line */
+static size_t test_maildir_uidlist_binary_offset(string_t *str)
+{
+	const char *p;
+
+	test_assert(str_begins(str_c(str), "4 "));
+	p = strchr(str_c(str), '\n');
+	i_assert(p != NULL);
+	return p - str_c(str) + 1;
+}
+
+/* Truncate the file at offset (relative to the binary part), or if size is
+   non-zero, zero size bytes from it. */
+static void
+test_maildir_uidlist_break(const char *path, size_t offset, size_t size)
+{
+	string_t *str;
+
+	str = test_maildir_uidlist_read(path);
+	offset += test_maildir_uidlist_binary_offset(str);
+	i_assert(offset + size <= str_len(str));
+	if (size == 0)
+		str_truncate(str, offset);
+	else
+		memset(str_c_modifiable(str) + offset, 0, size);
+	test_maildir_uidlist_write(path, str);
+}
+
+static void test_maildir_uidlist_binary(void)
+{
+	const char *const extra_input[] = {
+		"maildir_uidlist_binary=yes",
+		NULL
+	};
+	struct test_mail_storage_ctx ctx;
+	struct mail_namespace *ns;
+	struct mailbox *box;
+	string_t *str;
+	const char *path;
+	size_t offset;
+
+	i_zero(&ctx);
+	test_begin("maildir uidlist binary");
+
+	test_mail_init(&ctx);
+	if (test_mail_init_user("testuser", "maildir", "", ".",
+				extra_input, &ctx) < 0)
+		i_unreached();
+	ns = mail_namespace_find_inbox(ctx.user->namespaces);
+
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	path = test_maildir_uidlist_path(box);
+	test_mailbox_save_mail(box);
+	test_mailbox_save_mail(box);
+	test_mailbox_save_mail(box);
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_free(&box);
+
+	/* the new mails were appended as text lines after an empty binary
+	   part */
+	str = test_maildir_uidlist_read(path);
+	offset = test_maildir_uidlist_binary_offset(str);
+	test_assert(be32_to_cpu_unaligned(str_data(str) + offset) == 0);
+	test_maildir_uidlist_verify(ns, 0, 3);
+
+	/* round trip: the next change recreates the file with all the
+	   records in the binary part, and they're read back from there */
+	box = mailbox_alloc(ns->list, "INBOX", 0);
+	test_assert(mailbox_open(box) == 0);
+	test_mailbox_save_mail(box);
+	test_assert(mailbox_sync(box, 0) == 0);
+	mailbox_free(&box);
+	str = test_maildir_uidlist_read(path);
+	offset = test_maildir_uidlist_binary_offset(str);
+	test_assert(be32_to_cpu_unaligned(str_data(str) + offset) == 4);
+	test_assert(str_data(str)[str_len(str)-1] == '\0');
+	test_maildir_uidlist_verify(ns, 0, 4);
+
+	/* The broken files below are noticed when the mailbox is resynced.
+	   They're recreated, and the mails are found again. */
+	test_maildir_uidlist_break(path, 8 + 5, 0);
+	test_expect_error_string("header: Truncated binary data");
+	test_maildir_uidlist_verify(ns, MAILBOX_SYNC_FLAG_FORCE_RESYNC, 4);
+	test_expect_no_more_errors();
+
+	/* names_size=0 with records */
+	test_maildir_uidlist_break(path, 4, 4);
+	test_expect_error_string("header: Invalid binary header");
+	test_maildir_uidlist_verify(ns, MAILBOX_SYNC_FLAG_FORCE_RESYNC, 4);
+	test_expect_no_more_errors();
+
+	/* the error tells which record is broken */
+	test_maildir_uidlist_break(path, 8 + 12, 4);
+	test_expect_error_string("record 2: Invalid binary record (uid=0)");
+	test_maildir_uidlist_verify(ns, MAILBOX_SYNC_FLAG_FORCE_RESYNC, 4);
+	test_expect_no_more_errors();
+
+	test_mail_deinit_user(&ctx);
+	test_mail_deinit(&ctx);
+
+	test_end();
+}
 
 int main(int argc, char **argv)
 {
@@ -669,6 +975,9 @@ int main(int argc, char **argv)
 		test_mailbox_verify_name,
 		test_mailbox_list_maildir,
 		test_mailbox_list_mbox,
+		test_mailbox_save_body_snippet,
+		test_mailbox_view_have_log_changes,
+		test_maildir_uidlist_binary,
 		NULL
 	};
 
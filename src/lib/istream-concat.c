@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "buffer.h"
+#include "ioloop.h"
 #include "istream-private.h"
 #include "istream-concat.h"
 
@@ -14,6 +15,9 @@ struct concat_istream {
 
 	unsigned int cur_idx, unknown_size_idx;
 	size_t prev_stream_left, prev_stream_skip, prev_skip;
+
+	/* Waiting for a non-blocking cur_input to have more data */
+	struct io *cur_input_io;
 };
 
 static void i_stream_concat_skip(struct concat_istream *cstream);
@@ -42,6 +46,7 @@ static void i_stream_concat_destroy(struct iostream_private *stream)
 	i_assert(cstream->cur_input == cstream->input[cstream->cur_idx]);
 	unsigned int i;
 
+	io_remove(&cstream->cur_input_io);
 	for (i = 0; i < cstream->input_count; i++)
 		i_stream_unref(&cstream->input[i]);
 	i_free(cstream->input);
@@ -135,6 +140,12 @@ static void i_stream_concat_skip(struct concat_istream *cstream)
 	i_stream_skip(cstream->cur_input, bytes_skipped);
 }
 
+static void i_stream_concat_cur_input_ready(struct concat_istream *cstream)
+{
+	io_remove(&cstream->cur_input_io);
+	i_stream_set_input_pending(&cstream->istream.istream, TRUE);
+}
+
 static ssize_t i_stream_concat_read(struct istream_private *stream)
 {
 	struct concat_istream *cstream = (struct concat_istream *)stream;
@@ -146,6 +157,7 @@ static ssize_t i_stream_concat_read(struct istream_private *stream)
 	bool last_stream;
 
 	i_assert(cstream->cur_input != NULL);
+	io_remove(&cstream->cur_input_io);
 	i_stream_concat_skip(cstream);
 
 	i_assert(stream->pos >= stream->skip + cstream->prev_stream_left);
@@ -160,6 +172,14 @@ static ssize_t i_stream_concat_read(struct istream_private *stream)
 		   istream. */
 		i_assert(cur_data_pos == data_size);
 		ret = i_stream_read(cstream->cur_input);
+		if (ret == 0) {
+			/* The input doesn't know about our io, so it can't
+			   notify it directly when it has more data. */
+			cstream->cur_input_io =
+				io_add_istream(cstream->cur_input,
+					       i_stream_concat_cur_input_ready,
+					       cstream);
+		}
 		if (ret == -2 || ret == 0)
 			return ret;
 
@@ -274,6 +294,8 @@ static void i_stream_concat_seek(struct istream_private *stream,
 	struct concat_istream *cstream = (struct concat_istream *)stream;
 	i_assert(cstream->cur_input == cstream->input[cstream->cur_idx]);
 
+	io_remove(&cstream->cur_input_io);
+
 	stream->istream.v_offset = v_offset;
 	stream->skip = stream->pos = 0;
 	cstream->prev_stream_left = 0;
@@ -322,12 +344,34 @@ i_stream_concat_stat(struct istream_private *stream, bool exact ATTR_UNUSED)
 	return 0;
 }
 
+static void
+i_stream_concat_switch_ioloop_to(struct istream_private *stream,
+				 struct ioloop *ioloop)
+{
+	struct concat_istream *cstream = (struct concat_istream *)stream;
+
+	if (cstream->cur_input_io != NULL) {
+		cstream->cur_input_io =
+			io_loop_move_io_to(ioloop, &cstream->cur_input_io);
+	}
+}
+
+static void
+i_stream_concat_set_blocking(struct istream_private *stream, bool blocking)
+{
+	struct concat_istream *cstream = (struct concat_istream *)stream;
+	unsigned int i;
+
+	for (i = 0; i < cstream->input_count; i++)
+		i_stream_set_blocking(cstream->input[i], blocking);
+}
+
 struct istream *i_stream_create_concat(struct istream *input[])
 {
 	struct concat_istream *cstream;
 	unsigned int count;
 	size_t max_buffer_size = I_STREAM_MIN_SIZE;
-	bool blocking = TRUE, seekable = TRUE;
+	bool blocking = TRUE, seekable = TRUE, async_input = FALSE;
 
 	/* if any of the streams isn't blocking or seekable, set ourself also
 	   nonblocking/nonseekable */
@@ -340,6 +384,8 @@ struct istream *i_stream_create_concat(struct istream *input[])
 			blocking = FALSE;
 		if (!input[count]->seekable)
 			seekable = FALSE;
+		if (input[count]->async_input)
+			async_input = TRUE;
 		i_stream_ref(input[count]);
 	}
 	i_assert(count != 0);
@@ -361,9 +407,12 @@ struct istream *i_stream_create_concat(struct istream *input[])
 	cstream->istream.read = i_stream_concat_read;
 	cstream->istream.seek = i_stream_concat_seek;
 	cstream->istream.stat = i_stream_concat_stat;
+	cstream->istream.switch_ioloop_to = i_stream_concat_switch_ioloop_to;
+	cstream->istream.set_blocking = i_stream_concat_set_blocking;
 
 	cstream->istream.istream.readable_fd = FALSE;
 	cstream->istream.istream.blocking = blocking;
+	cstream->istream.istream.async_input = async_input;
 	cstream->istream.istream.seekable = seekable;
 	return i_stream_create(&cstream->istream, NULL, -1,
 			       ISTREAM_CREATE_FLAG_NOOP_SNAPSHOT);
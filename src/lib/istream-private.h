@@ -21,6 +21,10 @@ struct istream_private {
 	int (*get_size)(struct istream_private *stream, bool exact, uoff_t *size_r);
 	void (*switch_ioloop_to)(struct istream_private *stream,
 				 struct ioloop *ioloop);
+	/* Called by i_stream_set_blocking() in addition to updating the
+	   parent streams. Needed by streams that read from other streams
+	   than their parent. */
+	void (*set_blocking)(struct istream_private *stream, bool blocking);
 	struct istream_snapshot *
 		(*snapshot)(struct istream_private *stream,
 			    struct istream_snapshot *prev_snapshot);
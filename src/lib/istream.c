@@ -164,6 +164,10 @@ void i_stream_set_blocking(struct istream *stream, bool blocking)
 			fd_set_nonblock(stream->real_stream->fd, !blocking);
 			prev_fd = stream->real_stream->fd;
 		}
+		if (stream->real_stream->set_blocking != NULL) {
+			stream->real_stream->set_blocking(stream->real_stream,
+							  blocking);
+		}
 		stream = stream->real_stream->parent;
 	} while (stream != NULL);
 }
@@ -1149,6 +1153,8 @@ void i_stream_init_parent(struct istream_private *_stream,
 	/* if parent stream is an istream-error, copy the error */
 	_stream->istream.stream_errno = parent->stream_errno;
 	_stream->istream.eof = parent->eof;
+	if (parent->async_input)
+		_stream->istream.async_input = TRUE;
 	i_stream_ref(parent);
 }
 
@@ -29,6 +29,11 @@ struct istream {
 	bool readable_fd:1; /* fd can be read directly if necessary
 	                               (for sendfile()) */
 	bool seekable:1; /* we can seek() backwards */
+	/* read() may wait internally for async I/O (e.g. an async fs) while
+	   the stream is blocking. i_stream_set_blocking(FALSE) makes it
+	   return 0 instead. Streams without this can't return 0 while
+	   blocking, so there's no need to change them non-blocking. */
+	bool async_input:1;
 	/* read() has reached to end of file (but there may still be data
 	   available in buffer) or stream_errno != 0 */
 	bool eof:1;
@@ -135,8 +140,9 @@ void i_stream_set_return_partial_line(struct istream *stream, bool set);
    the memory usage is minimized by freeing the stream's buffers whenever they
    become empty. */
 void i_stream_set_persistent_buffers(struct istream *stream, bool set);
-/* Set the istream blocking or nonblocking, including its parent streams.
-   If any of the istreams have an fd, its O_NONBLOCK flag is changed. */
+/* Set the istream blocking or nonblocking, including its parent streams
+   (and e.g. the streams concatenated by istream-concat). If any of the
+   istreams have an fd, its O_NONBLOCK flag is changed. */
 void i_stream_set_blocking(struct istream *stream, bool blocking);
 
 /* Returns number of bytes read if read was ok, 0 if stream is non-blocking and
@@ -36,6 +36,9 @@ struct lmtp_local_recipient {
 
 	struct lmtp_local_recipient *duplicate;
 
+	/* Why the delivery failed, if it did */
+	const char *delivery_error;
+
 	bool anvil_connect_sent:1;
 };
 
@@ -416,6 +419,13 @@ void lmtp_local_add_headers(struct lmtp_local *local,
 	}
 }
 
+static void
+lmtp_local_rcpt_set_error(struct lmtp_local_recipient *llrcpt,
+			  const char *error)
+{
+	llrcpt->delivery_error = p_strdup(llrcpt->rcpt->rcpt->pool, error);
+}
+
 static int
 lmtp_local_deliver(struct lmtp_local *local,
 		   struct smtp_server_cmd_ctx *cmd ATTR_UNUSED,
@@ -478,6 +488,8 @@ lmtp_local_deliver(struct lmtp_local *local,
 	if (mail_storage_service_next(storage_service, service_user,
 				      &rcpt_user, &error) < 0) {
 		e_error(rcpt->event, "Failed to initialize user: %s", error);
+		lmtp_local_rcpt_set_error(llrcpt, t_strdup_printf(
+			"Failed to initialize user: %s", error));
 		smtp_server_recipient_reply(rcpt, 451, "4.3.0",
 					    "Temporary internal error");
 		return -1;
@@ -500,6 +512,8 @@ lmtp_local_deliver(struct lmtp_local *local,
 	}
 	if (ret <= 0) {
 		e_error(rcpt->event, "Failed to expand settings: %s", error);
+		lmtp_local_rcpt_set_error(llrcpt, t_strdup_printf(
+			"Failed to expand settings: %s", error));
 		smtp_server_recipient_reply(rcpt, 451, "4.3.0",
 					    "Temporary internal error");
 		return -1;
@@ -511,6 +525,9 @@ lmtp_local_deliver(struct lmtp_local *local,
 				  rcpt_user, &error) <= 0) {
 		e_error(rcpt->event, "Failed to expand mail_log_prefix=%s: %s",
 			rcpt_user->set->mail_log_prefix, error);
+		lmtp_local_rcpt_set_error(llrcpt, t_strdup_printf(
+			"Failed to expand mail_log_prefix=%s: %s",
+			rcpt_user->set->mail_log_prefix, error));
 		smtp_server_recipient_reply(rcpt, 451, "4.3.0",
 					    "Temporary internal error");
 		return -1;
@@ -602,10 +619,13 @@ int lmtp_local_default_deliver(struct client *client,
 					    lldctx->session_id);
 		ret = 0;
 	} else if (dctx.tempfail_error != NULL) {
+		lmtp_local_rcpt_set_error(llrcpt, dctx.tempfail_error);
 		smtp_server_recipient_reply(rcpt, 451, "4.2.0", "%s",
 					    dctx.tempfail_error);
 		ret = -1;
 	} else if (storage != NULL) {
+		lmtp_local_rcpt_set_error(llrcpt,
+			mail_storage_get_last_internal_error(storage, NULL));
 		error = mail_storage_get_last_error(storage, &mail_error);
 		if (mail_error == MAIL_ERROR_NOQUOTA) {
 			lmtp_local_rcpt_reply_overquota(llrcpt, error);
@@ -617,6 +637,8 @@ int lmtp_local_default_deliver(struct client *client,
 	} else {
 		/* This shouldn't happen */
 		e_error(rcpt->event, "BUG: Saving failed to unknown storage");
+		lmtp_local_rcpt_set_error(llrcpt,
+			"BUG: Saving failed to unknown storage");
 		smtp_server_recipient_reply(rcpt, 451, "4.3.0",
 					    "Temporary internal error");
 		ret = -1;
@@ -627,6 +649,28 @@ int lmtp_local_default_deliver(struct client *client,
 	return ret;
 }
 
+static void
+lmtp_local_rcpt_delivery_finished(struct lmtp_local *local,
+				  struct lmtp_local_recipient *llrcpt,
+				  struct event *event, struct mail *src_mail,
+				  int ret)
+{
+	struct event_passthrough *e =
+		event_create_passthrough(event)->
+		set_name("lmtp_local_delivery_finished")->
+		add_str("source", src_mail == local->raw_mail ? "raw" : "copy");
+
+	if (ret < 0) {
+		/* the error is NULL if a plugin's local_deliver() failed
+		   without setting it */
+		e->add_str("error", llrcpt->delivery_error != NULL ?
+			   llrcpt->delivery_error : "Delivery failed");
+		e_debug(e->event(), "Local delivery failed");
+	} else {
+		e_debug(e->event(), "Local delivery finished");
+	}
+}
+
 static uid_t
 lmtp_local_deliver_to_rcpts(struct lmtp_local *local,
 			    struct smtp_server_cmd_ctx *cmd,
@@ -635,6 +679,7 @@ lmtp_local_deliver_to_rcpts(struct lmtp_local *local,
 {
 	uid_t first_uid = (uid_t)-1;
 	struct mail *src_mail;
+	struct event *event;
 	struct lmtp_local_recipient *const *llrcpts;
 	unsigned int count, i;
 	int ret;
@@ -654,9 +699,13 @@ lmtp_local_deliver_to_rcpts(struct lmtp_local *local,
 			continue;
 		}
 
+		event = event_create(rcpt->event);
 		ret = lmtp_local_deliver(local, cmd,
 			trans, llrcpt, src_mail, session);
 		i_set_failure_prefix("lmtp(%s): ", my_pid);
+		lmtp_local_rcpt_delivery_finished(local, llrcpt, event,
+						  src_mail, ret);
+		event_unref(&event);
 
 		/* succeeded and mail_user is not saved in first_saved_mail */
 		if ((ret == 0 &&
@@ -690,6 +739,13 @@ lmtp_local_open_raw_mail(struct lmtp_local *local,
 		"From", "To", "Message-ID", "Subject", "Return-Path",
 		NULL
 	};
+	/* The raw mail is shared by all the recipients. Have the message
+	   structure and sizes parsed the first time the message is read, so
+	   they stay cached in the mail for the following deliveries (and e.g.
+	   Sieve scripts) instead of going through the message again. */
+	static const enum mail_fetch_field wanted_fields =
+		MAIL_FETCH_MESSAGE_PARTS |
+		MAIL_FETCH_PHYSICAL_SIZE | MAIL_FETCH_VIRTUAL_SIZE;
 	struct client *client = local->client;
 	struct mailbox *box;
 	struct mailbox_transaction_context *mtrans;
@@ -710,7 +766,7 @@ lmtp_local_open_raw_mail(struct lmtp_local *local,
 	mtrans = mailbox_transaction_begin(box, 0, __func__);
 
 	headers_ctx = mailbox_header_lookup_init(box, wanted_headers);
-	local->raw_mail = mail_alloc(mtrans, 0, headers_ctx);
+	local->raw_mail = mail_alloc(mtrans, wanted_fields, headers_ctx);
 	mailbox_header_lookup_unref(&headers_ctx);
 	mail_set_seq(local->raw_mail, 1);
 	return 0;
@@ -69,11 +69,6 @@ fs_compress_init(struct fs *_fs, const char *args, const
 	}
 
 	level_str = t_strdup_until(args, p++);
-	if (str_to_uint(level_str, &fs->compress_level) < 0 ||
-	    fs->compress_level > 9) {
-		fs_set_error(_fs, "Invalid compression level parameter '%s'", level_str);
-		return -1;
-	}
 	args = p;
 
 	fs->handler = compression_lookup_handler(compression_name);
@@ -81,6 +76,11 @@ fs_compress_init(struct fs *_fs, const char *args, const
 		fs_set_error(_fs, "Compression method '%s' not support", compression_name);
 		return -1;
 	}
+	if (str_to_uint(level_str, &fs->compress_level) < 0 ||
+	    fs->compress_level > fs->handler->max_level) {
+		fs_set_error(_fs, "Invalid compression level parameter '%s'", level_str);
+		return -1;
+	}
 
 	parent_args = strchr(args, ':');
 	if (parent_args == NULL) {
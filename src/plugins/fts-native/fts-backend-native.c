@@ -0,0 +1,543 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "strnum.h"
+#include "file-lock.h"
+#include "mail-user.h"
+#include "mail-namespace.h"
+#include "mail-storage-private.h"
+#include "mailbox-list-iter.h"
+#include "mail-search-build.h"
+#include "fts-native-index.h"
+#include "fts-native-plugin.h"
+
+#define FTS_NATIVE_FILE_PREFIX "dovecot.fts-native"
+#define FTS_NATIVE_LOCK_FNAME "dovecot-fts-native.lock"
+#define FTS_NATIVE_LOCK_SECS 60
+
+struct native_fts_backend {
+	struct fts_backend backend;
+	struct fts_native_settings set;
+
+	struct mailbox *box;
+	struct fts_native_index *index;
+	bool refresh;
+};
+
+struct native_fts_backend_update_context {
+	struct fts_backend_update_context ctx;
+
+	struct mailbox *box;
+	struct file_lock *lock;
+	struct fts_native_build *build;
+	ARRAY_TYPE(seq_range) expunged_uids;
+
+	enum fts_native_field field;
+	uint32_t uid, last_uid;
+	bool failed;
+};
+
+static struct fts_backend *fts_backend_native_alloc(void)
+{
+	struct native_fts_backend *backend;
+
+	backend = i_new(struct native_fts_backend, 1);
+	backend->backend = fts_backend_native;
+	return &backend->backend;
+}
+
+static int
+fts_backend_native_init(struct fts_backend *_backend, const char **error_r)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	const char *const *tmp, *env;
+	unsigned int num;
+
+	if (FTS_NATIVE_USER_CONTEXT(_backend->ns->user) == NULL) {
+		*error_r = "Failed to initialize lib-fts for the user";
+		return -1;
+	}
+
+	env = mail_user_plugin_getenv(_backend->ns->user, "fts_native");
+	if (env == NULL)
+		return 0;
+
+	for (tmp = t_strsplit_spaces(env, " "); *tmp != NULL; tmp++) {
+		if (str_begins(*tmp, "max_segments=")) {
+			if (str_to_uint(*tmp + 13, &num) < 0 || num == 0) {
+				*error_r = t_strdup_printf(
+					"Invalid max_segments: %s", *tmp + 13);
+				return -1;
+			}
+			backend->set.max_segments = num;
+		} else if (str_begins(*tmp, "build_memory_kb=")) {
+			if (str_to_uint(*tmp + 16, &num) < 0 || num == 0) {
+				*error_r = t_strdup_printf(
+					"Invalid build_memory_kb: %s", *tmp + 16);
+				return -1;
+			}
+			backend->set.max_build_memory = (size_t)num * 1024;
+		} else {
+			*error_r = t_strdup_printf("Invalid setting: %s", *tmp);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+fts_backend_native_unset_box(struct native_fts_backend *backend)
+{
+	if (backend->index != NULL)
+		fts_native_index_deinit(&backend->index);
+	backend->box = NULL;
+}
+
+static void fts_backend_native_deinit(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	fts_backend_native_unset_box(backend);
+	i_free(backend);
+}
+
+static int
+fts_backend_native_set_box(struct native_fts_backend *backend,
+			   struct mailbox *box)
+{
+	const struct mailbox_permissions *perm;
+	struct fts_native_settings set;
+	const char *path;
+
+	if (backend->box == box) {
+		if (backend->refresh) {
+			if (fts_native_index_refresh(backend->index) < 0)
+				return -1;
+			backend->refresh = FALSE;
+		}
+		return 0;
+	}
+	fts_backend_native_unset_box(backend);
+	backend->refresh = FALSE;
+	if (box == NULL)
+		return 0;
+
+	perm = mailbox_get_permissions(box);
+	if (mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX, &path) <= 0)
+		i_unreached(); /* fts already checked this */
+
+	set = backend->set;
+	set.file_create_mode = perm->file_create_mode;
+	set.file_create_gid = perm->file_create_gid;
+	backend->index = fts_native_index_init(
+		t_strconcat(path, "/"FTS_NATIVE_FILE_PREFIX, NULL), &set);
+	backend->box = box;
+	return fts_native_index_refresh(backend->index);
+}
+
+static int
+fts_backend_native_lock(struct mailbox *box, struct file_lock **lock_r)
+{
+	const char *error;
+	int ret;
+
+	ret = mailbox_lock_file_create(box, FTS_NATIVE_LOCK_FNAME,
+				       FTS_NATIVE_LOCK_SECS, lock_r, &error);
+	if (ret < 0)
+		mailbox_set_critical(box, "fts-native: %s", error);
+	else if (ret == 0) {
+		mailbox_set_critical(box,
+			"fts-native: Timeout while waiting for index lock: %s",
+			error);
+	}
+	return ret <= 0 ? -1 : 0;
+}
+
+static int
+fts_backend_native_get_last_uid(struct fts_backend *_backend ATTR_UNUSED,
+				struct mailbox *box, uint32_t *last_uid_r)
+{
+	struct fts_index_header hdr;
+
+	if (!fts_index_get_header(box, &hdr))
+		*last_uid_r = 0;
+	else
+		*last_uid_r = hdr.last_indexed_uid;
+	return 0;
+}
+
+static struct fts_backend_update_context *
+fts_backend_native_update_init(struct fts_backend *_backend)
+{
+	struct native_fts_backend_update_context *ctx;
+
+	ctx = i_new(struct native_fts_backend_update_context, 1);
+	ctx->ctx.backend = _backend;
+	i_array_init(&ctx->expunged_uids, 16);
+	return &ctx->ctx;
+}
+
+static int
+fts_backend_native_update_finish_box(struct native_fts_backend_update_context *ctx)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)ctx->ctx.backend;
+	int ret = 0;
+
+	if (ctx->build != NULL) {
+		if (ctx->failed)
+			fts_native_build_abort(&ctx->build);
+		else if (fts_native_build_deinit(&ctx->build) < 0)
+			ret = -1;
+		else if (ctx->last_uid != 0)
+			fts_index_set_last_uid(ctx->box, ctx->last_uid);
+	}
+	if (array_count(&ctx->expunged_uids) > 0 && !ctx->failed) {
+		if (fts_native_index_expunge(backend->index,
+					     &ctx->expunged_uids) < 0)
+			ret = -1;
+	}
+	array_clear(&ctx->expunged_uids);
+	if (ctx->lock != NULL)
+		file_lock_free(&ctx->lock);
+	ctx->box = NULL;
+	ctx->uid = 0;
+	ctx->last_uid = 0;
+	return ret;
+}
+
+static int
+fts_backend_native_update_deinit(struct fts_backend_update_context *_ctx)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	int ret = ctx->failed ? -1 : 0;
+
+	if (fts_backend_native_update_finish_box(ctx) < 0)
+		ret = -1;
+	array_free(&ctx->expunged_uids);
+	i_free(ctx);
+	return ret;
+}
+
+static void
+fts_backend_native_update_set_mailbox(struct fts_backend_update_context *_ctx,
+				      struct mailbox *box)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)ctx->ctx.backend;
+
+	if (fts_backend_native_update_finish_box(ctx) < 0)
+		ctx->failed = TRUE;
+	if (box == NULL || ctx->failed)
+		return;
+
+	if (fts_backend_native_lock(box, &ctx->lock) < 0 ||
+	    fts_backend_native_set_box(backend, box) < 0) {
+		ctx->failed = TRUE;
+		return;
+	}
+	ctx->box = box;
+	ctx->build = fts_native_build_init(backend->index);
+}
+
+static void
+fts_backend_native_update_expunge(struct fts_backend_update_context *_ctx,
+				  uint32_t uid)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	/* written to the index when the mailbox is finished */
+	if (ctx->box != NULL)
+		seq_range_array_add(&ctx->expunged_uids, uid);
+}
+
+static bool
+fts_backend_native_update_set_build_key(struct fts_backend_update_context *_ctx,
+					const struct fts_backend_build_key *key)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	if (ctx->failed || ctx->build == NULL)
+		return FALSE;
+
+	switch (key->type) {
+	case FTS_BACKEND_BUILD_KEY_HDR:
+	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
+		ctx->field = FTS_NATIVE_FIELD_HEADER;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART:
+		ctx->field = FTS_NATIVE_FIELD_BODY;
+		break;
+	case FTS_BACKEND_BUILD_KEY_BODY_PART_BINARY:
+		i_unreached();
+	}
+	ctx->uid = key->uid;
+	if (ctx->last_uid < key->uid)
+		ctx->last_uid = key->uid;
+	return TRUE;
+}
+
+static void
+fts_backend_native_update_unset_build_key(struct fts_backend_update_context *_ctx ATTR_UNUSED)
+{
+}
+
+static int
+fts_backend_native_update_build_more(struct fts_backend_update_context *_ctx,
+				     const unsigned char *data, size_t size)
+{
+	struct native_fts_backend_update_context *ctx =
+		(struct native_fts_backend_update_context *)_ctx;
+
+	fts_native_build_add(ctx->build, ctx->uid, ctx->field, data, size);
+	return 0;
+}
+
+static int fts_backend_native_refresh(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	backend->refresh = TRUE;
+	return 0;
+}
+
+static int get_all_msg_uids(struct mailbox *box, ARRAY_TYPE(seq_range) *uids)
+{
+	struct mailbox_transaction_context *t;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *search_args;
+	struct mail *mail;
+	int ret;
+
+	t = mailbox_transaction_begin(box, 0, __func__);
+
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	search_ctx = mailbox_search_init(t, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+
+	while (mailbox_search_next(search_ctx, &mail))
+		seq_range_array_add(uids, mail->uid);
+	ret = mailbox_search_deinit(&search_ctx);
+	(void)mailbox_transaction_commit(&t);
+	return ret;
+}
+
+static int
+fts_backend_native_optimize_box(struct native_fts_backend *backend,
+				struct mailbox *box, bool rescan)
+{
+	struct file_lock *lock;
+	ARRAY_TYPE(seq_range) uids;
+	int ret = 0;
+
+	if (fts_backend_native_lock(box, &lock) < 0)
+		return -1;
+
+	/* merge all segments and drop the expunged messages */
+	i_array_init(&uids, 128);
+	if (fts_backend_native_set_box(backend, box) < 0 ||
+	    get_all_msg_uids(box, &uids) < 0 ||
+	    fts_native_index_merge(backend->index, &uids) < 0)
+		ret = -1;
+	else if (rescan) {
+		/* Messages without any tokens don't show up in the index, so
+		   it can't tell which messages are missing. Index them all
+		   again - the UIDs that already exist in the segment are
+		   merged with the new ones. */
+		if (fts_index_set_last_uid(box, 0) < 0)
+			ret = -1;
+	}
+	array_free(&uids);
+	file_lock_free(&lock);
+	return ret;
+}
+
+static int
+fts_backend_native_optimize_all(struct native_fts_backend *backend,
+				bool rescan)
+{
+	struct fts_backend *_backend = &backend->backend;
+	struct mailbox_list_iterate_context *iter;
+	const struct mailbox_info *info;
+	struct mailbox *box;
+	int ret = 0;
+
+	iter = mailbox_list_iter_init(_backend->ns->list, "*",
+				      MAILBOX_LIST_ITER_SKIP_ALIASES |
+				      MAILBOX_LIST_ITER_NO_AUTO_BOXES);
+	while ((info = mailbox_list_iter_next(iter)) != NULL) {
+		if ((info->flags &
+		     (MAILBOX_NONEXISTENT | MAILBOX_NOSELECT)) != 0)
+			continue;
+
+		box = mailbox_alloc(info->ns->list, info->vname, 0);
+		if (mailbox_open(box) == 0) {
+			if (fts_backend_native_optimize_box(backend, box,
+							    rescan) < 0)
+				ret = -1;
+		}
+		fts_backend_native_unset_box(backend);
+		mailbox_free(&box);
+	}
+	if (mailbox_list_iter_deinit(&iter) < 0)
+		ret = -1;
+	return ret;
+}
+
+static int fts_backend_native_rescan(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	return fts_backend_native_optimize_all(backend, TRUE);
+}
+
+static int fts_backend_native_optimize(struct fts_backend *_backend)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+
+	return fts_backend_native_optimize_all(backend, FALSE);
+}
+
+static int native_lookup_arg(struct native_fts_backend *backend,
+			     const struct mail_search_arg *arg, bool and_args,
+			     ARRAY_TYPE(seq_range) *definite_uids,
+			     ARRAY_TYPE(seq_range) *maybe_uids)
+{
+	enum fts_native_field fields;
+	ARRAY_TYPE(seq_range) tmp_definite_uids, tmp_maybe_uids;
+	bool definite;
+	int ret;
+
+	switch (arg->type) {
+	case SEARCH_TEXT:
+		fields = FTS_NATIVE_FIELD_HEADER | FTS_NATIVE_FIELD_BODY;
+		definite = TRUE;
+		break;
+	case SEARCH_BODY:
+		fields = FTS_NATIVE_FIELD_BODY;
+		definite = TRUE;
+		break;
+	case SEARCH_HEADER:
+	case SEARCH_HEADER_ADDRESS:
+	case SEARCH_HEADER_COMPRESS_LWSP:
+		/* the header name isn't stored with the tokens */
+		fields = FTS_NATIVE_FIELD_HEADER;
+		definite = FALSE;
+		break;
+	default:
+		return 0;
+	}
+	if (arg->match_not || arg->value.str[0] == '\0') {
+		/* leave these for the regular search */
+		return 0;
+	}
+
+	i_array_init(&tmp_definite_uids, 128);
+	i_array_init(&tmp_maybe_uids, 128);
+
+	ret = fts_native_index_lookup(backend->index, fields, arg->value.str,
+				      definite ? &tmp_definite_uids :
+				      &tmp_maybe_uids);
+
+	if (and_args) {
+		/* AND:
+		   definite && definite -> definite
+		   definite && maybe -> maybe
+		   maybe && maybe -> maybe */
+
+		/* put definites among maybies, so they can be intersected */
+		seq_range_array_merge(maybe_uids, definite_uids);
+		seq_range_array_merge(&tmp_maybe_uids, &tmp_definite_uids);
+
+		seq_range_array_intersect(maybe_uids, &tmp_maybe_uids);
+		seq_range_array_intersect(definite_uids, &tmp_definite_uids);
+		/* remove duplicate maybies that are also definites */
+		seq_range_array_remove_seq_range(maybe_uids, definite_uids);
+	} else {
+		/* OR:
+		   definite || definite -> definite
+		   definite || maybe -> definite
+		   maybe || maybe -> maybe */
+
+		/* remove maybies that are now definites */
+		seq_range_array_remove_seq_range(&tmp_maybe_uids,
+						 definite_uids);
+		seq_range_array_remove_seq_range(maybe_uids,
+						 &tmp_definite_uids);
+
+		seq_range_array_merge(definite_uids, &tmp_definite_uids);
+		seq_range_array_merge(maybe_uids, &tmp_maybe_uids);
+	}
+
+	array_free(&tmp_definite_uids);
+	array_free(&tmp_maybe_uids);
+	return ret < 0 ? -1 : 1;
+}
+
+static int
+fts_backend_native_lookup(struct fts_backend *_backend, struct mailbox *box,
+			  struct mail_search_arg *args,
+			  enum fts_lookup_flags flags,
+			  struct fts_result *result)
+{
+	struct native_fts_backend *backend =
+		(struct native_fts_backend *)_backend;
+	bool and_args = (flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0;
+	bool first = TRUE;
+	int ret;
+
+	if (fts_backend_native_set_box(backend, box) < 0)
+		return -1;
+
+	for (; args != NULL; args = args->next) {
+		ret = native_lookup_arg(backend, args, first ? FALSE : and_args,
+					&result->definite_uids,
+					&result->maybe_uids);
+		if (ret < 0)
+			return -1;
+		if (ret > 0) {
+			args->match_always = TRUE;
+			first = FALSE;
+		}
+	}
+	return 0;
+}
+
+struct fts_backend fts_backend_native = {
+	.name = "native",
+	.flags = FTS_BACKEND_FLAG_TOKENIZED_INPUT,
+
+	{
+		fts_backend_native_alloc,
+		fts_backend_native_init,
+		fts_backend_native_deinit,
+		fts_backend_native_get_last_uid,
+		fts_backend_native_update_init,
+		fts_backend_native_update_deinit,
+		fts_backend_native_update_set_mailbox,
+		fts_backend_native_update_expunge,
+		fts_backend_native_update_set_build_key,
+		fts_backend_native_update_unset_build_key,
+		fts_backend_native_update_build_more,
+		fts_backend_native_refresh,
+		fts_backend_native_rescan,
+		fts_backend_native_optimize,
+		fts_backend_default_can_lookup,
+		fts_backend_native_lookup,
+		NULL,
+		NULL
+	}
+};
@@ -0,0 +1,1208 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "hash.h"
+#include "str.h"
+#include "strnum.h"
+#include "istream.h"
+#include "ostream.h"
+#include "numpack.h"
+#include "sort.h"
+#include "mmap-util.h"
+#include "write-full.h"
+#include "fts-native-index.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define FTS_NATIVE_SEGMENT_MAGIC 0x53544644 /* "DFTS" */
+#define FTS_NATIVE_SEGMENT_VERSION 1
+#define FTS_NATIVE_LIST_VERSION "1"
+
+#define FTS_NATIVE_DEFAULT_MAX_SEGMENTS 8
+#define FTS_NATIVE_DEFAULT_MAX_BUILD_MEMORY (32*1024*1024)
+/* Segments smaller than this are all in the lowest merge tier */
+#define FTS_NATIVE_MERGE_MIN_TIER_SIZE (64*1024)
+/* Segments may get merged and deleted while we're reading the list */
+#define FTS_NATIVE_REFRESH_MAX_RETRIES 5
+
+#define FTS_NATIVE_FIELD_CHAR_BODY 'b'
+#define FTS_NATIVE_FIELD_CHAR_HEADER 'h'
+
+/* The header is followed by the terms sorted by their key. Each term is:
+
+   numpack key_size, key (field char + token),
+   numpack uid_count, numpack first_uid, numpack uid_delta, ...
+
+   The terms are followed by uint32_t term_offsets[term_count], which is
+   used for binary searching the terms. */
+struct fts_native_segment_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t term_count;
+	uint32_t term_index_offset;
+};
+
+struct fts_native_segment {
+	uint32_t id;
+	char *path;
+	int fd;
+
+	void *mmap_base;
+	size_t mmap_size;
+
+	const struct fts_native_segment_header *hdr;
+	const uint32_t *term_offsets;
+	const uint8_t *terms_end;
+};
+ARRAY_DEFINE_TYPE(fts_native_segment, struct fts_native_segment *);
+
+struct fts_native_segment_writer {
+	char *path;
+	int fd;
+	struct ostream *output;
+
+	buffer_t *buf;
+	ARRAY(uint32_t) term_offsets;
+
+	bool failed;
+};
+
+struct fts_native_build_term {
+	ARRAY(uint32_t) uids;
+	bool unsorted;
+};
+
+struct fts_native_build {
+	struct fts_native_index *index;
+
+	pool_t pool;
+	HASH_TABLE(char *, struct fts_native_build_term *) terms;
+	string_t *key;
+	size_t memory_used;
+
+	bool failed;
+};
+
+struct fts_native_index {
+	char *path_prefix, *list_path;
+	struct fts_native_settings set;
+
+	struct stat list_st;
+	ARRAY(struct fts_native_segment *) segments;
+	/* UIDs that are still in the segments, but have been expunged */
+	ARRAY_TYPE(seq_range) expunged_uids;
+	uint32_t next_segment_id;
+	/* Number of bytes written to merged segments */
+	uoff_t merge_written_bytes;
+	bool list_read;
+};
+
+struct fts_native_index *
+fts_native_index_init(const char *path_prefix,
+		      const struct fts_native_settings *set)
+{
+	struct fts_native_index *index;
+
+	index = i_new(struct fts_native_index, 1);
+	index->path_prefix = i_strdup(path_prefix);
+	index->list_path = i_strconcat(path_prefix, ".list", NULL);
+	index->set = *set;
+	if (index->set.file_create_mode == 0)
+		index->set.file_create_mode = 0600;
+	if (index->set.max_segments == 0)
+		index->set.max_segments = FTS_NATIVE_DEFAULT_MAX_SEGMENTS;
+	if (index->set.max_build_memory == 0) {
+		index->set.max_build_memory =
+			FTS_NATIVE_DEFAULT_MAX_BUILD_MEMORY;
+	}
+	i_array_init(&index->segments, 8);
+	i_array_init(&index->expunged_uids, 8);
+	index->next_segment_id = 1;
+	return index;
+}
+
+static void fts_native_segment_close(struct fts_native_segment **_seg)
+{
+	struct fts_native_segment *seg = *_seg;
+
+	*_seg = NULL;
+	if (seg->mmap_base != NULL) {
+		if (munmap(seg->mmap_base, seg->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", seg->path);
+	}
+	i_close_fd_path(&seg->fd, seg->path);
+	i_free(seg->path);
+	i_free(seg);
+}
+
+static void fts_native_index_close_segments(struct fts_native_index *index)
+{
+	struct fts_native_segment **segp;
+
+	array_foreach_modifiable(&index->segments, segp)
+		fts_native_segment_close(segp);
+	array_clear(&index->segments);
+}
+
+void fts_native_index_deinit(struct fts_native_index **_index)
+{
+	struct fts_native_index *index = *_index;
+
+	*_index = NULL;
+	fts_native_index_close_segments(index);
+	array_free(&index->segments);
+	array_free(&index->expunged_uids);
+	i_free(index->list_path);
+	i_free(index->path_prefix);
+	i_free(index);
+}
+
+static const char *
+fts_native_segment_path(struct fts_native_index *index, uint32_t id)
+{
+	return t_strdup_printf("%s.%u", index->path_prefix, id);
+}
+
+static void
+fts_native_segment_set_corrupted(struct fts_native_segment *seg,
+				 const char *reason)
+{
+	i_error("fts-native: Corrupted segment %s: %s", seg->path, reason);
+}
+
+static int fts_native_segment_map(struct fts_native_segment *seg)
+{
+	const struct fts_native_segment_header *hdr;
+	struct stat st;
+
+	if (fstat(seg->fd, &st) < 0) {
+		i_error("fstat(%s) failed: %m", seg->path);
+		return -1;
+	}
+	if ((uoff_t)st.st_size < sizeof(*hdr)) {
+		fts_native_segment_set_corrupted(seg, "File too small");
+		return -1;
+	}
+	seg->mmap_size = st.st_size;
+	seg->mmap_base = mmap_ro_file(seg->fd, &seg->mmap_size);
+	if (seg->mmap_base == MAP_FAILED) {
+		seg->mmap_base = NULL;
+		i_error("mmap(%s) failed: %m", seg->path);
+		return -1;
+	}
+
+	hdr = seg->mmap_base;
+	if (hdr->magic != FTS_NATIVE_SEGMENT_MAGIC ||
+	    hdr->version != FTS_NATIVE_SEGMENT_VERSION) {
+		fts_native_segment_set_corrupted(seg, "Invalid header");
+		return -1;
+	}
+	if (hdr->term_index_offset < sizeof(*hdr) ||
+	    hdr->term_index_offset % sizeof(uint32_t) != 0 ||
+	    hdr->term_index_offset > seg->mmap_size ||
+	    (seg->mmap_size - hdr->term_index_offset) / sizeof(uint32_t) <
+	    hdr->term_count) {
+		fts_native_segment_set_corrupted(seg, "Invalid term index");
+		return -1;
+	}
+	seg->hdr = hdr;
+	seg->term_offsets = CONST_PTR_OFFSET(seg->mmap_base,
+					     hdr->term_index_offset);
+	seg->terms_end = CONST_PTR_OFFSET(seg->mmap_base,
+					  hdr->term_index_offset);
+	return 0;
+}
+
+/* Returns 1 if opened, 0 if the segment doesn't exist, -1 if error. */
+static int
+fts_native_segment_open(struct fts_native_index *index, uint32_t id,
+			struct fts_native_segment **seg_r)
+{
+	struct fts_native_segment *seg;
+	const char *path = fts_native_segment_path(index, id);
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		i_error("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	seg = i_new(struct fts_native_segment, 1);
+	seg->id = id;
+	seg->path = i_strdup(path);
+	seg->fd = fd;
+	if (fts_native_segment_map(seg) < 0) {
+		fts_native_segment_close(&seg);
+		return -1;
+	}
+	*seg_r = seg;
+	return 1;
+}
+
+static int
+fts_native_segment_get_term(struct fts_native_segment *seg, uint32_t idx,
+			    const uint8_t **key_r, uint32_t *key_size_r,
+			    const uint8_t **postings_r)
+{
+	const uint8_t *p;
+
+	i_assert(idx < seg->hdr->term_count);
+
+	if (seg->term_offsets[idx] < sizeof(*seg->hdr) ||
+	    seg->term_offsets[idx] >= seg->hdr->term_index_offset) {
+		fts_native_segment_set_corrupted(seg, "Invalid term offset");
+		return -1;
+	}
+	p = CONST_PTR_OFFSET(seg->mmap_base, seg->term_offsets[idx]);
+	if (numpack_decode32(&p, seg->terms_end, key_size_r) < 0 ||
+	    *key_size_r > (size_t)(seg->terms_end - p)) {
+		fts_native_segment_set_corrupted(seg, "Invalid term key");
+		return -1;
+	}
+	*key_r = p;
+	*postings_r = p + *key_size_r;
+	return 0;
+}
+
+static int
+fts_native_segment_read_uids(struct fts_native_segment *seg,
+			     const uint8_t *p, ARRAY_TYPE(seq_range) *uids)
+{
+	uint32_t i, count, delta, uid = 0;
+
+	if (numpack_decode32(&p, seg->terms_end, &count) < 0) {
+		fts_native_segment_set_corrupted(seg, "Invalid UID count");
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (numpack_decode32(&p, seg->terms_end, &delta) < 0 ||
+		    delta == 0 || uid > (uint32_t)-1 - delta) {
+			fts_native_segment_set_corrupted(seg, "Invalid UID");
+			return -1;
+		}
+		uid += delta;
+		seq_range_array_add(uids, uid);
+	}
+	return 0;
+}
+
+static int key_cmp(const void *key1, size_t key1_size,
+		   const void *key2, size_t key2_size)
+{
+	int ret;
+
+	ret = memcmp(key1, key2, I_MIN(key1_size, key2_size));
+	if (ret != 0)
+		return ret;
+	return key1_size < key2_size ? -1 :
+		(key1_size > key2_size ? 1 : 0);
+}
+
+static int
+fts_native_segment_lookup(struct fts_native_segment *seg,
+			  const void *key, size_t key_size,
+			  ARRAY_TYPE(seq_range) *uids)
+{
+	const uint8_t *term_key, *postings;
+	uint32_t term_key_size, idx, left_idx, right_idx;
+	int ret;
+
+	left_idx = 0; right_idx = seg->hdr->term_count;
+	while (left_idx < right_idx) {
+		idx = (left_idx + right_idx) / 2;
+		if (fts_native_segment_get_term(seg, idx, &term_key,
+						&term_key_size, &postings) < 0)
+			return -1;
+
+		ret = key_cmp(key, key_size, term_key, term_key_size);
+		if (ret < 0)
+			right_idx = idx;
+		else if (ret > 0)
+			left_idx = idx+1;
+		else
+			return fts_native_segment_read_uids(seg, postings, uids);
+	}
+	return 0;
+}
+
+static int
+fts_native_list_parse_expunged(const char *line, ARRAY_TYPE(seq_range) *uids)
+{
+	uint32_t uid1, uid2;
+	const char *end;
+
+	/* e<uid1>-<uid2> */
+	if (str_parse_uint32(line + 1, &uid1, &end) < 0 || *end != '-' ||
+	    str_to_uint32(end + 1, &uid2) < 0 || uid1 == 0 || uid1 > uid2)
+		return -1;
+	seq_range_array_add_range(uids, uid1, uid2);
+	return 0;
+}
+
+static int
+fts_native_index_read_list(struct fts_native_index *index,
+			   ARRAY_TYPE(uint32_t) *ids,
+			   ARRAY_TYPE(seq_range) *expunged_uids)
+{
+	struct istream *input;
+	const char *line;
+	uint32_t id;
+	int ret = 0;
+
+	input = i_stream_create_file(index->list_path, 1024);
+	if ((line = i_stream_read_next_line(input)) == NULL) {
+		/* empty or missing list */
+	} else if (strcmp(line, FTS_NATIVE_LIST_VERSION) != 0) {
+		i_error("fts-native: %s: Unsupported version %s",
+			index->list_path, line);
+		ret = -1;
+	} else {
+		while ((line = i_stream_read_next_line(input)) != NULL) {
+			if (line[0] == 'e') {
+				if (fts_native_list_parse_expunged(line,
+						expunged_uids) == 0)
+					continue;
+				i_error("fts-native: %s: Invalid expunged UIDs %s",
+					index->list_path, line);
+				ret = -1;
+				break;
+			}
+			if (str_to_uint32(line, &id) < 0 || id == 0) {
+				i_error("fts-native: %s: Invalid segment ID %s",
+					index->list_path, line);
+				ret = -1;
+				break;
+			}
+			array_push_back(ids, &id);
+		}
+	}
+	if (input->stream_errno != 0 && input->stream_errno != ENOENT) {
+		i_error("read(%s) failed: %s", index->list_path,
+			i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_unref(&input);
+	return ret;
+}
+
+static int fts_native_index_refresh_try(struct fts_native_index *index)
+{
+	ARRAY_TYPE(uint32_t) ids;
+	struct fts_native_segment *seg;
+	const uint32_t *idp;
+	struct stat st;
+	int ret;
+
+	if (stat(index->list_path, &st) < 0) {
+		if (errno != ENOENT) {
+			i_error("stat(%s) failed: %m", index->list_path);
+			return -1;
+		}
+		i_zero(&st);
+	}
+	if (index->list_read && !ST_CHANGED(st, index->list_st))
+		return 1;
+
+	fts_native_index_close_segments(index);
+	array_clear(&index->expunged_uids);
+	index->list_read = FALSE;
+	index->next_segment_id = 1;
+
+	t_array_init(&ids, 8);
+	if (fts_native_index_read_list(index, &ids,
+				       &index->expunged_uids) < 0)
+		return -1;
+	array_foreach(&ids, idp) {
+		ret = fts_native_segment_open(index, *idp, &seg);
+		if (ret <= 0) {
+			/* ret == 0: the list was just replaced */
+			fts_native_index_close_segments(index);
+			return ret;
+		}
+		array_push_back(&index->segments, &seg);
+		if (index->next_segment_id <= *idp)
+			index->next_segment_id = *idp + 1;
+	}
+	index->list_st = st;
+	index->list_read = TRUE;
+	return 1;
+}
+
+int fts_native_index_refresh(struct fts_native_index *index)
+{
+	unsigned int i;
+	int ret;
+
+	for (i = 0; i < FTS_NATIVE_REFRESH_MAX_RETRIES; i++) {
+		T_BEGIN {
+			ret = fts_native_index_refresh_try(index);
+		} T_END;
+		if (ret != 0)
+			return ret < 0 ? -1 : 0;
+	}
+	i_error("fts-native: %s: Segments keep disappearing",
+		index->list_path);
+	return -1;
+}
+
+unsigned int fts_native_index_get_segment_count(struct fts_native_index *index)
+{
+	return array_count(&index->segments);
+}
+
+uoff_t fts_native_index_get_merge_written_bytes(struct fts_native_index *index)
+{
+	return index->merge_written_bytes;
+}
+
+static void
+fts_native_key_init(string_t *key, enum fts_native_field field,
+		    const void *token, size_t size)
+{
+	str_truncate(key, 0);
+	switch (field) {
+	case FTS_NATIVE_FIELD_BODY:
+		str_append_c(key, FTS_NATIVE_FIELD_CHAR_BODY);
+		break;
+	case FTS_NATIVE_FIELD_HEADER:
+		str_append_c(key, FTS_NATIVE_FIELD_CHAR_HEADER);
+		break;
+	default:
+		i_unreached();
+	}
+	str_append_data(key, token, size);
+}
+
+int fts_native_index_lookup(struct fts_native_index *index,
+			    enum fts_native_field fields,
+			    const char *token, ARRAY_TYPE(seq_range) *uids)
+{
+	static const enum fts_native_field all_fields[] = {
+		FTS_NATIVE_FIELD_BODY, FTS_NATIVE_FIELD_HEADER
+	};
+	struct fts_native_segment *const *segp;
+	ARRAY_TYPE(seq_range) found_uids;
+	string_t *key = t_str_new(128);
+	unsigned int i;
+
+	t_array_init(&found_uids, 32);
+	for (i = 0; i < N_ELEMENTS(all_fields); i++) {
+		if ((fields & all_fields[i]) == 0)
+			continue;
+
+		fts_native_key_init(key, all_fields[i], token, strlen(token));
+		array_foreach(&index->segments, segp) {
+			if (fts_native_segment_lookup(*segp, str_data(key),
+						      str_len(key),
+						      &found_uids) < 0)
+				return -1;
+		}
+	}
+	seq_range_array_remove_seq_range(&found_uids, &index->expunged_uids);
+	seq_range_array_merge(uids, &found_uids);
+	return 0;
+}
+
+static int
+fts_native_create_file(struct fts_native_index *index, const char *path)
+{
+	mode_t old_mask;
+	int fd;
+
+	old_mask = umask(0);
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC,
+		  index->set.file_create_mode);
+	umask(old_mask);
+	if (fd == -1) {
+		i_error("creat(%s) failed: %m", path);
+		return -1;
+	}
+	if (index->set.file_create_gid != (gid_t)-1) {
+		if (fchown(fd, (uid_t)-1, index->set.file_create_gid) < 0) {
+			i_error("fchown(%s, -1, %ld) failed: %m",
+				path, (long)index->set.file_create_gid);
+			i_close_fd(&fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static int
+fts_native_index_write_list(struct fts_native_index *index,
+			    const ARRAY_TYPE(uint32_t) *ids,
+			    const ARRAY_TYPE(seq_range) *expunged_uids)
+{
+	const struct seq_range *range;
+	const char *temp_path;
+	const uint32_t *idp;
+	string_t *str;
+	int fd, ret = 0;
+
+	str = t_str_new(128);
+	str_append(str, FTS_NATIVE_LIST_VERSION"\n");
+	array_foreach(ids, idp)
+		str_printfa(str, "%u\n", *idp);
+	if (expunged_uids != NULL) {
+		array_foreach(expunged_uids, range)
+			str_printfa(str, "e%u-%u\n", range->seq1, range->seq2);
+	}
+
+	temp_path = t_strconcat(index->list_path, ".tmp", NULL);
+	fd = fts_native_create_file(index, temp_path);
+	if (fd == -1)
+		return -1;
+	if (write_full(fd, str_data(str), str_len(str)) < 0) {
+		i_error("write(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if (close(fd) < 0) {
+		i_error("close(%s) failed: %m", temp_path);
+		ret = -1;
+	}
+	if (ret == 0 && rename(temp_path, index->list_path) < 0) {
+		i_error("rename(%s, %s) failed: %m",
+			temp_path, index->list_path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink_if_exists(temp_path);
+	return ret;
+}
+
+static struct fts_native_segment_writer *
+fts_native_segment_writer_init(struct fts_native_index *index, uint32_t id)
+{
+	struct fts_native_segment_writer *writer;
+	struct fts_native_segment_header hdr;
+	const char *path = fts_native_segment_path(index, id);
+	int fd;
+
+	fd = fts_native_create_file(index, path);
+	if (fd == -1)
+		return NULL;
+
+	writer = i_new(struct fts_native_segment_writer, 1);
+	writer->path = i_strdup(path);
+	writer->fd = fd;
+	writer->output = o_stream_create_fd_file(fd, 0, FALSE);
+	o_stream_cork(writer->output);
+	writer->buf = buffer_create_dynamic(default_pool, 256);
+	i_array_init(&writer->term_offsets, 1024);
+
+	/* the header is written once the term index offset is known */
+	i_zero(&hdr);
+	o_stream_nsend(writer->output, &hdr, sizeof(hdr));
+	return writer;
+}
+
+static int
+fts_native_segment_writer_add(struct fts_native_segment_writer *writer,
+			      const void *key, size_t key_size,
+			      const uint32_t *uids, unsigned int uid_count)
+{
+	uint32_t offset, prev_uid = 0;
+	unsigned int i;
+
+	i_assert(uid_count > 0);
+	i_assert(!writer->failed);
+
+	if (writer->output->offset > (uint32_t)-1) {
+		/* term offsets are 32bit */
+		i_error("fts-native: %s: Segment grew too large",
+			writer->path);
+		writer->failed = TRUE;
+		return -1;
+	}
+	offset = writer->output->offset;
+	array_push_back(&writer->term_offsets, &offset);
+
+	buffer_set_used_size(writer->buf, 0);
+	numpack_encode(writer->buf, key_size);
+	buffer_append(writer->buf, key, key_size);
+	numpack_encode(writer->buf, uid_count);
+	for (i = 0; i < uid_count; i++) {
+		i_assert(uids[i] > prev_uid);
+		numpack_encode(writer->buf, uids[i] - prev_uid);
+		prev_uid = uids[i];
+	}
+	o_stream_nsend(writer->output, writer->buf->data, writer->buf->used);
+	return 0;
+}
+
+static void
+fts_native_segment_writer_free(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+
+	*_writer = NULL;
+	o_stream_destroy(&writer->output);
+	i_close_fd_path(&writer->fd, writer->path);
+	buffer_free(&writer->buf);
+	array_free(&writer->term_offsets);
+	i_free(writer->path);
+	i_free(writer);
+}
+
+static void
+fts_native_segment_writer_abort(struct fts_native_segment_writer **_writer)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+
+	o_stream_abort(writer->output);
+	i_unlink_if_exists(writer->path);
+	fts_native_segment_writer_free(_writer);
+}
+
+static int
+fts_native_segment_writer_finish(struct fts_native_segment_writer **_writer,
+				 uoff_t *size_r)
+{
+	struct fts_native_segment_writer *writer = *_writer;
+	struct fts_native_segment_header hdr;
+	static const uint8_t pad[sizeof(uint32_t)] = { 0, };
+	size_t pad_size;
+
+	i_assert(!writer->failed);
+
+	pad_size = writer->output->offset % sizeof(uint32_t);
+	if (pad_size != 0) {
+		o_stream_nsend(writer->output, pad,
+			       sizeof(uint32_t) - pad_size);
+	}
+
+	i_zero(&hdr);
+	hdr.magic = FTS_NATIVE_SEGMENT_MAGIC;
+	hdr.version = FTS_NATIVE_SEGMENT_VERSION;
+	hdr.term_count = array_count(&writer->term_offsets);
+	hdr.term_index_offset = writer->output->offset;
+	if (writer->output->offset > (uint32_t)-1) {
+		i_error("fts-native: %s: Segment grew too large",
+			writer->path);
+		fts_native_segment_writer_abort(_writer);
+		return -1;
+	}
+	o_stream_nsend(writer->output, array_front(&writer->term_offsets),
+		       array_count(&writer->term_offsets) * sizeof(uint32_t));
+
+	if (o_stream_finish(writer->output) < 0) {
+		i_error("write(%s) failed: %s", writer->path,
+			o_stream_get_error(writer->output));
+		fts_native_segment_writer_abort(_writer);
+		return -1;
+	}
+	if (pwrite_full(writer->fd, &hdr, sizeof(hdr), 0) < 0) {
+		i_error("pwrite(%s) failed: %m", writer->path);
+		fts_native_segment_writer_abort(_writer);
+		return -1;
+	}
+	*size_r = writer->output->offset;
+	fts_native_segment_writer_free(_writer);
+	return 0;
+}
+
+static void
+fts_native_index_unlink_segments(struct fts_native_index *index,
+				 const ARRAY_TYPE(uint32_t) *ids)
+{
+	const uint32_t *idp;
+
+	array_foreach(ids, idp)
+		i_unlink_if_exists(fts_native_segment_path(index, *idp));
+}
+
+static void
+fts_native_index_get_segment_ids(struct fts_native_index *index,
+				 ARRAY_TYPE(uint32_t) *ids)
+{
+	struct fts_native_segment *const *segp;
+
+	array_foreach(&index->segments, segp)
+		array_push_back(ids, &(*segp)->id);
+}
+
+/* Find the smallest key that any of the segment cursors point to */
+static int
+fts_native_merge_next_key(struct fts_native_segment *const *segs,
+			  unsigned int count, const uint32_t *cursors,
+			  const uint8_t **key_r, uint32_t *key_size_r)
+{
+	const uint8_t *key, *postings;
+	uint32_t key_size;
+	unsigned int i;
+
+	*key_r = NULL;
+	for (i = 0; i < count; i++) {
+		if (cursors[i] == segs[i]->hdr->term_count)
+			continue;
+		if (fts_native_segment_get_term(segs[i], cursors[i], &key,
+						&key_size, &postings) < 0)
+			return -1;
+		if (*key_r == NULL ||
+		    key_cmp(key, key_size, *key_r, *key_size_r) < 0) {
+			*key_r = key;
+			*key_size_r = key_size;
+		}
+	}
+	return *key_r == NULL ? 0 : 1;
+}
+
+static int
+fts_native_merge_key(struct fts_native_segment *const *segs,
+		     unsigned int count, uint32_t *cursors,
+		     const uint8_t *key, uint32_t key_size,
+		     ARRAY_TYPE(seq_range) *uids)
+{
+	const uint8_t *seg_key, *postings;
+	uint32_t seg_key_size;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (cursors[i] == segs[i]->hdr->term_count)
+			continue;
+		if (fts_native_segment_get_term(segs[i], cursors[i], &seg_key,
+						&seg_key_size, &postings) < 0)
+			return -1;
+		if (key_cmp(key, key_size, seg_key, seg_key_size) != 0)
+			continue;
+		if (fts_native_segment_read_uids(segs[i], postings, uids) < 0)
+			return -1;
+		cursors[i]++;
+	}
+	return 0;
+}
+
+static int
+fts_native_index_merge_segments(struct fts_native_index *index,
+				struct fts_native_segment *const *segs,
+				unsigned int count,
+				struct fts_native_segment_writer *writer,
+				const ARRAY_TYPE(seq_range) *existing_uids)
+{
+	ARRAY_TYPE(seq_range) uids;
+	ARRAY(uint32_t) uid_list;
+	struct seq_range_iter iter;
+	const uint8_t *key;
+	uint32_t *cursors, key_size, uid;
+	unsigned int n;
+	buffer_t *key_buf;
+	int ret;
+
+	cursors = t_new(uint32_t, count);
+	t_array_init(&uids, 128);
+	t_array_init(&uid_list, 128);
+	key_buf = t_buffer_create(128);
+	while ((ret = fts_native_merge_next_key(segs, count, cursors,
+						&key, &key_size)) > 0) {
+		/* the key points to a segment whose cursor gets moved */
+		buffer_set_used_size(key_buf, 0);
+		buffer_append(key_buf, key, key_size);
+
+		array_clear(&uids);
+		if (fts_native_merge_key(segs, count, cursors, key_buf->data,
+					 key_buf->used, &uids) < 0)
+			return -1;
+		if (existing_uids != NULL)
+			seq_range_array_intersect(&uids, existing_uids);
+		seq_range_array_remove_seq_range(&uids,
+						 &index->expunged_uids);
+
+		array_clear(&uid_list);
+		seq_range_array_iter_init(&iter, &uids); n = 0;
+		while (seq_range_array_iter_nth(&iter, n++, &uid))
+			array_push_back(&uid_list, &uid);
+		if (array_count(&uid_list) > 0 &&
+		    fts_native_segment_writer_add(writer,
+				key_buf->data, key_buf->used,
+				array_front(&uid_list),
+				array_count(&uid_list)) < 0)
+			return -1;
+	}
+	return ret;
+}
+
+/* Merge the given segments into a new one. If all the segments are merged,
+   the expunged UIDs are dropped from the list as well. */
+static int
+fts_native_index_merge_segs(struct fts_native_index *index,
+			    struct fts_native_segment *const *segs,
+			    unsigned int count,
+			    const ARRAY_TYPE(seq_range) *existing_uids)
+{
+	struct fts_native_segment_writer *writer;
+	struct fts_native_segment *const *segp;
+	ARRAY_TYPE(uint32_t) old_ids, new_ids;
+	uint32_t new_id;
+	uoff_t size;
+	unsigned int i;
+	bool merge_all = count == array_count(&index->segments);
+	int ret;
+
+	i_assert(existing_uids == NULL || merge_all);
+
+	new_id = index->next_segment_id;
+	writer = fts_native_segment_writer_init(index, new_id);
+	if (writer == NULL)
+		return -1;
+
+	T_BEGIN {
+		ret = fts_native_index_merge_segments(index, segs, count,
+						      writer, existing_uids);
+	} T_END;
+	if (ret < 0) {
+		fts_native_segment_writer_abort(&writer);
+		return -1;
+	}
+	if (fts_native_segment_writer_finish(&writer, &size) < 0)
+		return -1;
+	index->merge_written_bytes += size;
+
+	t_array_init(&old_ids, count);
+	for (i = 0; i < count; i++)
+		array_push_back(&old_ids, &segs[i]->id);
+	t_array_init(&new_ids, array_count(&index->segments) - count + 1);
+	array_foreach(&index->segments, segp) {
+		for (i = 0; i < count; i++) {
+			if (segs[i] == *segp)
+				break;
+		}
+		if (i == count)
+			array_push_back(&new_ids, &(*segp)->id);
+	}
+	array_push_back(&new_ids, &new_id);
+	/* the expunged UIDs were dropped from the merged segment, but the
+	   other segments may still have them */
+	if (fts_native_index_write_list(index, &new_ids, merge_all ? NULL :
+					&index->expunged_uids) < 0) {
+		i_unlink_if_exists(fts_native_segment_path(index, new_id));
+		return -1;
+	}
+	/* readers that still have the old segments open keep using them
+	   until they refresh */
+	fts_native_index_unlink_segments(index, &old_ids);
+	return fts_native_index_refresh(index);
+}
+
+int fts_native_index_merge(struct fts_native_index *index,
+			   const ARRAY_TYPE(seq_range) *existing_uids)
+{
+	struct fts_native_segment *const *segs;
+	unsigned int count;
+
+	if (fts_native_index_refresh(index) < 0)
+		return -1;
+	segs = array_get(&index->segments, &count);
+	if (count == 0 ||
+	    (count == 1 && existing_uids == NULL &&
+	     array_count(&index->expunged_uids) == 0))
+		return 0;
+	return fts_native_index_merge_segs(index, segs, count, existing_uids);
+}
+
+static unsigned int
+fts_native_segment_get_tier(struct fts_native_index *index,
+			    const struct fts_native_segment *seg)
+{
+	unsigned int factor = I_MAX(index->set.max_segments, 2);
+	uoff_t tier_size = FTS_NATIVE_MERGE_MIN_TIER_SIZE;
+	unsigned int tier = 0;
+
+	while (seg->mmap_size >= tier_size * factor) {
+		tier_size *= factor;
+		tier++;
+	}
+	return tier;
+}
+
+/* Find the lowest tier that has more than max_segments segments of a similar
+   size. Returns TRUE and the tier's segments if found. */
+static bool
+fts_native_index_get_merge_tier(struct fts_native_index *index,
+				ARRAY_TYPE(fts_native_segment) *segs_r)
+{
+	struct fts_native_segment *const *segs;
+	unsigned int i, j, count, tier_count, min_tier = UINT_MAX;
+	unsigned int *tiers;
+
+	segs = array_get(&index->segments, &count);
+	if (count <= index->set.max_segments)
+		return FALSE;
+
+	tiers = t_new(unsigned int, count);
+	for (i = 0; i < count; i++)
+		tiers[i] = fts_native_segment_get_tier(index, segs[i]);
+	for (i = 0; i < count; i++) {
+		tier_count = 0;
+		for (j = 0; j < count; j++) {
+			if (tiers[j] == tiers[i])
+				tier_count++;
+		}
+		if (tier_count > index->set.max_segments &&
+		    tiers[i] < min_tier)
+			min_tier = tiers[i];
+	}
+	if (min_tier == UINT_MAX)
+		return FALSE;
+
+	for (i = 0; i < count; i++) {
+		if (tiers[i] == min_tier)
+			array_push_back(segs_r, &segs[i]);
+	}
+	return TRUE;
+}
+
+/* Merge segments of a similar size until no tier has too many of them. Each
+   merge moves the data one tier up, so the data is rewritten only
+   logarithmically many times instead of on each merge. */
+static int fts_native_index_merge_tiers(struct fts_native_index *index)
+{
+	ARRAY_TYPE(fts_native_segment) segs;
+	bool found;
+	int ret = 0;
+
+	do {
+		T_BEGIN {
+			t_array_init(&segs, index->set.max_segments + 1);
+			found = fts_native_index_get_merge_tier(index, &segs);
+			if (found &&
+			    fts_native_index_merge_segs(index,
+					array_front(&segs), array_count(&segs),
+					NULL) < 0)
+				ret = -1;
+		} T_END;
+	} while (found && ret == 0);
+	return ret;
+}
+
+int fts_native_index_reset(struct fts_native_index *index)
+{
+	ARRAY_TYPE(uint32_t) ids;
+
+	if (fts_native_index_refresh(index) < 0)
+		return -1;
+
+	t_array_init(&ids, array_count(&index->segments));
+	fts_native_index_get_segment_ids(index, &ids);
+	if (i_unlink_if_exists(index->list_path) < 0)
+		return -1;
+	fts_native_index_unlink_segments(index, &ids);
+	return fts_native_index_refresh(index);
+}
+
+int fts_native_index_expunge(struct fts_native_index *index,
+			     const ARRAY_TYPE(seq_range) *uids)
+{
+	ARRAY_TYPE(uint32_t) ids;
+	ARRAY_TYPE(seq_range) expunged_uids;
+
+	if (fts_native_index_refresh(index) < 0)
+		return -1;
+	if (array_count(&index->segments) == 0) {
+		/* nothing to filter */
+		return 0;
+	}
+
+	t_array_init(&ids, array_count(&index->segments));
+	fts_native_index_get_segment_ids(index, &ids);
+	t_array_init(&expunged_uids, array_count(&index->expunged_uids) + 8);
+	array_append_array(&expunged_uids, &index->expunged_uids);
+	seq_range_array_merge(&expunged_uids, uids);
+	if (fts_native_index_write_list(index, &ids, &expunged_uids) < 0)
+		return -1;
+	return fts_native_index_refresh(index);
+}
+
+struct fts_native_build *fts_native_build_init(struct fts_native_index *index)
+{
+	struct fts_native_build *build;
+
+	build = i_new(struct fts_native_build, 1);
+	build->index = index;
+	build->pool = pool_alloconly_create(MEMPOOL_GROWING"fts native build",
+					    1024*64);
+	hash_table_create(&build->terms, build->pool, 1024, str_hash, strcmp);
+	build->key = str_new(default_pool, 128);
+	return build;
+}
+
+static void fts_native_build_clear(struct fts_native_build *build)
+{
+	struct hash_iterate_context *iter;
+	struct fts_native_build_term *term;
+	char *key;
+
+	iter = hash_table_iterate_init(build->terms);
+	while (hash_table_iterate(iter, build->terms, &key, &term))
+		array_free(&term->uids);
+	hash_table_iterate_deinit(&iter);
+
+	hash_table_clear(build->terms, TRUE);
+	p_clear(build->pool);
+	build->memory_used = 0;
+}
+
+static int str_cmp_p(char *const *s1, char *const *s2)
+{
+	return strcmp(*s1, *s2);
+}
+
+static void fts_native_build_term_sort(struct fts_native_build_term *term)
+{
+	uint32_t *uids;
+	unsigned int i, j, count;
+
+	array_sort(&term->uids, uint32_cmp);
+	uids = array_get_modifiable(&term->uids, &count);
+	for (i = j = 1; i < count; i++) {
+		if (uids[i] != uids[j-1])
+			uids[j++] = uids[i];
+	}
+	if (count > 0)
+		array_delete(&term->uids, j, count - j);
+	term->unsorted = FALSE;
+}
+
+static int fts_native_build_write(struct fts_native_build *build,
+				  struct fts_native_segment_writer *writer)
+{
+	struct hash_iterate_context *iter;
+	struct fts_native_build_term *term;
+	ARRAY(char *) keys;
+	char *key, *const *keyp;
+
+	t_array_init(&keys, hash_table_count(build->terms));
+	iter = hash_table_iterate_init(build->terms);
+	while (hash_table_iterate(iter, build->terms, &key, &term))
+		array_push_back(&keys, &key);
+	hash_table_iterate_deinit(&iter);
+	array_sort(&keys, str_cmp_p);
+
+	array_foreach(&keys, keyp) {
+		term = hash_table_lookup(build->terms, *keyp);
+		if (term->unsorted)
+			fts_native_build_term_sort(term);
+		if (fts_native_segment_writer_add(writer, *keyp, strlen(*keyp),
+						  array_front(&term->uids),
+						  array_count(&term->uids)) < 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int fts_native_build_flush(struct fts_native_build *build)
+{
+	struct fts_native_index *index = build->index;
+	struct fts_native_segment_writer *writer;
+	ARRAY_TYPE(uint32_t) ids;
+	uint32_t new_id;
+	uoff_t size;
+	int ret;
+
+	if (hash_table_count(build->terms) == 0)
+		return 0;
+	if (fts_native_index_refresh(index) < 0)
+		return -1;
+
+	new_id = index->next_segment_id;
+	writer = fts_native_segment_writer_init(index, new_id);
+	if (writer == NULL)
+		return -1;
+	T_BEGIN {
+		ret = fts_native_build_write(build, writer);
+	} T_END;
+	fts_native_build_clear(build);
+	if (ret < 0) {
+		fts_native_segment_writer_abort(&writer);
+		return -1;
+	}
+	if (fts_native_segment_writer_finish(&writer, &size) < 0)
+		return -1;
+
+	t_array_init(&ids, array_count(&index->segments) + 1);
+	fts_native_index_get_segment_ids(index, &ids);
+	array_push_back(&ids, &new_id);
+	if (fts_native_index_write_list(index, &ids,
+					&index->expunged_uids) < 0) {
+		i_unlink_if_exists(fts_native_segment_path(index, new_id));
+		return -1;
+	}
+	return fts_native_index_refresh(index);
+}
+
+void fts_native_build_add(struct fts_native_build *build, uint32_t uid,
+			  enum fts_native_field field,
+			  const unsigned char *token, size_t size)
+{
+	struct fts_native_build_term *term;
+	const uint32_t *last_uidp;
+	char *key;
+
+	i_assert(uid > 0);
+
+	if (size == 0 || build->failed)
+		return;
+
+	fts_native_key_init(build->key, field, token, size);
+	term = hash_table_lookup(build->terms, str_c(build->key));
+	if (term == NULL) {
+		key = p_strdup(build->pool, str_c(build->key));
+		term = p_new(build->pool, struct fts_native_build_term, 1);
+		i_array_init(&term->uids, 4);
+		hash_table_insert(build->terms, key, term);
+		build->memory_used += str_len(build->key) + sizeof(*term) +
+			sizeof(uint32_t) * 4;
+	} else {
+		last_uidp = array_back(&term->uids);
+		if (*last_uidp == uid)
+			return;
+		if (*last_uidp > uid)
+			term->unsorted = TRUE;
+	}
+	array_push_back(&term->uids, &uid);
+	build->memory_used += sizeof(uint32_t);
+
+	if (build->memory_used >= build->index->set.max_build_memory) {
+		if (fts_native_build_flush(build) < 0)
+			build->failed = TRUE;
+	}
+}
+
+static void fts_native_build_free(struct fts_native_build **_build)
+{
+	struct fts_native_build *build = *_build;
+
+	*_build = NULL;
+	fts_native_build_clear(build);
+	hash_table_destroy(&build->terms);
+	pool_unref(&build->pool);
+	str_free(&build->key);
+	i_free(build);
+}
+
+int fts_native_build_deinit(struct fts_native_build **_build)
+{
+	struct fts_native_build *build = *_build;
+	struct fts_native_index *index = build->index;
+	int ret = build->failed ? -1 : 0;
+
+	if (ret == 0 && fts_native_build_flush(build) < 0)
+		ret = -1;
+	fts_native_build_free(_build);
+
+	if (ret == 0 && fts_native_index_merge_tiers(index) < 0)
+		ret = -1;
+	return ret;
+}
+
+void fts_native_build_abort(struct fts_native_build **build)
+{
+	fts_native_build_free(build);
+}
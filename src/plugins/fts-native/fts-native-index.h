@@ -0,0 +1,76 @@
+#ifndef FTS_NATIVE_INDEX_H
+#define FTS_NATIVE_INDEX_H
+
+#include "seq-range-array.h"
+
+/* Each mailbox has a list file (<prefix>.list) containing the IDs of its
+   immutable segment files (<prefix>.<id>). Index updates write a new
+   segment and replace the list file. When there are too many segments of
+   a similar size, they're merged into a single larger one. The list file also contains the
+   expunged UIDs that still exist in the segments. Lookups filter them out
+   and merging drops them. */
+
+enum fts_native_field {
+	FTS_NATIVE_FIELD_BODY	= 0x01,
+	FTS_NATIVE_FIELD_HEADER	= 0x02
+};
+
+struct fts_native_settings {
+	/* 0 = 0600 */
+	mode_t file_create_mode;
+	/* (gid_t)-1 = default */
+	gid_t file_create_gid;
+	/* Merge segments of a similar size once there are more than this many
+	   of them. The merged segment is then roughly this many times larger,
+	   which puts it into the next size tier. */
+	unsigned int max_segments;
+	/* Write a segment once the build has used this much memory */
+	size_t max_build_memory;
+};
+
+struct fts_native_index;
+struct fts_native_build;
+
+struct fts_native_index *
+fts_native_index_init(const char *path_prefix,
+		      const struct fts_native_settings *set);
+void fts_native_index_deinit(struct fts_native_index **index);
+
+/* Re-read the segment list if it has changed. Returns 0 if ok, -1 if
+   error. */
+int fts_native_index_refresh(struct fts_native_index *index);
+unsigned int fts_native_index_get_segment_count(struct fts_native_index *index);
+/* Returns the number of bytes written to merged segments so far. */
+uoff_t fts_native_index_get_merge_written_bytes(struct fts_native_index *index);
+
+/* Add UIDs containing the token in any of the given fields to uids.
+   Returns 0 if ok, -1 if error. */
+int fts_native_index_lookup(struct fts_native_index *index,
+			    enum fts_native_field fields,
+			    const char *token, ARRAY_TYPE(seq_range) *uids);
+
+/* The following functions modify the index. The caller must make sure that
+   only a single process is modifying the index at a time. */
+
+struct fts_native_build *fts_native_build_init(struct fts_native_index *index);
+void fts_native_build_add(struct fts_native_build *build, uint32_t uid,
+			  enum fts_native_field field,
+			  const unsigned char *token, size_t size);
+/* Write the added tokens to a new segment and merge the segments of a
+   similar size if there are too many of them. Returns 0 if ok, -1 if
+   error. */
+int fts_native_build_deinit(struct fts_native_build **build);
+void fts_native_build_abort(struct fts_native_build **build);
+
+/* Merge all the segments into one. If existing_uids isn't NULL, the UIDs
+   not in it are dropped. Returns 0 if ok, -1 if error. */
+int fts_native_index_merge(struct fts_native_index *index,
+			   const ARRAY_TYPE(seq_range) *existing_uids);
+/* Mark the UIDs expunged, so lookups no longer return them. Returns 0 if ok,
+   -1 if error. */
+int fts_native_index_expunge(struct fts_native_index *index,
+			     const ARRAY_TYPE(seq_range) *uids);
+/* Delete all the segments. Returns 0 if ok, -1 if error. */
+int fts_native_index_reset(struct fts_native_index *index);
+
+#endif
@@ -0,0 +1,62 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "mail-user.h"
+#include "mail-storage-hooks.h"
+#include "fts-user.h"
+#include "fts-native-plugin.h"
+
+const char *fts_native_plugin_version = DOVECOT_ABI_VERSION;
+
+struct fts_native_user_module fts_native_user_module =
+	MODULE_CONTEXT_INIT(&mail_user_module_register);
+
+static void fts_native_mail_user_deinit(struct mail_user *user)
+{
+	struct fts_native_user *fuser = FTS_NATIVE_USER_CONTEXT_REQUIRE(user);
+
+	fts_mail_user_deinit(user);
+	fuser->module_ctx.super.deinit(user);
+}
+
+static void fts_native_mail_user_created(struct mail_user *user)
+{
+	struct mail_user_vfuncs *v = user->vlast;
+	struct fts_native_user *fuser;
+	const char *env, *error;
+
+	/* the backend is always given tokenized input, so lib-fts must be
+	   initialized for the user */
+	env = mail_user_plugin_getenv(user, "fts");
+	if (env == NULL || strcmp(env, fts_backend_native.name) != 0)
+		return;
+
+	if (fts_mail_user_init(user, &error) < 0) {
+		i_error("fts-native: %s", error);
+		return;
+	}
+
+	fuser = p_new(user->pool, struct fts_native_user, 1);
+	fuser->module_ctx.super = *v;
+	user->vlast = &fuser->module_ctx.super;
+	v->deinit = fts_native_mail_user_deinit;
+	MODULE_CONTEXT_SET(user, fts_native_user_module, fuser);
+}
+
+static struct mail_storage_hooks fts_native_mail_storage_hooks = {
+	.mail_user_created = fts_native_mail_user_created
+};
+
+void fts_native_plugin_init(struct module *module)
+{
+	fts_backend_register(&fts_backend_native);
+	mail_storage_hooks_add(module, &fts_native_mail_storage_hooks);
+}
+
+void fts_native_plugin_deinit(void)
+{
+	fts_backend_unregister(fts_backend_native.name);
+	mail_storage_hooks_remove(&fts_native_mail_storage_hooks);
+}
+
+const char *fts_native_plugin_dependencies[] = { "fts", NULL };
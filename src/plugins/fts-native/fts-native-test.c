@@ -0,0 +1,190 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "istream.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "fts-native-index.h"
+
+#include <stdio.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* Index an mbox file given as parameter and then look up the words read
+   from stdin. Words are simply lowercased runs of alphanumeric characters,
+   so this only measures the index, not lib-fts.
+
+   Usage: fts-native-test [-n <messages per build>] [-s <max segments>] <mbox>
+
+   With -n the mbox is indexed incrementally, as if new mails were
+   delivered and indexed in batches of that many messages. The number of
+   bytes rewritten by segment merges shows the cost of the merge policy. */
+
+static void result_print(ARRAY_TYPE(seq_range) *result)
+{
+	const struct seq_range *range;
+	unsigned int i, count;
+
+	range = array_get(result, &count);
+	for (i = 0; i < count; i++) {
+		if (i != 0)
+			printf(",");
+		printf("%u", range[i].seq1);
+		if (range[i].seq1 != range[i].seq2)
+			printf("-%u", range[i].seq2);
+	}
+	printf("\n");
+}
+
+static unsigned int
+build_line(struct fts_native_build *build, uint32_t uid,
+	   enum fts_native_field field, char *line)
+{
+	unsigned int count = 0;
+	char *p, *start;
+
+	for (p = line; *p != '\0'; ) {
+		while (*p != '\0' && !i_isalnum(*p))
+			p++;
+		for (start = p; i_isalnum(*p); p++)
+			*p = i_tolower(*p);
+		if (p != start) {
+			fts_native_build_add(build, uid, field,
+					     (const void *)start, p - start);
+			count++;
+		}
+	}
+	return count;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *prefix = "/tmp/fts-native-test";
+	struct fts_native_settings set;
+	struct fts_native_index *index;
+	struct fts_native_build *build;
+	struct istream *input;
+	ARRAY_TYPE(seq_range) uids;
+	enum fts_native_field field = FTS_NATIVE_FIELD_HEADER;
+	char *line, *str, buf[4096];
+	unsigned int token_count = 0, uid = 1, build_msgs = 0, builds = 1;
+	uoff_t merge_bytes;
+	bool first = TRUE;
+	clock_t clock_start, clock_end;
+	struct timeval tv_start, tv_end;
+	double cputime;
+	int fd, c, ret = 0;
+
+	lib_init();
+	i_zero(&set);
+	set.file_create_gid = (gid_t)-1;
+	while ((c = getopt(argc, argv, "n:s:")) > 0) {
+		switch (c) {
+		case 'n':
+			if (str_to_uint(optarg, &build_msgs) < 0)
+				i_fatal("Invalid -n: %s", optarg);
+			break;
+		case 's':
+			if (str_to_uint(optarg, &set.max_segments) < 0)
+				i_fatal("Invalid -s: %s", optarg);
+			break;
+		default:
+			i_fatal("Usage: %s [-n <messages per build>] "
+				"[-s <max segments>] <mbox>", argv[0]);
+		}
+	}
+	argc -= optind; argv += optind;
+	if (argc < 1)
+		i_fatal("Usage: fts-native-test [-n <messages per build>] "
+			"[-s <max segments>] <mbox>");
+	index = fts_native_index_init(prefix, &set);
+	if (fts_native_index_refresh(index) < 0 ||
+	    fts_native_index_reset(index) < 0)
+		return 1;
+
+	fd = open(argv[0], O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", argv[0]);
+
+	clock_start = clock();
+	gettimeofday(&tv_start, NULL);
+
+	build = fts_native_build_init(index);
+	input = i_stream_create_fd(fd, (size_t)-1);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		if (str_begins(line, "From ")) {
+			if (!first)
+				uid++;
+			first = FALSE;
+			if (build_msgs > 0 && uid % build_msgs == 0) {
+				if (fts_native_build_deinit(&build) < 0)
+					i_fatal("build broken");
+				build = fts_native_build_init(index);
+				builds++;
+			}
+			field = FTS_NATIVE_FIELD_HEADER;
+			continue;
+		}
+		if (*line == '\0') {
+			field = FTS_NATIVE_FIELD_BODY;
+			continue;
+		}
+		token_count += build_line(build, uid, field, line);
+	}
+	if (fts_native_build_deinit(&build) < 0)
+		ret = -1;
+	merge_bytes = fts_native_index_get_merge_written_bytes(index);
+	fprintf(stderr, " - Merges rewrote %"PRIuUOFF_T" bytes in %u builds, "
+		"%u segments left\n", merge_bytes, builds,
+		fts_native_index_get_segment_count(index));
+	/* optimize */
+	if (ret == 0 && fts_native_index_merge(index, NULL) < 0)
+		ret = -1;
+	if (ret < 0) {
+		printf("build broken\n");
+		return 1;
+	}
+	fprintf(stderr, " - Optimizing rewrote %"PRIuUOFF_T" bytes\n",
+		fts_native_index_get_merge_written_bytes(index) - merge_bytes);
+
+	clock_end = clock();
+	(void)gettimeofday(&tv_end, NULL);
+
+	cputime = (double)(clock_end - clock_start) / CLOCKS_PER_SEC;
+	fprintf(stderr, " - Index time: %.2f CPU seconds, "
+		"%.2f real seconds (%.02fMB/CPUs, %.0f tokens/CPUs)\n",
+		cputime, timeval_diff_msecs(&tv_end, &tv_start)/1000.0,
+		input->v_offset / cputime / (1024*1024),
+		token_count / cputime);
+	fprintf(stderr, " - %u messages, %u tokens, %u segments\n",
+		uid, token_count, fts_native_index_get_segment_count(index));
+	i_stream_unref(&input);
+	i_close_fd(&fd);
+
+	i_array_init(&uids, 128);
+	while ((str = fgets(buf, sizeof(buf), stdin)) != NULL) {
+		str[strcspn(str, "\n")] = '\0';
+
+		array_clear(&uids);
+		gettimeofday(&tv_start, NULL);
+		ret = fts_native_index_lookup(index, FTS_NATIVE_FIELD_HEADER |
+					      FTS_NATIVE_FIELD_BODY, str, &uids);
+		gettimeofday(&tv_end, NULL);
+		if (ret < 0)
+			printf("error\n");
+		else {
+			printf(" - Search took %.06f seconds\n",
+			       timeval_diff_usecs(&tv_end, &tv_start)/1000000.0);
+			printf(" - uids: ");
+			result_print(&uids);
+		}
+	}
+	array_free(&uids);
+	fts_native_index_deinit(&index);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,307 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "unlink-directory.h"
+#include "fts-native-index.h"
+#include "test-common.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define TEST_DIR ".test-fts-native"
+
+static void test_dir_init(void)
+{
+	const char *error;
+
+	(void)unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(TEST_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", TEST_DIR);
+}
+
+static void test_dir_deinit(void)
+{
+	const char *error;
+
+	if (unlink_directory(TEST_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error) < 0)
+		i_fatal("unlink_directory(%s) failed: %s", TEST_DIR, error);
+}
+
+static struct fts_native_index *test_index_init(unsigned int max_segments)
+{
+	struct fts_native_settings set;
+
+	i_zero(&set);
+	set.file_create_gid = (gid_t)-1;
+	set.max_segments = max_segments;
+	return fts_native_index_init(TEST_DIR"/index", &set);
+}
+
+static void
+test_build_add_str(struct fts_native_build *build, uint32_t uid,
+		   enum fts_native_field field, const char *token)
+{
+	fts_native_build_add(build, uid, field,
+			     (const unsigned char *)token, strlen(token));
+}
+
+static const char *
+test_lookup(struct fts_native_index *index, enum fts_native_field fields,
+	    const char *token)
+{
+	ARRAY_TYPE(seq_range) uids;
+	const struct seq_range *range;
+	string_t *str = t_str_new(64);
+
+	t_array_init(&uids, 8);
+	test_assert(fts_native_index_lookup(index, fields, token, &uids) == 0);
+	array_foreach(&uids, range) {
+		if (str_len(str) > 0)
+			str_append_c(str, ',');
+		str_printfa(str, "%u", range->seq1);
+		if (range->seq1 != range->seq2)
+			str_printfa(str, "-%u", range->seq2);
+	}
+	return str_c(str);
+}
+
+static void test_fts_native_index_build(void)
+{
+	const enum fts_native_field all =
+		FTS_NATIVE_FIELD_BODY | FTS_NATIVE_FIELD_HEADER;
+	struct fts_native_index *index, *index2;
+	struct fts_native_build *build;
+
+	test_begin("fts native index build");
+	test_dir_init();
+	index = test_index_init(10);
+	test_assert(fts_native_index_refresh(index) == 0);
+	test_assert_strcmp(test_lookup(index, all, "foo"), "");
+
+	build = fts_native_build_init(index);
+	test_build_add_str(build, 1, FTS_NATIVE_FIELD_HEADER, "foo");
+	test_build_add_str(build, 1, FTS_NATIVE_FIELD_BODY, "bar");
+	test_build_add_str(build, 2, FTS_NATIVE_FIELD_BODY, "foo");
+	test_build_add_str(build, 2, FTS_NATIVE_FIELD_BODY, "foo");
+	test_build_add_str(build, 3, FTS_NATIVE_FIELD_BODY, "foo");
+	test_build_add_str(build, 3, FTS_NATIVE_FIELD_BODY, "fo");
+	test_assert(fts_native_build_deinit(&build) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+
+	test_assert_strcmp(test_lookup(index, all, "foo"), "1-3");
+	test_assert_strcmp(test_lookup(index, FTS_NATIVE_FIELD_BODY, "foo"), "2-3");
+	test_assert_strcmp(test_lookup(index, FTS_NATIVE_FIELD_HEADER, "foo"), "1");
+	test_assert_strcmp(test_lookup(index, all, "fo"), "3");
+	test_assert_strcmp(test_lookup(index, all, "fooo"), "");
+	test_assert_strcmp(test_lookup(index, all, "bar"), "1");
+
+	/* another index instance sees the new segment after refresh */
+	index2 = test_index_init(10);
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert_strcmp(test_lookup(index2, all, "foo"), "1-3");
+
+	build = fts_native_build_init(index);
+	test_build_add_str(build, 5, FTS_NATIVE_FIELD_BODY, "foo");
+	test_build_add_str(build, 4, FTS_NATIVE_FIELD_BODY, "bar");
+	test_assert(fts_native_build_deinit(&build) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 2);
+
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert_strcmp(test_lookup(index2, all, "foo"), "1-3,5");
+	test_assert_strcmp(test_lookup(index2, all, "bar"), "1,4");
+
+	fts_native_index_deinit(&index2);
+	fts_native_index_deinit(&index);
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_merge(void)
+{
+	const enum fts_native_field all =
+		FTS_NATIVE_FIELD_BODY | FTS_NATIVE_FIELD_HEADER;
+	struct fts_native_index *index;
+	struct fts_native_build *build;
+	ARRAY_TYPE(seq_range) existing_uids;
+	uint32_t uid;
+
+	test_begin("fts native index merge");
+	test_dir_init();
+	index = test_index_init(3);
+	test_assert(fts_native_index_reset(index) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 0);
+
+	/* the fourth segment triggers merging */
+	for (uid = 1; uid <= 4; uid++) {
+		build = fts_native_build_init(index);
+		test_build_add_str(build, uid, FTS_NATIVE_FIELD_BODY, "all");
+		test_build_add_str(build, uid, FTS_NATIVE_FIELD_BODY,
+				   uid % 2 == 0 ? "even" : "odd");
+		test_assert(fts_native_build_deinit(&build) == 0);
+		test_assert(fts_native_index_get_segment_count(index) ==
+			    (uid < 4 ? uid : 1));
+	}
+	test_assert_strcmp(test_lookup(index, all, "all"), "1-4");
+	test_assert_strcmp(test_lookup(index, all, "even"), "2,4");
+	test_assert_strcmp(test_lookup(index, all, "odd"), "1,3");
+
+	/* drop expunged UIDs */
+	t_array_init(&existing_uids, 4);
+	seq_range_array_add_range(&existing_uids, 2, 3);
+	test_assert(fts_native_index_merge(index, &existing_uids) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_lookup(index, all, "all"), "2-3");
+	test_assert_strcmp(test_lookup(index, all, "even"), "2");
+
+	test_assert(fts_native_index_reset(index) == 0);
+	test_assert_strcmp(test_lookup(index, all, "all"), "");
+	fts_native_index_deinit(&index);
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_merge_tiers(void)
+{
+	struct fts_native_index *index;
+	struct fts_native_build *build;
+	uoff_t merge_bytes;
+	uint32_t uid;
+
+	test_begin("fts native index merge tiers");
+	test_dir_init();
+	index = test_index_init(2);
+	test_assert(fts_native_index_reset(index) == 0);
+
+	/* one large segment */
+	build = fts_native_build_init(index);
+	for (uid = 1; uid <= 20000; uid++) T_BEGIN {
+		test_build_add_str(build, uid, FTS_NATIVE_FIELD_BODY,
+				   t_strdup_printf("word%u", uid));
+	} T_END;
+	test_assert(fts_native_build_deinit(&build) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	merge_bytes = fts_native_index_get_merge_written_bytes(index);
+
+	/* small segments are merged only with each other */
+	for (uid = 20001; uid <= 20003; uid++) {
+		build = fts_native_build_init(index);
+		test_build_add_str(build, uid, FTS_NATIVE_FIELD_BODY, "small");
+		test_assert(fts_native_build_deinit(&build) == 0);
+		test_assert(fts_native_index_get_segment_count(index) ==
+			    (uid < 20003 ? uid - 20000 + 1 : 2));
+	}
+	test_assert(fts_native_index_get_merge_written_bytes(index) -
+		    merge_bytes < 1024);
+	test_assert_strcmp(test_lookup(index, FTS_NATIVE_FIELD_BODY, "small"),
+			   "20001-20003");
+	test_assert_strcmp(test_lookup(index, FTS_NATIVE_FIELD_BODY,
+				       "word123"), "123");
+
+	/* optimizing merges everything */
+	test_assert(fts_native_index_merge(index, NULL) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_lookup(index, FTS_NATIVE_FIELD_BODY, "small"),
+			   "20001-20003");
+	fts_native_index_deinit(&index);
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_expunge(void)
+{
+	const enum fts_native_field all =
+		FTS_NATIVE_FIELD_BODY | FTS_NATIVE_FIELD_HEADER;
+	struct fts_native_index *index, *index2;
+	struct fts_native_build *build;
+	ARRAY_TYPE(seq_range) uids;
+	uint32_t uid;
+
+	test_begin("fts native index expunge");
+	test_dir_init();
+	index = test_index_init(10);
+	index2 = test_index_init(10);
+	test_assert(fts_native_index_reset(index) == 0);
+
+	for (uid = 1; uid <= 2; uid++) {
+		build = fts_native_build_init(index);
+		test_build_add_str(build, uid, FTS_NATIVE_FIELD_BODY, "all");
+		test_build_add_str(build, uid+2, FTS_NATIVE_FIELD_HEADER, "all");
+		test_assert(fts_native_build_deinit(&build) == 0);
+	}
+	test_assert_strcmp(test_lookup(index, all, "all"), "1-4");
+
+	/* lookups filter out the expunged UIDs */
+	t_array_init(&uids, 4);
+	seq_range_array_add(&uids, 2);
+	seq_range_array_add(&uids, 4);
+	test_assert(fts_native_index_expunge(index, &uids) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 2);
+	test_assert_strcmp(test_lookup(index, all, "all"), "1,3");
+	/* ..also in other processes */
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert_strcmp(test_lookup(index2, all, "all"), "1,3");
+
+	/* new segments keep the expunged UIDs */
+	build = fts_native_build_init(index);
+	test_build_add_str(build, 5, FTS_NATIVE_FIELD_BODY, "all");
+	test_assert(fts_native_build_deinit(&build) == 0);
+	test_assert_strcmp(test_lookup(index, all, "all"), "1,3,5");
+
+	/* merging drops them from the segments */
+	test_assert(fts_native_index_merge(index, NULL) == 0);
+	test_assert(fts_native_index_get_segment_count(index) == 1);
+	test_assert_strcmp(test_lookup(index, all, "all"), "1,3,5");
+	test_assert(fts_native_index_refresh(index2) == 0);
+	test_assert_strcmp(test_lookup(index2, all, "all"), "1,3,5");
+
+	fts_native_index_deinit(&index2);
+	fts_native_index_deinit(&index);
+	test_dir_deinit();
+	test_end();
+}
+
+static void test_fts_native_index_flush(void)
+{
+	struct fts_native_settings set;
+	struct fts_native_index *index;
+	struct fts_native_build *build;
+	uint32_t uid;
+
+	test_begin("fts native index build memory limit");
+	test_dir_init();
+	i_zero(&set);
+	set.file_create_gid = (gid_t)-1;
+	set.max_segments = 1000;
+	set.max_build_memory = 1024;
+	index = fts_native_index_init(TEST_DIR"/index", &set);
+	test_assert(fts_native_index_reset(index) == 0);
+
+	build = fts_native_build_init(index);
+	for (uid = 1; uid <= 1000; uid++) T_BEGIN {
+		test_build_add_str(build, uid, FTS_NATIVE_FIELD_BODY,
+				   t_strdup_printf("word%u", uid % 100));
+	} T_END;
+	test_assert(fts_native_build_deinit(&build) == 0);
+	test_assert(fts_native_index_get_segment_count(index) > 1);
+	test_assert_strcmp(test_lookup(index, FTS_NATIVE_FIELD_BODY, "word7"),
+			   "7,107,207,307,407,507,607,707,807,907");
+	fts_native_index_deinit(&index);
+	test_dir_deinit();
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_native_index_build,
+		test_fts_native_index_merge,
+		test_fts_native_index_merge_tiers,
+		test_fts_native_index_expunge,
+		test_fts_native_index_flush,
+		NULL
+	};
+
+	return test_run(test_functions);
+}
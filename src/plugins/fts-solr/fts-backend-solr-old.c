@@ -251,6 +251,10 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 		*error_r = "Invalid fts_solr setting";
 		return -1;
 	}
+	if (fuser->set.json) {
+		*error_r = "fts_solr: format=json isn't supported by solr_old";
+		return -1;
+	}
 
 	i_zero(&ssl_set);
 	mail_user_init_ssl_client_settings(_backend->ns->user, &ssl_set);
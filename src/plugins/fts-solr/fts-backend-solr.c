@@ -4,8 +4,11 @@
 #include "array.h"
 #include "str.h"
 #include "hash.h"
+#include "ioloop.h"
+#include "time-util.h"
 #include "strescape.h"
 #include "unichar.h"
+#include "json-parser.h"
 #include "iostream-ssl.h"
 #include "http-url.h"
 #include "mail-storage-private.h"
@@ -41,6 +44,8 @@ struct solr_fts_field {
 
 struct solr_fts_backend_update_context {
 	struct fts_backend_update_context ctx;
+	struct event *event;
+	struct timeval start_time;
 
 	struct mailbox *cur_box;
 	char box_guid[MAILBOX_GUID_HEX_LENGTH+1];
@@ -53,7 +58,10 @@ struct solr_fts_backend_update_context {
 
 	uint32_t last_indexed_uid;
 	unsigned int mails_since_flush;
+	unsigned int docs_added;
+	uoff_t bytes_posted;
 
+	bool json:1;
 	bool tokenized_input:1;
 	bool last_indexed_uid_set:1;
 	bool body_open:1;
@@ -144,6 +152,55 @@ static void xml_encode(string_t *dest, const char *str)
 	xml_encode_data(dest, (const unsigned char *)str, strlen(str));
 }
 
+static size_t
+json_encode_data_max(string_t *dest, const unsigned char *data, size_t len,
+		     unsigned int max_len)
+{
+	unichar_t chr;
+	size_t i;
+	int char_len;
+
+	i_assert(max_len > 0 || len == 0);
+
+	if (max_len > len)
+		max_len = len;
+	for (i = 0; i < max_len; i += char_len) {
+		char_len = uni_utf8_get_char_n(data + i, len - i, &chr);
+		if (char_len > 0 && uni_is_valid_ucs4(chr))
+			json_append_escaped_ucs4(dest, chr);
+		else {
+			str_append_data(dest, utf8_replacement_char,
+					UTF8_REPLACEMENT_CHAR_LEN);
+			char_len = 1;
+		}
+	}
+	return i;
+}
+
+static size_t
+solr_encode_data_max(struct solr_fts_backend_update_context *ctx,
+		     string_t *dest, const unsigned char *data, size_t len,
+		     unsigned int max_len)
+{
+	if (ctx->json)
+		return json_encode_data_max(dest, data, len, max_len);
+	else
+		return xml_encode_data_max(dest, data, len, max_len);
+}
+
+static void
+solr_encode_data(struct solr_fts_backend_update_context *ctx,
+		 string_t *dest, const unsigned char *data, size_t len)
+{
+	(void)solr_encode_data_max(ctx, dest, data, len, len);
+}
+
+static void solr_encode(struct solr_fts_backend_update_context *ctx,
+			string_t *dest, const char *str)
+{
+	solr_encode_data(ctx, dest, (const unsigned char *)str, strlen(str));
+}
+
 static const char *solr_escape(const char *str)
 {
 	string_t *ret;
@@ -191,6 +248,10 @@ fts_backend_solr_init(struct fts_backend *_backend, const char **error_r)
 		_backend->flags &= ~FTS_BACKEND_FLAG_FUZZY_SEARCH;
 		_backend->flags |= FTS_BACKEND_FLAG_TOKENIZED_INPUT;
 	}
+	if (fuser->set.commit_delay_msecs > 0) {
+		/* indexed mails aren't searchable until the commit */
+		_backend->flags |= FTS_BACKEND_FLAG_DELAYED_VISIBILITY;
+	}
 
 	i_zero(&ssl_set);
 	mail_user_init_ssl_client_settings(_backend->ns->user, &ssl_set);
@@ -278,29 +339,56 @@ fts_backend_solr_update_init(struct fts_backend *_backend)
 {
 	struct solr_fts_backend_update_context *ctx;
 
+	struct fts_solr_user *fuser = FTS_SOLR_USER_CONTEXT_REQUIRE(_backend->ns->user);
+
 	ctx = i_new(struct solr_fts_backend_update_context, 1);
 	ctx->ctx.backend = _backend;
+	ctx->event = event_create(_backend->ns->user->event);
+	if (gettimeofday(&ctx->start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	ctx->json = fuser->set.json;
 	ctx->tokenized_input =
 		(_backend->flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0;
 	i_array_init(&ctx->fields, 16);
 	return &ctx->ctx;
 }
 
-static void xml_encode_id(struct solr_fts_backend_update_context *ctx,
-			  string_t *str, uint32_t uid)
+static void solr_encode_id(struct solr_fts_backend_update_context *ctx,
+			   string_t *str, uint32_t uid)
 {
 	str_printfa(str, "%u/%s", uid, ctx->box_guid);
 	if (ctx->ctx.backend->ns->owner != NULL) {
 		str_append_c(str, '/');
-		xml_encode(str, ctx->ctx.backend->ns->owner->username);
+		solr_encode(ctx, str, ctx->ctx.backend->ns->owner->username);
 	}
 }
 
+static void
+fts_backend_solr_doc_open_json(struct solr_fts_backend_update_context *ctx,
+			       uint32_t uid)
+{
+	if (ctx->mails_since_flush > 1)
+		str_append_c(ctx->cmd, ',');
+	str_printfa(ctx->cmd, "{\"uid\":%u,\"box\":\"%s\",\"user\":\"",
+		    uid, ctx->box_guid);
+	if (ctx->ctx.backend->ns->owner != NULL)
+		json_append_escaped(ctx->cmd, ctx->ctx.backend->ns->owner->username);
+	str_append(ctx->cmd, "\",\"id\":\"");
+	solr_encode_id(ctx, ctx->cmd, uid);
+	str_append_c(ctx->cmd, '"');
+}
+
 static void
 fts_backend_solr_doc_open(struct solr_fts_backend_update_context *ctx,
 			  uint32_t uid)
 {
 	ctx->documents_added = TRUE;
+	ctx->docs_added++;
+
+	if (ctx->json) {
+		fts_backend_solr_doc_open_json(ctx, uid);
+		return;
+	}
 
 	str_printfa(ctx->cmd, "<doc>"
 		    "<field name=\"uid\">%u</field>"
@@ -312,7 +400,7 @@ fts_backend_solr_doc_open(struct solr_fts_backend_update_context *ctx,
 	str_append(ctx->cmd, "</field>");
 
 	str_printfa(ctx->cmd, "<field name=\"id\">");
-	xml_encode_id(ctx, ctx->cmd, uid);
+	solr_encode_id(ctx, ctx->cmd, uid);
 	str_append(ctx->cmd, "</field>");
 }
 
@@ -342,16 +430,33 @@ fts_backend_solr_doc_close(struct solr_fts_backend_update_context *ctx)
 
 	if (ctx->body_open) {
 		ctx->body_open = FALSE;
-		str_append(ctx->cmd, "</field>");
+		str_append(ctx->cmd, ctx->json ? "\"" : "</field>");
 	}
 	array_foreach_modifiable(&ctx->fields, field) {
-		str_printfa(ctx->cmd, "<field name=\"%s\">", field->key);
-		/* the values are already xml-escaped */
-		str_append_str(ctx->cmd, field->value);
-		str_append(ctx->cmd, "</field>");
+		/* the values are already escaped */
+		if (ctx->json) {
+			str_append(ctx->cmd, ",\"");
+			json_append_escaped(ctx->cmd, field->key);
+			str_append(ctx->cmd, "\":\"");
+			str_append_str(ctx->cmd, field->value);
+			str_append_c(ctx->cmd, '"');
+		} else {
+			str_printfa(ctx->cmd, "<field name=\"%s\">", field->key);
+			str_append_str(ctx->cmd, field->value);
+			str_append(ctx->cmd, "</field>");
+		}
 		str_truncate(field->value, 0);
 	}
-	str_append(ctx->cmd, "</doc>");
+	str_append(ctx->cmd, ctx->json ? "}" : "</doc>");
+}
+
+static void
+fts_backend_solr_post_cmd(struct solr_fts_backend_update_context *ctx)
+{
+	solr_connection_post_more(ctx->post, str_data(ctx->cmd),
+				  str_len(ctx->cmd));
+	ctx->bytes_posted += str_len(ctx->cmd);
+	str_truncate(ctx->cmd, 0);
 }
 
 static int
@@ -361,13 +466,19 @@ fts_backed_solr_build_flush(struct solr_fts_backend_update_context *ctx)
 		return 0;
 
 	fts_backend_solr_doc_close(ctx);
-	str_append(ctx->cmd, "</add>");
+	str_append(ctx->cmd, ctx->json ? "]" : "</add>");
 	ctx->mails_since_flush = 0;
 
-	solr_connection_post_more(ctx->post, str_data(ctx->cmd),
-				  str_len(ctx->cmd));
-	str_truncate(ctx->cmd, 0);
-	return solr_connection_post_end(&ctx->post);
+	fts_backend_solr_post_cmd(ctx);
+	/* don't wait for Solr to process the batch. the caller waits for
+	   it before it relies on the batch having been indexed. */
+	return solr_connection_post_submit(&ctx->post);
+}
+
+static void
+fts_backend_solr_expunge_begin(struct solr_fts_backend_update_context *ctx)
+{
+	str_append(ctx->cmd_expunge, ctx->json ? "{\"delete\":[" : "<delete>");
 }
 
 static void
@@ -376,10 +487,56 @@ fts_backend_solr_expunge_flush(struct solr_fts_backend_update_context *ctx)
 	struct solr_fts_backend *backend =
 		(struct solr_fts_backend *)ctx->ctx.backend;
 
-	str_append(ctx->cmd_expunge, "</delete>");
+	str_append(ctx->cmd_expunge, ctx->json ? "]}" : "</delete>");
 	(void)solr_connection_post(backend->solr_conn, str_c(ctx->cmd_expunge));
 	str_truncate(ctx->cmd_expunge, 0);
-	str_append(ctx->cmd_expunge, "<delete>");
+	fts_backend_solr_expunge_begin(ctx);
+}
+
+static int
+fts_backend_solr_commit_later(struct fts_backend *_backend,
+			      const struct fts_solr_settings *set,
+			      bool wait_searcher)
+{
+	struct ssl_iostream_settings ssl_set;
+	const char *error;
+
+	i_zero(&ssl_set);
+	mail_user_init_ssl_client_settings(_backend->ns->user, &ssl_set);
+	if (solr_connection_commit_later(set, &ssl_set, wait_searcher,
+					 &error) < 0) {
+		i_error("%s", error);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+fts_backend_solr_update_send_event(struct solr_fts_backend_update_context *ctx,
+				   bool failed)
+{
+	struct timeval end_time;
+	long long msecs;
+	uint64_t docs_per_sec;
+
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	msecs = timeval_diff_msecs(&end_time, &ctx->start_time);
+	docs_per_sec = msecs <= 0 ? ctx->docs_added :
+		(uint64_t)ctx->docs_added * 1000 / msecs;
+
+	struct event_passthrough *e =
+		event_create_passthrough(ctx->event)->
+		set_name("fts_solr_update_finished")->
+		add_int("docs", ctx->docs_added)->
+		add_int("bytes", ctx->bytes_posted)->
+		add_int("docs_per_sec", docs_per_sec);
+	if (failed)
+		e->add_str("error", "Indexing failed");
+	e_debug(e->event(), "fts_solr: Indexed %u documents (%"PRIuUOFF_T
+		" bytes) in %lld msecs, %"PRIu64" docs/sec%s",
+		ctx->docs_added, ctx->bytes_posted, msecs, docs_per_sec,
+		failed ? " (failed)" : "");
 }
 
 static int
@@ -391,25 +548,32 @@ fts_backend_solr_update_deinit(struct fts_backend_update_context *_ctx)
 		(struct solr_fts_backend *)_ctx->backend;
 	struct fts_solr_user *fuser = FTS_SOLR_USER_CONTEXT(_ctx->backend->ns->user);
 	struct solr_fts_field *field;
-	const char *str;
 	int ret = _ctx->failed ? -1 : 0;
 
 	if (fts_backed_solr_build_flush(ctx) < 0)
 		ret = -1;
+	if (solr_connection_post_wait(backend->solr_conn) < 0)
+		ret = -1;
 
 	if (ctx->documents_added || ctx->expunges) {
 		/* commit and wait until the documents we just indexed are
 		   visible to the following search */
 		if (ctx->expunges)
 			fts_backend_solr_expunge_flush(ctx);
-		if (fuser->set.soft_commit) {
-			str = t_strdup_printf("<commit softCommit=\"true\" waitSearcher=\"%s\"/>",
-					      ctx->documents_added ? "true" : "false");
-			if (solr_connection_post(backend->solr_conn, str) < 0)
-				ret = -1;
-		}
+		if (!fuser->set.soft_commit)
+			;
+		else if (fuser->set.commit_delay_msecs > 0 &&
+			 fts_backend_solr_commit_later(_ctx->backend, &fuser->set,
+						       ctx->documents_added) == 0)
+			;
+		else if (solr_connection_commit(backend->solr_conn,
+						ctx->documents_added) < 0)
+			ret = -1;
 	}
+	if (ctx->docs_added > 0)
+		fts_backend_solr_update_send_event(ctx, ret < 0);
 
+	event_unref(&ctx->event);
 	str_free(&ctx->cmd);
 	str_free(&ctx->cmd_expunge);
 	array_foreach_modifiable(&ctx->fields, field) {
@@ -427,6 +591,8 @@ fts_backend_solr_update_set_mailbox(struct fts_backend_update_context *_ctx,
 {
 	struct solr_fts_backend_update_context *ctx =
 		(struct solr_fts_backend_update_context *)_ctx;
+	struct solr_fts_backend *backend =
+		(struct solr_fts_backend *)_ctx->backend;
 	const char *box_guid;
 
 	if (ctx->prev_uid != 0) {
@@ -434,7 +600,8 @@ fts_backend_solr_update_set_mailbox(struct fts_backend_update_context *_ctx,
 
 		/* flush solr between mailboxes, so we don't wrongly update
 		   last_uid before we know it has succeeded */
-		if (fts_backed_solr_build_flush(ctx) < 0)
+		if (fts_backed_solr_build_flush(ctx) < 0 ||
+		    solr_connection_post_wait(backend->solr_conn) < 0)
 			_ctx->failed = TRUE;
 		else if (!_ctx->failed)
 			fts_index_set_last_uid(ctx->cur_box, ctx->prev_uid);
@@ -477,15 +644,23 @@ fts_backend_solr_update_expunge(struct fts_backend_update_context *_ctx,
 	if (!ctx->expunges) {
 		ctx->expunges = TRUE;
 		ctx->cmd_expunge = str_new(default_pool, 1024);
-		str_append(ctx->cmd_expunge, "<delete>");
+		fts_backend_solr_expunge_begin(ctx);
 	}
 
 	if (str_len(ctx->cmd_expunge) >= SOLR_CMDBUF_FLUSH_SIZE)
 		fts_backend_solr_expunge_flush(ctx);
 
-	str_append(ctx->cmd_expunge, "<id>");
-	xml_encode_id(ctx, ctx->cmd_expunge, uid);
-	str_append(ctx->cmd_expunge, "</id>");
+	if (!ctx->json) {
+		str_append(ctx->cmd_expunge, "<id>");
+		solr_encode_id(ctx, ctx->cmd_expunge, uid);
+		str_append(ctx->cmd_expunge, "</id>");
+	} else {
+		if (str_data(ctx->cmd_expunge)[str_len(ctx->cmd_expunge)-1] != '[')
+			str_append_c(ctx->cmd_expunge, ',');
+		str_append_c(ctx->cmd_expunge, '"');
+		solr_encode_id(ctx, ctx->cmd_expunge, uid);
+		str_append_c(ctx->cmd_expunge, '"');
+	}
 }
 
 static void
@@ -505,7 +680,7 @@ fts_backend_solr_uid_changed(struct solr_fts_backend_update_context *ctx,
 		if (ctx->cmd == NULL)
 			ctx->cmd = str_new(default_pool, SOLR_CMDBUF_SIZE);
 		ctx->post = solr_connection_post_begin(backend->solr_conn);
-		str_append(ctx->cmd, "<add>");
+		str_append(ctx->cmd, ctx->json ? "[" : "<add>");
 	} else {
 		fts_backend_solr_doc_close(ctx);
 	}
@@ -533,13 +708,14 @@ fts_backend_solr_update_set_build_key(struct fts_backend_update_context *_ctx,
 		/* fall through */
 	case FTS_BACKEND_BUILD_KEY_MIME_HDR:
 		ctx->cur_value = fts_solr_field_get(ctx, "hdr");
-		xml_encode(ctx->cur_value, key->hdr_name);
+		solr_encode(ctx, ctx->cur_value, key->hdr_name);
 		str_append(ctx->cur_value, ": ");
 		break;
 	case FTS_BACKEND_BUILD_KEY_BODY_PART:
 		if (!ctx->body_open) {
 			ctx->body_open = TRUE;
-			str_append(ctx->cmd, "<field name=\"body\">");
+			str_append(ctx->cmd, ctx->json ? ",\"body\":\"" :
+				   "<field name=\"body\">");
 		}
 		ctx->cur_value = ctx->cmd;
 		break;
@@ -558,10 +734,10 @@ fts_backend_solr_update_unset_build_key(struct fts_backend_update_context *_ctx)
 	/* There can be multiple duplicate keys (duplicate header lines,
 	   multiple MIME body parts). Make sure they are separated by
 	   whitespace. */
-	str_append_c(ctx->cur_value, '\n');
+	str_append(ctx->cur_value, ctx->json ? "\\n" : "\n");
 	ctx->cur_value = NULL;
 	if (ctx->cur_value2 != NULL) {
-		str_append_c(ctx->cur_value2, '\n');
+		str_append(ctx->cur_value2, ctx->json ? "\\n" : "\n");
 		ctx->cur_value2 = NULL;
 	}
 }
@@ -581,43 +757,36 @@ fts_backend_solr_update_build_more(struct fts_backend_update_context *_ctx,
 		/* we're writing to message body. if size is huge,
 		   flush it once in a while */
 		while (size >= SOLR_CMDBUF_FLUSH_SIZE) {
-			if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE) {
-				solr_connection_post_more(ctx->post,
-							  str_data(ctx->cmd),
-							  str_len(ctx->cmd));
-				str_truncate(ctx->cmd, 0);
-			}
-			len = xml_encode_data_max(ctx->cmd, data, size,
-						  SOLR_CMDBUF_FLUSH_SIZE -
-						  str_len(ctx->cmd));
+			if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE)
+				fts_backend_solr_post_cmd(ctx);
+			len = solr_encode_data_max(ctx, ctx->cmd, data, size,
+						   SOLR_CMDBUF_FLUSH_SIZE -
+						   str_len(ctx->cmd));
 			i_assert(len > 0);
 			i_assert(len <= size);
 			data += len;
 			size -= len;
 		}
-		xml_encode_data(ctx->cmd, data, size);
+		solr_encode_data(ctx, ctx->cmd, data, size);
 		if (ctx->tokenized_input)
 			str_append_c(ctx->cmd, ' ');
 	} else {
 		if (!ctx->truncate_header) {
-			xml_encode_data(ctx->cur_value, data, size);
+			solr_encode_data(ctx, ctx->cur_value, data, size);
 			if (ctx->tokenized_input)
 				str_append_c(ctx->cur_value, ' ');
 		}
 		if (ctx->cur_value2 != NULL &&
 		    (!ctx->truncate_header ||
 		     str_len(ctx->cur_value2) < SOLR_HEADER_LINE_MAX_TRUNC_SIZE)) {
-			xml_encode_data(ctx->cur_value2, data, size);
+			solr_encode_data(ctx, ctx->cur_value2, data, size);
 			if (ctx->tokenized_input)
 				str_append_c(ctx->cur_value2, ' ');
 		}
 	}
 
-	if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE) {
-		solr_connection_post_more(ctx->post, str_data(ctx->cmd),
-					  str_len(ctx->cmd));
-		str_truncate(ctx->cmd, 0);
-	}
+	if (str_len(ctx->cmd) >= SOLR_CMDBUF_FLUSH_SIZE)
+		fts_backend_solr_post_cmd(ctx);
 	if (!ctx->truncate_header &&
 	    str_len(ctx->cur_value) >= SOLR_HEADER_MAX_SIZE) {
 		/* a large header */
@@ -793,7 +962,8 @@ solr_add_maybe_query_args(string_t *str, struct mail_search_arg *arg,
 }
 
 static int solr_search(struct fts_backend *_backend, string_t *str,
-		       const char *box_guid, ARRAY_TYPE(seq_range) *uids_r,
+		       const char *box_guid, uint32_t min_uid,
+		       ARRAY_TYPE(seq_range) *uids_r,
 		       ARRAY_TYPE(fts_score_map) *scores_r)
 {
 	struct solr_fts_backend *backend = (struct solr_fts_backend *)_backend;
@@ -808,6 +978,8 @@ static int solr_search(struct fts_backend *_backend, string_t *str,
 		solr_quote_http(str, _backend->ns->owner->username);
 	else
 		str_append(str, "%22%22");
+	if (min_uid > 1)
+		str_printfa(str, "+%%2Buid:%%5B%u+TO+*%%5D", min_uid);
 
 	ret = solr_connection_select(backend->solr_conn, str_c(str),
 				     pool, &results);
@@ -840,21 +1012,25 @@ fts_backend_solr_lookup(struct fts_backend *_backend, struct mailbox *box,
 		    status.uidnext);
 	prefix_len = str_len(str);
 
+	/* each search returns its scores sorted by UID */
+	result->scores_sorted = TRUE;
 	if (solr_add_definite_query_args(str, args, and_args)) {
 		ARRAY_TYPE(seq_range) *uids_arr =
 			(flags & FTS_LOOKUP_FLAG_NO_AUTO_FUZZY) == 0 ?
 			&result->definite_uids : &result->maybe_uids;
-		if (solr_search(_backend, str, box_guid,
+		if (solr_search(_backend, str, box_guid, result->min_uid,
 				uids_arr, &result->scores) < 0)
 			return -1;
 	}
 	str_truncate(str, prefix_len);
 	if (solr_add_maybe_query_args(str, args, and_args)) {
-		if (solr_search(_backend, str, box_guid,
+		/* the maybe scores are appended after the definite ones */
+		if (array_count(&result->scores) > 0)
+			result->scores_sorted = FALSE;
+		if (solr_search(_backend, str, box_guid, result->min_uid,
 				&result->maybe_uids, &result->scores) < 0)
 			return -1;
-	}               
-	result->scores_sorted = TRUE;
+	}
 	return 0;
 }
 
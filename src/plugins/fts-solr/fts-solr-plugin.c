@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "array.h"
+#include "settings-parser.h"
 #include "http-client.h"
 #include "mail-user.h"
 #include "mail-storage-hooks.h"
@@ -21,7 +22,7 @@ static int
 fts_solr_plugin_init_settings(struct mail_user *user,
 			      struct fts_solr_settings *set, const char *str)
 {
-	const char *const *tmp;
+	const char *const *tmp, *error;
 
 	if (str == NULL)
 		str = "";
@@ -56,6 +57,22 @@ fts_solr_plugin_init_settings(struct mail_user *user,
 				i_error("fts_solr: Invalid setting for soft_commit: %s", *tmp+12);
 				return -1;
 			}
+		} else if (str_begins(*tmp, "commit_delay=")) {
+			if (settings_get_time_msecs(*tmp + 13,
+						    &set->commit_delay_msecs,
+						    &error) < 0) {
+				i_error("fts_solr: Invalid setting for commit_delay: %s", error);
+				return -1;
+			}
+		} else if (str_begins(*tmp, "format=")) {
+			if (strcmp(*tmp + 7, "xml") == 0) {
+				set->json = FALSE;
+			} else if (strcmp(*tmp + 7, "json") == 0) {
+				set->json = TRUE;
+			} else {
+				i_error("fts_solr: Invalid setting for format: %s", *tmp+7);
+				return -1;
+			}
 		} else {
 			i_error("fts_solr: Invalid setting: %s", *tmp);
 			return -1;
@@ -126,6 +143,7 @@ void fts_solr_plugin_deinit(void)
 	fts_backend_unregister(fts_backend_solr.name);
 	fts_backend_unregister(fts_backend_solr_old.name);
 	mail_storage_hooks_remove(&fts_solr_mail_storage_hooks);
+	solr_connection_commit_flush();
 	if (solr_http_client != NULL)
 		http_client_deinit(&solr_http_client);
 
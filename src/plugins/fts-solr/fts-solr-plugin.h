@@ -13,9 +13,14 @@
 struct fts_solr_settings {
 	const char *url, *default_ns_prefix, *rawlog_dir;
 	unsigned int batch_size;
+	/* Delay commits by this many msecs, so a single commit covers all
+	   the updates done meanwhile. 0 = commit after each update. */
+	unsigned int commit_delay_msecs;
 	bool use_libfts;
 	bool debug;
 	bool soft_commit;
+	/* Send updates as JSON instead of XML */
+	bool json;
 };
 
 struct fts_solr_user {
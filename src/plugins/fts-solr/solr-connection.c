@@ -7,6 +7,7 @@
 #include "strescape.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "buffer.h"
 #include "http-url.h"
 #include "http-client.h"
 #include "fts-solr-plugin.h"
@@ -14,6 +15,13 @@
 
 #include <expat.h>
 
+/* Maximum number of update batches sent to Solr without waiting for their
+   responses. Each of them may be processed by Solr in parallel. */
+#define SOLR_MAX_PENDING_POSTS 4
+/* Update batches are buffered in memory up to this size, so they can be
+   submitted without waiting for Solr. Larger batches are streamed. */
+#define SOLR_POST_MAX_BUFFER_SIZE (4*1024*1024)
+
 enum solr_xml_response_state {
 	SOLR_XML_RESPONSE_STATE_ROOT,
 	SOLR_XML_RESPONSE_STATE_RESPONSE,
@@ -51,10 +59,21 @@ struct solr_connection_post {
 	struct solr_connection *conn;
 
 	struct http_client_request *http_req;
+	/* payload is buffered here until it grows too large */
+	buffer_t *buf;
 
 	bool failed:1;
 };
 
+/* Commit that is delayed, so that it covers the updates of many users */
+struct solr_delayed_commit {
+	char *url;
+	struct solr_connection *conn;
+	struct timeout *to;
+
+	bool wait_searcher:1;
+};
+
 struct solr_connection {
 	XML_Parser xml_parser;
 
@@ -66,16 +85,25 @@ struct solr_connection {
 	char *http_password;
 
 	int request_status;
+	const char *content_type;
+
+	/* submitted update posts that haven't received a response yet */
+	unsigned int pending_posts;
+	struct ioloop *pending_ioloop;
 
 	struct istream *payload;
 	struct io *io;
 
 	bool debug:1;
 	bool posting:1;
+	bool pending_posts_failed:1;
 	bool xml_failed:1;
 	bool http_ssl:1;
+	bool json:1;
 };
 
+static struct solr_delayed_commit *solr_delayed_commit = NULL;
+
 static int solr_xml_parse(struct solr_connection *conn,
 			  const void *data, size_t size, bool done)
 {
@@ -143,11 +171,14 @@ int solr_connection_init(const struct fts_solr_settings *solr_set,
 	}
 
 	conn->debug = solr_set->debug;
+	conn->json = solr_set->json;
+	conn->content_type = solr_set->json ?
+		"application/json" : "text/xml";
 
 	if (solr_http_client == NULL) {
 		i_zero(&http_set);
 		http_set.max_idle_time_msecs = 5*1000;
-		http_set.max_parallel_connections = 1;
+		http_set.max_parallel_connections = SOLR_MAX_PENDING_POSTS;
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
 		http_set.max_attempts = 3;
@@ -173,6 +204,8 @@ void solr_connection_deinit(struct solr_connection **_conn)
 	struct solr_connection *conn = *_conn;
 
 	*_conn = NULL;
+	if (solr_connection_post_wait(conn) < 0)
+		i_error("fts_solr: Indexing failed: Some updates weren't saved");
 	XML_ParserFree(conn->xml_parser);
 	i_free(conn->http_host);
 	i_free(conn->http_base_url);
@@ -504,6 +537,19 @@ solr_connection_update_response(const struct http_response *response,
 	}
 }
 
+static void
+solr_connection_update_request_init(struct solr_connection *conn,
+				    struct http_client_request *http_req)
+{
+	if (conn->http_user != NULL) {
+		http_client_request_set_auth_simple(http_req, conn->http_user, conn->http_password);
+	}
+	http_client_request_set_port(http_req, conn->http_port);
+	http_client_request_set_ssl(http_req, conn->http_ssl);
+	http_client_request_add_header(http_req, "Content-Type",
+				       conn->content_type);
+}
+
 static struct http_client_request *
 solr_connection_post_request(struct solr_connection *conn)
 {
@@ -515,15 +561,58 @@ solr_connection_post_request(struct solr_connection *conn)
 	http_req = http_client_request(solr_http_client, "POST",
 				       conn->http_host, url,
 				       solr_connection_update_response, conn);
-	if (conn->http_user != NULL) {
-		http_client_request_set_auth_simple(http_req, conn->http_user, conn->http_password);
-	}
-	http_client_request_set_port(http_req, conn->http_port);
-	http_client_request_set_ssl(http_req, conn->http_ssl);
-	http_client_request_add_header(http_req, "Content-Type", "text/xml");
+	solr_connection_update_request_init(conn, http_req);
 	return http_req;
 }
 
+static void
+solr_connection_pending_post_response(const struct http_response *response,
+				      struct solr_connection *conn)
+{
+	i_assert(conn->pending_posts > 0);
+
+	if (response->status / 100 != 2) {
+		i_error("fts_solr: Indexing failed: %s",
+			http_response_get_message(response));
+		conn->pending_posts_failed = TRUE;
+	}
+	conn->pending_posts--;
+	if (conn->pending_ioloop != NULL)
+		io_loop_stop(conn->pending_ioloop);
+}
+
+static void
+solr_connection_wait_pending(struct solr_connection *conn,
+			     unsigned int max_pending)
+{
+	struct ioloop *prev_ioloop = current_ioloop;
+
+	if (conn->pending_posts <= max_pending)
+		return;
+
+	/* like http_client_wait(), but only until enough of our posts have
+	   finished */
+	conn->pending_ioloop = io_loop_create();
+	(void)http_client_switch_ioloop(solr_http_client);
+	while (conn->pending_posts > max_pending)
+		io_loop_run(conn->pending_ioloop);
+
+	io_loop_set_current(prev_ioloop);
+	(void)http_client_switch_ioloop(solr_http_client);
+	io_loop_set_current(conn->pending_ioloop);
+	io_loop_destroy(&conn->pending_ioloop);
+}
+
+int solr_connection_post_wait(struct solr_connection *conn)
+{
+	solr_connection_wait_pending(conn, 0);
+	if (conn->pending_posts_failed) {
+		conn->pending_posts_failed = FALSE;
+		return -1;
+	}
+	return 0;
+}
+
 struct solr_connection_post *
 solr_connection_post_begin(struct solr_connection *conn)
 {
@@ -534,7 +623,7 @@ solr_connection_post_begin(struct solr_connection *conn)
 
 	post = i_new(struct solr_connection_post, 1);
 	post->conn = conn;
-	post->http_req = solr_connection_post_request(conn);
+	post->buf = buffer_create_dynamic(default_pool, 1024*64);
 	XML_ParserReset(conn->xml_parser, "UTF-8");
 	return post;
 }
@@ -548,10 +637,82 @@ void solr_connection_post_more(struct solr_connection_post *post,
 	if (post->failed)
 		return;
 
+	if (post->buf != NULL) {
+		buffer_append(post->buf, data, size);
+		if (post->buf->used <= SOLR_POST_MAX_BUFFER_SIZE)
+			return;
+		/* too large to keep in memory - start streaming it. It isn't
+		   counted in pending_posts, since solr_connection_post_end()
+		   waits for it to finish, but leave room for it so there are
+		   at most SOLR_MAX_PENDING_POSTS requests in flight. */
+		solr_connection_wait_pending(conn, SOLR_MAX_PENDING_POSTS - 1);
+		post->http_req = solr_connection_post_request(conn);
+		conn->request_status = 0;
+		data = post->buf->data;
+		size = post->buf->used;
+	}
+
 	if (conn->request_status == 0)
 		(void)http_client_request_send_payload(&post->http_req, data, size);
 	if (conn->request_status < 0)
 		post->failed = TRUE;
+	if (post->buf != NULL)
+		buffer_free(&post->buf);
+}
+
+static void solr_connection_post_free(struct solr_connection_post **_post)
+{
+	struct solr_connection_post *post = *_post;
+
+	*_post = NULL;
+	if (post->buf != NULL)
+		buffer_free(&post->buf);
+	post->conn->posting = FALSE;
+	i_free(post);
+}
+
+static void solr_connection_post_buf_free(buffer_t *buf)
+{
+	buffer_free(&buf);
+}
+
+int solr_connection_post_submit(struct solr_connection_post **_post)
+{
+	struct solr_connection_post *post = *_post;
+	struct solr_connection *conn = post->conn;
+	struct http_client_request *http_req;
+	struct istream *input;
+
+	i_assert(conn->posting);
+
+	if (post->buf == NULL) {
+		/* the payload was already streamed */
+		return solr_connection_post_end(_post);
+	}
+
+	/* make room for this post */
+	solr_connection_wait_pending(conn, SOLR_MAX_PENDING_POSTS - 1);
+
+	http_req = http_client_request(solr_http_client, "POST",
+				       conn->http_host,
+				       t_strconcat(conn->http_base_url,
+						   "update", NULL),
+				       solr_connection_pending_post_response,
+				       conn);
+	solr_connection_update_request_init(conn, http_req);
+
+	/* the istream owns the buffer from now on */
+	input = i_stream_create_from_buffer(post->buf);
+	i_stream_add_destroy_callback(input, solr_connection_post_buf_free,
+				      post->buf);
+	post->buf = NULL;
+	http_client_request_set_payload(http_req, input, FALSE);
+	i_stream_unref(&input);
+
+	conn->pending_posts++;
+	http_client_request_submit(http_req);
+	solr_connection_post_free(_post);
+	return 0;
 }
 
 int solr_connection_post_end(struct solr_connection_post **_post)
@@ -562,7 +723,10 @@ int solr_connection_post_end(struct solr_connection_post **_post)
 
 	i_assert(conn->posting);
 
-	*_post = NULL;
+	if (post->buf != NULL) {
+		ret = solr_connection_post_submit(_post);
+		return solr_connection_post_wait(conn) < 0 ? -1 : ret;
+	}
 
 	if (!post->failed) {
 		if (http_client_request_finish_payload(&post->http_req) < 0 ||
@@ -572,9 +736,7 @@ int solr_connection_post_end(struct solr_connection_post **_post)
 	} else {
 		http_client_request_abort(&post->http_req);
 	}
-	i_free(post);
-
-	conn->posting = FALSE;
+	solr_connection_post_free(_post);
 	return ret;
 }
 
@@ -585,6 +747,10 @@ int solr_connection_post(struct solr_connection *conn, const char *cmd)
 
 	i_assert(!conn->posting);
 
+	/* make sure the pending updates are processed first */
+	if (solr_connection_post_wait(conn) < 0)
+		return -1;
+
 	http_req = solr_connection_post_request(conn);
 	post_payload = i_stream_create_from_data(cmd, strlen(cmd));
 	http_client_request_set_payload(http_req, post_payload, TRUE);
@@ -598,3 +764,70 @@ int solr_connection_post(struct solr_connection *conn, const char *cmd)
 
 	return conn->request_status;
 }
+
+int solr_connection_commit(struct solr_connection *conn, bool wait_searcher)
+{
+	const char *str;
+
+	if (conn->json) {
+		str = t_strdup_printf("{\"commit\":{\"softCommit\":true,\"waitSearcher\":%s}}",
+				      wait_searcher ? "true" : "false");
+	} else {
+		str = t_strdup_printf("<commit softCommit=\"true\" waitSearcher=\"%s\"/>",
+				      wait_searcher ? "true" : "false");
+	}
+	return solr_connection_post(conn, str);
+}
+
+void solr_connection_commit_flush(void)
+{
+	struct solr_delayed_commit *commit = solr_delayed_commit;
+
+	if (commit == NULL)
+		return;
+	solr_delayed_commit = NULL;
+
+	timeout_remove(&commit->to);
+	(void)solr_connection_commit(commit->conn, commit->wait_searcher);
+	solr_connection_deinit(&commit->conn);
+	i_free(commit->url);
+	i_free(commit);
+}
+
+static void solr_connection_commit_timeout(void *context ATTR_UNUSED)
+{
+	solr_connection_commit_flush();
+}
+
+int solr_connection_commit_later(const struct fts_solr_settings *solr_set,
+				 const struct ssl_iostream_settings *ssl_client_set,
+				 bool wait_searcher, const char **error_r)
+{
+	struct solr_delayed_commit *commit = solr_delayed_commit;
+
+	if (commit != NULL &&
+	    (strcmp(commit->url, solr_set->url) != 0 ||
+	     commit->conn->json != solr_set->json)) {
+		/* a different Solr server */
+		solr_connection_commit_flush();
+		commit = NULL;
+	}
+
+	if (commit == NULL) {
+		commit = i_new(struct solr_delayed_commit, 1);
+		if (solr_connection_init(solr_set, ssl_client_set,
+					 &commit->conn, error_r) < 0) {
+			i_free(commit);
+			return -1;
+		}
+		commit->url = i_strdup(solr_set->url);
+		commit->to = timeout_add_to(io_loop_get_root(),
+					    solr_set->commit_delay_msecs,
+					    solr_connection_commit_timeout,
+					    (void *)NULL);
+		solr_delayed_commit = commit;
+	}
+	if (wait_searcher)
+		commit->wait_searcher = TRUE;
+	return 0;
+}
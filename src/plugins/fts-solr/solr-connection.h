@@ -28,6 +28,26 @@ struct solr_connection_post *
 solr_connection_post_begin(struct solr_connection *conn);
 void solr_connection_post_more(struct solr_connection_post *post,
 			       const unsigned char *data, size_t size);
+/* Finish the post and wait for Solr to process it. */
 int solr_connection_post_end(struct solr_connection_post **post);
+/* Finish the post, but don't wait for Solr to process it. Returns -1 if it
+   already failed. Use solr_connection_post_wait() to find out whether the
+   submitted posts succeeded. */
+int solr_connection_post_submit(struct solr_connection_post **post);
+/* Wait until all the submitted posts are processed. Returns -1 if any of
+   them failed. */
+int solr_connection_post_wait(struct solr_connection *conn);
+
+/* Send a soft commit and wait for Solr to process it. */
+int solr_connection_commit(struct solr_connection *conn, bool wait_searcher);
+/* Send a soft commit to the Solr server after the commit_delay. All the
+   commits requested meanwhile in this process are merged into it, even if
+   they came from different users. The commit uses its own connection, since
+   the callers' connections are freed along with their users. */
+int solr_connection_commit_later(const struct fts_solr_settings *solr_set,
+				 const struct ssl_iostream_settings *ssl_client_set,
+				 bool wait_searcher, const char **error_r);
+/* Send the delayed commit now, if there is one. */
+void solr_connection_commit_flush(void);
 
 #endif
@@ -0,0 +1,457 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "hostpid.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "iostream-ssl.h"
+#include "json-parser.h"
+#include "http-url.h"
+#include "http-request.h"
+#include "http-server.h"
+#include "http-client.h"
+#include "fts-solr-plugin.h"
+#include "solr-connection.h"
+#include "test-common.h"
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+/* Solr takes this long to process each update */
+#define TEST_UPDATE_DELAY_MSECS 20
+/* larger than solr-connection's buffer for pipelined posts */
+#define TEST_LARGE_POST_SIZE (5*1024*1024)
+
+struct http_client *solr_http_client = NULL;
+
+static struct ip_addr bind_ip;
+static in_port_t bind_port = 0;
+static int fd_listen = -1;
+static pid_t server_pid = (pid_t)-1;
+
+/*
+ * Test server
+ */
+
+struct test_server_request {
+	struct http_server_request *req;
+	struct istream *payload_input;
+	struct io *io;
+	buffer_t *payload;
+	struct timeout *to;
+};
+
+static struct http_server *http_server;
+static struct io *io_listen;
+/* log of the received requests, returned by GET /log */
+static string_t *server_log;
+static unsigned int server_pending_updates, server_max_pending_updates;
+
+static void test_server_update_respond(struct test_server_request *treq)
+{
+	struct http_server_response *resp;
+
+	timeout_remove(&treq->to);
+	i_assert(server_pending_updates > 0);
+	server_pending_updates--;
+
+	resp = http_server_response_create(treq->req, 200, "OK");
+	http_server_response_submit(resp);
+	buffer_free(&treq->payload);
+	http_server_request_unref(&treq->req);
+}
+
+static bool test_server_json_is_valid(const buffer_t *payload)
+{
+	struct istream *input;
+	struct json_parser *parser;
+	enum json_type type;
+	const char *value, *error;
+
+	input = i_stream_create_from_data(payload->data, payload->used);
+	parser = json_parser_init_flags(input, JSON_PARSER_NO_ROOT_OBJECT);
+	while (json_parse_next(parser, &type, &value) > 0) ;
+	i_stream_unref(&input);
+	return json_parser_deinit(&parser, &error) == 0;
+}
+
+static void test_server_update_received(struct test_server_request *treq)
+{
+	const struct http_request *hreq = http_server_request_get(treq->req);
+	const char *content_type =
+		http_request_header_get(hreq, "Content-Type");
+	const char *body = t_strndup(treq->payload->data, treq->payload->used);
+
+	if (null_strcmp(content_type, "application/json") == 0) {
+		/* the JSON body itself doesn't fit into the log header */
+		str_append(server_log,
+			   !test_server_json_is_valid(treq->payload) ?
+			   "invalid-json " : strstr(body, "\"commit\"") != NULL ?
+			   t_strdup_printf("json-commit(%u) ",
+					   server_pending_updates) :
+			   "json ");
+	} else if (strstr(body, "commit") != NULL) {
+		/* all the updates must have been processed by now */
+		str_printfa(server_log, "commit(%u) ", server_pending_updates);
+	} else if (treq->payload->used >= TEST_LARGE_POST_SIZE) {
+		str_printfa(server_log, "large(%u) ", server_pending_updates);
+	} else {
+		str_printfa(server_log, "%s ", body);
+	}
+	server_pending_updates++;
+	server_max_pending_updates = I_MAX(server_max_pending_updates,
+					   server_pending_updates);
+	/* respond to the updates later, so they pile up */
+	treq->to = timeout_add_short(TEST_UPDATE_DELAY_MSECS,
+				     test_server_update_respond, treq);
+}
+
+static void test_server_update_input(struct test_server_request *treq)
+{
+	const unsigned char *data;
+	size_t size;
+	int ret;
+
+	while ((ret = i_stream_read_more(treq->payload_input,
+					 &data, &size)) > 0) {
+		buffer_append(treq->payload, data, size);
+		i_stream_skip(treq->payload_input, size);
+	}
+	if (ret == 0)
+		return;
+	if (treq->payload_input->stream_errno != 0) {
+		i_fatal("test server: read(%s) failed: %s",
+			i_stream_get_name(treq->payload_input),
+			i_stream_get_error(treq->payload_input));
+	}
+	io_remove(&treq->io);
+	i_stream_unref(&treq->payload_input);
+	test_server_update_received(treq);
+}
+
+static void
+test_server_handle_request(void *context ATTR_UNUSED,
+			   struct http_server_request *req)
+{
+	const struct http_request *hreq = http_server_request_get(req);
+	pool_t pool = http_server_request_get_pool(req);
+	struct http_server_response *resp;
+	struct test_server_request *treq;
+
+	if (strcmp(hreq->method, "GET") == 0 &&
+	    strcmp(hreq->target.url->path, "/log") == 0) {
+		resp = http_server_response_create(req, 200, "OK");
+		http_server_response_add_header(resp, "X-Test-Log",
+			t_strdup_printf("%smax=%u", str_c(server_log),
+					server_max_pending_updates));
+		http_server_response_submit(resp);
+		str_truncate(server_log, 0);
+		server_max_pending_updates = 0;
+		return;
+	}
+	if (strcmp(hreq->method, "POST") != 0 ||
+	    strcmp(hreq->target.url->path, "/solr/update") != 0) {
+		http_server_request_fail(req, 404, "Not Found");
+		return;
+	}
+
+	treq = p_new(pool, struct test_server_request, 1);
+	treq->req = req;
+	treq->payload = buffer_create_dynamic(default_pool, 64);
+	treq->payload_input = http_server_request_get_payload_input(req, FALSE);
+	treq->io = io_add_istream(treq->payload_input,
+				  test_server_update_input, treq);
+	http_server_request_ref(req);
+	test_server_update_input(treq);
+}
+
+static const struct http_server_callbacks test_server_callbacks = {
+	.handle_request = test_server_handle_request
+};
+
+static void test_server_accept(void *context ATTR_UNUSED)
+{
+	int fd;
+
+	fd = net_accept(fd_listen, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (fd == -2)
+		i_fatal("test server: accept() failed: %m");
+	net_set_nonblock(fd, TRUE);
+	(void)http_server_connection_create(http_server, fd, fd, FALSE,
+					    &test_server_callbacks, NULL);
+}
+
+static void test_server_run(void)
+{
+	struct http_server_settings http_set;
+	struct ioloop *ioloop;
+
+	i_zero(&http_set);
+	http_set.request_limits.max_payload_size = (uoff_t)-1;
+
+	ioloop = io_loop_create();
+	server_log = str_new(default_pool, 256);
+	http_server = http_server_init(&http_set);
+	io_listen = io_add(fd_listen, IO_READ, test_server_accept, NULL);
+	io_loop_run(ioloop);
+}
+
+static void test_server_start(void)
+{
+	if (net_addr2ip("127.0.0.1", &bind_ip) < 0)
+		i_unreached();
+	fd_listen = net_listen(&bind_ip, &bind_port, 128);
+	if (fd_listen == -1) {
+		i_fatal("listen(%s:%u) failed: %m",
+			net_ip2addr(&bind_ip), bind_port);
+	}
+	net_set_nonblock(fd_listen, TRUE);
+
+	if ((server_pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (server_pid == 0) {
+		/* child: server - runs until it's killed */
+		server_pid = (pid_t)-1;
+		hostpid_init();
+		test_server_run();
+		exit(0);
+	}
+	i_close_fd(&fd_listen);
+}
+
+static void test_server_kill(void)
+{
+	if (server_pid != (pid_t)-1) {
+		(void)kill(server_pid, SIGKILL);
+		(void)waitpid(server_pid, NULL, 0);
+	}
+	server_pid = (pid_t)-1;
+}
+
+/*
+ * Test client
+ */
+
+static void test_solr_settings_init(struct fts_solr_settings *set_r)
+{
+	i_zero(set_r);
+	set_r->url = t_strdup_printf("http://127.0.0.1:%u/solr/", bind_port);
+	set_r->commit_delay_msecs = 100;
+}
+
+static void
+test_server_log_response(const struct http_response *response,
+			 const char **log_r)
+{
+	const char *value = http_response_header_get(response, "X-Test-Log");
+
+	*log_r = value == NULL ? "" : t_strdup(value);
+}
+
+/* Returns the requests the server received since the previous call, and the
+   maximum number of updates that were pending at the same time. */
+static const char *test_server_get_log(void)
+{
+	struct http_client_request *http_req;
+	const char *log = NULL;
+
+	http_req = http_client_request(solr_http_client, "GET",
+				       "127.0.0.1", "/log",
+				       test_server_log_response, &log);
+	http_client_request_set_port(http_req, bind_port);
+	http_client_request_submit(http_req);
+	http_client_wait(solr_http_client);
+	return log;
+}
+
+static struct solr_connection *
+test_solr_connection_init(const struct fts_solr_settings *set)
+{
+	struct ssl_iostream_settings ssl_set;
+	struct solr_connection *conn;
+	const char *error;
+
+	i_zero(&ssl_set);
+	if (solr_connection_init(set, &ssl_set, &conn, &error) < 0)
+		i_fatal("solr_connection_init() failed: %s", error);
+	return conn;
+}
+
+static void test_solr_post_pipelined(void)
+{
+	struct fts_solr_settings set;
+	struct solr_connection *conn;
+	struct solr_connection_post *post;
+	const char *data;
+	unsigned int i;
+
+	test_begin("solr pipelined posts");
+	test_solr_settings_init(&set);
+	conn = test_solr_connection_init(&set);
+
+	for (i = 0; i < 10; i++) {
+		post = solr_connection_post_begin(conn);
+		data = t_strdup_printf("<add>%u</add>", i);
+		solr_connection_post_more(post, (const void *)data,
+					  strlen(data));
+		test_assert(solr_connection_post_submit(&post) == 0);
+	}
+	/* a commit is sent only after all the updates are processed */
+	test_assert(solr_connection_commit(conn, TRUE) == 0);
+
+	/* Solr may receive the parallel updates in any order, but all of them
+	   are sent, at most 4 are pending at a time and the commit comes
+	   last */
+	const char *const *log = t_strsplit(test_server_get_log(), " ");
+	test_assert(str_array_length(log) == 12);
+	for (i = 0; i < 10 && log[i] != NULL; i++) {
+		test_assert_idx(str_begins(log[i], "<add>") &&
+				str_array_find(log, t_strdup_printf("<add>%u</add>", i)), i);
+	}
+	test_assert_strcmp(log[10], "commit(0)");
+	test_assert(str_begins(log[11], "max="));
+	unsigned int max_pending = 0;
+	test_assert(str_to_uint(log[11] + 4, &max_pending) == 0);
+	test_assert(max_pending > 1 && max_pending <= 4);
+
+	solr_connection_deinit(&conn);
+	test_end();
+}
+
+static void test_solr_post_large(void)
+{
+	struct fts_solr_settings set;
+	struct solr_connection *conn;
+	struct solr_connection_post *post;
+	unsigned char data[1024];
+	unsigned int i;
+
+	test_begin("solr large post");
+	test_solr_settings_init(&set);
+	conn = test_solr_connection_init(&set);
+
+	for (i = 0; i < 4; i++) {
+		post = solr_connection_post_begin(conn);
+		solr_connection_post_more(post, (const void *)"<add>", 5);
+		test_assert(solr_connection_post_submit(&post) == 0);
+	}
+
+	/* a post that doesn't fit into the buffer is streamed. It's started
+	   only after one of the earlier pipelined posts is processed. */
+	memset(data, 'x', sizeof(data));
+	post = solr_connection_post_begin(conn);
+	for (i = 0; i < TEST_LARGE_POST_SIZE / sizeof(data); i++)
+		solr_connection_post_more(post, data, sizeof(data));
+	test_assert(solr_connection_post_submit(&post) == 0);
+	test_assert(solr_connection_post_wait(conn) == 0);
+
+	const char *const *log = t_strsplit(test_server_get_log(), " ");
+	unsigned int pending = UINT_MAX, max_pending = UINT_MAX;
+	test_assert(str_array_length(log) == 6);
+	test_assert(str_array_find(log, "<add>"));
+	for (i = 0; log[i] != NULL; i++) {
+		if (str_begins(log[i], "large(")) {
+			test_assert(str_to_uint(t_strcut(log[i] + 6, ')'),
+						&pending) == 0);
+		} else if (str_begins(log[i], "max=")) {
+			test_assert(str_to_uint(log[i] + 4, &max_pending) == 0);
+		}
+	}
+	test_assert(pending < 4);
+	test_assert(max_pending <= 4);
+
+	solr_connection_deinit(&conn);
+	test_end();
+}
+
+static void test_solr_json(void)
+{
+	struct fts_solr_settings set;
+	struct solr_connection *conn;
+	struct solr_connection_post *post;
+	const char *log, *data = "[{\"id\":\"1/uid\",\"body\":\"a\\nb\"}]";
+
+	test_begin("solr json format");
+	test_solr_settings_init(&set);
+	set.json = TRUE;
+	conn = test_solr_connection_init(&set);
+
+	post = solr_connection_post_begin(conn);
+	solr_connection_post_more(post, (const void *)data, strlen(data));
+	test_assert(solr_connection_post_submit(&post) == 0);
+	test_assert(solr_connection_commit(conn, TRUE) == 0);
+	log = test_server_get_log();
+	test_assert_strcmp(log, "json json-commit(0) max=1");
+
+	solr_connection_deinit(&conn);
+	test_end();
+}
+
+static void test_solr_commit_later(void)
+{
+	struct fts_solr_settings set;
+	struct ssl_iostream_settings ssl_set;
+	struct ioloop *ioloop = current_ioloop;
+	struct timeout *to;
+	const char *log, *error;
+
+	test_begin("solr delayed commit");
+	test_solr_settings_init(&set);
+	i_zero(&ssl_set);
+
+	/* commits requested by two users are merged */
+	test_assert(solr_connection_commit_later(&set, &ssl_set, FALSE,
+						 &error) == 0);
+	test_assert(solr_connection_commit_later(&set, &ssl_set, TRUE,
+						 &error) == 0);
+	log = test_server_get_log();
+	test_assert_strcmp(log, "max=0");
+
+	/* the commit is sent once the delay passes */
+	to = timeout_add(set.commit_delay_msecs * 3, io_loop_stop, ioloop);
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+	log = test_server_get_log();
+	test_assert_strcmp(log, "commit(0) max=1");
+
+	/* and at deinit */
+	test_assert(solr_connection_commit_later(&set, &ssl_set, FALSE,
+						 &error) == 0);
+	solr_connection_commit_flush();
+	log = test_server_get_log();
+	test_assert_strcmp(log, "commit(0) max=1");
+	solr_connection_commit_flush();
+	log = test_server_get_log();
+	test_assert_strcmp(log, "max=0");
+	test_end();
+}
+
+static void test_solr_connection(void)
+{
+	struct ioloop *ioloop;
+
+	test_server_start();
+	ioloop = io_loop_create();
+
+	test_solr_post_pipelined();
+	test_solr_post_large();
+	test_solr_json();
+	test_solr_commit_later();
+
+	http_client_deinit(&solr_http_client);
+	io_loop_destroy(&ioloop);
+	test_server_kill();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_solr_connection,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -3,8 +3,9 @@
 
 #include "file-dotlock.h"
 #include "squat-trie.h"
+#include "squat-uidlist.h"
 
-#define SQUAT_TRIE_VERSION 2
+#define SQUAT_TRIE_VERSION 3
 #define SQUAT_TRIE_LOCK_TIMEOUT 60
 #define SQUAT_TRIE_DOTLOCK_STALE_TIMEOUT (15*60)
 
@@ -26,6 +27,13 @@ struct squat_file_header {
 	uint8_t partial_len;
 	uint8_t full_len;
 	uint8_t normalize_map[256];
+	uint8_t unused2[2];
+
+	/* The uidlist header at the time this trie was written. The trie file
+	   is never modified after it's renamed into place and the uidlist file
+	   is only appended to (or replaced with a new indexid), so readers can
+	   use this to access the uidlist without locking. */
+	struct squat_uidlist_file_header uidlist_hdr;
 };
 
 /*
@@ -33,7 +41,8 @@ struct squat_file_header {
 
    struct squat_file_header;
 
-   // children are written before their parents
+   // the file is written to a temp file and renamed, it's never modified
+   // after that. children are written before their parents
    node[] {
      uint8_t child_count;
      unsigned char chars[child_count];
@@ -22,6 +22,10 @@
 #define DEFAULT_PARTIAL_LEN 4
 #define DEFAULT_FULL_LEN 4
 
+/* How many times to try mapping the trie without locking before falling back
+   to waiting for the writer to finish. */
+#define SQUAT_TRIE_UNLOCKED_MAP_ATTEMPTS 2
+
 #define MAX_FAST_LEVEL 3
 #define SEQUENTIAL_COUNT 46
 
@@ -278,6 +282,22 @@ int squat_trie_refresh(struct squat_trie *trie)
 	return ret;
 }
 
+static int squat_trie_reopen_if_stale(struct squat_trie *trie)
+{
+	int ret;
+
+	for (;;) {
+		if ((ret = squat_trie_is_file_stale(trie)) <= 0)
+			return ret;
+
+		squat_trie_close(trie);
+		if (squat_trie_open_fd(trie) < 0)
+			return -1;
+		if (trie->fd == -1)
+			return 0;
+	}
+}
+
 static int squat_trie_lock(struct squat_trie *trie, int lock_type,
 			   struct file_lock **file_lock_r,
 			   struct dotlock **dotlock_r)
@@ -1476,7 +1496,9 @@ static int squat_trie_map_header(struct squat_trie *trie)
 	return squat_trie_check_header(trie) ? 1 : 0;
 }
 
-static int squat_trie_map(struct squat_trie *trie, bool building)
+static int
+squat_trie_map_real(struct squat_trie *trie, bool building, bool lock,
+		    bool *changed_r)
 {
 	struct file_lock *file_lock = NULL;
 	struct dotlock *dotlock = NULL;
@@ -1484,10 +1506,14 @@ static int squat_trie_map(struct squat_trie *trie, bool building)
 	int ret;
 
 	if (trie->fd != -1) {
-		if (squat_trie_lock(trie, F_RDLCK, &file_lock, &dotlock) <= 0)
+		if (!lock) {
+			if (squat_trie_reopen_if_stale(trie) < 0)
+				return -1;
+		} else if (squat_trie_lock(trie, F_RDLCK, &file_lock,
+					   &dotlock) <= 0)
 			return -1;
 		if ((trie->flags & SQUAT_INDEX_FLAG_MMAP_DISABLE) != 0 &&
-		    trie->file_cache == NULL)
+		    trie->fd != -1 && trie->file_cache == NULL)
 			trie->file_cache = file_cache_new_path(trie->fd, trie->path);
 	}
 
@@ -1495,7 +1521,7 @@ static int squat_trie_map(struct squat_trie *trie, bool building)
 	if (ret == 0) {
 		if (file_lock != NULL)
 			file_unlock(&file_lock);
-		else
+		else if (dotlock != NULL)
 			file_dotlock_delete(&dotlock);
 		squat_trie_delete(trie);
 		squat_trie_close(trie);
@@ -1520,19 +1546,45 @@ static int squat_trie_map(struct squat_trie *trie, bool building)
 			trie->root.children_not_mapped = TRUE;
 		}
 	}
+	if (changed)
+		*changed_r = TRUE;
 
-	if (ret >= 0 && !building) {
-		/* do this while we're still locked */
-		ret = squat_uidlist_refresh(trie->uidlist);
+	if (ret >= 0) {
+		ret = building ? 1 :
+			squat_uidlist_refresh(trie->uidlist);
 	}
 
 	if (file_lock != NULL)
 		file_unlock(&file_lock);
 	if (dotlock != NULL)
 		file_dotlock_delete(&dotlock);
-	if (ret < 0)
-		return -1;
+	return ret;
+}
 
+static int squat_trie_map(struct squat_trie *trie, bool building)
+{
+	unsigned int attempts = 0;
+	bool changed = FALSE, lock;
+	int ret;
+
+	/* The trie file is replaced atomically and its header contains the
+	   matching uidlist header, so readers don't need to lock anything.
+	   Lock only when building, with NFS or if the uidlist keeps getting
+	   replaced while we're mapping it. */
+	do {
+		lock = building ||
+			attempts++ >= SQUAT_TRIE_UNLOCKED_MAP_ATTEMPTS ||
+			(trie->flags & SQUAT_INDEX_FLAG_NFS_FLUSH) != 0;
+		if ((ret = squat_trie_map_real(trie, building, lock,
+					       &changed)) < 0)
+			return -1;
+	} while (ret == 0 && !lock);
+
+	if (ret == 0) {
+		/* the uidlist doesn't match the trie even while locked */
+		squat_trie_set_corrupted(trie);
+		return -1;
+	}
 	return trie->hdr.root_offset == 0 || !changed ? 0 :
 		node_read_children(trie, &trie->root, 1);
 }
@@ -1613,54 +1665,30 @@ static int squat_trie_write(struct squat_trie_build_context *ctx)
 	const char *path;
 	int fd = -1, ret = 0;
 
-	if ((trie->hdr.used_file_size > sizeof(trie->hdr) &&
-	    trie->unmapped_child_count < trie->hdr.node_count/4) || 1) {
-		/* we might as well recreate the file */
-		ctx->compress_nodes = TRUE;
-
-		path = t_strconcat(trie->path, ".tmp", NULL);
-		fd = squat_trie_create_fd(trie, path, O_TRUNC);
-		if (fd == -1)
-			return -1;
+	/* always recreate the file. readers don't lock the trie, so it must
+	   never be modified after it has been renamed into place. */
+	ctx->compress_nodes = TRUE;
 
-		if (trie->lock_method != FILE_LOCK_METHOD_DOTLOCK) {
-			ret = file_wait_lock(fd, path, F_WRLCK,
-					     trie->lock_method,
-					     SQUAT_TRIE_LOCK_TIMEOUT,
-					     &file_lock);
-			if (ret <= 0) {
-				if (ret == 0) {
-					i_error("file_wait_lock(%s) failed: %m",
-						path);
-				}
-				i_close_fd(&fd);
-				return -1;
-			}
-		}
+	path = t_strconcat(trie->path, ".tmp", NULL);
+	fd = squat_trie_create_fd(trie, path, O_TRUNC);
+	if (fd == -1)
+		return -1;
 
-		output = o_stream_create_fd(fd, 0);
-		o_stream_cork(output);
-		o_stream_nsend(output, &trie->hdr, sizeof(trie->hdr));
-	} else {
-		/* we need to lock only while header is being written */
-		path = trie->path;
-		ctx->compress_nodes =
-			trie->hdr.used_file_size == sizeof(trie->hdr);
-
-		if (trie->hdr.used_file_size == 0) {
-			/* lock before opening the file, in case we reopen it */
-			if (squat_trie_write_lock(ctx) < 0)
-				return -1;
+	if (trie->lock_method != FILE_LOCK_METHOD_DOTLOCK) {
+		ret = file_wait_lock(fd, path, F_WRLCK, trie->lock_method,
+				     SQUAT_TRIE_LOCK_TIMEOUT, &file_lock);
+		if (ret <= 0) {
+			if (ret == 0)
+				i_error("file_wait_lock(%s) failed: %m", path);
+			i_close_fd(&fd);
+			return -1;
 		}
-		output = o_stream_create_fd(trie->fd, 0);
-		o_stream_cork(output);
-
-		if (trie->hdr.used_file_size != 0)
-			(void)o_stream_seek(output, trie->hdr.used_file_size);
-		else
-			o_stream_nsend(output, &trie->hdr, sizeof(trie->hdr));
 	}
 
+	output = o_stream_create_fd(fd, 0);
+	o_stream_cork(output);
+	o_stream_nsend(output, &trie->hdr, sizeof(trie->hdr));
+
 	ctx->output = output;
 	ret = squat_write_nodes(ctx);
 	ctx->output = NULL;
@@ -1675,6 +1703,8 @@ static int squat_trie_write(struct squat_trie_build_context *ctx)
 		ret = squat_trie_write_lock(ctx);
 	if (ret == 0) {
 		trie->hdr.used_file_size = output->offset;
+		squat_uidlist_build_get_header(ctx->uidlist_build_ctx,
+					       &trie->hdr.uidlist_hdr);
 		(void)o_stream_seek(output, 0);
 		o_stream_nsend(output, &trie->hdr, sizeof(trie->hdr));
 	}
@@ -1685,13 +1715,6 @@ static int squat_trie_write(struct squat_trie_build_context *ctx)
 	}
 	o_stream_destroy(&output);
 
-	if (fd == -1) {
-		/* appended to the existing file */
-		i_assert(file_lock == NULL);
-		return ret;
-	}
-
-	/* recreating the trie file */
 	if (ret < 0) {
 		if (close(fd) < 0)
 			i_error("close(%s) failed: %m", path);
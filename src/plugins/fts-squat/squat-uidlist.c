@@ -560,19 +560,75 @@ static void squat_uidlist_close(struct squat_uidlist *uidlist)
 	uidlist->corrupted = FALSE;
 }
 
-int squat_uidlist_refresh(struct squat_uidlist *uidlist)
+static int squat_uidlist_map_snapshot(struct squat_uidlist *uidlist)
 {
-	/* we assume here that trie is locked, so that we don't need to worry
-	   about it when reading the header */
-	if (uidlist->fd == -1 ||
-	    uidlist->hdr.indexid != uidlist->trie->hdr.indexid) {
-		if (squat_uidlist_open(uidlist) < 0)
-			return -1;
+	const struct squat_uidlist_file_header *hdr =
+		&uidlist->trie->hdr.uidlist_hdr;
+	struct squat_uidlist_file_header file_hdr;
+	int ret;
+
+	if ((uidlist->trie->flags & SQUAT_INDEX_FLAG_MMAP_DISABLE) == 0) {
+		if (uidlist->mmap_base != NULL &&
+		    memcmp(&uidlist->hdr, hdr, sizeof(*hdr)) == 0) {
+			/* file hasn't changed */
+			return 1;
+		}
+		if (uidlist->mmap_base == NULL ||
+		    uidlist->mmap_size < hdr->used_file_size) {
+			if (squat_uidlist_mmap(uidlist) < 0)
+				return -1;
+			if (uidlist->mmap_size < hdr->used_file_size)
+				return 0;
+		}
+		memcpy(&file_hdr, uidlist->mmap_base, sizeof(file_hdr));
 	} else {
-		if (squat_uidlist_map(uidlist) <= 0)
+		ret = pread_full(uidlist->fd, &file_hdr, sizeof(file_hdr), 0);
+		if (ret <= 0) {
+			if (ret < 0) {
+				i_error("pread(%s) failed: %m", uidlist->path);
+				return -1;
+			}
+			return 0;
+		}
+		uidlist->data = NULL;
+		uidlist->data_size = 0;
+		if (uidlist->file_cache == NULL) {
+			uidlist->file_cache =
+				file_cache_new_path(uidlist->fd, uidlist->path);
+		}
+	}
+	/* the header in the file is rewritten by writers, but its indexid
+	   changes only when the file is replaced by a rebuild. */
+	if (file_hdr.indexid != hdr->indexid)
+		return 0;
+
+	uidlist->hdr = *hdr;
+	return squat_uidlist_map_header(uidlist) > 0 ? 1 : -1;
+}
+
+int squat_uidlist_refresh(struct squat_uidlist *uidlist)
+{
+	const struct squat_uidlist_file_header *hdr =
+		&uidlist->trie->hdr.uidlist_hdr;
+
+	if (hdr->indexid == 0) {
+		/* no uidlists written yet */
+		i_zero(&uidlist->hdr);
+		uidlist->cur_block_count = 0;
+		return 1;
+	}
+
+	if (uidlist->fd == -1 || uidlist->hdr.indexid != hdr->indexid) {
+		squat_uidlist_close(uidlist);
+		uidlist->fd = open(uidlist->path, O_RDWR);
+		if (uidlist->fd == -1) {
+			if (errno == ENOENT)
+				return 0;
+			i_error("open(%s) failed: %m", uidlist->path);
 			return -1;
+		}
 	}
-	return 0;
+	return squat_uidlist_map_snapshot(uidlist);
 }
 
 static int squat_uidlist_is_file_stale(struct squat_uidlist *uidlist)
@@ -867,6 +923,12 @@ int squat_uidlist_build_finish(struct squat_uidlist_build_context *ctx)
 	return 0;
 }
 
+void squat_uidlist_build_get_header(struct squat_uidlist_build_context *ctx,
+				    struct squat_uidlist_file_header *hdr_r)
+{
+	*hdr_r = ctx->build_hdr;
+}
+
 void squat_uidlist_build_deinit(struct squat_uidlist_build_context **_ctx)
 {
 	struct squat_uidlist_build_context *ctx = *_ctx;
@@ -34,6 +34,9 @@ struct squat_uidlist_file_header {
 struct squat_uidlist *squat_uidlist_init(struct squat_trie *trie);
 void squat_uidlist_deinit(struct squat_uidlist *uidlist);
 
+/* Map the uidlist using the header snapshot in the trie header. The uidlist
+   file isn't locked. Returns 1 if ok, 0 if the uidlist file doesn't match
+   the trie (a writer is just replacing the files), -1 on error. */
 int squat_uidlist_refresh(struct squat_uidlist *uidlist);
 
 int squat_uidlist_build_init(struct squat_uidlist *uidlist,
@@ -42,6 +45,9 @@ uint32_t squat_uidlist_build_add_uid(struct squat_uidlist_build_context *ctx,
 				     uint32_t uid_list_idx, uint32_t uid);
 void squat_uidlist_build_flush(struct squat_uidlist_build_context *ctx);
 int squat_uidlist_build_finish(struct squat_uidlist_build_context *ctx);
+/* Returns the header that squat_uidlist_build_finish() is going to write. */
+void squat_uidlist_build_get_header(struct squat_uidlist_build_context *ctx,
+				    struct squat_uidlist_file_header *hdr_r);
 void squat_uidlist_build_deinit(struct squat_uidlist_build_context **ctx);
 
 int squat_uidlist_rebuild_init(struct squat_uidlist_build_context *build_ctx,
@@ -66,7 +66,10 @@ enum fts_backend_flags {
 	   directly indexable token at a time. Searching will modify the search
 	   args so that lookup() sees only tokens that can be directly
 	   searched. */
-	FTS_BACKEND_FLAG_TOKENIZED_INPUT	= 0x10
+	FTS_BACKEND_FLAG_TOKENIZED_INPUT	= 0x10,
+	/* Mails may become visible to lookups only some time after the
+	   last indexed UID was updated. Lookup results can't be cached. */
+	FTS_BACKEND_FLAG_DELAYED_VISIBILITY	= 0x20
 };
 
 struct fts_backend {
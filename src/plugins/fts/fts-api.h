@@ -55,6 +55,10 @@ ARRAY_DEFINE_TYPE(fts_score_map, struct fts_score_map);
 
 struct fts_result {
 	struct mailbox *box;
+	/* If non-zero, the caller is only interested in UIDs >= min_uid.
+	   Backends may use this to make the lookup cheaper, but they're also
+	   allowed to return lower UIDs. */
+	uint32_t min_uid;
 
 	ARRAY_TYPE(seq_range) definite_uids;
 	/* The maybe_uids is useful with backends that can only filter out
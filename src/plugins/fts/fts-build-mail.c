@@ -4,6 +4,7 @@
 #include "istream.h"
 #include "buffer.h"
 #include "str.h"
+#include "time-util.h"
 #include "rfc822-parser.h"
 #include "message-address.h"
 #include "message-parser.h"
@@ -24,6 +25,8 @@
 /* if we see a word larger than this, just go ahead and split it from
    wherever */
 #define MAX_WORD_SIZE 1024
+/* number of tokens to give to the filters at a time */
+#define FTS_BUILD_TOKEN_BATCH_SIZE 128
 
 struct fts_mail_build_context {
 	struct mail *mail;
@@ -32,8 +35,12 @@ struct fts_mail_build_context {
 	char *content_type, *content_disposition;
 	struct fts_parser *body_parser;
 
-	buffer_t *word_buf, *pending_input;
+	buffer_t *word_buf, *pending_input, *token_buf;
 	struct fts_user_language *cur_user_lang;
+
+	/* language detection statistics for this mail */
+	struct fts_language_detect_stats lang_stats_start;
+	long long lang_detect_usecs;
 };
 
 static int fts_build_data(struct fts_mail_build_context *ctx,
@@ -265,31 +272,116 @@ fts_build_body_begin(struct fts_mail_build_context *ctx,
 	return TRUE;
 }
 
+static int
+fts_build_add_tokens_unbatched(struct fts_mail_build_context *ctx,
+			       struct fts_filter *filter)
+{
+	const char *p, *end, *token, *error;
+	int ret;
+
+	p = ctx->token_buf->data;
+	end = CONST_PTR_OFFSET(p, ctx->token_buf->used);
+	for (; p < end; p += strlen(p) + 1) {
+		token = p;
+		ret = fts_filter_filter(filter, &token, &error);
+		if (ret < 0) {
+			i_error("fts: Couldn't create indexable tokens: %s",
+				error);
+		} else if (ret > 0) {
+			if (fts_backend_update_build_more(ctx->update_ctx,
+							  (const void *)token,
+							  strlen(token)) < 0)
+				return -1;
+		}
+	}
+	return 0;
+}
+
 static int
 fts_build_add_tokens_with_filter(struct fts_mail_build_context *ctx,
 				 const unsigned char *data, size_t size)
 {
 	struct fts_tokenizer *tokenizer = ctx->cur_user_lang->index_tokenizer;
 	struct fts_filter *filter = ctx->cur_user_lang->filter;
-	const char *token, *error;
-	int ret = 1, ret2;
+	ARRAY_TYPE(const_string) tokens;
+	const char *const *tokenp, *token, *error, *p, *end;
+	unsigned int count;
+	int ret = 1;
 
+	if (ctx->token_buf == NULL)
+		ctx->token_buf = buffer_create_dynamic(default_pool, 1024);
 	while (ret > 0) T_BEGIN {
-		ret = ret2 = fts_tokenizer_next(tokenizer, data, size, &token, &error);
-		if (ret2 > 0 && filter != NULL)
-			ret2 = fts_filter_filter(filter, &token, &error);
-		if (ret2 < 0)
+		/* filter the tokens in batches. the tokenizer may overwrite
+		   the previous token, so copy them all to the same buffer. */
+		buffer_set_used_size(ctx->token_buf, 0);
+		count = 0;
+		while (count < FTS_BUILD_TOKEN_BATCH_SIZE &&
+		       (ret = fts_tokenizer_next(tokenizer, data, size,
+						 &token, &error)) > 0) {
+			buffer_append(ctx->token_buf, token, strlen(token) + 1);
+			count++;
+		}
+		if (ret < 0)
 			i_error("fts: Couldn't create indexable tokens: %s", error);
-		if (ret2 > 0) {
+
+		t_array_init(&tokens, I_MAX(count, 1));
+		p = ctx->token_buf->data;
+		end = CONST_PTR_OFFSET(p, ctx->token_buf->used);
+		for (; p < end; p += strlen(p) + 1)
+			array_push_back(&tokens, &p);
+		if (filter != NULL && count > 0 &&
+		    fts_filter_filter_batch(filter, &tokens, &error) < 0) {
+			/* the whole batch was dropped. filter the tokens one
+			   by one, so only the failing ones are lost. */
+			if (fts_build_add_tokens_unbatched(ctx, filter) < 0)
+				ret = -1;
+			array_clear(&tokens);
+		}
+		array_foreach(&tokens, tokenp) {
 			if (fts_backend_update_build_more(ctx->update_ctx,
-							  (const void *)token,
-							  strlen(token)) < 0)
+							  (const void *)*tokenp,
+							  strlen(*tokenp)) < 0) {
 				ret = -1;
+				break;
+			}
 		}
 	} T_END;
 	return ret;
 }
 
+static enum fts_language_result
+fts_detect_language_sample(struct fts_mail_build_context *ctx,
+			   struct fts_language_list *lang_list,
+			   const unsigned char *data, size_t size,
+			   const struct fts_language **lang_r)
+{
+	enum fts_language_result result;
+	struct timeval start_time, end_time;
+	buffer_t *sample;
+
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	if (ctx->pending_input->used == 0) {
+		result = fts_language_detect(lang_list, data, size, lang_r);
+	} else T_BEGIN {
+		/* detect from the beginning of the input, but don't bother
+		   copying more than detection looks at */
+		sample = t_buffer_create(FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE);
+		buffer_append(sample, ctx->pending_input->data,
+			      I_MIN(ctx->pending_input->used,
+				    FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE));
+		buffer_append(sample, data,
+			      I_MIN(size, FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE -
+				    sample->used));
+		result = fts_language_detect(lang_list, sample->data,
+					     sample->used, lang_r);
+	} T_END;
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	ctx->lang_detect_usecs += timeval_diff_usecs(&end_time, &start_time);
+	return result;
+}
+
 static int
 fts_detect_language(struct fts_mail_build_context *ctx,
 		    const unsigned char *data, size_t size, bool last,
@@ -299,12 +391,14 @@ fts_detect_language(struct fts_mail_build_context *ctx,
 	struct fts_language_list *lang_list = fts_user_get_language_list(user);
 	const struct fts_language *lang;
 
-	switch (fts_language_detect(lang_list, data, size, &lang)) {
+	switch (fts_detect_language_sample(ctx, lang_list, data, size, &lang)) {
 	case FTS_LANGUAGE_RESULT_SHORT:
 		/* save the input so far and try again later */
 		buffer_append(ctx->pending_input, data, size);
-		if (last) {
-			/* we've run out of data. use the default language. */
+		if (last ||
+		    ctx->pending_input->used >= FTS_LANGUAGE_DETECT_MAX_SAMPLE_SIZE) {
+			/* we've run out of data or the sample is already as
+			   large as detection uses. use the default language. */
 			*lang_r = fts_language_list_get_first(lang_list);
 			return 1;
 		}
@@ -469,6 +563,30 @@ static int fts_body_parser_finish(struct fts_mail_build_context *ctx,
 	return deinit_ret < 0 ? -1 : 0;
 }
 
+static void fts_build_mail_lang_stats(struct fts_mail_build_context *ctx)
+{
+	struct mail_user *user = ctx->update_ctx->backend->ns->user;
+	struct fts_language_detect_stats stats;
+	unsigned int detects, cache_hits;
+
+	fts_language_list_get_stats(fts_user_get_language_list(user), &stats);
+	detects = stats.detect_count - ctx->lang_stats_start.detect_count;
+	cache_hits = stats.cache_hit_count -
+		ctx->lang_stats_start.cache_hit_count;
+	if (detects + cache_hits == 0)
+		return;
+
+	struct event_passthrough *e =
+		event_create_passthrough(user->event)->
+		set_name("fts_language_detect_finished")->
+		add_int("detects", detects)->
+		add_int("cache_hits", cache_hits)->
+		add_int("usecs", ctx->lang_detect_usecs);
+	e_debug(e->event(), "fts: Language detected for mail UID=%u "
+		"%u times (%u cache hits) in %lld usecs", ctx->mail->uid,
+		detects + cache_hits, cache_hits, ctx->lang_detect_usecs);
+}
+
 static int
 fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 		    struct mail *mail,
@@ -499,8 +617,12 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	i_zero(&ctx);
 	ctx.update_ctx = update_ctx;
 	ctx.mail = mail;
-	if ((update_ctx->backend->flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0)
+	if ((update_ctx->backend->flags & FTS_BACKEND_FLAG_TOKENIZED_INPUT) != 0) {
 		ctx.pending_input = buffer_create_dynamic(default_pool, 128);
+		fts_language_list_get_stats(
+			fts_user_get_language_list(update_ctx->backend->ns->user),
+			&ctx.lang_stats_start);
+	}
 
 	prev_part = NULL;
 	parser = message_parser_init(pool_datastack_create(), input,
@@ -597,10 +719,13 @@ fts_build_mail_real(struct fts_backend_update_context *update_ctx,
 	if (message_parser_deinit_from_parts(&parser, &parts, &error) < 0)
 		index_mail_set_message_parts_corrupted(mail, error);
 	message_decoder_deinit(&decoder);
+	if (ctx.pending_input != NULL)
+		fts_build_mail_lang_stats(&ctx);
 	i_free(ctx.content_type);
 	i_free(ctx.content_disposition);
 	buffer_free(&ctx.word_buf);
 	buffer_free(&ctx.pending_input);
+	buffer_free(&ctx.token_buf);
 	return ret < 0 ? -1 : 1;
 }
 
@@ -3,8 +3,13 @@
 #include "lib.h"
 #include "ioloop.h"
 #include "istream.h"
+#include "buffer.h"
+#include "hash.h"
+#include "llist.h"
+#include "sha2.h"
 #include "module-context.h"
 #include "iostream-ssl.h"
+#include "settings-parser.h"
 #include "http-url.h"
 #include "http-client.h"
 #include "message-parser.h"
@@ -14,24 +19,64 @@
 #define TIKA_USER_CONTEXT(obj) \
 	MODULE_CONTEXT(obj, fts_parser_tika_user_module)
 
+/* Keep the connection to Tika open between attachments */
+#define TIKA_MAX_IDLE_TIME_MSECS (10*1000)
+/* Default maximum total size of the extracted texts in the cache */
+#define TIKA_CACHE_DEFAULT_SIZE (10*1024*1024)
+/* Larger attachments are streamed to Tika without caching */
+#define TIKA_CACHE_MAX_INPUT_SIZE (8*1024*1024)
+
 struct fts_parser_tika_user {
 	union mail_user_module_context module_ctx;
 	struct http_url *http_url;
+	/* fts_tika_cache_size - 0 disables caching for this user */
+	uoff_t cache_max_size;
+};
+
+/* Extracted text of an attachment, keyed by SHA256 of its Content-Type and
+   decoded body. The same attachment is commonly found in many mails (and
+   many users' mailboxes), so it needs to be sent to Tika only once. */
+struct tika_cache_entry {
+	struct tika_cache_entry *prev, *next;
+
+	unsigned char digest[SHA256_RESULTLEN];
+	size_t text_size;
+	unsigned char text[FLEXIBLE_ARRAY_MEMBER];
+};
+
+struct tika_cache {
+	HASH_TABLE(const unsigned char *, struct tika_cache_entry *) entries;
+	/* least recently used first */
+	struct tika_cache_entry *head, *tail;
+	/* The cache is shared by all the users in the process, so its size is
+	   the largest fts_tika_cache_size of the users that have used it. */
+	size_t size, max_size;
 };
 
 struct tika_fts_parser {
 	struct fts_parser parser;
 	struct mail_user *user;
+	struct http_url *http_url;
+	char *content_type, *content_disposition;
 	struct http_client_request *http_req;
 
 	struct ioloop *ioloop;
 	struct io *io;
 	struct istream *payload;
 
+	/* The attachment is buffered until it's finished, so it can be looked
+	   up from the cache before sending it to Tika. NULL when streaming. */
+	buffer_t *input;
+	struct sha256_ctx input_hash;
+	unsigned char digest[SHA256_RESULTLEN];
+	/* Text returned by Tika, added to cache once it's fully read */
+	buffer_t *output;
+
 	bool failed;
 };
 
 static struct http_client *tika_http_client = NULL;
+static struct tika_cache *tika_cache = NULL;
 static MODULE_CONTEXT_DEFINE_INIT(fts_parser_tika_user_module,
 				  &mail_user_module_register);
 
@@ -41,7 +86,7 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 	struct fts_parser_tika_user *tuser = TIKA_USER_CONTEXT(user);
 	struct http_client_settings http_set;
 	struct ssl_iostream_settings ssl_set;
-	const char *url, *error;
+	const char *url, *value, *error;
 
 	url = mail_user_plugin_getenv(user, "fts_tika");
 	if (url == NULL) {
@@ -57,6 +102,14 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 	tuser = p_new(user->pool, struct fts_parser_tika_user, 1);
 	MODULE_CONTEXT_SET(user, fts_parser_tika_user_module, tuser);
 
+	tuser->cache_max_size = TIKA_CACHE_DEFAULT_SIZE;
+	value = mail_user_plugin_getenv(user, "fts_tika_cache_size");
+	if (value != NULL &&
+	    settings_get_size(value, &tuser->cache_max_size, &error) < 0) {
+		i_error("fts_tika: Invalid fts_tika_cache_size: %s", error);
+		tuser->cache_max_size = TIKA_CACHE_DEFAULT_SIZE;
+	}
+
 	if (http_url_parse(url, NULL, 0, user->pool,
 			   &tuser->http_url, &error) < 0) {
 		i_error("fts_tika: Failed to parse HTTP url %s: %s", url, error);
@@ -68,7 +121,7 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 		mail_user_init_ssl_client_settings(user, &ssl_set);
 
 		i_zero(&http_set);
-		http_set.max_idle_time_msecs = 100;
+		http_set.max_idle_time_msecs = TIKA_MAX_IDLE_TIME_MSECS;
 		http_set.max_parallel_connections = 1;
 		http_set.max_pipelined_requests = 1;
 		http_set.max_redirects = 1;
@@ -83,6 +136,88 @@ tika_get_http_client_url(struct mail_user *user, struct http_url **http_url_r)
 	return 0;
 }
 
+static unsigned int tika_cache_digest_hash(const unsigned char *digest)
+{
+	unsigned int hash;
+
+	memcpy(&hash, digest, sizeof(hash));
+	return hash;
+}
+
+static int tika_cache_digest_cmp(const unsigned char *digest1,
+				 const unsigned char *digest2)
+{
+	return memcmp(digest1, digest2, SHA256_RESULTLEN);
+}
+
+static void tika_cache_init(uoff_t max_size)
+{
+	if (tika_cache == NULL) {
+		tika_cache = i_new(struct tika_cache, 1);
+		hash_table_create(&tika_cache->entries, default_pool, 0,
+				  tika_cache_digest_hash, tika_cache_digest_cmp);
+	}
+	max_size = I_MIN(max_size, SSIZE_T_MAX);
+	if (tika_cache->max_size < max_size)
+		tika_cache->max_size = max_size;
+}
+
+static void tika_cache_entry_free(struct tika_cache_entry *entry)
+{
+	const unsigned char *digest = entry->digest;
+
+	hash_table_remove(tika_cache->entries, digest);
+	DLLIST2_REMOVE(&tika_cache->head, &tika_cache->tail, entry);
+	tika_cache->size -= entry->text_size;
+	i_free(entry);
+}
+
+static void tika_cache_deinit(void)
+{
+	if (tika_cache == NULL)
+		return;
+
+	while (tika_cache->head != NULL)
+		tika_cache_entry_free(tika_cache->head);
+	hash_table_destroy(&tika_cache->entries);
+	i_free(tika_cache);
+}
+
+static const struct tika_cache_entry *
+tika_cache_lookup(const unsigned char *digest)
+{
+	struct tika_cache_entry *entry;
+
+	entry = hash_table_lookup(tika_cache->entries, digest);
+	if (entry != NULL) {
+		DLLIST2_REMOVE(&tika_cache->head, &tika_cache->tail, entry);
+		DLLIST2_APPEND(&tika_cache->head, &tika_cache->tail, entry);
+	}
+	return entry;
+}
+
+static void tika_cache_add(const unsigned char *digest, const buffer_t *text)
+{
+	struct tika_cache_entry *entry;
+
+	/* a single text may use at most 1/4 of the cache */
+	if (text->used > tika_cache->max_size / 4 ||
+	    hash_table_lookup(tika_cache->entries, digest) != NULL)
+		return;
+
+	while (tika_cache->size + text->used > tika_cache->max_size)
+		tika_cache_entry_free(tika_cache->head);
+
+	entry = i_malloc(MALLOC_ADD(sizeof(*entry), text->used));
+	memcpy(entry->digest, digest, sizeof(entry->digest));
+	entry->text_size = text->used;
+	memcpy(entry->text, text->data, text->used);
+	digest = entry->digest;
+	hash_table_insert(tika_cache->entries, digest, entry);
+	DLLIST2_APPEND(&tika_cache->head, &tika_cache->tail, entry);
+	tika_cache->size += entry->text_size;
+}
+
 static void
 fts_tika_parser_response(const struct http_response *response,
 			 struct tika_fts_parser *parser)
@@ -132,40 +267,127 @@ fts_tika_parser_response(const struct http_response *response,
 	io_loop_stop(current_ioloop);
 }
 
+static void fts_parser_tika_request_init(struct tika_fts_parser *parser)
+{
+	struct http_url *http_url = parser->http_url;
+	struct http_client_request *http_req;
+
+	http_req = http_client_request(tika_http_client, "PUT",
+			http_url->host.name,
+			t_strconcat(http_url->path, http_url->enc_query, NULL),
+			fts_tika_parser_response, parser);
+	http_client_request_set_port(http_req, http_url->port);
+	http_client_request_set_ssl(http_req, http_url->have_ssl);
+	if (parser->content_type != NULL)
+		http_client_request_add_header(http_req, "Content-Type",
+					       parser->content_type);
+	if (parser->content_disposition != NULL)
+		http_client_request_add_header(http_req, "Content-Disposition",
+					       parser->content_disposition);
+	http_client_request_add_header(http_req, "Accept", "text/plain");
+
+	parser->http_req = http_req;
+}
+
 static struct fts_parser *
 fts_parser_tika_try_init(struct fts_parser_context *parser_context)
 {
+	struct fts_parser_tika_user *tuser;
 	struct tika_fts_parser *parser;
 	struct http_url *http_url;
-	struct http_client_request *http_req;
 
 	if (tika_get_http_client_url(parser_context->user, &http_url) < 0)
 		return NULL;
 	if (http_url->path == NULL)
 		http_url->path = "/";
+	tuser = TIKA_USER_CONTEXT(parser_context->user);
 
 	parser = i_new(struct tika_fts_parser, 1);
 	parser->parser.v = fts_parser_tika;
 	parser->user = parser_context->user;
+	parser->http_url = http_url;
+	parser->content_type = i_strdup(parser_context->content_type);
+	parser->content_disposition =
+		i_strdup(parser_context->content_disposition);
 
-	http_req = http_client_request(tika_http_client, "PUT",
-			http_url->host.name,
-			t_strconcat(http_url->path, http_url->enc_query, NULL),
-			fts_tika_parser_response, parser);
-	http_client_request_set_port(http_req, http_url->port);
-	http_client_request_set_ssl(http_req, http_url->have_ssl);
-	if (parser_context->content_type != NULL)
-		http_client_request_add_header(http_req, "Content-Type",
-					       parser_context->content_type);
-	if (parser_context->content_disposition != NULL)
-		http_client_request_add_header(http_req, "Content-Disposition",
-					       parser_context->content_disposition);
-	http_client_request_add_header(http_req, "Accept", "text/plain");
-
-	parser->http_req = http_req;
+	if (tuser->cache_max_size == 0) {
+		/* caching disabled - stream directly to Tika */
+		fts_parser_tika_request_init(parser);
+		return &parser->parser;
+	}
+	tika_cache_init(tuser->cache_max_size);
+	parser->input = buffer_create_dynamic(default_pool, 1024*16);
+	sha256_init(&parser->input_hash);
+	if (parser->content_type != NULL) {
+		sha256_loop(&parser->input_hash, parser->content_type,
+			    strlen(parser->content_type));
+	}
+	sha256_loop(&parser->input_hash, "", 1);
 	return &parser->parser;
 }
 
+static void
+fts_parser_tika_send_payload(struct tika_fts_parser *parser,
+			     const unsigned char *data, size_t size)
+{
+	if (parser->input == NULL) {
+		if (!parser->failed &&
+		    http_client_request_send_payload(&parser->http_req,
+						     data, size) < 0)
+			parser->failed = TRUE;
+		return;
+	}
+
+	sha256_loop(&parser->input_hash, data, size);
+	buffer_append(parser->input, data, size);
+	if (parser->input->used <= TIKA_CACHE_MAX_INPUT_SIZE)
+		return;
+
+	/* too large to be cached - start streaming it to Tika */
+	fts_parser_tika_request_init(parser);
+	if (http_client_request_send_payload(&parser->http_req,
+					     parser->input->data,
+					     parser->input->used) < 0)
+		parser->failed = TRUE;
+	buffer_free(&parser->input);
+}
+
+static void fts_parser_tika_finish_payload(struct tika_fts_parser *parser)
+{
+	const struct tika_cache_entry *entry;
+
+	if (parser->input != NULL) {
+		sha256_result(&parser->input_hash, parser->digest);
+		entry = tika_cache_lookup(parser->digest);
+		if (entry != NULL) {
+			e_debug(parser->user->event,
+				"fts_tika: Using cached text for %"PRIuSIZE_T
+				" bytes of %s", parser->input->used,
+				parser->content_type == NULL ? "(unknown)" :
+				parser->content_type);
+			parser->payload = i_stream_create_copy_from_data(
+				entry->text, entry->text_size);
+			return;
+		}
+
+		/* not cached - send the whole attachment to Tika now */
+		fts_parser_tika_request_init(parser);
+		if (parser->input->used > 0 &&
+		    http_client_request_send_payload(&parser->http_req,
+						     parser->input->data,
+						     parser->input->used) < 0)
+			parser->failed = TRUE;
+		buffer_free(&parser->input);
+		parser->output = buffer_create_dynamic(default_pool, 1024);
+	}
+
+	if (!parser->failed &&
+	    http_client_request_finish_payload(&parser->http_req) < 0)
+		parser->failed = TRUE;
+	if (!parser->failed && parser->payload == NULL)
+		http_client_wait(tika_http_client);
+}
+
 static void fts_parser_tika_more(struct fts_parser *_parser,
 				 struct message_block *block)
 {
@@ -177,22 +399,14 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 
 	if (block->size > 0) {
 		/* first we'll send everything to Tika */
-		if (!parser->failed &&
-		    http_client_request_send_payload(&parser->http_req,
-						     block->data,
-						     block->size) < 0)
-			parser->failed = TRUE;
+		fts_parser_tika_send_payload(parser, block->data, block->size);
 		block->size = 0;
 		return;
 	}
 
 	if (parser->payload == NULL) {
 		/* read the result from Tika */
-		if (!parser->failed &&
-		    http_client_request_finish_payload(&parser->http_req) < 0)
-			parser->failed = TRUE;
-		if (!parser->failed && parser->payload == NULL)
-			http_client_wait(tika_http_client);
+		fts_parser_tika_finish_payload(parser);
 		if (parser->failed)
 			return;
 		i_assert(parser->payload != NULL);
@@ -222,6 +436,8 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 		block->data = data;
 		block->size = size;
 		i_stream_skip(parser->payload, size);
+		if (parser->output != NULL)
+			buffer_append(parser->output, data, size);
 	} else {
 		/* finished */
 		i_assert(ret == -1);
@@ -230,6 +446,10 @@ static void fts_parser_tika_more(struct fts_parser *_parser,
 				i_stream_get_name(parser->payload),
 				i_stream_get_error(parser->payload));
 			parser->failed = TRUE;
+		} else if (parser->output != NULL &&
+			   !parser->parser.may_need_retry) {
+			tika_cache_add(parser->digest, parser->output);
+			buffer_free(&parser->output);
 		}
 	}
 }
@@ -253,12 +473,19 @@ static int fts_parser_tika_deinit(struct fts_parser *_parser, const char **retri
 		io_loop_set_current(parser->ioloop);
 		io_loop_destroy(&parser->ioloop);
 	}
+	if (parser->input != NULL)
+		buffer_free(&parser->input);
+	if (parser->output != NULL)
+		buffer_free(&parser->output);
+	i_free(parser->content_type);
+	i_free(parser->content_disposition);
 	i_free(parser);
 	return ret;
 }
 
 static void fts_parser_tika_unload(void)
 {
+	tika_cache_deinit();
 	if (tika_http_client != NULL)
 		http_client_deinit(&tika_http_client);
 }
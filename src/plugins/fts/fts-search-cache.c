@@ -0,0 +1,158 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "sort.h"
+#include "fts-search-cache.h"
+
+/* Number of different queries to remember per mailbox */
+#define FTS_SEARCH_CACHE_MAX_QUERIES 16
+
+struct fts_search_cache_entry {
+	pool_t pool;
+	const char *query;
+	struct fts_search_cache_result result;
+};
+
+struct fts_search_cache {
+	/* least recently used first */
+	ARRAY(struct fts_search_cache_entry) entries;
+};
+
+struct fts_search_cache *fts_search_cache_init(void)
+{
+	struct fts_search_cache *cache;
+
+	cache = i_new(struct fts_search_cache, 1);
+	i_array_init(&cache->entries, FTS_SEARCH_CACHE_MAX_QUERIES);
+	return cache;
+}
+
+void fts_search_cache_deinit(struct fts_search_cache **_cache)
+{
+	struct fts_search_cache *cache = *_cache;
+	struct fts_search_cache_entry *entry;
+
+	*_cache = NULL;
+	array_foreach_modifiable(&cache->entries, entry)
+		pool_unref(&entry->pool);
+	array_free(&cache->entries);
+	i_free(cache);
+}
+
+static unsigned int
+fts_search_cache_find(struct fts_search_cache *cache, const char *query)
+{
+	const struct fts_search_cache_entry *entries;
+	unsigned int i, count;
+
+	entries = array_get(&cache->entries, &count);
+	for (i = 0; i < count; i++) {
+		if (strcmp(entries[i].query, query) == 0)
+			return i;
+	}
+	return UINT_MAX;
+}
+
+const struct fts_search_cache_result *
+fts_search_cache_lookup(struct fts_search_cache *cache, const char *query)
+{
+	const struct fts_search_cache_entry *last;
+	struct fts_search_cache_entry entry;
+	unsigned int idx;
+
+	idx = fts_search_cache_find(cache, query);
+	if (idx == UINT_MAX)
+		return NULL;
+
+	/* move to the end as the most recently used */
+	entry = *array_idx(&cache->entries, idx);
+	array_delete(&cache->entries, idx, 1);
+	array_push_back(&cache->entries, &entry);
+	last = array_back(&cache->entries);
+	return &last->result;
+}
+
+void fts_search_cache_update(struct fts_search_cache *cache, const char *query,
+			     uint32_t last_indexed_uid,
+			     const struct fts_result *result,
+			     const buffer_t *args_matches)
+{
+	struct fts_search_cache_entry *entry, new_entry;
+	unsigned int idx;
+
+	idx = fts_search_cache_find(cache, query);
+	if (idx != UINT_MAX) {
+		entry = array_idx_modifiable(&cache->entries, idx);
+		pool_unref(&entry->pool);
+		array_delete(&cache->entries, idx, 1);
+	} else if (array_count(&cache->entries) >= FTS_SEARCH_CACHE_MAX_QUERIES) {
+		entry = array_front_modifiable(&cache->entries);
+		pool_unref(&entry->pool);
+		array_pop_front(&cache->entries);
+	}
+
+	i_zero(&new_entry);
+	new_entry.pool = pool_alloconly_create("fts search cache", 1024);
+	new_entry.query = p_strdup(new_entry.pool, query);
+	new_entry.result.last_indexed_uid = last_indexed_uid;
+	p_array_init(&new_entry.result.definite_uids, new_entry.pool,
+		     array_count(&result->definite_uids));
+	array_append_array(&new_entry.result.definite_uids,
+			   &result->definite_uids);
+	p_array_init(&new_entry.result.maybe_uids, new_entry.pool,
+		     array_count(&result->maybe_uids));
+	array_append_array(&new_entry.result.maybe_uids, &result->maybe_uids);
+	p_array_init(&new_entry.result.scores, new_entry.pool,
+		     array_count(&result->scores));
+	array_append_array(&new_entry.result.scores, &result->scores);
+	new_entry.result.args_matches =
+		buffer_create_dynamic(new_entry.pool, args_matches->used);
+	buffer_append_buf(new_entry.result.args_matches, args_matches,
+			  0, (size_t)-1);
+	array_push_back(&cache->entries, &new_entry);
+}
+
+static int fts_score_map_cmp(const struct fts_score_map *m1,
+			     const struct fts_score_map *m2)
+{
+	if (m1->uid < m2->uid)
+		return -1;
+	if (m1->uid > m2->uid)
+		return 1;
+	return 0;
+}
+
+void fts_search_cache_merge_scores(const ARRAY_TYPE(fts_score_map) *cached_scores,
+				   const ARRAY_TYPE(fts_score_map) *new_scores,
+				   uint32_t min_uid,
+				   ARRAY_TYPE(fts_score_map) *scores)
+{
+	const struct fts_score_map *score;
+	struct fts_score_map *maps;
+	unsigned int i, j, count, start = array_count(scores);
+
+	array_foreach(cached_scores, score) {
+		if (score->uid < min_uid)
+			array_push_back(scores, score);
+	}
+	array_foreach(new_scores, score) {
+		if (score->uid >= min_uid)
+			array_push_back(scores, score);
+	}
+
+	/* e.g. fts-solr appends the maybe-scores after the definite ones,
+	   so the same UID may be there twice and out of order */
+	maps = array_get_modifiable(scores, &count);
+	i_qsort(&maps[start], count - start, sizeof(*maps), fts_score_map_cmp);
+	for (i = j = start; i < count; i++) {
+		if (j > start && maps[j-1].uid == maps[i].uid) {
+			if (maps[j-1].score < maps[i].score)
+				maps[j-1].score = maps[i].score;
+		} else {
+			maps[j++] = maps[i];
+		}
+	}
+	array_delete(scores, j, count - j);
+}
@@ -0,0 +1,40 @@
+#ifndef FTS_SEARCH_CACHE_H
+#define FTS_SEARCH_CACHE_H
+
+#include "fts-api.h"
+
+/* Remembers the results of the latest FTS lookups done for a mailbox, so
+   a repeated lookup needs to ask the backend only for the mails indexed
+   since. */
+struct fts_search_cache_result {
+	/* Backend's last indexed UID when the lookup was done */
+	uint32_t last_indexed_uid;
+
+	ARRAY_TYPE(seq_range) definite_uids, maybe_uids;
+	ARRAY_TYPE(fts_score_map) scores;
+	/* Serialized [non]match_always fields of the looked up args */
+	buffer_t *args_matches;
+};
+
+struct fts_search_cache *fts_search_cache_init(void);
+void fts_search_cache_deinit(struct fts_search_cache **cache);
+
+/* Returns the cached result for the query or NULL if there is none. */
+const struct fts_search_cache_result *
+fts_search_cache_lookup(struct fts_search_cache *cache, const char *query);
+/* Add or replace the query's cached result. The least recently used results
+   are dropped when the cache is full. */
+void fts_search_cache_update(struct fts_search_cache *cache, const char *query,
+			     uint32_t last_indexed_uid,
+			     const struct fts_result *result,
+			     const buffer_t *args_matches);
+
+/* Add the cached scores for UIDs < min_uid and the new scores for
+   UIDs >= min_uid to scores, sorted by UID. The inputs don't need to be
+   sorted. If a UID has multiple scores, the highest one is kept. */
+void fts_search_cache_merge_scores(const ARRAY_TYPE(fts_score_map) *cached_scores,
+				   const ARRAY_TYPE(fts_score_map) *new_scores,
+				   uint32_t min_uid,
+				   ARRAY_TYPE(fts_score_map) *scores);
+
+#endif
@@ -3,10 +3,12 @@
 #include "lib.h"
 #include "array.h"
 #include "str.h"
+#include "time-util.h"
 #include "seq-range-array.h"
 #include "mail-search.h"
 #include "fts-api-private.h"
 #include "fts-search-args.h"
+#include "fts-search-cache.h"
 #include "fts-search-serialize.h"
 #include "fts-storage.h"
 
@@ -32,6 +34,124 @@ uid_range_to_seqs(struct fts_search_context *fctx,
 	}
 }
 
+static const char *
+fts_search_cache_query(struct fts_search_context *fctx,
+		       struct mail_search_arg *args, enum fts_lookup_flags flags)
+{
+	struct mailbox_status status;
+	const char *error;
+	string_t *str;
+
+	if ((fctx->backend->flags & FTS_BACKEND_FLAG_DELAYED_VISIBILITY) != 0)
+		return NULL;
+
+	mailbox_get_open_status(fctx->box, STATUS_UIDVALIDITY, &status);
+	str = t_str_new(128);
+	str_printfa(str, "%u %x ", status.uidvalidity, flags);
+	if (!mail_search_args_to_imap(str, args, &error))
+		return NULL;
+	return str_c(str);
+}
+
+static void
+fts_search_merge_cached(struct fts_search_context *fctx,
+			const struct fts_search_cache_result *cached,
+			struct fts_result *result)
+{
+	ARRAY_TYPE(seq_range) new_uids, no_uids, old_uids;
+	ARRAY_TYPE(fts_score_map) scores;
+
+	/* the backend may have returned also UIDs before min_uid. they're
+	   already in the cached result. */
+	t_array_init(&new_uids, 1);
+	t_array_init(&no_uids, 1);
+	seq_range_array_add_range(&new_uids, result->min_uid, (uint32_t)-1);
+	fts_filter_uids(&result->definite_uids, &new_uids,
+			&result->maybe_uids, &no_uids);
+
+	t_array_init(&old_uids, array_count(&cached->definite_uids));
+	array_append_array(&old_uids, &cached->definite_uids);
+	seq_range_array_remove_range(&old_uids, result->min_uid, (uint32_t)-1);
+	seq_range_array_merge(&result->definite_uids, &old_uids);
+
+	array_clear(&old_uids);
+	array_append_array(&old_uids, &cached->maybe_uids);
+	seq_range_array_remove_range(&old_uids, result->min_uid, (uint32_t)-1);
+	seq_range_array_merge(&result->maybe_uids, &old_uids);
+
+	p_array_init(&scores, fctx->result_pool,
+		     array_count(&cached->scores) + array_count(&result->scores));
+	fts_search_cache_merge_scores(&cached->scores, &result->scores,
+				      result->min_uid, &scores);
+	result->scores = scores;
+	result->scores_sorted = TRUE;
+}
+
+static int
+fts_search_lookup_level_single_result(struct fts_search_context *fctx,
+				      struct mail_search_arg *args,
+				      enum fts_lookup_flags flags,
+				      struct fts_result *result,
+				      buffer_t *args_matches)
+{
+	struct fts_search_cache *cache =
+		fts_mailbox_get_search_cache(fctx->box);
+	const struct fts_search_cache_result *cached = NULL;
+	const char *query;
+
+	query = fts_search_cache_query(fctx, args, flags);
+	if (query != NULL)
+		cached = fts_search_cache_lookup(cache, query);
+	if (cached != NULL &&
+	    cached->last_indexed_uid > fctx->last_indexed_uid) {
+		/* index was rebuilt */
+		cached = NULL;
+	}
+	if (cached != NULL &&
+	    cached->last_indexed_uid == fctx->last_indexed_uid) {
+		/* nothing new indexed since the last lookup */
+		fts_search_deserialize(args, cached->args_matches);
+		buffer_append_buf(args_matches, cached->args_matches,
+				  0, (size_t)-1);
+		array_append_array(&result->definite_uids,
+				   &cached->definite_uids);
+		array_append_array(&result->maybe_uids, &cached->maybe_uids);
+		array_append_array(&result->scores, &cached->scores);
+		fctx->cached_lookups++;
+		return 0;
+	}
+
+	result->min_uid = cached == NULL ? 0 : cached->last_indexed_uid + 1;
+	mail_search_args_reset(args, TRUE);
+	if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
+			       result) < 0)
+		return -1;
+	fts_search_serialize(args_matches, args);
+
+	if (cached != NULL && buffer_cmp(args_matches, cached->args_matches)) {
+		fts_search_merge_cached(fctx, cached, result);
+		fctx->incremental_lookups++;
+	} else if (cached != NULL) {
+		/* backend used different args this time. the results can't
+		   be merged, so look up everything. */
+		result->min_uid = 0;
+		buffer_set_used_size(args_matches, 0);
+		mail_search_args_reset(args, TRUE);
+		if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
+				       result) < 0)
+			return -1;
+		fts_search_serialize(args_matches, args);
+		fctx->full_lookups++;
+	} else {
+		fctx->full_lookups++;
+	}
+	if (query != NULL) {
+		fts_search_cache_update(cache, query, fctx->last_indexed_uid,
+					result, args_matches);
+	}
+	return 0;
+}
+
 static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 					  struct mail_search_arg *args,
 					  bool and_args)
@@ -40,20 +160,20 @@ static int fts_search_lookup_level_single(struct fts_search_context *fctx,
 		(and_args ? FTS_LOOKUP_FLAG_AND_ARGS : 0);
 	struct fts_search_level *level;
 	struct fts_result result;
+	buffer_t *args_matches;
 
 	i_zero(&result);
 	p_array_init(&result.definite_uids, fctx->result_pool, 32);
 	p_array_init(&result.maybe_uids, fctx->result_pool, 32);
 	p_array_init(&result.scores, fctx->result_pool, 32);
 
-	mail_search_args_reset(args, TRUE);
-	if (fts_backend_lookup(fctx->backend, fctx->box, args, flags,
-			       &result) < 0)
+	args_matches = buffer_create_dynamic(fctx->result_pool, 16);
+	if (fts_search_lookup_level_single_result(fctx, args, flags, &result,
+						  args_matches) < 0)
 		return -1;
 
 	level = array_append_space(&fctx->levels);
-	level->args_matches = buffer_create_dynamic(fctx->result_pool, 16);
-	fts_search_serialize(level->args_matches, args);
+	level->args_matches = args_matches;
 
 	uid_range_to_seqs(fctx, &result.definite_uids, &level->definite_seqs);
 	uid_range_to_seqs(fctx, &result.maybe_uids, &level->maybe_seqs);
@@ -336,17 +456,46 @@ static void fts_search_merge_scores(struct fts_search_context *fctx)
 				      TRUE, &fctx->scores->score_map);
 }
 
+static void fts_search_lookup_finished(struct fts_search_context *fctx,
+				       const struct timeval *start_time)
+{
+	struct timeval end_time;
+	long long usecs;
+
+	if (gettimeofday(&end_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
+	usecs = timeval_diff_usecs(&end_time, start_time);
+
+	struct event_passthrough *e =
+		event_create_passthrough(fctx->box->event)->
+		set_name("fts_lookup_finished")->
+		add_int("usecs", usecs)->
+		add_int("cached_lookups", fctx->cached_lookups)->
+		add_int("incremental_lookups", fctx->incremental_lookups)->
+		add_int("full_lookups", fctx->full_lookups);
+	if (!fctx->fts_lookup_success)
+		e->add_str("error", "Lookup failed");
+	e_debug(e->event(), "fts: Lookup finished in %lld usecs "
+		"(%u cached, %u incremental, %u full lookups)", usecs,
+		fctx->cached_lookups, fctx->incremental_lookups,
+		fctx->full_lookups);
+}
+
 void fts_search_lookup(struct fts_search_context *fctx)
 {
+	struct timeval start_time;
 	uint32_t last_uid, seq1, seq2;
 
 	i_assert(array_count(&fctx->levels) == 0);
 	i_assert(fctx->args->simplified);
 
+	if (gettimeofday(&start_time, NULL) < 0)
+		i_fatal("gettimeofday() failed: %m");
 	if (fts_backend_refresh(fctx->backend) < 0)
 		return;
 	if (fts_backend_get_last_uid(fctx->backend, fctx->box, &last_uid) < 0)
 		return;
+	fctx->last_indexed_uid = last_uid;
 	mailbox_get_seq_range(fctx->box, last_uid+1, (uint32_t)-1,
 			      &seq1, &seq2);
 	fctx->first_unindexed_seq = seq1 != 0 ? seq1 : (uint32_t)-1;
@@ -364,4 +513,5 @@ void fts_search_lookup(struct fts_search_context *fctx)
 
 	fts_search_deserialize(fctx->args->args, fctx->orig_matches);
 	fts_backend_lookup_done(fctx->backend);
+	fts_search_lookup_finished(fctx, &start_time);
 }
@@ -14,6 +14,7 @@
 #include "fts-tokenizer.h"
 #include "fts-indexer.h"
 #include "fts-build-mail.h"
+#include "fts-search-cache.h"
 #include "fts-search-serialize.h"
 #include "fts-plugin.h"
 #include "fts-storage.h"
@@ -47,6 +48,7 @@ struct fts_mailbox_list {
 struct fts_mailbox {
 	union mailbox_module_context module_ctx;
 	struct fts_backend_update_context *sync_update_ctx;
+	struct fts_search_cache *search_cache;
 	bool fts_mailbox_excluded;
 };
 
@@ -853,6 +855,15 @@ static bool fts_autoindex_exclude_match(struct mailbox *box)
 	return FALSE;
 }
 
+static void fts_mailbox_close(struct mailbox *box)
+{
+	struct fts_mailbox *fbox = FTS_CONTEXT_REQUIRE(box);
+
+	if (fbox->search_cache != NULL)
+		fts_search_cache_deinit(&fbox->search_cache);
+	fbox->module_ctx.super.close(box);
+}
+
 void fts_mailbox_allocated(struct mailbox *box)
 {
 	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT(box->list);
@@ -867,6 +878,7 @@ void fts_mailbox_allocated(struct mailbox *box)
 	box->vlast = &fbox->module_ctx.super;
 	fbox->fts_mailbox_excluded = fts_autoindex_exclude_match(box);
 
+	v->close = fts_mailbox_close;
 	v->get_status = fts_mailbox_get_status;
 	v->search_init = fts_mailbox_search_init;
 	v->search_next_nonblock = fts_mailbox_search_next_nonblock;
@@ -952,6 +964,15 @@ fts_mailbox_list_created(struct mailbox_list *list)
 	MODULE_CONTEXT_SET(list, fts_mailbox_list_module, flist);
 }
 
+struct fts_search_cache *fts_mailbox_get_search_cache(struct mailbox *box)
+{
+	struct fts_mailbox *fbox = FTS_CONTEXT_REQUIRE(box);
+
+	if (fbox->search_cache == NULL)
+		fbox->search_cache = fts_search_cache_init();
+	return fbox->search_cache;
+}
+
 struct fts_backend *fts_mailbox_backend(struct mailbox *box)
 {
 	struct fts_mailbox_list *flist = FTS_LIST_CONTEXT_REQUIRE(box->list);
@@ -36,6 +36,11 @@ struct fts_search_context {
 	buffer_t *orig_matches;
 
 	uint32_t first_unindexed_seq;
+	/* backend's last indexed UID at the time of the lookup */
+	uint32_t last_indexed_uid;
+	/* number of lookups answered fully or partially from the search
+	   cache, and the number of full backend lookups */
+	unsigned int cached_lookups, incremental_lookups, full_lookups;
 
 	/* final scores, combined from all levels */
 	struct fts_scores *scores;
@@ -52,6 +57,8 @@ struct fts_search_context {
 void fts_search_analyze(struct fts_search_context *fctx);
 /* Perform the actual index lookup and update definite_uids and maybe_uids. */
 void fts_search_lookup(struct fts_search_context *fctx);
+/* Returns the mailbox's cache of the latest lookup results. */
+struct fts_search_cache *fts_mailbox_get_search_cache(struct mailbox *box);
 /* Returns FTS backend for the given mailbox (assumes it has one). */
 struct fts_backend *fts_mailbox_backend(struct mailbox *box);
 /* Returns FTS backend for the given mailbox list, or NULL if it has none. */
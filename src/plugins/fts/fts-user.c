@@ -49,12 +49,21 @@ static const char *const *str_keyvalues_to_array(const char *str)
 	return array_front(&arr);
 }
 
+static void
+fts_user_lang_config_add(ARRAY_TYPE(const_string) *lang_config,
+			 const char *key, const char *value)
+{
+	array_push_back(lang_config, &key);
+	array_push_back(lang_config, &value);
+}
+
 static int
 fts_user_init_languages(struct mail_user *user, struct fts_user *fuser,
 			const char **error_r)
 {
-	const char *languages, *unknown;
-	const char *lang_config[3] = {NULL, NULL, NULL};
+	ARRAY_TYPE(const_string) lang_config;
+	const char *languages, *unknown, *value, *const *filter_set;
+	unsigned int i;
 
 	languages = mail_user_plugin_getenv(user, "fts_languages");
 	if (languages == NULL) {
@@ -62,10 +71,27 @@ fts_user_init_languages(struct mail_user *user, struct fts_user *fuser,
 		return -1;
 	}
 
-	lang_config[1] = mail_user_plugin_getenv(user, "fts_language_config");
-	if (lang_config[1] != NULL)
-		lang_config[0] = "fts_language_config";
-	if (fts_language_list_init(lang_config, &fuser->lang_list, error_r) < 0)
+	t_array_init(&lang_config, 5);
+	value = mail_user_plugin_getenv(user, "fts_language_config");
+	if (value != NULL)
+		fts_user_lang_config_add(&lang_config, "fts_language_config", value);
+	/* language detection uses the stopwords. by default use the same
+	   ones as the stopwords filter. */
+	value = mail_user_plugin_getenv(user, "fts_language_stopwords_dir");
+	filter_set = str_keyvalues_to_array(
+		mail_user_plugin_getenv(user, "fts_filter_stopwords"));
+	for (i = 0; value == NULL && filter_set != NULL &&
+		    filter_set[i] != NULL; i += 2) {
+		if (strcmp(filter_set[i], "stopwords_dir") == 0)
+			value = filter_set[i+1];
+	}
+	if (value != NULL) {
+		fts_user_lang_config_add(&lang_config,
+					 "fts_language_stopwords_dir", value);
+	}
+	array_append_zero(&lang_config);
+	if (fts_language_list_init(array_front(&lang_config),
+				   &fuser->lang_list, error_r) < 0)
 		return -1;
 
 	if (!fts_language_list_add_names(fuser->lang_list, languages, &unknown)) {
@@ -0,0 +1,371 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "hostpid.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "unlink-directory.h"
+#include "master-service.h"
+#include "http-request.h"
+#include "http-server.h"
+#include "message-parser.h"
+#include "mail-user.h"
+#include "mail-storage-service.h"
+#include "fts-parser.h"
+#include "test-common.h"
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#define TEST_ATTACHMENT_1 "attachment body 1"
+#define TEST_ATTACHMENT_2 "attachment body 2"
+
+struct test_user {
+	struct mail_storage_service_user *service_user;
+	struct mail_user *user;
+};
+
+static struct mail_storage_service_ctx *storage_service;
+static struct ioloop *test_ioloop;
+static const char *test_home;
+
+static struct ip_addr bind_ip;
+static in_port_t bind_port = 0;
+static int fd_listen = -1;
+static pid_t server_pid = (pid_t)-1;
+
+/*
+ * Test server
+ */
+
+static struct http_server *http_server;
+static struct io *io_listen;
+static unsigned int server_request_count = 0;
+
+struct test_server_request {
+	struct http_server_request *req;
+	buffer_t *payload;
+};
+
+static void test_server_payload_finished(struct test_server_request *treq)
+{
+	struct http_server_request *req = treq->req;
+	const struct http_request *hreq = http_server_request_get(req);
+	struct http_server_response *resp;
+	const char *content_type, *text;
+
+	/* every extracted text is different, so the client can see whether
+	   it came from the cache or from a new request */
+	server_request_count++;
+	content_type = http_request_header_get(hreq, "Content-Type");
+	if (content_type != NULL &&
+	    strcmp(content_type, "application/x-test-500") == 0) {
+		http_server_request_fail(req, 500, "Internal Server Error");
+		return;
+	}
+	if (content_type != NULL &&
+	    strcmp(content_type, "application/x-test-400") == 0) {
+		http_server_request_fail(req, 400, "Bad Request");
+		return;
+	}
+	text = t_strdup_printf("text %u", server_request_count);
+	resp = http_server_response_create(req, 200, "OK");
+	http_server_response_add_header(resp, "Content-Type", "text/plain");
+	http_server_response_set_payload_data(resp,
+		(const unsigned char *)text, strlen(text));
+	http_server_response_submit(resp);
+}
+
+static void
+test_server_handle_request(void *context ATTR_UNUSED,
+			   struct http_server_request *req)
+{
+	pool_t pool = http_server_request_get_pool(req);
+	struct test_server_request *treq;
+
+	/* read the whole attachment before replying */
+	treq = p_new(pool, struct test_server_request, 1);
+	treq->req = req;
+	treq->payload = buffer_create_dynamic(pool, 64);
+	http_server_request_buffer_payload(req, treq->payload, (uoff_t)-1,
+					   test_server_payload_finished, treq);
+}
+
+static const struct http_server_callbacks test_server_callbacks = {
+	.handle_request = test_server_handle_request
+};
+
+static void test_server_accept(void *context ATTR_UNUSED)
+{
+	int fd;
+
+	fd = net_accept(fd_listen, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (fd == -2)
+		i_fatal("test server: accept() failed: %m");
+	net_set_nonblock(fd, TRUE);
+	(void)http_server_connection_create(http_server, fd, fd, FALSE,
+					    &test_server_callbacks, NULL);
+}
+
+static void test_server_run(void)
+{
+	struct http_server_settings http_set;
+	struct ioloop *ioloop;
+
+	i_zero(&http_set);
+	http_set.request_limits.max_payload_size = (uoff_t)-1;
+
+	ioloop = io_loop_create();
+	http_server = http_server_init(&http_set);
+	io_listen = io_add(fd_listen, IO_READ, test_server_accept, NULL);
+	io_loop_run(ioloop);
+}
+
+static void test_server_start(void)
+{
+	if (net_addr2ip("127.0.0.1", &bind_ip) < 0)
+		i_unreached();
+	fd_listen = net_listen(&bind_ip, &bind_port, 128);
+	if (fd_listen == -1) {
+		i_fatal("listen(%s:%u) failed: %m",
+			net_ip2addr(&bind_ip), bind_port);
+	}
+	net_set_nonblock(fd_listen, TRUE);
+
+	if ((server_pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (server_pid == 0) {
+		/* child: server - runs until it's killed */
+		server_pid = (pid_t)-1;
+		hostpid_init();
+		test_server_run();
+		exit(0);
+	}
+	i_close_fd(&fd_listen);
+}
+
+static void test_server_kill(void)
+{
+	if (server_pid != (pid_t)-1) {
+		(void)kill(server_pid, SIGKILL);
+		(void)waitpid(server_pid, NULL, 0);
+	}
+	server_pid = (pid_t)-1;
+}
+
+/*
+ * Test client
+ */
+
+static void
+test_user_init(struct test_user *tuser, const char *username,
+	       const char *cache_size)
+{
+	const char *error;
+
+	struct mail_storage_service_input input = {
+		.userdb_fields = (const char *const[]){
+			"mail=maildir:~/",
+			t_strdup_printf("home=%s/%s", test_home, username),
+			t_strdup_printf("fts_tika=http://127.0.0.1:%u/",
+					bind_port),
+			t_strdup_printf("fts_tika_cache_size=%s", cache_size),
+			NULL
+		},
+		.username = username,
+		.no_userdb_lookup = TRUE,
+	};
+
+	i_zero(tuser);
+	if (mail_storage_service_lookup_next(storage_service, &input,
+					     &tuser->service_user,
+					     &tuser->user, &error) < 0)
+		i_fatal("mail_storage_service_lookup_next(%s) failed: %s",
+			username, error);
+}
+
+static void test_user_deinit(struct test_user *tuser)
+{
+	mail_user_deinit(&tuser->user);
+	mail_storage_service_user_unref(&tuser->service_user);
+}
+
+/* Parse the attachment with Tika. Returns the fts_parser deinit() result and
+   the extracted text. */
+static int
+test_tika_parse(struct mail_user *user, const char *content_type,
+		const char *body, const char **text_r,
+		const char **retriable_error_r)
+{
+	struct fts_parser_context parser_context;
+	struct fts_parser *parser;
+	struct message_block block;
+	string_t *text = t_str_new(64);
+	int ret;
+
+	i_zero(&parser_context);
+	parser_context.user = user;
+	parser_context.content_type = content_type;
+	parser = fts_parser_tika.try_init(&parser_context);
+	test_assert(parser != NULL);
+	if (parser == NULL)
+		return -1;
+
+	i_zero(&block);
+	block.data = (const unsigned char *)body;
+	block.size = strlen(body);
+	fts_parser_tika.more(parser, &block);
+	test_assert(block.size == 0);
+	do {
+		i_zero(&block);
+		fts_parser_tika.more(parser, &block);
+		str_append_data(text, block.data, block.size);
+	} while (block.size > 0);
+
+	ret = fts_parser_tika.deinit(parser, retriable_error_r);
+	*text_r = str_c(text);
+	return ret;
+}
+
+static void test_fts_parser_tika_cache(void)
+{
+	struct test_user tuser;
+	const char *text1, *text2, *text, *error;
+
+	test_begin("fts tika cache");
+	test_user_init(&tuser, "user1", "1M");
+
+	/* cache miss - sent to Tika */
+	test_assert(test_tika_parse(tuser.user, "application/pdf",
+				    TEST_ATTACHMENT_1, &text1, &error) == 1);
+	test_assert(str_begins(text1, "text "));
+	/* cache hit - the same text, so Tika wasn't asked again */
+	test_assert(test_tika_parse(tuser.user, "application/pdf",
+				    TEST_ATTACHMENT_1, &text, &error) == 1);
+	test_assert_strcmp(text, text1);
+
+	/* a different body is a miss */
+	test_assert(test_tika_parse(tuser.user, "application/pdf",
+				    TEST_ATTACHMENT_2, &text2, &error) == 1);
+	test_assert(str_begins(text2, "text "));
+	test_assert(strcmp(text2, text1) != 0);
+	/* so is the same body with a different Content-Type */
+	test_assert(test_tika_parse(tuser.user, "application/msword",
+				    TEST_ATTACHMENT_1, &text, &error) == 1);
+	test_assert(str_begins(text, "text "));
+	test_assert(strcmp(text, text1) != 0 && strcmp(text, text2) != 0);
+
+	test_user_deinit(&tuser);
+	test_end();
+}
+
+static void test_fts_parser_tika_cache_shared(void)
+{
+	struct test_user tuser1, tuser2;
+	const char *text1, *text, *error;
+
+	test_begin("fts tika cache shared between users");
+	test_user_init(&tuser1, "user2", "1M");
+	test_user_init(&tuser2, "user3", "0");
+
+	test_assert(test_tika_parse(tuser1.user, "text/rtf",
+				    TEST_ATTACHMENT_1, &text1, &error) == 1);
+	test_assert(test_tika_parse(tuser1.user, "text/rtf",
+				    TEST_ATTACHMENT_1, &text, &error) == 1);
+	test_assert_strcmp(text, text1);
+
+	/* fts_tika_cache_size=0 user doesn't use the cache */
+	test_assert(test_tika_parse(tuser2.user, "text/rtf",
+				    TEST_ATTACHMENT_1, &text, &error) == 1);
+	test_assert(str_begins(text, "text "));
+	test_assert(strcmp(text, text1) != 0);
+
+	test_user_deinit(&tuser2);
+	test_user_deinit(&tuser1);
+	test_end();
+}
+
+static void test_fts_parser_tika_errors(void)
+{
+	struct test_user tuser;
+	const char *text, *error;
+
+	test_begin("fts tika errors");
+	test_user_init(&tuser, "user4", "1M");
+
+	/* 5xx errors are retriable */
+	error = NULL;
+	test_assert(test_tika_parse(tuser.user, "application/x-test-500",
+				    TEST_ATTACHMENT_1, &text, &error) == 0);
+	test_assert(error != NULL && strstr(error, "500") != NULL);
+	test_assert_strcmp(text, "");
+	/* ..and the failure isn't cached */
+	error = NULL;
+	test_assert(test_tika_parse(tuser.user, "application/x-test-500",
+				    TEST_ATTACHMENT_1, &text, &error) == 0);
+	test_assert(error != NULL);
+
+	/* other errors fail the parsing */
+	test_expect_error_string("fts_tika: PUT");
+	test_assert(test_tika_parse(tuser.user, "application/x-test-400",
+				    TEST_ATTACHMENT_1, &text, &error) == -1);
+	test_expect_no_more_errors();
+
+	test_user_deinit(&tuser);
+	test_end();
+}
+
+static void test_fts_parser_tika(void)
+{
+	const char *error;
+	char path_buf[4096];
+
+	if (getcwd(path_buf, sizeof(path_buf)) == NULL)
+		i_fatal("getcwd() failed: %m");
+	test_home = t_strdup_printf("%s/.test-fts-parser-tika", path_buf);
+	(void)unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+
+	test_server_start();
+	test_ioloop = io_loop_create();
+	storage_service = mail_storage_service_init(master_service, NULL,
+		MAIL_STORAGE_SERVICE_FLAG_NO_RESTRICT_ACCESS |
+		MAIL_STORAGE_SERVICE_FLAG_NO_LOG_INIT |
+		MAIL_STORAGE_SERVICE_FLAG_NO_PLUGINS);
+
+	test_fts_parser_tika_cache();
+	test_fts_parser_tika_cache_shared();
+	test_fts_parser_tika_errors();
+
+	fts_parser_tika.unload();
+	mail_storage_service_deinit(&storage_service);
+	io_loop_destroy(&test_ioloop);
+	test_server_kill();
+
+	if (unlink_directory(test_home, UNLINK_DIRECTORY_FLAG_RMDIR,
+			     &error) < 0 && errno != ENOENT)
+		i_error("unlink_directory(%s) failed: %s", test_home, error);
+}
+
+int main(int argc, char **argv)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_parser_tika,
+		NULL
+	};
+	int ret;
+
+	master_service = master_service_init("test-fts-parser-tika",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_NO_CONFIG_SETTINGS |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	ret = test_run(test_functions);
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -0,0 +1,117 @@
+/* Copyright (c) 2018 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "seq-range-array.h"
+#include "fts-search-cache.h"
+#include "test-common.h"
+
+static void
+test_scores_add(ARRAY_TYPE(fts_score_map) *scores, const uint32_t *uids,
+		const float *values, unsigned int count)
+{
+	struct fts_score_map *score;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		score = array_append_space(scores);
+		score->uid = uids[i];
+		score->score = values[i];
+	}
+}
+
+static void test_fts_search_cache_merge_scores(void)
+{
+	static const uint32_t cached_uids[] = { 7, 2, 9, 1, 5 };
+	static const float cached_values[] = { 0.7, 0.2, 0.9, 0.1, 0.5 };
+	/* unsorted and overlapping, as with fts-solr's definite+maybe
+	   results. UIDs 4 and 5 are below min_uid, so they're dropped. */
+	static const uint32_t new_uids[] = { 12, 8, 4, 10, 8, 6, 5, 12 };
+	static const float new_values[] = { 1.2, 0.3, 0.4, 1.0, 0.8, 0.6,
+					    0.55, 1.5 };
+	static const uint32_t expected_uids[] = { 1, 2, 5, 6, 8, 10, 12 };
+	static const float expected_values[] = { 0.1, 0.2, 0.5, 0.6, 0.8,
+						  1.0, 1.5 };
+	ARRAY_TYPE(fts_score_map) cached_scores, new_scores, scores;
+	const struct fts_score_map *maps;
+	unsigned int i, count;
+
+	test_begin("fts search cache merge scores");
+	t_array_init(&cached_scores, N_ELEMENTS(cached_uids));
+	t_array_init(&new_scores, N_ELEMENTS(new_uids));
+	t_array_init(&scores, 16);
+	test_scores_add(&cached_scores, cached_uids, cached_values,
+			N_ELEMENTS(cached_uids));
+	test_scores_add(&new_scores, new_uids, new_values,
+			N_ELEMENTS(new_uids));
+
+	fts_search_cache_merge_scores(&cached_scores, &new_scores, 6, &scores);
+	maps = array_get(&scores, &count);
+	test_assert(count == N_ELEMENTS(expected_uids));
+	for (i = 0; i < count && i < N_ELEMENTS(expected_uids); i++) {
+		test_assert_idx(maps[i].uid == expected_uids[i], i);
+		test_assert_idx(maps[i].score == expected_values[i], i);
+	}
+
+	/* nothing cached */
+	array_clear(&scores);
+	array_clear(&cached_scores);
+	fts_search_cache_merge_scores(&cached_scores, &new_scores, 0, &scores);
+	maps = array_get(&scores, &count);
+	test_assert(count == 6);
+	for (i = 1; i < count; i++)
+		test_assert_idx(maps[i-1].uid < maps[i].uid, i);
+	test_end();
+}
+
+static void test_fts_search_cache_lookup(void)
+{
+	struct fts_search_cache *cache;
+	const struct fts_search_cache_result *cached;
+	struct fts_result result;
+	buffer_t *args_matches;
+	unsigned int i;
+
+	test_begin("fts search cache lookup");
+	cache = fts_search_cache_init();
+	i_zero(&result);
+	t_array_init(&result.definite_uids, 4);
+	t_array_init(&result.maybe_uids, 4);
+	t_array_init(&result.scores, 4);
+	args_matches = t_buffer_create(8);
+	buffer_append_c(args_matches, 1);
+
+	test_assert(fts_search_cache_lookup(cache, "q1") == NULL);
+	seq_range_array_add_range(&result.definite_uids, 1, 5);
+	fts_search_cache_update(cache, "q1", 10, &result, args_matches);
+	cached = fts_search_cache_lookup(cache, "q1");
+	test_assert(cached != NULL &&
+		    cached->last_indexed_uid == 10 &&
+		    seq_range_count(&cached->definite_uids) == 5 &&
+		    cached->args_matches->used == 1);
+
+	/* the least recently used queries are dropped when the cache is
+	   full. q1 was just looked up, so q2 is dropped first. */
+	fts_search_cache_update(cache, "q2", 10, &result, args_matches);
+	(void)fts_search_cache_lookup(cache, "q1");
+	for (i = 0; i < 15; i++) {
+		fts_search_cache_update(cache, t_strdup_printf("x%u", i),
+					10, &result, args_matches);
+	}
+	test_assert(fts_search_cache_lookup(cache, "q2") == NULL);
+	test_assert(fts_search_cache_lookup(cache, "q1") != NULL);
+
+	fts_search_cache_deinit(&cache);
+	test_end();
+}
+
+int main(void)
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_search_cache_merge_scores,
+		test_fts_search_cache_lookup,
+		NULL
+	};
+	return test_run(test_functions);
+}
@@ -90,7 +90,10 @@ static bool cmd_compress(struct client_command_context *cmd)
 	}
 
 	handler = compression_lookup_handler(t_str_lcase(mechanism));
-	if (handler == NULL || handler->create_istream == NULL) {
+	/* the output is flushed after each reply, so the handler must be
+	   able to write out partially filled blocks */
+	if (handler == NULL || handler->create_istream == NULL ||
+	    !handler->streamable) {
 		client_send_tagline(cmd, "NO Unknown compression mechanism.");
 		return TRUE;
 	}
@@ -101,7 +104,7 @@ static bool cmd_compress(struct client_command_context *cmd)
 	value = mail_user_plugin_getenv(client->user,
 					"imap_zlib_compress_level");
 	if (value == NULL || str_to_uint(value, &level) < 0 ||
-	    level <= 0 || level > 9)
+	    level <= 0 || level > handler->max_level)
 		level = IMAP_COMPRESS_DEFAULT_LEVEL;
 
 	old_input = client->input;
@@ -10,6 +10,7 @@
 #include "index-storage.h"
 #include "index-mail.h"
 #include "compression.h"
+#include "ostream-zlib.h"
 #include "zlib-plugin.h"
 
 #include <fcntl.h>
@@ -46,6 +47,7 @@ struct zlib_user {
 
 	const struct compression_handler *save_handler;
 	unsigned int save_level;
+	unsigned int save_threads;
 };
 
 const char *zlib_plugin_version = DOVECOT_ABI_VERSION;
@@ -152,8 +154,11 @@ static int zlib_istream_opened(struct mail *_mail, struct istream **stream)
 		input = *stream;
 		*stream = handler->create_istream(input, TRUE);
 		i_stream_unref(&input);
-		/* dont cache the stream if _mail->uid is 0 */
-		*stream = zlib_mail_cache_open(zuser, _mail, *stream, (_mail->uid > 0));
+		if (!handler->fast_seek) {
+			/* dont cache the stream if _mail->uid is 0 */
+			*stream = zlib_mail_cache_open(zuser, _mail, *stream,
+						       (_mail->uid > 0));
+		}
 	}
 	return zmail->module_ctx.super.istream_opened(_mail, stream);
 }
@@ -233,6 +238,13 @@ zlib_mail_save_compress_begin(struct mail_save_context *ctx,
 	if (zbox->super.save_begin(ctx, input) < 0)
 		return -1;
 
+#ifdef HAVE_ZLIB
+	if (zuser->save_threads > 0) {
+		output = o_stream_create_zblock_threads(ctx->data.output,
+							zuser->save_level,
+							zuser->save_threads);
+	} else
+#endif
 	output = zuser->save_handler->create_ostream(ctx->data.output,
 						     zuser->save_level);
 	o_stream_unref(&ctx->data.output);
@@ -334,6 +346,13 @@ static void zlib_mail_user_deinit(struct mail_user *user)
 	zuser->module_ctx.super.deinit(user);
 }
 
+static unsigned int zlib_get_cpu_count(void)
+{
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return count < 1 ? 1 : (unsigned int)count;
+}
+
 static void zlib_mail_user_created(struct mail_user *user)
 {
 	struct mail_user_vfuncs *v = user->vlast;
@@ -357,14 +376,33 @@ static void zlib_mail_user_created(struct mail_user *user)
 	}
 	name = mail_user_plugin_getenv(user, "zlib_save_level");
 	if (name != NULL) {
+		unsigned int max_level = zuser->save_handler == NULL ? 9 :
+			zuser->save_handler->max_level;
+
 		if (str_to_uint(name, &zuser->save_level) < 0 ||
-		    zuser->save_level < 1 || zuser->save_level > 9) {
-			i_error("zlib_save_level: Level must be between 1..9");
+		    zuser->save_level < 1 || zuser->save_level > max_level) {
+			i_error("zlib_save_level: Level must be between 1..%u",
+				max_level);
 			zuser->save_level = 0;
 		}
 	}
 	if (zuser->save_level == 0)
 		zuser->save_level = ZLIB_PLUGIN_DEFAULT_LEVEL;
+	name = mail_user_plugin_getenv(user, "zlib_save_threads");
+	if (name != NULL) {
+		if (str_to_uint(name, &zuser->save_threads) < 0) {
+			i_error("zlib_save_threads: Invalid number: %s", name);
+			zuser->save_threads = 0;
+		} else if (zuser->save_threads > 0 &&
+			   (zuser->save_handler == NULL ||
+			    strcmp(zuser->save_handler->name, "zblock") != 0)) {
+			i_error("zlib_save_threads: Only supported with zlib_save=zblock");
+			zuser->save_threads = 0;
+		} else if (zuser->save_threads > zlib_get_cpu_count()) {
+			/* more threads than CPUs only adds overhead */
+			zuser->save_threads = zlib_get_cpu_count();
+		}
+	}
 	MODULE_CONTEXT_SET(user, zlib_user_module, zuser);
 }
 